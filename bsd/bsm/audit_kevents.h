@@ -617,6 +617,9 @@
 #define AUE_DBGPORTFORPID       43215   /* Darwin-specific. */
 #define AUE_PREADV              43216   /* Darwin. */
 #define AUE_PWRITEV             43217   /* Darwin. */
+#define AUE_SPLICE              43218   /* Darwin. */
+#define AUE_CLOSE_RANGE_NP      43219   /* Darwin. */
+#define AUE_CLOSEV_NP           43220   /* Darwin. */
 
 #define AUE_SESSION_START       44901   /* Darwin. */
 #define AUE_SESSION_UPDATE      44902   /* Darwin. */
@@ -69,8 +69,13 @@ UNUSED_SYMBOL(decmpfs_validate_compressed_file)
 #include <sys/ubc.h>
 #include <sys/decmpfs.h>
 #include <sys/uio_internal.h>
+#include <sys/sysctl.h>
+#include <sys/queue.h>
 #include <libkern/OSByteOrder.h>
 #include <libkern/section_keywords.h>
+#include <kern/thread.h>
+#include <kern/sched_prim.h>
+#include <os/atomic_private.h>
 
 #include <ptrauth.h>
 
@@ -216,6 +221,8 @@ static lck_mtx_t *decompress_channel_mtx;
 
 vfs_context_t decmpfs_ctx;
 
+static void decmpfs_chunk_purge(decmpfs_cnode *cp);
+
 #pragma mark --- decmp_get_func ---
 
 #define offsetof_func(func) ((uintptr_t)offsetof(decmpfs_registration, func))
@@ -357,6 +364,7 @@ decmpfs_cnode_init(decmpfs_cnode *cp)
 void
 decmpfs_cnode_destroy(decmpfs_cnode *cp)
 {
+	decmpfs_chunk_purge(cp);
 	lck_rw_destroy(&cp->compressed_data_lock, decmpfs_lockgrp);
 }
 
@@ -1315,6 +1323,549 @@ commit_upl(upl_t upl, upl_offset_t pl_offset, size_t uplSize, int flags, int abo
 	return kr;
 }
 
+#pragma mark --- parallel fetch and chunk cache ---
+
+/*
+ * Compressors store a file as independently compressed chunks (64KB
+ * for the common types), and will fetch any range of it.  A large
+ * pagein is split at chunk boundaries (as reported by adjust_fetch)
+ * and the pieces are decompressed at the same time by a small pool
+ * of threads, with the faulting thread doing its share.
+ *
+ * A pagein smaller than the chunk it falls in used to decompress the
+ * whole chunk and throw most of it away; instead, the rest is kept
+ * in a per-cnode chunk cache for the pageins that follow.  When the
+ * pageins of a file are sequential, the range after the current one
+ * is decompressed into the cache ahead of time.
+ */
+#define DECMPFS_FETCH_THREADS   4
+#define DECMPFS_FETCH_PIECES    8               /* most pieces a pagein is split into */
+#define DECMPFS_PIECE_MIN       (64 * 1024)     /* smallest piece worth handing off */
+#define DECMPFS_CHUNK_MAX       (256 * 1024)    /* largest range kept in the chunk cache */
+#define DECMPFS_CHUNK_ENTRIES   32              /* most cached ranges, over all files */
+
+struct decmpfs_chunk {
+	TAILQ_ENTRY(decmpfs_chunk) dc_lru;
+	decmpfs_cnode  *dc_cp;
+	off_t           dc_offset;
+	user_ssize_t    dc_size;
+	char            dc_buf[];       /* dc_size bytes, up to DECMPFS_CHUNK_MAX */
+};
+
+enum {
+	DECMPFS_JOB_FETCH    = 1,    /* decompress a piece of a pagein */
+	DECMPFS_JOB_PREFETCH = 2,    /* decompress ahead of a sequential reader */
+};
+
+struct decmpfs_job {
+	TAILQ_ENTRY(decmpfs_job) dj_link;
+	int             dj_kind;
+	int             dj_queued;
+	vnode_t         dj_vp;
+	decmpfs_cnode  *dj_cp;
+	decmpfs_header *dj_hdr;      /* DECMPFS_JOB_FETCH only */
+	off_t           dj_offset;
+	user_ssize_t    dj_size;
+	char           *dj_buf;      /* DECMPFS_JOB_FETCH only */
+	uint64_t        dj_did_read;
+	int             dj_err;
+	int            *dj_pending;  /* DECMPFS_JOB_FETCH: unfinished pieces of the pagein */
+};
+
+static lck_mtx_t *decmpfs_chunk_mtx;
+static TAILQ_HEAD(decmpfs_chunk_head, decmpfs_chunk) decmpfs_chunk_lru = TAILQ_HEAD_INITIALIZER(decmpfs_chunk_lru);
+static int decmpfs_chunk_count;
+
+static lck_mtx_t *decmpfs_job_mtx;
+static TAILQ_HEAD(, decmpfs_job) decmpfs_job_queue = TAILQ_HEAD_INITIALIZER(decmpfs_job_queue);
+static int decmpfs_fetch_threads_started;
+
+static uint64_t decmpfs_parallel_fetches;   /* pageins split across threads */
+static uint64_t decmpfs_chunk_hits;         /* pageins served (at least partly) from the chunk cache */
+static uint64_t decmpfs_prefetches;         /* ranges decompressed ahead of a sequential reader */
+
+SYSCTL_QUAD(_debug, OID_AUTO, decmpfs_parallel_fetches, CTLFLAG_RD | CTLFLAG_LOCKED, &decmpfs_parallel_fetches, "");
+SYSCTL_QUAD(_debug, OID_AUTO, decmpfs_chunk_hits, CTLFLAG_RD | CTLFLAG_LOCKED, &decmpfs_chunk_hits, "");
+SYSCTL_QUAD(_debug, OID_AUTO, decmpfs_prefetches, CTLFLAG_RD | CTLFLAG_LOCKED, &decmpfs_prefetches, "");
+
+static void
+decmpfs_adjust_fetch(vnode_t vp, decmpfs_header *hdr, off_t *offset, user_ssize_t *size)
+{
+	lck_rw_lock_shared(decompressorsLock);
+	decmpfs_adjust_fetch_region_func adjust_fetch = decmp_get_func(vp, hdr->compression_type, adjust_fetch);
+	if (adjust_fetch) {
+		adjust_fetch(vp, decmpfs_ctx, hdr, offset, size);
+	}
+	lck_rw_unlock_shared(decompressorsLock);
+}
+
+/* caller holds decmpfs_chunk_mtx */
+static void
+decmpfs_chunk_unlink(struct decmpfs_chunk *dc)
+{
+	TAILQ_REMOVE(&decmpfs_chunk_lru, dc, dc_lru);
+	decmpfs_chunk_count--;
+	dc->dc_cp->chunk_cache = NULL;
+	dc->dc_cp = NULL;
+}
+
+/* makes dc the chunk cached for cp, evicting whatever it replaces */
+static void
+decmpfs_chunk_install(decmpfs_cnode *cp, struct decmpfs_chunk *dc)
+{
+	struct decmpfs_chunk *old = NULL, *lru = NULL;
+
+	lck_mtx_lock(decmpfs_chunk_mtx);
+	if ((old = cp->chunk_cache) != NULL) {
+		decmpfs_chunk_unlink(old);
+	}
+	if (decmpfs_chunk_count >= DECMPFS_CHUNK_ENTRIES) {
+		lru = TAILQ_LAST(&decmpfs_chunk_lru, decmpfs_chunk_head);
+		decmpfs_chunk_unlink(lru);
+	}
+	dc->dc_cp = cp;
+	cp->chunk_cache = dc;
+	TAILQ_INSERT_HEAD(&decmpfs_chunk_lru, dc, dc_lru);
+	decmpfs_chunk_count++;
+	lck_mtx_unlock(decmpfs_chunk_mtx);
+
+	if (old) {
+		FREE(old, M_TEMP);
+	}
+	if (lru) {
+		FREE(lru, M_TEMP);
+	}
+}
+
+static void
+decmpfs_chunk_purge(decmpfs_cnode *cp)
+{
+	struct decmpfs_chunk *dc;
+
+	if (cp->chunk_cache == NULL) {
+		return;
+	}
+	lck_mtx_lock(decmpfs_chunk_mtx);
+	if ((dc = cp->chunk_cache) != NULL) {
+		decmpfs_chunk_unlink(dc);
+	}
+	lck_mtx_unlock(decmpfs_chunk_mtx);
+
+	if (dc) {
+		FREE(dc, M_TEMP);
+	}
+}
+
+/*
+ * copies out the part of [offset, offset + size) at its start that is
+ * in cp's chunk cache, returning how much that was.  the chunk is
+ * taken out of the cache while it's copied from (anyone else looking
+ * just misses) and freed once a reader has reached its end.
+ */
+static user_ssize_t
+decmpfs_chunk_copyout(decmpfs_cnode *cp, off_t offset, user_ssize_t size, char *buf)
+{
+	struct decmpfs_chunk *dc;
+	user_ssize_t amt;
+
+	if (cp->chunk_cache == NULL) {
+		return 0;
+	}
+	lck_mtx_lock(decmpfs_chunk_mtx);
+	dc = cp->chunk_cache;
+	if (dc == NULL || offset < dc->dc_offset || offset >= dc->dc_offset + dc->dc_size) {
+		lck_mtx_unlock(decmpfs_chunk_mtx);
+		return 0;
+	}
+	decmpfs_chunk_unlink(dc);
+	lck_mtx_unlock(decmpfs_chunk_mtx);
+
+	amt = MIN(size, (user_ssize_t)(dc->dc_offset + dc->dc_size - offset));
+	memcpy(buf, &dc->dc_buf[offset - dc->dc_offset], (size_t)amt);
+	os_atomic_inc(&decmpfs_chunk_hits, relaxed);
+
+	if (offset + amt < dc->dc_offset + dc->dc_size) {
+		lck_mtx_lock(decmpfs_chunk_mtx);
+		if (cp->chunk_cache == NULL) {
+			dc->dc_cp = cp;
+			cp->chunk_cache = dc;
+			TAILQ_INSERT_HEAD(&decmpfs_chunk_lru, dc, dc_lru);
+			decmpfs_chunk_count++;
+			dc = NULL;
+		}
+		lck_mtx_unlock(decmpfs_chunk_mtx);
+	}
+	if (dc) {
+		FREE(dc, M_TEMP);
+	}
+	return amt;
+}
+
+/*
+ * decompresses the compressor's region around [offset, offset + size)
+ * into a new chunk, caching it for cp.  if buf is non-NULL the range
+ * is copied out to it, and EAGAIN is returned (with nothing done)
+ * unless the region is bigger than the range and fits in a chunk.
+ * a prefetch (buf == NULL) caches as much as fits from offset on.
+ */
+static int
+decmpfs_chunk_fill(vnode_t vp, decmpfs_cnode *cp, decmpfs_header *hdr, off_t offset, user_ssize_t size, char *buf, uint64_t *bytes_read)
+{
+	struct decmpfs_chunk *dc = NULL;
+	off_t        chunk_offset = offset;
+	user_ssize_t chunk_size = size;
+	uint64_t     did_read = 0;
+	int          err;
+
+	if ((uint64_t)offset >= hdr->uncompressed_size) {
+		return EAGAIN;
+	}
+	decmpfs_adjust_fetch(vp, hdr, &chunk_offset, &chunk_size);
+	if ((uint64_t)chunk_offset + chunk_size > hdr->uncompressed_size) {
+		chunk_size = (user_ssize_t)(hdr->uncompressed_size - chunk_offset);
+	}
+	if (buf == NULL) {
+		chunk_size = MIN(chunk_size, DECMPFS_CHUNK_MAX);
+		size = MIN(size, (user_ssize_t)(chunk_offset + chunk_size - offset));
+	}
+	if (chunk_offset > offset || chunk_offset + chunk_size < offset + size || size <= 0 ||
+	    (buf && chunk_size <= size) || chunk_size > DECMPFS_CHUNK_MAX) {
+		return EAGAIN;
+	}
+
+	/*
+	 * a pagein has the data to fall back on and shouldn't wait for
+	 * memory, a prefetch runs on a fetch thread and can
+	 */
+	MALLOC(dc, struct decmpfs_chunk *, sizeof(*dc) + (size_t)chunk_size, M_TEMP,
+	    buf ? M_NOWAIT : M_WAITOK);
+	if (dc == NULL) {
+		return EAGAIN;
+	}
+
+	decmpfs_vector vec = {
+		.buf = dc->dc_buf,
+		.size = chunk_size,
+	};
+	err = decmpfs_fetch_uncompressed_data(vp, cp, hdr, chunk_offset, chunk_size, 1, &vec, &did_read);
+	if (err || did_read < (uint64_t)(offset + size - chunk_offset)) {
+		FREE(dc, M_TEMP);
+		return err ? err : EAGAIN;
+	}
+
+	if (buf) {
+		memcpy(buf, &dc->dc_buf[offset - chunk_offset], (size_t)size);
+		*bytes_read = (uint64_t)size;
+	}
+	dc->dc_offset = chunk_offset;
+	dc->dc_size = (user_ssize_t)did_read;
+	decmpfs_chunk_install(cp, dc);
+
+	return 0;
+}
+
+static void
+decmpfs_job_done(struct decmpfs_job *job)
+{
+	lck_mtx_lock(decmpfs_job_mtx);
+	if (--(*job->dj_pending) == 0) {
+		wakeup((caddr_t)job->dj_pending);
+	}
+	lck_mtx_unlock(decmpfs_job_mtx);
+}
+
+static void
+decmpfs_job_run(struct decmpfs_job *job)
+{
+	decmpfs_vector vec = {
+		.buf = job->dj_buf,
+		.size = job->dj_size,
+	};
+
+	job->dj_err = decmpfs_fetch_uncompressed_data(job->dj_vp, job->dj_cp, job->dj_hdr,
+	    job->dj_offset, job->dj_size, 1, &vec, &job->dj_did_read);
+}
+
+static void
+decmpfs_prefetch_run(struct decmpfs_job *job)
+{
+	decmpfs_cnode *cp = job->dj_cp;
+	vnode_t vp = job->dj_vp;
+	decmpfs_header *hdr = NULL;
+
+	/* don't wait behind a decompress_file: it'll throw the chunk away anyway */
+	if (decmpfs_trylock_compressed_data(cp, 0)) {
+		if (decmpfs_fast_get_state(cp) == FILE_IS_COMPRESSED &&
+		    decmpfs_fetch_compressed_header(vp, cp, &hdr, 0) == 0) {
+			if (decmpfs_chunk_fill(vp, cp, hdr, job->dj_offset, job->dj_size, NULL, NULL) == 0) {
+				os_atomic_inc(&decmpfs_prefetches, relaxed);
+			}
+			FREE(hdr, M_TEMP);
+		}
+		decmpfs_unlock_compressed_data(cp, 0);
+	}
+	os_atomic_store(&cp->chunk_prefetching, 0, relaxed);
+
+	vnode_put(vp);
+	FREE(job, M_TEMP);
+}
+
+__attribute__((noreturn))
+static void
+decmpfs_fetch_continue(void)
+{
+	struct decmpfs_job *job;
+
+	for (;;) {
+		lck_mtx_lock(decmpfs_job_mtx);
+
+		if ((job = TAILQ_FIRST(&decmpfs_job_queue)) == NULL) {
+			assert_wait((event_t)&decmpfs_job_queue, (THREAD_UNINT));
+
+			lck_mtx_unlock(decmpfs_job_mtx);
+
+			thread_block((thread_continue_t)decmpfs_fetch_continue);
+
+			continue;
+		}
+		TAILQ_REMOVE(&decmpfs_job_queue, job, dj_link);
+		job->dj_queued = 0;
+
+		lck_mtx_unlock(decmpfs_job_mtx);
+
+		if (job->dj_kind == DECMPFS_JOB_PREFETCH) {
+			decmpfs_prefetch_run(job);
+		} else {
+			decmpfs_job_run(job);
+			decmpfs_job_done(job);
+		}
+	}
+}
+
+/*
+ * the fetch threads are only started once a file's pageins first
+ * need them, so systems that don't page in large compressed files
+ * never pay for them
+ */
+static void
+decmpfs_fetch_threads_start(void)
+{
+	if (os_atomic_load(&decmpfs_fetch_threads_started, relaxed) ||
+	    !os_atomic_cmpxchg(&decmpfs_fetch_threads_started, 0, 1, relaxed)) {
+		return;
+	}
+	for (int i = 0; i < DECMPFS_FETCH_THREADS; i++) {
+		thread_t thread;
+
+		kernel_thread_start((thread_continue_t)decmpfs_fetch_continue, NULL, &thread);
+		thread_deallocate(thread);
+	}
+}
+
+static void
+decmpfs_job_queue_locked(struct decmpfs_job *job)
+{
+	job->dj_queued = 1;
+	TAILQ_INSERT_TAIL(&decmpfs_job_queue, job, dj_link);
+	wakeup_one((caddr_t)&decmpfs_job_queue);
+}
+
+/*
+ * splits [offset, offset + size) at chunk boundaries and decompresses
+ * the pieces in parallel.  the calling thread runs the first piece and
+ * then takes back any the pool hasn't got to, so it never waits on
+ * threads that are busy with someone else's pagein.  the jobs are
+ * allocated, to keep them off the pagein stack.
+ */
+static int
+decmpfs_fetch_parallel(vnode_t vp, decmpfs_cnode *cp, decmpfs_header *hdr, off_t offset, user_ssize_t size, char *buf, uint64_t *bytes_read)
+{
+	struct decmpfs_job *jobs;
+	user_ssize_t piece;
+	off_t end = offset + size, start = offset;
+	int njobs = 0, pending, err = 0;
+
+	MALLOC(jobs, struct decmpfs_job *, DECMPFS_FETCH_PIECES * sizeof(*jobs), M_TEMP, M_NOWAIT);
+	if (jobs == NULL) {
+		/* don't wait for memory in a pagein: decompress it all here */
+		decmpfs_vector vec = {
+			.buf = buf,
+			.size = size,
+		};
+
+		return decmpfs_fetch_uncompressed_data(vp, cp, hdr, offset, size, 1, &vec, bytes_read);
+	}
+
+	piece = (user_ssize_t)round_page((vm_offset_t)(size / DECMPFS_FETCH_PIECES));
+	if (piece < DECMPFS_PIECE_MIN) {
+		piece = DECMPFS_PIECE_MIN;
+	}
+
+	while (start < end && njobs < DECMPFS_FETCH_PIECES) {
+		off_t next = start + piece;
+
+		if (next < end && njobs < DECMPFS_FETCH_PIECES - 1) {
+			/* end the piece where the chunk containing next starts */
+			off_t chunk_offset = next;
+			user_ssize_t chunk_size = PAGE_SIZE;
+
+			decmpfs_adjust_fetch(vp, hdr, &chunk_offset, &chunk_size);
+			if (chunk_offset > start && chunk_offset <= next) {
+				next = chunk_offset;
+			}
+		} else {
+			next = end;
+		}
+
+		jobs[njobs] = (struct decmpfs_job) {
+			.dj_kind = DECMPFS_JOB_FETCH,
+			.dj_vp = vp,
+			.dj_cp = cp,
+			.dj_hdr = hdr,
+			.dj_offset = start,
+			.dj_size = (user_ssize_t)(next - start),
+			.dj_buf = buf + (start - offset),
+			.dj_pending = &pending,
+		};
+		njobs++;
+		start = next;
+	}
+	pending = njobs;
+
+	decmpfs_fetch_threads_start();
+	lck_mtx_lock(decmpfs_job_mtx);
+	for (int i = 1; i < njobs; i++) {
+		decmpfs_job_queue_locked(&jobs[i]);
+	}
+	lck_mtx_unlock(decmpfs_job_mtx);
+	os_atomic_inc(&decmpfs_parallel_fetches, relaxed);
+
+	decmpfs_job_run(&jobs[0]);
+	decmpfs_job_done(&jobs[0]);
+
+	for (int i = 1; i < njobs; i++) {
+		lck_mtx_lock(decmpfs_job_mtx);
+		if (!jobs[i].dj_queued) {
+			lck_mtx_unlock(decmpfs_job_mtx);
+			continue;
+		}
+		TAILQ_REMOVE(&decmpfs_job_queue, &jobs[i], dj_link);
+		jobs[i].dj_queued = 0;
+		lck_mtx_unlock(decmpfs_job_mtx);
+
+		decmpfs_job_run(&jobs[i]);
+		decmpfs_job_done(&jobs[i]);
+	}
+
+	lck_mtx_lock(decmpfs_job_mtx);
+	while (pending) {
+		msleep((caddr_t)&pending, decmpfs_job_mtx, PRIBIO, "decmpfs_fetch", NULL);
+	}
+	lck_mtx_unlock(decmpfs_job_mtx);
+
+	/* only the data up to the first short or failed piece counts */
+	*bytes_read = 0;
+	for (int i = 0; i < njobs; i++) {
+		if ((err = jobs[i].dj_err) != 0) {
+			break;
+		}
+		*bytes_read += jobs[i].dj_did_read;
+		if (jobs[i].dj_did_read < (uint64_t)jobs[i].dj_size) {
+			break;
+		}
+	}
+	FREE(jobs, M_TEMP);
+	return err;
+}
+
+/* queues decompressing the range after a sequential pagein into the chunk cache */
+static void
+decmpfs_prefetch(vnode_t vp, decmpfs_cnode *cp, decmpfs_header *hdr, off_t offset, user_ssize_t size)
+{
+	struct decmpfs_chunk *dc;
+	struct decmpfs_job *job;
+
+	if ((uint64_t)offset >= hdr->uncompressed_size) {
+		return;
+	}
+	if ((dc = cp->chunk_cache) != NULL && offset >= dc->dc_offset &&
+	    offset < dc->dc_offset + dc->dc_size) {
+		/* unlocked peek: at worst we prefetch what's already there */
+		return;
+	}
+	if (!os_atomic_cmpxchg(&cp->chunk_prefetching, 0, 1, relaxed)) {
+		return;
+	}
+
+	MALLOC(job, struct decmpfs_job *, sizeof(*job), M_TEMP, M_NOWAIT);
+	if (job == NULL || vnode_get(vp) != 0) {
+		if (job) {
+			FREE(job, M_TEMP);
+		}
+		os_atomic_store(&cp->chunk_prefetching, 0, relaxed);
+		return;
+	}
+	*job = (struct decmpfs_job) {
+		.dj_kind = DECMPFS_JOB_PREFETCH,
+		.dj_vp = vp,
+		.dj_cp = cp,
+		.dj_offset = offset,
+		.dj_size = MIN(size, DECMPFS_CHUNK_MAX),
+	};
+
+	decmpfs_fetch_threads_start();
+	lck_mtx_lock(decmpfs_job_mtx);
+	decmpfs_job_queue_locked(job);
+	lck_mtx_unlock(decmpfs_job_mtx);
+}
+
+/*
+ * fetches [offset, offset + size) of a pagein, using the chunk cache
+ * and the fetch threads where that helps
+ */
+static int
+decmpfs_fetch_pagein(vnode_t vp, decmpfs_cnode *cp, decmpfs_header *hdr, off_t offset, user_ssize_t size, char *buf, uint64_t *bytes_read)
+{
+	off_t        start = offset;
+	user_ssize_t amt;
+	uint64_t     did_read = 0;
+	int          err = 0;
+
+	*bytes_read = 0;
+	if (size <= 0) {
+		return 0;
+	}
+
+	amt = decmpfs_chunk_copyout(cp, offset, size, buf);
+	offset += amt;
+	size -= amt;
+	buf += amt;
+
+	if (size >= 2 * DECMPFS_PIECE_MIN) {
+		err = decmpfs_fetch_parallel(vp, cp, hdr, offset, size, buf, &did_read);
+	} else if (size > 0) {
+		err = decmpfs_chunk_fill(vp, cp, hdr, offset, size, buf, &did_read);
+		if (err == EAGAIN) {
+			decmpfs_vector vec = {
+				.buf = buf,
+				.size = size,
+			};
+			err = decmpfs_fetch_uncompressed_data(vp, cp, hdr, offset, size, 1, &vec, &did_read);
+		}
+	}
+	*bytes_read = (uint64_t)amt + did_read;
+
+	if (err == 0) {
+		off_t next = offset + size;
+
+		if (start == cp->chunk_next) {
+			decmpfs_prefetch(vp, cp, hdr, next, (user_ssize_t)(next - start));
+		}
+		cp->chunk_next = next;
+	}
+	return err;
+}
+
 
 errno_t
 decmpfs_pagein_compressed(struct vnop_pagein_args *ap, int *is_compressed, decmpfs_cnode *cp)
@@ -1430,7 +1981,7 @@ decompress:
 		err = 0;
 	} else {
 		if (!verify_block_size || (verify_block_size <= PAGE_SIZE)) {
-			err = decmpfs_fetch_uncompressed_data(vp, cp, hdr, uplPos, uplSize, 1, &vec, &did_read);
+			err = decmpfs_fetch_pagein(vp, cp, hdr, uplPos, uplSize, vec.buf, &did_read);
 		} else {
 			off_t l_uplPos = uplPos;
 			off_t l_pl_offset = pl_offset;
@@ -1937,6 +2488,8 @@ decmpfs_free_compressed_data(vnode_t vp, decmpfs_cnode *cp)
 	 */
 	DECMPFS_EMIT_TRACE_ENTRY(DECMPDBG_FREE_COMPRESSED_DATA, vp->v_id);
 
+	decmpfs_chunk_purge(cp);
+
 	int err = decmpfs_fetch_compressed_header(vp, cp, &hdr, 0);
 	if (err) {
 		ErrorLogWithPath("decmpfs_fetch_compressed_header err %d\n", err);
@@ -2062,6 +2615,7 @@ decompress:
 	case FILE_IS_COMPRESSED:
 	{
 		/* the file is compressed, so decompress it */
+		decmpfs_chunk_purge(cp);
 		break;
 	}
 
@@ -2332,6 +2886,8 @@ decmpfs_init()
 	lck_grp_attr_free(attr);
 	decompressorsLock = lck_rw_alloc_init(decmpfs_lockgrp, NULL);
 	decompress_channel_mtx = lck_mtx_alloc_init(decmpfs_lockgrp, NULL);
+	decmpfs_chunk_mtx = lck_mtx_alloc_init(decmpfs_lockgrp, NULL);
+	decmpfs_job_mtx = lck_mtx_alloc_init(decmpfs_lockgrp, NULL);
 
 	register_decmpfs_decompressor(CMP_Type1, &Type1Reg);
 
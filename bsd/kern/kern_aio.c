@@ -67,9 +67,13 @@
 #include <kern/zalloc.h>
 #include <kern/task.h>
 #include <kern/sched_prim.h>
+#include <kern/thread_call.h>
+
+#include <machine/machine_routines.h>
 
 #include <vm/vm_map.h>
 
+#include <os/hash.h>
 #include <os/refcnt.h>
 
 #include <sys/kdebug.h>
@@ -113,6 +117,7 @@ __options_decl(aio_entry_flags_t, uint32_t, {
 	AIO_DSYNC       = 0x00000008, /* aio_fsync with op = O_DSYNC (not supported yet) */
 	AIO_LIO         = 0x00000010, /* lio_listio generated IO */
 	AIO_LIO_WAIT    = 0x00000020, /* lio_listio is waiting on the leader */
+	AIO_FSYNC_PARKED = 0x00000040, /* aio_fsync off the work queues, waiting on earlier IOs */
 
 	/*
 	 * These flags mean that this entry is blocking either:
@@ -181,13 +186,21 @@ struct aio_workq_entry {
 };
 
 /*
- * aio requests queue up on the aio_async_workq or lio_sync_workq (for
- * lio_listio LIO_WAIT).  Requests then move to the per process aio_activeq
- * (proc.aio_activeq) when one of our worker threads start the IO.
- * And finally, requests move to the per process aio_doneq (proc.aio_doneq)
- * when the IO request completes.  The request remains on aio_doneq until
- * user process calls aio_return or the process exits, either way that is our
- * trigger to release aio resources.
+ * aio requests queue up on one of the aio_async_workqs, picked by hashing
+ * the process and file descriptor of the request, so that the requests
+ * against a given file are dispatched in submission order.  Requests then
+ * move to the per process aio_activeq (proc.aio_activeq) when one of our
+ * worker threads start the IO.  And finally, requests move to the per
+ * process aio_doneq (proc.aio_doneq) when the IO request completes.
+ * The request remains on aio_doneq until user process calls aio_return or
+ * the process exits, either way that is our trigger to release aio resources.
+ *
+ * There is one work queue per CPU (up to AIO_MAX_WORK_QUEUES).  Each worker
+ * thread has a "home" queue it sleeps on, and steals work from the other
+ * queues when its own is empty.  Worker threads are added on demand when
+ * work is queued while all workers are busy (up to AIO_MAX_WORKERS_PER_QUEUE
+ * per queue), and the ones above aio_worker_threads retire after being idle
+ * for AIO_WORKER_IDLE_TIMEOUT_NS.
  */
 typedef struct aio_workq   {
 	TAILQ_HEAD(, aio_workq_entry)   aioq_entries;
@@ -195,13 +208,19 @@ typedef struct aio_workq   {
 	struct waitq                    aioq_waitq;
 } *aio_workq_t;
 
-#define AIO_NUM_WORK_QUEUES 1
+#define AIO_MAX_WORK_QUEUES             16
+#define AIO_MAX_WORKERS_PER_QUEUE       4
+#define AIO_WORKER_IDLE_TIMEOUT_NS      (10 * NSEC_PER_SEC)
+
 struct aio_anchor_cb {
 	os_atomic(int)          aio_total_count;        /* total extant entries */
+	os_atomic(int)          aio_num_workers;        /* extant worker threads */
+	os_atomic(uint32_t)     aio_next_home;          /* home queue of the next worker */
+	thread_call_t           aio_grow_call;
 
 	/* Hash table of queues here */
 	int                     aio_num_workqs;
-	struct aio_workq        aio_async_workqs[AIO_NUM_WORK_QUEUES];
+	struct aio_workq        aio_async_workqs[AIO_MAX_WORK_QUEUES];
 };
 typedef struct aio_anchor_cb aio_anchor_cb;
 
@@ -245,7 +264,11 @@ static void             aio_workq_unlock(aio_workq_t wq);
 static lck_spin_t      *aio_workq_lock(aio_workq_t wq);
 
 static void             aio_work_thread(void *arg, wait_result_t wr);
-static aio_workq_entry *aio_get_some_work(void);
+static aio_workq_entry *aio_get_some_work(aio_workq_t home);
+static void             aio_workq_wakeup_worker(aio_workq_t queue);
+static void             aio_grow_workers(thread_call_param_t p0, thread_call_param_t p1);
+static int              aio_entry_do_io(aio_workq_entry *entryp);
+static void             aio_entry_complete_io(aio_workq_entry *entryp, int error);
 
 static int              aio_queue_async_request(proc_t procp, user_addr_t aiocbp, aio_entry_flags_t);
 static int              aio_validate(proc_t, aio_workq_entry *entryp);
@@ -286,9 +309,7 @@ extern int aio_worker_threads;                  /* AIO_THREAD_COUNT - configurab
 /*
  * aio static variables.
  */
-static aio_anchor_cb aio_anchor = {
-	.aio_num_workqs = AIO_NUM_WORK_QUEUES,
-};
+static aio_anchor_cb aio_anchor;
 os_refgrp_decl(static, aio_refgrp, "aio", NULL);
 static LCK_GRP_DECLARE(aio_proc_lock_grp, "aio_proc");
 static LCK_GRP_DECLARE(aio_queue_lock_grp, "aio_queue");
@@ -299,9 +320,12 @@ static ZONE_DECLARE(aio_workq_zonep, "aiowq", sizeof(aio_workq_entry),
 
 /* Hash */
 static aio_workq_t
-aio_entry_workq(__unused aio_workq_entry *entryp)
+aio_entry_workq(aio_workq_entry *entryp)
 {
-	return &aio_anchor.aio_async_workqs[0];
+	uint32_t hash = os_hash_kernel_pointer(entryp->procp) ^
+	    (uint32_t)entryp->aiocb.aio_fildes;
+
+	return &aio_anchor.aio_async_workqs[hash % aio_anchor.aio_num_workqs];
 }
 
 static void
@@ -389,6 +413,31 @@ aio_proc_move_done_locked(proc_t procp, aio_workq_entry *entryp)
 	TAILQ_INSERT_TAIL(&procp->p_aio_doneq, entryp, aio_proc_link);
 }
 
+/*
+ * An aio_fsync that had to wait for earlier requests is parked, off the work
+ * queues, until it is the oldest request of its process: see
+ * aio_workq_pop_work().  Requeue it once the requests ahead of it completed.
+ */
+static void
+aio_proc_unpark_fsync_locked(proc_t procp)
+{
+	aio_workq_entry *entryp = TAILQ_FIRST(&procp->p_aio_activeq);
+	aio_workq_t queue;
+
+	ASSERT_AIO_PROC_LOCK_OWNED(procp);
+
+	if (entryp == NULL || (entryp->flags & AIO_FSYNC_PARKED) == 0) {
+		return;
+	}
+	entryp->flags &= ~AIO_FSYNC_PARKED;
+
+	queue = aio_entry_workq(entryp);
+	aio_workq_lock_spin(queue);
+	aio_workq_add_entry_locked(queue, entryp);
+	aio_workq_unlock(queue);
+	aio_workq_wakeup_worker(queue);
+}
+
 static void
 aio_proc_remove_done_locked(proc_t procp, aio_workq_entry *entryp)
 {
@@ -935,8 +984,10 @@ again:
 			}
 		}
 
-		/* Can only be cancelled if it's still on a work queue */
-		if (aio_entry_try_workq_remove(entryp)) {
+		/* Can only be cancelled if it's still on a work queue, or parked */
+		if ((entryp->flags & AIO_FSYNC_PARKED) ||
+		    aio_entry_try_workq_remove(entryp)) {
+			entryp->flags &= ~AIO_FSYNC_PARKED;
 			entryp->errorval = ECANCELED;
 			entryp->returnval = -1;
 
@@ -1347,9 +1398,8 @@ aio_try_enqueue_work_locked(proc_t procp, aio_workq_entry *entryp,
 	aio_entry_ref(entryp); /* consumed in do_aio_completion_and_unlock */
 	aio_workq_lock_spin(queue);
 	aio_workq_add_entry_locked(queue, entryp);
-	waitq_wakeup64_one(&queue->aioq_waitq, CAST_EVENT64_T(queue),
-	    THREAD_AWAKENED, WAITQ_ALL_PRIORITIES);
 	aio_workq_unlock(queue);
+	aio_workq_wakeup_worker(queue);
 
 	KERNEL_DEBUG_CONSTANT(BSDDBG_CODE(DBG_BSD_AIO, AIO_work_queued) | DBG_FUNC_START,
 	    VM_KERNEL_ADDRPERM(procp), VM_KERNEL_ADDRPERM(entryp->uaiocbp),
@@ -1448,6 +1498,8 @@ lio_listio(proc_t p, struct lio_listio_args *uap, int *retval __unused)
 	 * Past this point we're commited and will not bail out
 	 *
 	 * - keep a reference on the leader for LIO_WAIT
+	 * - keep a reference on every entry for LIO_WAIT, so that they can
+	 *   be looked at after submission even once aio_return() released them
 	 * - perform the submissions and optionally wait
 	 */
 
@@ -1460,7 +1512,11 @@ lio_listio(proc_t p, struct lio_listio_args *uap, int *retval __unused)
 
 	for (int i = 0; i < lio_count; i++) {
 		if (aio_try_enqueue_work_locked(p, entries[i], leader)) {
-			entries[i] = NULL; /* the entry was submitted */
+			if (uap->mode == LIO_WAIT) {
+				aio_entry_ref(entries[i]); /* consumed at exit */
+			} else {
+				entries[i] = NULL; /* the entry was submitted */
+			}
 		} else {
 			result = EAGAIN;
 		}
@@ -1468,7 +1524,23 @@ lio_listio(proc_t p, struct lio_listio_args *uap, int *retval __unused)
 
 	if (uap->mode == LIO_WAIT && result == 0) {
 		leader->flags |= AIO_LIO_WAIT;
+		aio_proc_unlock(p);
 
+		/*
+		 * We are going to block until the whole batch is done anyway:
+		 * rather than waiting for worker threads to get to them, perform
+		 * the requests that are still queued ourselves.  This saves
+		 * a handoff and a context switch per request, and workers
+		 * that were woken up keep working on the batch in parallel.
+		 */
+		for (int i = 0; i < lio_count; i++) {
+			if (aio_entry_try_workq_remove(entries[i])) {
+				aio_entry_complete_io(entries[i],
+				    aio_entry_do_io(entries[i]));
+			}
+		}
+
+		aio_proc_lock_spin(p);
 		while (leader->lio_pending) {
 			/* If we were interrupted, fail out (even if all finished) */
 			if (msleep(leader, aio_proc_mutex(p),
@@ -1488,7 +1560,7 @@ lio_listio(proc_t p, struct lio_listio_args *uap, int *retval __unused)
 	}
 
 ExitRoutine:
-	/* Consume unsubmitted entries */
+	/* Consume unsubmitted entries, and our LIO_WAIT references */
 	for (int i = 0; i < lio_count; i++) {
 		if (entries[i]) {
 			aio_entry_unref(entries[i]);
@@ -1502,15 +1574,36 @@ ExitRoutine:
 }
 
 
+/*
+ * aio_worker_try_retire - called by a worker thread that was idle for
+ * AIO_WORKER_IDLE_TIMEOUT_NS, returns whether it should terminate.
+ */
+static bool
+aio_worker_try_retire(void)
+{
+	int old, new;
+
+	os_atomic_rmw_loop(&aio_anchor.aio_num_workers, old, new, relaxed, {
+		if (old <= aio_worker_threads) {
+		        os_atomic_rmw_loop_give_up(return false);
+		}
+		new = old - 1;
+	});
+
+	return true;
+}
+
+
 /*
  * aio worker thread.  this is where all the real work gets done.
- * we get a wake up call on sleep channel &aio_anchor.aio_async_workq
+ * we get a wake up call on the aioq_waitq of our home queue (`arg')
  * after new work is queued up.
  */
 __attribute__((noreturn))
 static void
-aio_work_thread(void *arg __unused, wait_result_t wr __unused)
+aio_work_thread(void *arg, wait_result_t wr)
 {
+	aio_workq_t      home = arg;
 	aio_workq_entry *entryp;
 	int              error;
 	vm_map_t         currentmap;
@@ -1519,12 +1612,17 @@ aio_work_thread(void *arg __unused, wait_result_t wr __unused)
 	struct uthread  *uthreadp = NULL;
 	proc_t           p = NULL;
 
+	if (wr == THREAD_TIMED_OUT && aio_worker_try_retire()) {
+		thread_terminate(current_thread());
+		__builtin_unreachable();
+	}
+
 	for (;;) {
 		/*
 		 * returns with the entry ref'ed.
 		 * sleeps until work is available.
 		 */
-		entryp = aio_get_some_work();
+		entryp = aio_get_some_work(home);
 		p = entryp->procp;
 
 		KERNEL_DEBUG(BSDDBG_CODE(DBG_BSD_AIO, AIO_worker_thread) | DBG_FUNC_START,
@@ -1550,15 +1648,7 @@ aio_work_thread(void *arg __unused, wait_result_t wr __unused)
 			oldmap = vm_map_switch(entryp->aio_map);
 		}
 
-		if ((entryp->flags & AIO_READ) != 0) {
-			error = do_aio_read(entryp);
-		} else if ((entryp->flags & AIO_WRITE) != 0) {
-			error = do_aio_write(entryp);
-		} else if ((entryp->flags & (AIO_FSYNC | AIO_DSYNC)) != 0) {
-			error = do_aio_fsync(entryp);
-		} else {
-			error = EINVAL;
-		}
+		error = aio_entry_do_io(entryp);
 
 		/* Restore old map */
 		if (currentmap != entryp->aio_map) {
@@ -1566,89 +1656,227 @@ aio_work_thread(void *arg __unused, wait_result_t wr __unused)
 			uthreadp->uu_aio_task = oldaiotask;
 		}
 
-		/* liberate unused map */
-		vm_map_deallocate(entryp->aio_map);
-		entryp->aio_map = VM_MAP_NULL;
-
 		KERNEL_DEBUG(SDDBG_CODE(DBG_BSD_AIO, AIO_worker_thread) | DBG_FUNC_END,
 		    VM_KERNEL_ADDRPERM(p), VM_KERNEL_ADDRPERM(entryp->uaiocbp),
 		    entryp->errorval, entryp->returnval, 0);
 
-		/* we're done with the IO request so pop it off the active queue and */
-		/* push it on the done queue */
-		aio_proc_lock(p);
-		entryp->errorval = error;
-		do_aio_completion_and_unlock(p, entryp);
+		aio_entry_complete_io(entryp, error);
+	}
+}
+
+
+/*
+ * aio_entry_do_io - perform the IO of an entry pulled off its work queue.
+ * The caller must be running in the address space of the entry's process.
+ */
+static int
+aio_entry_do_io(aio_workq_entry *entryp)
+{
+	if ((entryp->flags & AIO_READ) != 0) {
+		return do_aio_read(entryp);
+	} else if ((entryp->flags & AIO_WRITE) != 0) {
+		return do_aio_write(entryp);
+	} else if ((entryp->flags & (AIO_FSYNC | AIO_DSYNC)) != 0) {
+		return do_aio_fsync(entryp);
+	} else {
+		return EINVAL;
+	}
+}
+
+
+/*
+ * aio_entry_complete_io - we're done with the IO request so pop it off the
+ * active queue and push it on the done queue.  Consumes the work queue ref.
+ */
+static void
+aio_entry_complete_io(aio_workq_entry *entryp, int error)
+{
+	proc_t p = entryp->procp;
+
+	/* liberate unused map */
+	vm_map_deallocate(entryp->aio_map);
+	entryp->aio_map = VM_MAP_NULL;
+
+	aio_proc_lock(p);
+	entryp->errorval = error;
+	do_aio_completion_and_unlock(p, entryp);
+}
+
+
+/*
+ * aio_has_queued_work - whether any work queue has entries.  This is racy and
+ * only meant for idle workers to check whether they should go to sleep.
+ */
+static bool
+aio_has_queued_work(void)
+{
+	for (int i = 0; i < aio_anchor.aio_num_workqs; i++) {
+		if (!TAILQ_EMPTY(&aio_anchor.aio_async_workqs[i].aioq_entries)) {
+			return true;
+		}
 	}
+	return false;
 }
 
 
 /*
- * aio_get_some_work - get the next async IO request that is ready to be executed.
- * aio_fsync complicates matters a bit since we cannot do the fsync until all async
- * IO requests at the time the aio_fsync call came in have completed.
- * NOTE - AIO_LOCK must be held by caller
+ * aio_max_workers - the number of worker threads we are willing to run.
+ */
+static int
+aio_max_workers(void)
+{
+	return MAX(aio_worker_threads,
+	           aio_anchor.aio_num_workqs * AIO_MAX_WORKERS_PER_QUEUE);
+}
+
+
+/*
+ * aio_workq_pop_work - pull the next request that is ready to be executed
+ * off `queue', if any.
+ *
+ * aio_fsync complicates matters a bit since we cannot do the fsync until all
+ * async IO requests at the time the aio_fsync call came in have completed.
+ * Those might be on other work queues, or in flight: when we find an fsync
+ * that must be delayed, we park it, and the completion of the last request
+ * ahead of it puts it back on its queue (see aio_proc_unpark_fsync_locked()).
  */
 static aio_workq_entry *
-aio_get_some_work(void)
+aio_workq_pop_work(aio_workq_t queue)
 {
 	aio_workq_entry *entryp = NULL;
-	aio_workq_t      queue = NULL;
 
-	/* Just one queue for the moment.  In the future there will be many. */
-	queue = &aio_anchor.aio_async_workqs[0];
 	aio_workq_lock_spin(queue);
 
 	/*
-	 * Hold the queue lock.
-	 *
-	 * pop some work off the work queue and add to our active queue
-	 * Always start with the queue lock held.
+	 * Pull of of work queue.  Once it's off, it can't be cancelled,
+	 * so we can take our ref once we drop the queue lock.
 	 */
-	while ((entryp = TAILQ_FIRST(&queue->aioq_entries))) {
-		/*
-		 * Pull of of work queue.  Once it's off, it can't be cancelled,
-		 * so we can take our ref once we drop the queue lock.
-		 */
+	entryp = TAILQ_FIRST(&queue->aioq_entries);
+	if (entryp == NULL) {
+		aio_workq_unlock(queue);
+		return NULL;
+	}
 
-		aio_workq_remove_entry_locked(queue, entryp);
+	aio_workq_remove_entry_locked(queue, entryp);
 
-		aio_workq_unlock(queue);
+	aio_workq_unlock(queue);
 
+	/*
+	 * Check if it's an fsync that must be delayed.  No need to lock the entry;
+	 * that flag would have been set at initialization.
+	 */
+	if ((entryp->flags & AIO_FSYNC) != 0) {
 		/*
-		 * Check if it's an fsync that must be delayed.  No need to lock the entry;
-		 * that flag would have been set at initialization.
+		 * Check for unfinished operations on the same file
+		 * in this proc's queue.
 		 */
-		if ((entryp->flags & AIO_FSYNC) != 0) {
-			/*
-			 * Check for unfinished operations on the same file
-			 * in this proc's queue.
-			 */
-			aio_proc_lock_spin(entryp->procp);
-			if (aio_delay_fsync_request(entryp)) {
-				/* It needs to be delayed.  Put it back on the end of the work queue */
-				KERNEL_DEBUG(BSDDBG_CODE(DBG_BSD_AIO, AIO_fsync_delay) | DBG_FUNC_NONE,
-				    VM_KERNEL_ADDRPERM(p), VM_KERNEL_ADDRPERM(entryp->uaiocbp),
-				    0, 0, 0);
+		aio_proc_lock_spin(entryp->procp);
+		if (aio_delay_fsync_request(entryp)) {
+			/* It needs to be delayed.  Park it until it's the oldest */
+			KERNEL_DEBUG(BSDDBG_CODE(DBG_BSD_AIO, AIO_fsync_delay) | DBG_FUNC_NONE,
+			    VM_KERNEL_ADDRPERM(entryp->procp), VM_KERNEL_ADDRPERM(entryp->uaiocbp),
+			    0, 0, 0);
+
+			entryp->flags |= AIO_FSYNC_PARKED;
+			aio_proc_unlock(entryp->procp);
+			return NULL;
+		}
+		aio_proc_unlock(entryp->procp);
+	}
 
-				aio_proc_unlock(entryp->procp);
+	return entryp;
+}
 
-				aio_workq_lock_spin(queue);
-				aio_workq_add_entry_locked(queue, entryp);
+
+/*
+ * aio_get_some_work - get the next async IO request that is ready to be
+ * executed, looking at our home queue first, then stealing from the others.
+ *
+ * Sleeps on the home queue until work is available.
+ */
+static aio_workq_entry *
+aio_get_some_work(aio_workq_t home)
+{
+	int              nqueues = aio_anchor.aio_num_workqs;
+	int              first = (int)(home - aio_anchor.aio_async_workqs);
+	aio_workq_entry *entryp;
+	uint64_t         deadline = 0;
+
+	for (;;) {
+		for (int i = 0; i < nqueues; i++) {
+			aio_workq_t queue = &aio_anchor.aio_async_workqs[(first + i) % nqueues];
+
+			if (TAILQ_EMPTY(&queue->aioq_entries)) {
 				continue;
 			}
-			aio_proc_unlock(entryp->procp);
+			if ((entryp = aio_workq_pop_work(queue)) != NULL) {
+				return entryp;
+			}
+		}
+
+		/* workers above the configured count retire when idle */
+		if (os_atomic_load(&aio_anchor.aio_num_workers, relaxed) > aio_worker_threads) {
+			nanoseconds_to_deadline(AIO_WORKER_IDLE_TIMEOUT_NS, &deadline);
 		}
 
-		return entryp;
+		/* We will wake up when someone enqueues something */
+		aio_workq_lock_spin(home);
+		waitq_assert_wait64_leeway(&home->aioq_waitq, CAST_EVENT64_T(home),
+		    THREAD_UNINT, TIMEOUT_URGENCY_SYS_BACKGROUND, deadline,
+		    TIMEOUT_NO_LEEWAY);
+		aio_workq_unlock(home);
+
+		/*
+		 * Work queued on another queue after we looked at it tried
+		 * to wake up a worker before we were waiting: look again now
+		 * that such a wakeup can't be missed.
+		 */
+		if (!aio_has_queued_work()) {
+			thread_block_parameter(aio_work_thread, home);
+			__builtin_unreachable();
+		}
+		clear_wait(current_thread(), THREAD_AWAKENED);
 	}
+}
+
+
+/*
+ * aio_workq_wakeup_worker - wake up a worker for work just queued on `queue':
+ * one sleeping on that queue if possible, or else any idle worker, which will
+ * steal it.  If every worker is busy, have another one created.
+ */
+static void
+aio_workq_wakeup_worker(aio_workq_t queue)
+{
+	int nqueues = aio_anchor.aio_num_workqs;
+	int first = (int)(queue - aio_anchor.aio_async_workqs);
+
+	for (int i = 0; i < nqueues; i++) {
+		aio_workq_t wq = &aio_anchor.aio_async_workqs[(first + i) % nqueues];
+
+		if (waitq_wakeup64_one(&wq->aioq_waitq, CAST_EVENT64_T(wq),
+		    THREAD_AWAKENED, WAITQ_ALL_PRIORITIES) == KERN_SUCCESS) {
+			return;
+		}
+	}
+
+	if (os_atomic_load(&aio_anchor.aio_num_workers, relaxed) < aio_max_workers()) {
+		thread_call_enter(aio_anchor.aio_grow_call);
+	}
+}
 
-	/* We will wake up when someone enqueues something */
-	waitq_assert_wait64(&queue->aioq_waitq, CAST_EVENT64_T(queue), THREAD_UNINT, 0);
-	aio_workq_unlock(queue);
-	thread_block(aio_work_thread);
 
-	__builtin_unreachable();
+/*
+ * aio_grow_workers - thread call adding a worker thread when work was queued
+ * while all of them were busy.
+ */
+static void
+aio_grow_workers(__unused thread_call_param_t p0, __unused thread_call_param_t p1)
+{
+	if (aio_has_queued_work() &&
+	    os_atomic_load(&aio_anchor.aio_num_workers, relaxed) < aio_max_workers()) {
+		_aio_create_worker_threads(1);
+	}
 }
 
 /*
@@ -1867,6 +2095,7 @@ do_aio_completion_and_unlock(proc_t p, aio_workq_entry *entryp)
 	ASSERT_AIO_PROC_LOCK_OWNED(p);
 
 	aio_proc_move_done_locked(p, entryp);
+	aio_proc_unpark_fsync_locked(p);
 
 	if (leader) {
 		lio_pending = --leader->lio_pending;
@@ -2158,10 +2387,14 @@ ExitThisRoutine:
 __private_extern__ void
 aio_init(void)
 {
-	for (int i = 0; i < AIO_NUM_WORK_QUEUES; i++) {
+	aio_anchor.aio_num_workqs = MIN(ml_wait_max_cpus(), AIO_MAX_WORK_QUEUES);
+	for (int i = 0; i < aio_anchor.aio_num_workqs; i++) {
 		aio_workq_init(&aio_anchor.aio_async_workqs[i]);
 	}
 
+	aio_anchor.aio_grow_call = thread_call_allocate_with_options(aio_grow_workers,
+	    NULL, THREAD_CALL_PRIORITY_KERNEL, THREAD_CALL_OPTIONS_ONCE);
+
 	_aio_create_worker_threads(aio_worker_threads);
 }
 
@@ -2177,8 +2410,16 @@ _aio_create_worker_threads(int num)
 	/* create some worker threads to handle the async IO requests */
 	for (i = 0; i < num; i++) {
 		thread_t                myThread;
+		uint32_t                home;
+
+		/* spread the workers' home queues */
+		home = os_atomic_inc_orig(&aio_anchor.aio_next_home, relaxed) %
+		    (uint32_t)aio_anchor.aio_num_workqs;
 
-		if (KERN_SUCCESS != kernel_thread_start(aio_work_thread, NULL, &myThread)) {
+		os_atomic_inc(&aio_anchor.aio_num_workers, relaxed);
+		if (KERN_SUCCESS != kernel_thread_start(aio_work_thread,
+		    &aio_anchor.aio_async_workqs[home], &myThread)) {
+			os_atomic_dec(&aio_anchor.aio_num_workers, relaxed);
 			printf("%s - failed to create a work thread \n", __FUNCTION__);
 		} else {
 			thread_deallocate(myThread);
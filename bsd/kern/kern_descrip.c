@@ -111,6 +111,7 @@
 #include <kern/kalloc.h>
 #include <kern/waitq.h>
 #include <kern/ipc_misc.h>
+#include <kern/task.h>
 
 #include <vm/vm_protos.h>
 #include <mach/mach_port.h>
@@ -580,7 +581,8 @@ void
 procfdtbl_releasefd(struct proc * p, int fd, struct fileproc * fp)
 {
 	if (fp != NULL) {
-		p->p_fd->fd_ofiles[fd] = fp;
+		/* pairs with fp_lookup_lockless() */
+		os_atomic_store(&p->p_fd->fd_ofiles[fd], fp, release);
 	}
 	p->p_fd->fd_ofileflags[fd] &= ~UF_RESERVED;
 	if ((p->p_fd->fd_ofileflags[fd] & UF_RESVWAIT) == UF_RESVWAIT) {
@@ -647,6 +649,71 @@ fdrelse(struct proc * p, int fd)
 	}
 }
 
+/*
+ * fd_lookup_synchronize
+ *
+ * Description:	Wait for the lookups of the open file table that were made
+ *		without the proc_fdlock and may still be looking at a
+ *		fileproc or at file table arrays that are about to be freed.
+ *
+ * Parameters:	fdp				Pointer to the filedesc
+ *
+ * Locks:	May block; the proc_fdlock may be held (not in spin mode).
+ *
+ * Notes:	See fp_lookup_lockless().
+ */
+static void
+fd_lookup_synchronize(struct filedesc *fdp)
+{
+	/*
+	 * The entries being freed were taken out of the table under the
+	 * proc_fdlock: if lockless lookups weren't enabled by then, none
+	 * can see them (see fd_lookup_enable()).
+	 */
+	if (!os_atomic_load(&fdp->fd_lookup_lockless, acquire)) {
+		return;
+	}
+	lck_brw_lock_exclusive(&fdp->fd_lookup_brw);
+	lck_brw_unlock_exclusive(&fdp->fd_lookup_brw);
+}
+
+/*
+ * fd_lookup_enable
+ *
+ * Description:	Allow lookups of the open file table of the current process
+ *		without the proc_fdlock, once it has more than one thread.
+ *
+ * Parameters:	p				Process (current)
+ *
+ * Locks:	May block; the proc_fdlock must not be held.
+ *
+ * Notes:	A single threaded process doesn't contend on its
+ *		proc_fdlock, so it is spared the per-CPU reader counters of
+ *		fd_lookup_brw, and its closes the exclusive round trip of
+ *		fd_lookup_synchronize().
+ *
+ *		fd_lookup_lockless is set under the proc_fdlock with release
+ *		semantics, and lookups check it with acquire semantics, so a
+ *		lookup made without the lock sees every change to the table
+ *		made before it was set.
+ */
+static void
+fd_lookup_enable(proc_t p)
+{
+	struct filedesc *fdp = p->p_fd;
+
+	if (get_task_numacts(proc_task(p)) < 2) {
+		return;
+	}
+
+	proc_fdlock(p);
+	if (!fdp->fd_lookup_lockless) {
+		lck_brw_init(&fdp->fd_lookup_brw, proc_fdmlock_grp, proc_lck_attr);
+		os_atomic_store(&fdp->fd_lookup_lockless, true, release);
+	}
+	proc_fdunlock(p);
+}
+
 
 int
 fd_rdwr(
@@ -3342,8 +3409,18 @@ close_nocancel(proc_t p, int fd)
 }
 
 
-int
-fp_close_and_unlock(proc_t p, int fd, struct fileproc *fp, int flags)
+/*
+ * fp_close_release_locked
+ *
+ * Description:	First half of closing a descriptor: mark it in flux, make
+ *		the close callouts, wait for the I/O references on the
+ *		fileproc to drain and release the slot in the open file table.
+ *
+ * Locks:	Called and returns with the proc_fdlock held,
+ *		may drop it temporarily.
+ */
+static void
+fp_close_release_locked(proc_t p, int fd, struct fileproc *fp, int flags)
 {
 	struct filedesc *fdp = p->p_fd;
 	struct fileglob *fg = fp->fp_glob;
@@ -3422,8 +3499,22 @@ fp_close_and_unlock(proc_t p, int fd, struct fileproc *fp, int flags)
 	} else {
 		fdrelse(p, fd);
 	}
+}
 
-	proc_fdunlock(p);
+/*
+ * fp_close_free
+ *
+ * Description:	Second half of closing a descriptor: free the fileproc
+ *		released by fp_close_release_locked() and drop its fileglob,
+ *		which may call the per-fileops close.
+ *
+ * Locks:	Called without the proc_fdlock, after fd_lookup_synchronize()
+ *		so that no lockless lookup can still see the fileproc.
+ */
+static int
+fp_close_free(proc_t p, int fd, struct fileproc *fp)
+{
+	struct fileglob *fg = fp->fp_glob;
 
 	if (ENTR_SHOULDTRACE && FILEGLOB_DTYPE(fg) == DTYPE_SOCKET) {
 		KERNEL_ENERGYTRACE(kEnTrActKernSocket, DBG_FUNC_END,
@@ -3435,6 +3526,294 @@ fp_close_and_unlock(proc_t p, int fd, struct fileproc *fp, int flags)
 	return fg_drop(p, fg);
 }
 
+int
+fp_close_and_unlock(proc_t p, int fd, struct fileproc *fp, int flags)
+{
+	fp_close_release_locked(p, fd, fp, flags);
+	proc_fdunlock(p);
+
+	fd_lookup_synchronize(p->p_fd);
+
+	return fp_close_free(p, fd, fp);
+}
+
+
+/*
+ * Descriptors closed together are released from the table under a single
+ * hold of the proc_fdlock, then their fileprocs are freed and their
+ * fileglobs dropped after a single fd_lookup_synchronize().
+ *
+ * The batch is flushed when it is full, which bounds how long the
+ * proc_fdlock is held and how much stack the batch takes.
+ */
+#define FD_CLOSE_BATCH  32
+
+struct fd_close_batch {
+	u_int                   fcb_count;
+	int                     fcb_error;      /* first error from a close */
+	bool                    fcb_audit;      /* audit each close like close(2) */
+	int                     fcb_fds[FD_CLOSE_BATCH];
+	struct fileproc        *fcb_fps[FD_CLOSE_BATCH];
+};
+
+#if CONFIG_AUDIT
+/*
+ * fd_close_audit_begin
+ *
+ * Description:	Start an AUE_CLOSE audit record for a descriptor of a
+ *		batch, as close(2) would, apart from the record of the
+ *		system call closing it, which is set aside and returned.
+ *
+ * Locks:	Called without the proc_fdlock held.
+ */
+static struct kaudit_record *
+fd_close_audit_begin(proc_t p, int fd, struct fileproc *fp)
+{
+	struct uthread *uth = get_bsdthread_info(current_thread());
+	struct kaudit_record *save_uu_ar = uth->uu_ar;
+	struct fileglob *fg = fp->fp_glob;
+
+	uth->uu_ar = NULL;
+	AUDIT_SUBCALL_ENTER(CLOSE, p, uth);
+	AUDIT_ARG(fd, fd);
+	if (FILEGLOB_DTYPE(fg) == DTYPE_VNODE) {
+		AUDIT_ARG(vnpath_withref, (struct vnode *)fg->fg_data,
+		    ARG_VNODE1);
+	}
+	return save_uu_ar;
+}
+
+/*
+ * fd_close_audit_end
+ *
+ * Description:	Commit the record started by fd_close_audit_begin() with
+ *		the result of the close, and restore the system call's.
+ */
+static void
+fd_close_audit_end(struct kaudit_record *save_uu_ar, int error)
+{
+	struct uthread *uth = get_bsdthread_info(current_thread());
+
+	AUDIT_SUBCALL_EXIT(uth, error);
+	uth->uu_ar = save_uu_ar;
+}
+#endif /* CONFIG_AUDIT */
+
+/*
+ * fd_close_batch_flush
+ *
+ * Description:	Free the fileprocs of the descriptors of a batch and drop
+ *		their fileglobs, which may call the per-fileops close.
+ *
+ * Locks:	Called and returns with the proc_fdlock held,
+ *		drops it while the batch is flushed.
+ */
+static void
+fd_close_batch_flush(proc_t p, struct fd_close_batch *fcb)
+{
+	u_int count = fcb->fcb_count;
+
+	if (count == 0) {
+		return;
+	}
+	fcb->fcb_count = 0;
+
+	proc_fdunlock(p);
+
+	fd_lookup_synchronize(p->p_fd);
+
+	for (u_int i = 0; i < count; i++) {
+		int error;
+#if CONFIG_AUDIT
+		bool audit = fcb->fcb_audit && AUDIT_ENABLED();
+		struct kaudit_record *save_uu_ar = NULL;
+
+		if (audit) {
+			save_uu_ar = fd_close_audit_begin(p, fcb->fcb_fds[i],
+			    fcb->fcb_fps[i]);
+		}
+#endif /* CONFIG_AUDIT */
+		error = fp_close_free(p, fcb->fcb_fds[i], fcb->fcb_fps[i]);
+#if CONFIG_AUDIT
+		if (audit) {
+			fd_close_audit_end(save_uu_ar, error);
+		}
+#endif /* CONFIG_AUDIT */
+
+		if (error && fcb->fcb_error == 0) {
+			fcb->fcb_error = error;
+		}
+	}
+
+	proc_fdlock(p);
+}
+
+/*
+ * fd_close_batch_add
+ *
+ * Description:	Release a descriptor from the open file table like
+ *		fp_close_and_unlock() does, but leave freeing its fileproc
+ *		and dropping its fileglob to fd_close_batch_flush().
+ *
+ * Locks:	Called and returns with the proc_fdlock held,
+ *		may drop it temporarily.
+ */
+static void
+fd_close_batch_add(proc_t p, int fd, struct fileproc *fp,
+    struct fd_close_batch *fcb)
+{
+	fp_close_release_locked(p, fd, fp, 0);
+
+	fcb->fcb_fds[fcb->fcb_count] = fd;
+	fcb->fcb_fps[fcb->fcb_count] = fp;
+	if (++fcb->fcb_count == FD_CLOSE_BATCH) {
+		fd_close_batch_flush(p, fcb);
+	}
+}
+
+/*
+ * close_range_np
+ *
+ * Description:	Close, or mark close-on-exec, every open descriptor
+ *		numbered from lowfd to highfd.
+ *
+ * Parameters:	p				Process performing the call
+ *		uap->lowfd			First descriptor of the range
+ *		uap->highfd			Last descriptor of the range
+ *		uap->flags			CLOSE_RANGE_CLOEXEC to only
+ *						mark the descriptors
+ *		retval				<unused>
+ *
+ * Returns:	0			Success
+ *		EINVAL			Invalid range or flags
+ *		fg_drop:???		Anything returnable by a per-fileops
+ *					close function; the rest of the range
+ *					is closed anyway
+ *
+ * Notes:	Descriptors guarded against close, and descriptors being
+ *		opened or closed by another thread, are left alone.
+ */
+int
+close_range_np(proc_t p, struct close_range_np_args *uap, __unused int32_t *retval)
+{
+	struct filedesc *fdp = p->p_fd;
+	struct fd_close_batch fcb = { .fcb_audit = true };
+	u_int fd;
+
+	AUDIT_ARG(fd, uap->lowfd);
+	AUDIT_ARG(value32, uap->highfd);
+	AUDIT_ARG(cmd, uap->flags);
+
+	if (uap->lowfd > uap->highfd ||
+	    (uap->flags & ~CLOSE_RANGE_CLOEXEC) != 0) {
+		return EINVAL;
+	}
+
+	proc_fdlock(p);
+
+	for (fd = uap->lowfd;
+	    fdp->fd_lastfile >= 0 && fd <= MIN(uap->highfd, (u_int)fdp->fd_lastfile);
+	    fd++) {
+		struct fileproc *fp = fdp->fd_ofiles[fd];
+
+		if (fp == NULL || (fdp->fd_ofileflags[fd] & UF_RESERVED)) {
+			continue;
+		}
+
+		if (uap->flags & CLOSE_RANGE_CLOEXEC) {
+			fdp->fd_ofileflags[fd] |= UF_EXCLOSE;
+			continue;
+		}
+
+		if (fp_isguarded(fp, GUARD_CLOSE)) {
+			continue;
+		}
+
+		fd_close_batch_add(p, (int)fd, fp, &fcb);
+	}
+
+	fd_close_batch_flush(p, &fcb);
+
+	proc_fdunlock(p);
+
+	return fcb.fcb_error;
+}
+
+/*
+ * closev_np
+ *
+ * Description:	Close a set of descriptors.
+ *
+ * Parameters:	p				Process performing the call
+ *		uap->fds			User array of descriptors
+ *		uap->nfds			Number of descriptors in fds
+ *		uap->flags			Must be 0
+ *		retval				<unused>
+ *
+ * Returns:	0			Success
+ *		EINVAL			Invalid flags
+ *	copyin:EFAULT
+ *		EBADF			A descriptor of the set was not open
+ *	fp_guard_exception:???		A descriptor of the set is guarded
+ *		fg_drop:???		Anything returnable by a per-fileops
+ *					close function
+ *
+ * Notes:	Every descriptor of the set that can be closed is closed,
+ *		the first error met is returned.
+ */
+int
+closev_np(proc_t p, struct closev_np_args *uap, __unused int32_t *retval)
+{
+	struct fd_close_batch fcb = { .fcb_audit = true };
+	int fds[FD_CLOSE_BATCH];
+	int error = 0;
+
+	AUDIT_ARG(value32, uap->nfds);
+	AUDIT_ARG(cmd, uap->flags);
+
+	if (uap->flags != 0) {
+		return EINVAL;
+	}
+
+	for (u_int done = 0; done < uap->nfds;) {
+		u_int count = MIN(uap->nfds - done, FD_CLOSE_BATCH);
+
+		/* copy the descriptors in without the proc_fdlock held */
+		error = copyin(uap->fds + done * sizeof(int), fds, count * sizeof(int));
+		if (error) {
+			break;
+		}
+		done += count;
+
+		proc_fdlock(p);
+		for (u_int i = 0; i < count; i++) {
+			struct fileproc *fp = fp_get_noref_locked(p, fds[i]);
+
+			if (fp == NULL) {
+				if (fcb.fcb_error == 0) {
+					fcb.fcb_error = EBADF;
+				}
+				continue;
+			}
+
+			if (fp_isguarded(fp, GUARD_CLOSE)) {
+				int gerror = fp_guard_exception(p, fds[i], fp, kGUARD_EXC_CLOSE);
+
+				if (fcb.fcb_error == 0) {
+					fcb.fcb_error = gerror;
+				}
+				continue;
+			}
+
+			fd_close_batch_add(p, fds[i], fp, &fcb);
+		}
+		fd_close_batch_flush(p, &fcb);
+		proc_fdunlock(p);
+	}
+
+	return error ? error : fcb.fcb_error;
+}
+
 
 /*
  * fstat
@@ -3887,9 +4266,16 @@ fdalloc(proc_t p, int want, int *result)
 		    (numfiles - oldnfiles) *
 		    sizeof(*fdp->fd_ofileflags));
 		ofiles = fdp->fd_ofiles;
-		fdp->fd_ofiles = newofiles;
-		fdp->fd_ofileflags = newofileflags;
-		fdp->fd_nfiles = numfiles;
+		/*
+		 * Lockless lookups read fd_nfiles, then fd_ofiles, then
+		 * fd_ofileflags: publish in the opposite order so that they
+		 * never index arrays smaller than the bound they checked,
+		 * and wait for them to be done with the old arrays.
+		 */
+		os_atomic_store(&fdp->fd_ofileflags, newofileflags, relaxed);
+		os_atomic_store(&fdp->fd_ofiles, newofiles, release);
+		os_atomic_store(&fdp->fd_nfiles, numfiles, release);
+		fd_lookup_synchronize(fdp);
 		FREE(ofiles, M_OFILETABL);
 		fdexpand++;
 	}
@@ -3970,12 +4356,135 @@ fp_get_noref_locked_with_iocount(proc_t p, int fd)
 	return fp;
 }
 
+/*
+ * fp_lookup_lockless
+ *
+ * Description:	Try to get the fileproc pointer for a given fd of the current
+ *		process and increment its fp_iocount without taking the
+ *		proc_fdlock, so that threads doing I/O on different
+ *		descriptors don't serialize on it.
+ *
+ * Parameters:	p				Process in which fd lives
+ *		fd				fd to get information for
+ *		resultfp			Pointer to result fileproc
+ *						pointer area
+ *
+ * Returns:	true			*resultfp holds an I/O reference
+ *		false			The caller must perform a locked
+ *						lookup
+ *
+ * Locks:	None held on entry or exit.
+ *
+ * Notes:	Lookups only hold fd_lookup_brw for reading, which only costs
+ *		a CPU local increment, while they look at the table, and take
+ *		their reference with an atomic increment.  Anything out of
+ *		the ordinary (an entry in flux, a table being modified under
+ *		fd_lookup_brw, another process) is left to the locked path.
+ *
+ *		The table is still only modified under the proc_fdlock, and
+ *		fileprocs or arrays that were reachable from it are only freed
+ *		after fd_lookup_synchronize() has waited for lookups that
+ *		might still be looking at them.
+ *
+ *		A close sets UF_RESERVED before draining fp_iocount: after
+ *		taking its reference, a lookup checks that the entry is
+ *		still there and not reserved, or backs off.  Both sides
+ *		issue a full fence in between, so that either the close
+ *		sees the reference and waits for it, or the lookup sees
+ *		the flag.
+ */
+static bool
+fp_lookup_lockless(proc_t p, int fd, struct fileproc **resultfp)
+{
+	struct filedesc *fdp = p->p_fd;
+	struct fileproc **ofiles, *fp = NULL;
+	char *ofileflags;
+	bool found = false, needwakeup = false;
+
+	if (p != current_proc() || fdp == NULL || fd < 0) {
+		return false;
+	}
+	if (!os_atomic_load(&fdp->fd_lookup_lockless, acquire)) {
+		/* this lookup takes the locked path either way */
+		fd_lookup_enable(p);
+		return false;
+	}
+	if (!lck_brw_try_lock_shared(&fdp->fd_lookup_brw)) {
+		return false;
+	}
+
+	if (fd >= os_atomic_load(&fdp->fd_nfiles, acquire)) {
+		goto out;
+	}
+	ofiles = os_atomic_load(&fdp->fd_ofiles, acquire);
+	ofileflags = os_atomic_load(&fdp->fd_ofileflags, relaxed);
+
+	fp = os_atomic_load(&ofiles[fd], dependency);
+	if (fp == NULL || (os_atomic_load(&ofileflags[fd], acquire) & UF_RESERVED)) {
+		fp = NULL;
+		goto out;
+	}
+
+	os_ref_retain(&fp->fp_iocount);
+	os_atomic_thread_fence(seq_cst);
+
+	/*
+	 * fp_tryswap() clears UF_RESERVED after it publishes the new
+	 * fileproc: read the flag first, so that seeing it clear means
+	 * seeing the entry that was there by then.
+	 */
+	if (os_atomic_load(&fdp->fd_ofileflags, relaxed) == ofileflags &&
+	    !(os_atomic_load(&ofileflags[fd], acquire) & UF_RESERVED) &&
+	    os_atomic_load(&ofiles[fd], relaxed) == fp) {
+		*resultfp = fp;
+		found = true;
+	}
+
+out:
+	if (fp != NULL && !found) {
+		/*
+		 * Lost a race with a close, dup2 or swap: back off.
+		 *
+		 * The reference must be dropped before fd_lookup_brw, which
+		 * keeps fd_lookup_synchronize(), and thus the free of fp,
+		 * from completing.  The proc_fdlock can't be taken with
+		 * fd_lookup_brw held, so drainers are woken up afterwards,
+		 * without looking at fp.
+		 */
+		needwakeup = (os_ref_release(&fp->fp_iocount) == 1);
+	}
+	lck_brw_unlock_shared(&fdp->fd_lookup_brw);
+
+	if (needwakeup) {
+		proc_fdlock_spin(p);
+		if (p->p_fpdrainwait) {
+			p->p_fpdrainwait = 0;
+		} else {
+			needwakeup = false;
+		}
+		proc_fdunlock(p);
+		if (needwakeup) {
+			wakeup(&p->p_fpdrainwait);
+		}
+	}
+	return found;
+}
+
 int
 fp_get_ftype(proc_t p, int fd, file_type_t ftype, int err, struct fileproc **fpp)
 {
 	struct filedesc *fdp = p->p_fd;
 	struct fileproc *fp;
 
+	if (fp_lookup_lockless(p, fd, &fp)) {
+		if (fp->f_type != ftype) {
+			fp_drop(p, fd, fp, 0);
+			return err;
+		}
+		*fpp = fp;
+		return 0;
+	}
+
 	proc_fdlock_spin(p);
 	if (fd < 0 || fd >= fdp->fd_nfiles ||
 	    (fp = fdp->fd_ofiles[fd]) == NULL ||
@@ -3989,7 +4498,7 @@ fp_get_ftype(proc_t p, int fd, file_type_t ftype, int err, struct fileproc **fpp
 		return err;
 	}
 
-	os_ref_retain_locked(&fp->fp_iocount);
+	os_ref_retain(&fp->fp_iocount);
 	proc_fdunlock(p);
 
 	*fpp = fp;
@@ -4125,6 +4634,9 @@ fp_lookup(proc_t p, int fd, struct fileproc **resultfp, int locked)
 	struct fileproc *fp;
 
 	if (!locked) {
+		if (fp_lookup_lockless(p, fd, &fp)) {
+			goto found;
+		}
 		proc_fdlock_spin(p);
 	}
 	if (fd < 0 || fdp == NULL || fd >= fdp->fd_nfiles ||
@@ -4135,14 +4647,15 @@ fp_lookup(proc_t p, int fd, struct fileproc **resultfp, int locked)
 		}
 		return EBADF;
 	}
-	os_ref_retain_locked(&fp->fp_iocount);
+	os_ref_retain(&fp->fp_iocount);
+	if (!locked) {
+		proc_fdunlock(p);
+	}
 
+found:
 	if (resultfp) {
 		*resultfp = fp;
 	}
-	if (!locked) {
-		proc_fdunlock(p);
-	}
 
 	return 0;
 }
@@ -4186,7 +4699,16 @@ fp_tryswap(proc_t p, int fd, struct fileproc *nfp)
 	if (os_ref_get_count(&fp->fp_iocount) < 3 ||
 	    1 != os_ref_get_count(&nfp->fp_iocount)) {
 		panic("%s: fp_iocount", __func__);
-	} else if (3 == os_ref_get_count(&fp->fp_iocount)) {
+	}
+
+	/*
+	 * Keep lockless lookups from taking new references while we
+	 * look at fp_iocount (see fileproc_drain()).
+	 */
+	p->p_fd->fd_ofileflags[fd] |= UF_RESERVED;
+	os_atomic_thread_fence(seq_cst);
+
+	if (3 == os_ref_get_count(&fp->fp_iocount)) {
 		/* Copy the contents of *fp, preserving the "type" of *nfp */
 
 		nfp->fp_flags = (nfp->fp_flags & FP_TYPEMASK) |
@@ -4196,13 +4718,21 @@ fp_tryswap(proc_t p, int fd, struct fileproc *nfp)
 		nfp->fp_glob = fp->fp_glob;
 		nfp->fp_wset = fp->fp_wset;
 
-		p->p_fd->fd_ofiles[fd] = nfp;
+		os_atomic_store(&p->p_fd->fd_ofiles[fd], nfp, release);
+		os_atomic_store(&p->p_fd->fd_ofileflags[fd],
+		    p->p_fd->fd_ofileflags[fd] & ~UF_RESERVED, release);
 		fp_drop(p, fd, nfp, 1);
 
+		/* lookups that raced with us must be done backing off */
+		lck_mtx_convert_spin(&p->p_fdmlock);
+		fd_lookup_synchronize(p->p_fd);
+
 		os_ref_release_live(&fp->fp_iocount);
 		os_ref_release_live(&fp->fp_iocount);
 		fileproc_free(fp);
 	} else {
+		p->p_fd->fd_ofileflags[fd] &= ~UF_RESERVED;
+
 		/*
 		 * Wait for all other active references to evaporate.
 		 */
@@ -4251,6 +4781,26 @@ fp_drop(proc_t p, int fd, struct fileproc *fp, int locked)
 	struct filedesc *fdp = p->p_fd;
 	int     needwakeup = 0;
 
+	/*
+	 * Only dropping the last I/O reference needs the proc_fdlock,
+	 * to synchronize with fileproc_drain() and select: a drainer that
+	 * sees the count at 1 may free fp as soon as it gets the lock, so
+	 * the count is only decremented here while it stays above that.
+	 */
+	if (!locked && fp != FILEPROC_NULL) {
+		os_ref_count_t ocount, ncount;
+
+		os_atomic_rmw_loop(&fp->fp_iocount.ref_count, ocount, ncount, release, {
+			if (ocount <= 2) {
+			        os_atomic_rmw_loop_give_up();
+			}
+			ncount = ocount - 1;
+		});
+		if (ocount > 2) {
+			return 0;
+		}
+	}
+
 	if (!locked) {
 		proc_fdlock_spin(p);
 	}
@@ -4264,7 +4814,7 @@ fp_drop(proc_t p, int fd, struct fileproc *fp, int locked)
 		return EBADF;
 	}
 
-	if (1 == os_ref_release_locked(&fp->fp_iocount)) {
+	if (1 == os_ref_release(&fp->fp_iocount)) {
 		if (fp->fp_flags & FP_SELCONFLICT) {
 			fp->fp_flags &= ~FP_SELCONFLICT;
 		}
@@ -4504,7 +5054,7 @@ file_drop(int fd)
 	proc_fdlock_spin(p);
 	fp = fp_get_noref_locked_with_iocount(p, fd);
 
-	if (1 == os_ref_release_locked(&fp->fp_iocount)) {
+	if (1 == os_ref_release(&fp->fp_iocount)) {
 		if (fp->fp_flags & FP_SELCONFLICT) {
 			fp->fp_flags &= ~FP_SELCONFLICT;
 		}
@@ -4624,7 +5174,8 @@ falloc_withalloc(proc_t p, struct fileproc **resultfp, int *resultfd,
 
 	proc_fdlock(p);
 
-	p->p_fd->fd_ofiles[nfd] = fp;
+	/* pairs with fp_lookup_lockless() */
+	os_atomic_store(&p->p_fd->fd_ofiles[nfd], fp, release);
 
 	proc_fdunlock(p);
 
@@ -4656,6 +5207,8 @@ falloc(proc_t p, struct fileproc **resultfp, int *resultfd, vfs_context_t ctx)
  *		files except those marked with "inherit" as treated as
  *		close-on-exec.
  *
+ *		Descriptors are closed in batches, see fd_close_batch_add().
+ *
  * Parameters:	p				Pointer to process calling
  *						execve
  *
@@ -4674,6 +5227,7 @@ fdexec(proc_t p, short flags, int self_exec)
 	thread_t self = current_thread();
 	struct uthread *ut = get_bsdthread_info(self);
 	struct kqworkq *dealloc_kqwq = NULL;
+	struct fd_close_batch fcb = { };
 
 	/*
 	 * If the current thread is bound as a workq/workloop
@@ -4717,11 +5271,12 @@ fdexec(proc_t p, short flags, int self_exec)
 			|| (fp && mac_file_check_inherit(proc_ucred(p), fp->fp_glob))
 #endif
 			) {
-			fp_close_and_unlock(p, i, fp, 0);
-			proc_fdlock(p);
+			fd_close_batch_add(p, i, fp, &fcb);
 		}
 	}
 
+	fd_close_batch_flush(p, &fcb);
+
 	/* release the per-process workq kq */
 	if (fdp->fd_wqkqueue) {
 		dealloc_kqwq = fdp->fd_wqkqueue;
@@ -4748,6 +5303,11 @@ fdexec(proc_t p, short flags, int self_exec)
  *						is to be copied (parent)
  *		uth_cdir			Per thread current working
  *						cirectory, or NULL
+ *		exec_fdmin			Lowest descriptor that need not
+ *						be copied if the exec that
+ *						follows closes it, or INT_MAX
+ *		exec_cloexec_default		The exec closes all descriptors
+ *						(POSIX_SPAWN_CLOEXEC_DEFAULT)
  *
  * Returns:	NULL				Copy failed
  *		!NULL				Pointer to new struct filedesc
@@ -4772,9 +5332,16 @@ fdexec(proc_t p, short flags, int self_exec)
  *		reference there would constitute an "escape" from the chroot
  *		environment, which must not be allowed.  In that case, we will
  *		deny the execve() operation, rather than allowing the escape.
+ *
+ *		posix_spawn() passes an exec_fdmin above all the descriptors
+ *		its file actions use: from there up, the descriptors that
+ *		fdexec() would close are never copied, and with
+ *		exec_cloexec_default the table is only as large as needed
+ *		for the ones below.  A parent with many descriptors then
+ *		does not pay for copying and closing them for each child.
  */
 struct filedesc *
-fdcopy(proc_t p, vnode_t uth_cdir)
+fdcopy(proc_t p, vnode_t uth_cdir, int exec_fdmin, bool exec_cloexec_default)
 {
 	struct filedesc *newfdp, *fdp = p->p_fd;
 	int i;
@@ -4859,6 +5426,16 @@ fdcopy(proc_t p, vnode_t uth_cdir)
 		return NULL;
 	}
 
+	/*
+	 * None of the descriptors from exec_fdmin up survive the exec.
+	 */
+	if (exec_cloexec_default && newfdp->fd_lastfile >= exec_fdmin) {
+		newfdp->fd_lastfile = MAX(exec_fdmin - 1, 0);
+		if (newfdp->fd_freefile > newfdp->fd_lastfile + 1) {
+			newfdp->fd_freefile = newfdp->fd_lastfile + 1;
+		}
+	}
+
 	/*
 	 * If the number of open files fits in the internal arrays
 	 * of the open file structure, use them, otherwise allocate
@@ -4913,7 +5490,9 @@ fdcopy(proc_t p, vnode_t uth_cdir)
 		for (i = newfdp->fd_lastfile; i >= 0; i--, fpp--, flags--) {
 			if ((ofp = *fpp) != NULL &&
 			    0 == (ofp->fp_glob->fg_lflags & FG_CONFINED) &&
-			    0 == (*flags & (UF_FORKCLOSE | UF_RESERVED))) {
+			    0 == (*flags & (UF_FORKCLOSE | UF_RESERVED)) &&
+			    (i < exec_fdmin ||
+			    (!exec_cloexec_default && 0 == (*flags & UF_EXCLOSE)))) {
 #if DEBUG
 				if (FILEPROC_TYPE(ofp) != FTYPE_SIMPLE) {
 					panic("complex fileproc");
@@ -4962,6 +5541,8 @@ fdcopy(proc_t p, vnode_t uth_cdir)
 	newfdp->fd_wqkqueue = NULL;
 	lck_mtx_init(&newfdp->fd_kqhashlock, proc_kqhashlock_grp, proc_lck_attr);
 	lck_mtx_init(&newfdp->fd_knhashlock, proc_knhashlock_grp, proc_lck_attr);
+	/* the child starts single threaded (see fd_lookup_enable()) */
+	newfdp->fd_lookup_lockless = false;
 
 	return newfdp;
 }
@@ -5062,6 +5643,9 @@ fdfree(proc_t p)
 
 	lck_mtx_destroy(&fdp->fd_kqhashlock, proc_kqhashlock_grp);
 	lck_mtx_destroy(&fdp->fd_knhashlock, proc_knhashlock_grp);
+	if (fdp->fd_lookup_lockless) {
+		lck_brw_destroy(&fdp->fd_lookup_brw, proc_fdmlock_grp);
+	}
 
 	zfree(fdp_zone, fdp);
 }
@@ -5111,6 +5695,13 @@ fileproc_drain(proc_t p, struct fileproc * fp)
 	/* Set the vflag for drain */
 	fileproc_modify_vflags(fp, FPV_DRAIN, FALSE);
 
+	/*
+	 * Order setting UF_RESERVED on the entry with reading fp_iocount:
+	 * a lockless lookup either sees the flag and backs off,
+	 * or holds a reference we will see below (see fp_lookup_lockless()).
+	 */
+	os_atomic_thread_fence(seq_cst);
+
 	while (os_ref_get_count(&fp->fp_iocount) > 1) {
 		lck_mtx_convert_spin(&p->p_fdmlock);
 
@@ -5164,6 +5755,7 @@ fp_free(proc_t p, int fd, struct fileproc * fp)
 	fdrelse(p, fd);
 	proc_fdunlock(p);
 
+	fd_lookup_synchronize(p->p_fd);
 	fg_free(fp->fp_glob);
 	os_ref_release_live(&fp->fp_iocount);
 	fileproc_free(fp);
@@ -2992,6 +2992,39 @@ kqueue_alloc(struct proc *p)
 	return kqueue_init(kqf, NULL, SYNC_POLICY_FIFO | SYNC_POLICY_PREPOST).kq;
 }
 
+/*!
+ * @function kqueue_poll_cache_enable
+ *
+ * @brief
+ * Marks a kqfile as holding the interest set poll() caches across calls,
+ * so that knote_fdclose() flags it stale when it drops one of its knotes.
+ */
+void
+kqueue_poll_cache_enable(struct kqueue *kq)
+{
+	kqlock(kq);
+	kq->kq_state |= KQ_POLL_CACHE;
+	kqunlock(kq);
+}
+
+/*!
+ * @function kqueue_poll_cache_is_stale
+ *
+ * @brief
+ * Returns whether knotes of the cached poll() interest set were dropped.
+ */
+bool
+kqueue_poll_cache_is_stale(struct kqueue *kq)
+{
+	bool stale;
+
+	kqlock(kq);
+	stale = (kq->kq_state & KQ_POLL_STALE) != 0;
+	kqunlock(kq);
+
+	return stale;
+}
+
 /*!
  * @function kqueue_internal
  *
@@ -6195,6 +6228,10 @@ restart:
 			    __func__, kq->kq_p, p);
 		}
 
+		if (kq->kq_state & KQ_POLL_CACHE) {
+			kq->kq_state |= KQ_POLL_STALE;
+		}
+
 		/*
 		 * If the knote supports EV_VANISHED delivery,
 		 * transition it to vanished mode (or skip over
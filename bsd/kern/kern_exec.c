@@ -2576,6 +2576,62 @@ exec_handle_file_actions(struct image_params *imgp, short psa_flags)
 	return 0;
 }
 
+/*
+ * exec_spawn_fdmin
+ *
+ * Description:	Find the lowest descriptor above all the descriptors the
+ *		file actions of a posix_spawn() operate on.  From there up,
+ *		the child only needs the descriptors its exec leaves open,
+ *		see fdcopy().
+ *
+ * Parameters:	px_sfap				File actions, or NULL
+ *
+ * Returns:	The descriptor, 0 if there are no file actions
+ */
+static int
+exec_spawn_fdmin(_posix_spawn_file_actions_t px_sfap)
+{
+	int fdmin = 0;
+	int action;
+
+	if (px_sfap == NULL) {
+		return 0;
+	}
+
+	for (action = 0; action < px_sfap->psfa_act_count; action++) {
+		_psfa_action_t *psfa = &px_sfap->psfa_act_acts[action];
+		int fd = -1;
+
+		switch (psfa->psfaa_type) {
+		case PSFA_DUP2:
+			fd = MAX(psfa->psfaa_filedes,
+			    psfa->psfaa_dup2args.psfad_newfiledes);
+			break;
+		case PSFA_FILEPORT_DUP2:
+			fd = psfa->psfaa_dup2args.psfad_newfiledes;
+			break;
+		case PSFA_OPEN:
+		case PSFA_CLOSE:
+		case PSFA_INHERIT:
+		case PSFA_FCHDIR:
+			fd = psfa->psfaa_filedes;
+			break;
+		case PSFA_CHDIR:
+		default:
+			break;
+		}
+
+		if (fd == INT_MAX) {
+			return INT_MAX;
+		}
+		if (fd >= fdmin) {
+			fdmin = fd + 1;
+		}
+	}
+
+	return fdmin;
+}
+
 #if CONFIG_MACF
 /*
  * exec_spawnattr_getmacpolicyinfo
@@ -3408,6 +3464,15 @@ posix_spawn(proc_t ap, struct posix_spawn_args *uap, int32_t *retval)
 do_fork1:
 #endif /* CONFIG_COALITIONS */
 
+		/*
+		 * The child execs right away: let fdcopy() leave behind
+		 * the descriptors that would only be closed by the exec.
+		 */
+		uthread->uu_spawn_fdmin = exec_spawn_fdmin(px_sfap);
+		uthread->uu_spawn_cloexec_default = imgp->ip_px_sa != NULL &&
+		    (px_sa.psa_flags & POSIX_SPAWN_CLOEXEC_DEFAULT);
+		uthread->uu_flag |= UT_SPAWN_FDCOPY;
+
 		/*
 		 * note that this will implicitly inherit the
 		 * caller's persona (if it exists)
@@ -3415,6 +3480,8 @@ do_fork1:
 		error = fork1(p, &imgp->ip_new_thread, PROC_CREATE_SPAWN, coal);
 		/* returns a thread and task reference */
 
+		uthread->uu_flag &= ~UT_SPAWN_FDCOPY;
+
 		if (error == 0) {
 			new_task = get_threadtask(imgp->ip_new_thread);
 		}
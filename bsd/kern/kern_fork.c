@@ -1346,10 +1346,21 @@ retry:
 	 * per-process current working directory to that instead of the
 	 * parents.
 	 *
+	 * A child created by posix_spawn() is certain to exec: the
+	 * descriptors that the exec would close are not copied at all,
+	 * unless its file actions may operate on them.
+	 *
 	 * XXX may fail to copy descriptors to child
 	 */
 	lck_rw_init(&child_proc->p_dirs_lock, proc_dirslock_grp, proc_lck_attr);
-	child_proc->p_fd = fdcopy(parent_proc, parent_uthread->uu_cdir);
+	if (parent_uthread->uu_flag & UT_SPAWN_FDCOPY) {
+		child_proc->p_fd = fdcopy(parent_proc, parent_uthread->uu_cdir,
+		    parent_uthread->uu_spawn_fdmin,
+		    parent_uthread->uu_spawn_cloexec_default);
+	} else {
+		child_proc->p_fd = fdcopy(parent_proc, parent_uthread->uu_cdir,
+		    INT_MAX, false);
+	}
 
 #if SYSV_SHM
 	if (parent_proc->vm_shm) {
@@ -1691,6 +1702,8 @@ uthread_cleanup(task_t task, void *uthread, void * bsd_info)
 		uth->uu_wqstate_sz = 0;
 	}
 
+	poll_cache_free(uth);
+
 	os_reason_free(uth->uu_exit_reason);
 
 	if ((task != kernel_task) && p) {
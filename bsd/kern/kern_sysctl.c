@@ -5205,10 +5205,18 @@ int
 turnstile_get_boost_stats_sysctl(void *req);
 int
 turnstile_get_unboost_stats_sysctl(void *req);
+int
+turnstile_get_boost_chain_stats_sysctl(void *req);
+int
+turnstile_get_unboost_chain_stats_sysctl(void *req);
 static int
 sysctl_turnstile_boost_stats SYSCTL_HANDLER_ARGS;
 static int
 sysctl_turnstile_unboost_stats SYSCTL_HANDLER_ARGS;
+static int
+sysctl_turnstile_boost_chain_stats SYSCTL_HANDLER_ARGS;
+static int
+sysctl_turnstile_unboost_chain_stats SYSCTL_HANDLER_ARGS;
 extern uint64_t thread_block_on_turnstile_count;
 extern uint64_t thread_block_on_regular_waitq_count;
 
@@ -5226,10 +5234,28 @@ sysctl_turnstile_unboost_stats SYSCTL_HANDLER_ARGS
 	return turnstile_get_unboost_stats_sysctl(req);
 }
 
+static int
+sysctl_turnstile_boost_chain_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	return turnstile_get_boost_chain_stats_sysctl(req);
+}
+
+static int
+sysctl_turnstile_unboost_chain_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	return turnstile_get_unboost_chain_stats_sysctl(req);
+}
+
 SYSCTL_PROC(_kern, OID_AUTO, turnstile_boost_stats, CTLFLAG_RD | CTLFLAG_ANYBODY | CTLFLAG_KERN | CTLFLAG_LOCKED | CTLTYPE_STRUCT,
     0, 0, sysctl_turnstile_boost_stats, "S", "turnstiles boost stats");
 SYSCTL_PROC(_kern, OID_AUTO, turnstile_unboost_stats, CTLFLAG_RD | CTLFLAG_ANYBODY | CTLFLAG_KERN | CTLFLAG_LOCKED | CTLTYPE_STRUCT,
     0, 0, sysctl_turnstile_unboost_stats, "S", "turnstiles unboost stats");
+SYSCTL_PROC(_kern, OID_AUTO, turnstile_boost_chain_stats, CTLFLAG_RD | CTLFLAG_ANYBODY | CTLFLAG_KERN | CTLFLAG_LOCKED | CTLTYPE_STRUCT,
+    0, 0, sysctl_turnstile_boost_chain_stats, "S", "turnstiles boost chain length histogram");
+SYSCTL_PROC(_kern, OID_AUTO, turnstile_unboost_chain_stats, CTLFLAG_RD | CTLFLAG_ANYBODY | CTLFLAG_KERN | CTLFLAG_LOCKED | CTLTYPE_STRUCT,
+    0, 0, sysctl_turnstile_unboost_chain_stats, "S", "turnstiles unboost chain length histogram");
 SYSCTL_QUAD(_kern, OID_AUTO, thread_block_count_on_turnstile,
     CTLFLAG_RD | CTLFLAG_ANYBODY | CTLFLAG_KERN | CTLFLAG_LOCKED,
     &thread_block_on_turnstile_count, "thread blocked on turnstile count");
@@ -5237,6 +5263,19 @@ SYSCTL_QUAD(_kern, OID_AUTO, thread_block_count_on_reg_waitq,
     CTLFLAG_RD | CTLFLAG_ANYBODY | CTLFLAG_KERN | CTLFLAG_LOCKED,
     &thread_block_on_regular_waitq_count, "thread blocked on regular waitq count");
 
+int
+waitq_global_stats_sysctl(void *req);
+
+static int
+sysctl_waitq_global_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	return waitq_global_stats_sysctl(req);
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, waitq_global_stats, CTLFLAG_RD | CTLFLAG_ANYBODY | CTLFLAG_KERN | CTLFLAG_LOCKED | CTLTYPE_STRUCT,
+    0, 0, sysctl_waitq_global_stats, "S", "global waitq hash table stats");
+
 static int
 sysctl_erase_all_test_mtx_stats SYSCTL_HANDLER_ARGS
 {
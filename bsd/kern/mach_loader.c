@@ -777,6 +777,10 @@ parse_machfile(
 	size_t                  mach_header_sz = sizeof(struct mach_header);
 	boolean_t               abi64;
 	boolean_t               got_code_signatures = FALSE;
+	boolean_t               addr_allocated = FALSE;
+	struct ubc_lcmds        *lcmds = NULL;
+	struct cs_blob          *lcmds_blob = NULL;
+	uint32_t                lcmds_gen = 0;
 	boolean_t               found_header_segment = FALSE;
 	boolean_t               found_xhdr = FALSE;
 	boolean_t               found_version_cmd = FALSE;
@@ -876,22 +880,38 @@ parse_machfile(
 	}
 
 	/*
-	 * Map the load commands into kernel memory.
+	 * Use the copy of the load commands that a previous exec of this
+	 * file already validated, if it is still current.  Otherwise, when
+	 * they fit in the page exec_activate_image() read the header from,
+	 * use that page rather than reading it again.
 	 */
-	addr = kalloc(alloc_size);
-	if (addr == NULL) {
-		return LOAD_NOSPACE;
-	}
+	lcmds = ubc_lcmds_get(vp, file_offset, header, mach_header_sz, alloc_size);
+	if (lcmds != NULL) {
+		addr = lcmds->ul_data;
+	} else if ((caddr_t)header == imgp->ip_vdata && vp == imgp->ip_vp &&
+	    file_offset == (off_t)imgp->ip_arch_offset &&
+	    alloc_size <= PAGE_SIZE && (off_t)alloc_size <= macho_size) {
+		lcmds_gen = ubc_lcmds_gen(vp);
+		addr = imgp->ip_vdata;
+	} else {
+		/*
+		 * Map the load commands into kernel memory.
+		 */
+		lcmds_gen = ubc_lcmds_gen(vp);
+		addr = kalloc(alloc_size);
+		if (addr == NULL) {
+			return LOAD_NOSPACE;
+		}
+		addr_allocated = TRUE;
 
-	error = vn_rdwr(UIO_READ, vp, addr, (int)alloc_size, file_offset,
-	    UIO_SYSSPACE, 0, vfs_context_ucred(imgp->ip_vfs_context), &resid, p);
-	if (error) {
-		kfree(addr, alloc_size);
-		return LOAD_IOERROR;
-	}
+		error = vn_rdwr(UIO_READ, vp, addr, (int)alloc_size, file_offset,
+		    UIO_SYSSPACE, 0, vfs_context_ucred(imgp->ip_vfs_context), &resid, p);
+		if (error) {
+			kfree(addr, alloc_size);
+			return LOAD_IOERROR;
+		}
 
-	if (resid) {
-		{
+		if (resid) {
 			/* We must be able to read in as much as the mach_header indicated */
 			kfree(addr, alloc_size);
 			return LOAD_BADMACHO;
@@ -1275,7 +1295,17 @@ parse_machfile(
 					unsigned tainted = CS_VALIDATE_TAINTED;
 					boolean_t valid = FALSE;
 					vm_size_t off = 0;
-
+					struct cs_blob *blob;
+
+					blob = ubc_cs_blob_get(vp, header->cputype,
+					    header->cpusubtype & ~CPU_SUBTYPE_MASK, file_offset);
+					if (lcmds != NULL && blob != NULL &&
+					    memcmp(lcmds->ul_cdhash, blob->csb_cdhash,
+					    sizeof(lcmds->ul_cdhash)) == 0) {
+						/* validated against this code directory already */
+						break;
+					}
+					lcmds_blob = blob;
 
 					if (cs_debug > 10) {
 						printf("validating initial pages of %s\n", vp->v_name);
@@ -1300,6 +1330,7 @@ parse_machfile(
 								ret = LOAD_FAILURE;
 							}
 							result->csflags &= ~CS_VALID;
+							lcmds_blob = NULL;
 						}
 						off += PAGE_SIZE;
 					}
@@ -1443,7 +1474,15 @@ parse_machfile(
 		ret = LOAD_BADMACHO_UPX;
 	}
 
-	kfree(addr, alloc_size);
+	if (lcmds != NULL) {
+		ubc_lcmds_release(lcmds);
+	} else if (ret == LOAD_SUCCESS && lcmds_blob != NULL) {
+		/* every initial page validated: keep them for the next exec */
+		ubc_lcmds_set(vp, file_offset, addr, alloc_size, lcmds_blob, lcmds_gen);
+	}
+	if (addr_allocated) {
+		kfree(addr, alloc_size);
+	}
 
 	return ret;
 }
@@ -291,12 +291,9 @@ preparefileread(struct proc *p, struct fileproc **fp_ret, int fd, int check_for_
 
 	AUDIT_ARG(fd, fd);
 
-	proc_fdlock_spin(p);
-
-	error = fp_lookup(p, fd, &fp, 1);
+	error = fp_lookup(p, fd, &fp, 0);
 
 	if (error) {
-		proc_fdunlock(p);
 		return error;
 	}
 	if ((fp->f_flag & FREAD) == 0) {
@@ -321,13 +318,10 @@ preparefileread(struct proc *p, struct fileproc **fp_ret, int fd, int check_for_
 	}
 
 	*fp_ret = fp;
-
-	proc_fdunlock(p);
 	return 0;
 
 out:
-	fp_drop(p, fd, fp, 1);
-	proc_fdunlock(p);
+	fp_drop(p, fd, fp, 0);
 	return error;
 }
 
@@ -658,12 +652,9 @@ preparefilewrite(struct proc *p, struct fileproc **fp_ret, int fd, int check_for
 
 	AUDIT_ARG(fd, fd);
 
-	proc_fdlock_spin(p);
-
-	error = fp_lookup(p, fd, &fp, 1);
+	error = fp_lookup(p, fd, &fp, 0);
 
 	if (error) {
-		proc_fdunlock(p);
 		return error;
 	}
 	if ((fp->f_flag & FWRITE) == 0) {
@@ -671,7 +662,9 @@ preparefilewrite(struct proc *p, struct fileproc **fp_ret, int fd, int check_for
 		goto ExitThisRoutine;
 	}
 	if (fp_isguarded(fp, GUARD_WRITE)) {
+		proc_fdlock_spin(p);
 		error = fp_guard_exception(p, fd, fp, kGUARD_EXC_WRITE);
+		proc_fdunlock(p);
 		goto ExitThisRoutine;
 	}
 	if (check_for_pwrite) {
@@ -692,13 +685,10 @@ preparefilewrite(struct proc *p, struct fileproc **fp_ret, int fd, int check_for
 	}
 
 	*fp_ret = fp;
-
-	proc_fdunlock(p);
 	return 0;
 
 ExitThisRoutine:
-	fp_drop(p, fd, fp, 1);
-	proc_fdunlock(p);
+	fp_drop(p, fd, fp, 0);
 	return error;
 }
 
@@ -1817,6 +1807,273 @@ selscan(struct proc *p, struct _select *sel, struct _select_data * seldata,
 
 static int poll_callback(struct kevent_qos_s *, kevent_ctx_t);
 
+/*
+ * Interest set cached across poll() calls.
+ *
+ * Programs calling poll() in a loop typically pass the same array every
+ * time.  Rather than building a kqueue from scratch on every call, each
+ * thread keeps the kqueue of its last poll() call, with level-triggered
+ * knotes, along with the fd/events pairs it was built from:
+ *
+ * - when the same array is passed again, nothing is registered and
+ *   kqueue_scan() only looks at the knotes that fired,
+ *
+ * - when only the events of a few entries changed, only those are updated,
+ *
+ * - anything else rebuilds the kqueue.
+ *
+ * Knotes are identified by their index in the array (kn_udata), so that
+ * they don't point into a buffer that only lives for the duration of a call.
+ *
+ * Closing a descriptor drops its knotes from the kqueue behind our back,
+ * which knote_fdclose() signals by marking the kqueue KQ_POLL_STALE:
+ * the next call rebuilds the kqueue then.
+ */
+struct poll_cache {
+	struct kqueue  *pc_kq;
+	u_int           pc_nfds;
+	struct pollfd   pc_fds[];       /* revents unused */
+};
+
+/* beyond that many changed entries, just rebuild the cached kqueue */
+#define POLL_CACHE_MAX_UPDATES  16
+
+#define POLL_READ_EVENTS        (POLLIN | POLLRDNORM | POLLPRI | POLLRDBAND | POLLHUP)
+#define POLL_WRITE_EVENTS       (POLLOUT | POLLWRNORM | POLLWRBAND)
+#define POLL_VNODE_EVENTS       (POLLEXTEND | POLLATTRIB | POLLNLINK | POLLWRITE)
+
+static void
+poll_cache_destroy(struct poll_cache *pc)
+{
+	kqueue_dealloc(pc->pc_kq);
+	kheap_free(KHEAP_DEFAULT, pc, sizeof(*pc) + pc->pc_nfds * sizeof(struct pollfd));
+}
+
+void
+poll_cache_free(struct uthread *ut)
+{
+	if (ut->uu_poll_cache) {
+		poll_cache_destroy(ut->uu_poll_cache);
+		ut->uu_poll_cache = NULL;
+	}
+}
+
+/*
+ * Registers the knotes for the events of `pfd', the entry `index' of the
+ * array passed to poll(), returns whether registration failed.
+ */
+static bool
+poll_register(struct kqueue *kq, const struct pollfd *pfd, u_int index)
+{
+	short events = pfd->events;
+	__assert_only int rc;
+
+	/* convert the poll event into a kqueue kevent */
+	struct kevent_qos_s kev = {
+		.ident = pfd->fd,
+		.flags = EV_ADD | EV_POLL,
+		.udata = index,
+	};
+
+	/* Handle input events */
+	if (events & POLL_READ_EVENTS) {
+		kev.filter = EVFILT_READ;
+		if (events & (POLLPRI | POLLRDBAND)) {
+			kev.flags |= EV_OOBAND;
+		}
+		rc = kevent_register(kq, &kev, NULL);
+		assert((rc & FILTER_REGISTER_WAIT) == 0);
+	}
+
+	/* Handle output events */
+	if ((kev.flags & EV_ERROR) == 0 &&
+	    (events & POLL_WRITE_EVENTS)) {
+		kev.filter = EVFILT_WRITE;
+		rc = kevent_register(kq, &kev, NULL);
+		assert((rc & FILTER_REGISTER_WAIT) == 0);
+	}
+
+	/* Handle BSD extension vnode events */
+	if ((kev.flags & EV_ERROR) == 0 &&
+	    (events & POLL_VNODE_EVENTS)) {
+		kev.filter = EVFILT_VNODE;
+		kev.fflags = 0;
+		if (events & POLLEXTEND) {
+			kev.fflags |= NOTE_EXTEND;
+		}
+		if (events & POLLATTRIB) {
+			kev.fflags |= NOTE_ATTRIB;
+		}
+		if (events & POLLNLINK) {
+			kev.fflags |= NOTE_LINK;
+		}
+		if (events & POLLWRITE) {
+			kev.fflags |= NOTE_WRITE;
+		}
+		rc = kevent_register(kq, &kev, NULL);
+		assert((rc & FILTER_REGISTER_WAIT) == 0);
+	}
+
+	return (kev.flags & EV_ERROR) != 0;
+}
+
+/*
+ * Drops the knotes of `fd' for the filters that `old_events' needed
+ * but `new_events' doesn't.
+ */
+static void
+poll_unregister(struct kqueue *kq, int fd, short old_events, short new_events)
+{
+	struct kevent_qos_s kev = {
+		.ident = fd,
+		.flags = EV_DELETE,
+	};
+
+	if ((old_events & POLL_READ_EVENTS) && !(new_events & POLL_READ_EVENTS)) {
+		kev.filter = EVFILT_READ;
+		(void)kevent_register(kq, &kev, NULL);
+	}
+	if ((old_events & POLL_WRITE_EVENTS) && !(new_events & POLL_WRITE_EVENTS)) {
+		kev.filter = EVFILT_WRITE;
+		(void)kevent_register(kq, &kev, NULL);
+	}
+	if ((old_events & POLL_VNODE_EVENTS) && !(new_events & POLL_VNODE_EVENTS)) {
+		kev.filter = EVFILT_VNODE;
+		(void)kevent_register(kq, &kev, NULL);
+	}
+}
+
+/*
+ * Tries to bring the cached kqueue up to date with `fds' by only
+ * updating the entries whose events changed, returns whether it could.
+ */
+static bool
+poll_cache_update(struct poll_cache *pc, const struct pollfd *fds, u_int nfds)
+{
+	u_int updates[POLL_CACHE_MAX_UPDATES];
+	u_int nupdates = 0;
+
+	if (pc->pc_nfds != nfds || kqueue_poll_cache_is_stale(pc->pc_kq)) {
+		return false;
+	}
+
+	for (u_int i = 0; i < nfds; i++) {
+		if (fds[i].fd != pc->pc_fds[i].fd) {
+			return false;
+		}
+		if (fds[i].fd >= 0 && fds[i].events != pc->pc_fds[i].events) {
+			if (nupdates == POLL_CACHE_MAX_UPDATES) {
+				return false;
+			}
+			updates[nupdates++] = i;
+		}
+	}
+
+	for (u_int n = 0; n < nupdates; n++) {
+		u_int i = updates[n];
+
+		/* a knote serves every entry for a descriptor: bail on duplicates */
+		for (u_int j = 0; j < nfds; j++) {
+			if (j != i && fds[j].fd == fds[i].fd) {
+				return false;
+			}
+		}
+	}
+
+	for (u_int n = 0; n < nupdates; n++) {
+		u_int i = updates[n];
+
+		poll_unregister(pc->pc_kq, fds[i].fd, pc->pc_fds[i].events,
+		    fds[i].events);
+		if (poll_register(pc->pc_kq, &fds[i], i)) {
+			/* the kqueue no longer matches: rebuild it */
+			return false;
+		}
+		pc->pc_fds[i].events = fds[i].events;
+	}
+
+	return true;
+}
+
+/*
+ * Returns a kqueue with knotes registered for `fds', reusing the calling
+ * thread's cached interest set when possible.
+ *
+ * Entries that could not be registered are marked POLLNVAL and counted
+ * in `*rfdsp'.  If the returned kqueue isn't cached, `*cachedp' is set
+ * to false, and the caller must deallocate it.
+ */
+static struct kqueue *
+poll_cache_prepare(struct proc *p, struct pollfd *fds, u_int nfds,
+    u_int *rfdsp, bool *cachedp)
+{
+	struct uthread *ut = current_uthread();
+	struct poll_cache *pc = ut->uu_poll_cache;
+	struct kqueue *kq;
+	u_int rfds = 0;
+	bool cacheable = (nfds > 0);
+
+	/* a vfork child runs on its parent's thread: leave its cache alone */
+	if (pc && pc->pc_kq->kq_p != p) {
+		pc = NULL;
+		cacheable = false;
+	}
+
+	if (pc && poll_cache_update(pc, fds, nfds)) {
+		for (u_int i = 0; i < nfds; i++) {
+			fds[i].revents = 0;
+		}
+		*rfdsp = 0;
+		*cachedp = true;
+		return pc->pc_kq;
+	}
+
+	if (pc) {
+		poll_cache_destroy(pc);
+		ut->uu_poll_cache = pc = NULL;
+	}
+
+	kq = kqueue_alloc(p);
+	if (kq == NULL) {
+		return NULL;
+	}
+	kqueue_poll_cache_enable(kq);
+
+	for (u_int i = 0; i < nfds; i++) {
+		/* per spec, ignore fd values below zero */
+		if (fds[i].fd < 0) {
+			fds[i].revents = 0;
+			continue;
+		}
+
+		if (poll_register(kq, &fds[i], i)) {
+			fds[i].revents = POLLNVAL;
+			rfds++;
+		} else {
+			fds[i].revents = 0;
+		}
+	}
+
+	/*
+	 * Entries that failed to register must be retried on every call,
+	 * and there is no point caching an empty interest set.
+	 */
+	if (rfds == 0 && cacheable) {
+		pc = kheap_alloc(KHEAP_DEFAULT,
+		    sizeof(*pc) + nfds * sizeof(struct pollfd), Z_WAITOK);
+	}
+	if (pc) {
+		pc->pc_kq = kq;
+		pc->pc_nfds = nfds;
+		memcpy(pc->pc_fds, fds, nfds * sizeof(struct pollfd));
+		ut->uu_poll_cache = pc;
+	}
+
+	*rfdsp = rfds;
+	*cachedp = (pc != NULL);
+	return kq;
+}
+
 int
 poll(struct proc *p, struct poll_args *uap, int32_t *retval)
 {
@@ -1830,6 +2087,7 @@ poll_nocancel(struct proc *p, struct poll_nocancel_args *uap, int32_t *retval)
 {
 	struct pollfd *fds = NULL;
 	struct kqueue *kq = NULL;
+	bool cached = false;
 	int ncoll, error = 0;
 	u_int nfds = uap->nfds;
 	u_int rfds = 0;
@@ -1847,11 +2105,6 @@ poll_nocancel(struct proc *p, struct poll_nocancel_args *uap, int32_t *retval)
 		return EINVAL;
 	}
 
-	kq = kqueue_alloc(p);
-	if (kq == NULL) {
-		return EAGAIN;
-	}
-
 	if (nfds) {
 		size_t ni = nfds * sizeof(struct pollfd);
 		MALLOC(fds, struct pollfd *, ni, M_TEMP, M_WAITOK);
@@ -1869,68 +2122,12 @@ poll_nocancel(struct proc *p, struct poll_nocancel_args *uap, int32_t *retval)
 	/* JMM - all this P_SELECT stuff is bogus */
 	ncoll = nselcoll;
 	OSBitOrAtomic(P_SELECT, &p->p_flag);
-	for (u_int i = 0; i < nfds; i++) {
-		short events = fds[i].events;
-		__assert_only int rc;
-
-		/* per spec, ignore fd values below zero */
-		if (fds[i].fd < 0) {
-			fds[i].revents = 0;
-			continue;
-		}
-
-		/* convert the poll event into a kqueue kevent */
-		struct kevent_qos_s kev = {
-			.ident = fds[i].fd,
-			.flags = EV_ADD | EV_ONESHOT | EV_POLL,
-			.udata = CAST_USER_ADDR_T(&fds[i])
-		};
 
-		/* Handle input events */
-		if (events & (POLLIN | POLLRDNORM | POLLPRI | POLLRDBAND | POLLHUP)) {
-			kev.filter = EVFILT_READ;
-			if (events & (POLLPRI | POLLRDBAND)) {
-				kev.flags |= EV_OOBAND;
-			}
-			rc = kevent_register(kq, &kev, NULL);
-			assert((rc & FILTER_REGISTER_WAIT) == 0);
-		}
-
-		/* Handle output events */
-		if ((kev.flags & EV_ERROR) == 0 &&
-		    (events & (POLLOUT | POLLWRNORM | POLLWRBAND))) {
-			kev.filter = EVFILT_WRITE;
-			rc = kevent_register(kq, &kev, NULL);
-			assert((rc & FILTER_REGISTER_WAIT) == 0);
-		}
-
-		/* Handle BSD extension vnode events */
-		if ((kev.flags & EV_ERROR) == 0 &&
-		    (events & (POLLEXTEND | POLLATTRIB | POLLNLINK | POLLWRITE))) {
-			kev.filter = EVFILT_VNODE;
-			kev.fflags = 0;
-			if (events & POLLEXTEND) {
-				kev.fflags |= NOTE_EXTEND;
-			}
-			if (events & POLLATTRIB) {
-				kev.fflags |= NOTE_ATTRIB;
-			}
-			if (events & POLLNLINK) {
-				kev.fflags |= NOTE_LINK;
-			}
-			if (events & POLLWRITE) {
-				kev.fflags |= NOTE_WRITE;
-			}
-			rc = kevent_register(kq, &kev, NULL);
-			assert((rc & FILTER_REGISTER_WAIT) == 0);
-		}
-
-		if (kev.flags & EV_ERROR) {
-			fds[i].revents = POLLNVAL;
-			rfds++;
-		} else {
-			fds[i].revents = 0;
-		}
+	kq = poll_cache_prepare(p, fds, nfds, &rfds, &cached);
+	if (kq == NULL) {
+		OSBitAndAtomic(~((uint32_t)P_SELECT), &p->p_flag);
+		error = EAGAIN;
+		goto out;
 	}
 
 	/*
@@ -1951,6 +2148,8 @@ poll_nocancel(struct proc *p, struct poll_nocancel_args *uap, int32_t *retval)
 		.kec_process_noutputs = rfds,
 		.kec_process_flags    = KEVENT_FLAG_POLL,
 		.kec_deadline         = 0, /* wait forever */
+		/* poll_callback() finds the entries from the knotes' index */
+		.kec_process_eventlist = CAST_USER_ADDR_T(fds),
 	};
 
 	/*
@@ -1983,15 +2182,20 @@ out:
 		FREE(fds, M_TEMP);
 	}
 
-	kqueue_dealloc(kq);
+	if (kq != NULL && !cached) {
+		kqueue_dealloc(kq);
+	}
 	return error;
 }
 
 static int
 poll_callback(struct kevent_qos_s *kevp, kevent_ctx_t kectx)
 {
-	struct pollfd *fds = CAST_DOWN(struct pollfd *, kevp->udata);
-	short prev_revents = fds->revents;
+	struct pollfd *fds = CAST_DOWN(struct pollfd *, kectx->kec_process_eventlist);
+	short prev_revents;
+
+	fds += kevp->udata;
+	prev_revents = fds->revents;
 	short mask = 0;
 
 	/* convert the results back into revents */
@@ -2111,7 +2315,7 @@ selcount(struct proc *p, u_int32_t *ibits, int nfd, int *countp)
 					error = EBADF;
 					goto bad;
 				}
-				os_ref_retain_locked(&fp->fp_iocount);
+				os_ref_retain(&fp->fp_iocount);
 				n++;
 			}
 		}
@@ -2214,7 +2418,7 @@ seldrop_locked(struct proc *p, u_int32_t *ibits, int nfd, int lim, int *need_wak
 
 				nc++;
 
-				const os_ref_count_t refc = os_ref_release_locked(&fp->fp_iocount);
+				const os_ref_count_t refc = os_ref_release(&fp->fp_iocount);
 				if (0 == refc) {
 					panic("fp_iocount overdecrement!");
 				}
@@ -115,6 +115,11 @@
  * Memory usage may be monitored through the sysctls
  * kern.ipc.pipes, kern.ipc.pipekva.
  *
+ * Large blocking writes bypass the pipe buffer: the writer wires its pages
+ * and maps them in the kernel, then sleeps while readers copy the data out
+ * of that mapping (PIPE_DIRECTW). This saves one copy and keeps large
+ * transfers from being chopped into pipe buffer sized pieces.
+ *
  */
 
 #include <sys/param.h>
@@ -137,6 +142,9 @@
 #include <sys/pipe.h>
 #include <sys/sysproto.h>
 #include <sys/proc_info.h>
+#include <sys/sysctl.h>
+#include <sys/uio_internal.h>
+#include <sys/ubc.h>
 
 #include <security/audit/audit.h>
 
@@ -144,7 +152,9 @@
 
 #include <kern/zalloc.h>
 #include <kern/kalloc.h>
+#include <mach/memory_object_types.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_map.h>
 #include <libkern/OSAtomic.h>
 #include <libkern/section_keywords.h>
 
@@ -265,6 +275,7 @@ static int pipespace(struct pipe *cpipe, int size);
 static int choose_pipespace(unsigned long current, unsigned long expected);
 static int expand_pipespace(struct pipe *p, int target_size);
 static void pipeselwakeup(struct pipe *cpipe, struct pipe *spipe);
+static int64_t pipe_readable(struct pipe *cpipe);
 static __inline int pipeio_lock(struct pipe *cpipe, int catch);
 static __inline void pipeio_unlock(struct pipe *cpipe);
 
@@ -273,6 +284,23 @@ static ZONE_DECLARE(pipe_zone, "pipe zone", sizeof(struct pipepair), ZC_NONE);
 
 #define MAX_PIPESIZE(pipe)              ( MAX(PIPE_SIZE, (pipe)->pipe_buffer.size) )
 
+/*
+ * Writes are transferred directly from the writer's pages, at most
+ * PIPE_DIRECT_MAX bytes at a time, for every iovec of at least
+ * PIPE_DIRECT_MIN bytes.
+ */
+#define PIPE_DIRECT_MIN                 BIG_PIPE_SIZE
+#define PIPE_DIRECT_MAX                 (16 * BIG_PIPE_SIZE)
+
+static int pipe_direct = 1;
+
+#if DEVELOPMENT || DEBUG
+SYSCTL_DECL(_kern_ipc);
+
+SYSCTL_INT(_kern_ipc, OID_AUTO, pipe_direct, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &pipe_direct, 0, "Transfer large pipe writes directly from the writer's pages");
+#endif
+
 SYSINIT(vfs, SI_SUB_VFS, SI_ORDER_ANY, pipeinit, NULL);
 
 #if defined(XNU_TARGET_OS_OSX)
@@ -481,13 +509,13 @@ pipe_stat(struct pipe *cpipe, void *ub, int isstat64)
 		if (cpipe->pipe_peer) {
 			/* the peer still exists, use it's info */
 			pipe_size  = MAX_PIPESIZE(cpipe->pipe_peer);
-			pipe_count = cpipe->pipe_peer->pipe_buffer.cnt;
+			pipe_count = (int)pipe_readable(cpipe->pipe_peer);
 		} else {
 			pipe_count = 0;
 		}
 	} else {
 		pipe_size  = MAX_PIPESIZE(cpipe);
-		pipe_count = cpipe->pipe_buffer.cnt;
+		pipe_count = (int)pipe_readable(cpipe);
 	}
 	/*
 	 * since peer's buffer is setup ouside of lock
@@ -731,13 +759,27 @@ pipeselwakeup(struct pipe *cpipe, struct pipe *spipe)
 	}
 }
 
+/*
+ * number of bytes readers can consume without blocking
+ */
+static int64_t
+pipe_readable(struct pipe *cpipe)
+{
+	int64_t count = cpipe->pipe_buffer.cnt;
+
+	if (cpipe->pipe_state & PIPE_DIRECTW) {
+		count += cpipe->pipe_map.cnt;
+	}
+	return count;
+}
+
 /*
  * Read n bytes from the buffer. Semantics are similar to file read.
  * returns: number of bytes read from the buffer
  */
 /* ARGSUSED */
 static int
-pipe_read(struct fileproc *fp, struct uio *uio, __unused int flags,
+pipe_read(struct fileproc *fp, struct uio *uio, int flags,
     __unused vfs_context_t ctx)
 {
 	struct pipe *rpipe = (struct pipe *)fp->f_data;
@@ -805,6 +847,36 @@ pipe_read(struct fileproc *fp, struct uio *uio, __unused int flags,
 				rpipe->pipe_buffer.out = 0;
 			}
 			nread += size;
+		} else if ((rpipe->pipe_state & PIPE_DIRECTW) &&
+		    rpipe->pipe_map.cnt > 0) {
+			/*
+			 * direct write: copy out of the writer's pages,
+			 * which stay mapped as long as we hold the io lock.
+			 */
+			size = (u_int) MIN(INT_MAX, MIN((user_size_t)rpipe->pipe_map.cnt,
+			    (user_size_t)uio_resid(uio)));
+
+			PIPE_UNLOCK(rpipe); /* we still hold io lock.*/
+			error = uiomove((caddr_t)(rpipe->pipe_map.kva +
+			    rpipe->pipe_map.pos), size, uio);
+			PIPE_LOCK(rpipe);
+			if (error) {
+				break;
+			}
+
+			rpipe->pipe_map.pos += size;
+			rpipe->pipe_map.cnt -= size;
+
+			/*
+			 * Everything was consumed, let the writer
+			 * reclaim its pages.
+			 */
+			if (rpipe->pipe_map.cnt == 0 &&
+			    (rpipe->pipe_state & PIPE_WANTW)) {
+				rpipe->pipe_state &= ~PIPE_WANTW;
+				wakeup(rpipe);
+			}
+			nread += size;
 		} else {
 			/*
 			 * detect EOF condition
@@ -841,7 +913,7 @@ pipe_read(struct fileproc *fp, struct uio *uio, __unused int flags,
 			 * Handle non-blocking mode operation or
 			 * wait for more data.
 			 */
-			if (fp->f_flag & FNONBLOCK) {
+			if ((fp->f_flag & FNONBLOCK) || (flags & FOF_NONBLOCK)) {
 				error = EAGAIN;
 			} else {
 				rpipe->pipe_state |= PIPE_WANTR;
@@ -893,6 +965,159 @@ unlocked_error:
 	return error;
 }
 
+/*
+ * Transfer (part of) the current iovec of a large blocking write directly
+ * to the readers: the writer's pages are wired and mapped in the kernel,
+ * and we sleep until readers have copied everything out of the mapping.
+ *
+ * Called and returns with the pipe mutex held. Returns ENOTSUP if the
+ * pages could not be wired, in which case the caller goes through the
+ * pipe buffer instead.
+ */
+static int
+pipe_direct_write(struct fileproc *fp, struct pipe *wpipe, struct uio *uio)
+{
+	vm_map_t map = current_map();
+	user_addr_t base = uio_curriovbase(uio);
+	user_size_t len = MIN(uio_curriovlen(uio), PIPE_DIRECT_MAX);
+	vm_map_offset_t start, end;
+	upl_control_flags_t upl_flags;
+	upl_size_t upl_size;
+	upl_page_info_t *pl;
+	unsigned int count = 0;
+	upl_t upl = NULL;
+	vm_offset_t kva;
+	vm_size_t moved;
+	kern_return_t kr;
+	int error;
+
+	/*
+	 * Wait for the pipe buffer to be drained, and for any other direct
+	 * write to complete, so that data is delivered in order.
+	 */
+	for (;;) {
+		if ((wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) ||
+		    (fileproc_get_vflags(fp) & FPV_DRAIN)) {
+			return EPIPE;
+		}
+		if (wpipe->pipe_buffer.cnt == 0 &&
+		    (wpipe->pipe_state & PIPE_DIRECTW) == 0) {
+			if ((error = pipeio_lock(wpipe, 1)) != 0) {
+				return error;
+			}
+			if (wpipe->pipe_buffer.cnt == 0 &&
+			    (wpipe->pipe_state & PIPE_DIRECTW) == 0) {
+				break;
+			}
+			pipeio_unlock(wpipe);
+			continue;
+		}
+
+		if (wpipe->pipe_state & PIPE_WANTR) {
+			wpipe->pipe_state &= ~PIPE_WANTR;
+			wakeup(wpipe);
+		}
+		pipeselwakeup(wpipe, wpipe);
+
+		wpipe->pipe_state |= PIPE_WANTW;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH, "pipedw", 0);
+		if (error != 0) {
+			return error;
+		}
+	}
+
+	/*
+	 * Wire the pages of the writer, we hold the io lock so
+	 * nobody can touch the pipe buffer in the meantime.
+	 */
+	PIPE_UNLOCK(wpipe);
+
+	start = vm_map_trunc_page(base, vm_map_page_mask(map));
+	end = vm_map_round_page(base + len, vm_map_page_mask(map));
+	upl_size = (upl_size_t)(end - start);
+	upl_flags = UPL_FILE_IO | UPL_COPYOUT_FROM | UPL_NO_SYNC |
+	    UPL_CLEAN_IN_PLACE | UPL_SET_INTERNAL | UPL_SET_LITE | UPL_SET_IO_WIRE;
+
+	kr = vm_map_get_upl(map, start, &upl_size, &upl, NULL, &count,
+	    &upl_flags, VM_KERN_MEMORY_BSD, 0);
+	if (kr == KERN_SUCCESS && upl_size == end - start) {
+		pl = UPL_GET_INTERNAL_PAGE_LIST(upl);
+		for (unsigned int i = 0; i < upl_size >> vm_map_page_shift(map); i++) {
+			if (!upl_valid_page(pl, i)) {
+				kr = KERN_FAILURE;
+				break;
+			}
+		}
+	} else if (kr == KERN_SUCCESS) {
+		kr = KERN_FAILURE;
+	}
+	if (kr == KERN_SUCCESS) {
+		kr = ubc_upl_map(upl, &kva);
+	}
+	if (kr != KERN_SUCCESS) {
+		if (upl) {
+			ubc_upl_abort(upl, 0);
+		}
+		PIPE_LOCK(wpipe);
+		pipeio_unlock(wpipe);
+		return ENOTSUP;
+	}
+
+	PIPE_LOCK(wpipe);
+
+	wpipe->pipe_map.kva = kva + (vm_offset_t)(base - start);
+	wpipe->pipe_map.cnt = (vm_size_t)len;
+	wpipe->pipe_map.pos = 0;
+	wpipe->pipe_map.upl = upl;
+	wpipe->pipe_state |= PIPE_DIRECTW;
+	pipeio_unlock(wpipe);
+
+	if (wpipe->pipe_state & PIPE_WANTR) {
+		wpipe->pipe_state &= ~PIPE_WANTR;
+		wakeup(wpipe);
+	}
+	pipeselwakeup(wpipe, wpipe);
+
+	error = 0;
+	while (wpipe->pipe_map.cnt > 0) {
+		if ((wpipe->pipe_state & (PIPE_DRAIN | PIPE_EOF)) ||
+		    (fileproc_get_vflags(fp) & FPV_DRAIN)) {
+			error = EPIPE;
+			break;
+		}
+		wpipe->pipe_state |= PIPE_WANTW;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH, "pipedwt", 0);
+		if (error != 0) {
+			break;
+		}
+	}
+
+	/*
+	 * Take the mapping back: a reader might still be copying
+	 * out of it, the io lock waits for it to be done.
+	 */
+	(void)pipeio_lock(wpipe, 0);
+	moved = wpipe->pipe_map.pos;
+	wpipe->pipe_state &= ~PIPE_DIRECTW;
+	bzero(&wpipe->pipe_map, sizeof(wpipe->pipe_map));
+	pipeio_unlock(wpipe);
+
+	/* let other writers waiting on us proceed */
+	if (wpipe->pipe_state & PIPE_WANTW) {
+		wpipe->pipe_state &= ~PIPE_WANTW;
+		wakeup(wpipe);
+	}
+	pipeselwakeup(wpipe, wpipe);
+
+	PIPE_UNLOCK(wpipe);
+	(void)ubc_upl_unmap(upl);
+	ubc_upl_abort(upl, 0);
+	PIPE_LOCK(wpipe);
+
+	uio_update(uio, (user_size_t)moved);
+	return error;
+}
+
 /*
  * perform a write of n bytes into the read side of buffer. Since
  * pipes are unidirectional a write is meant to be read by the otherside only.
@@ -911,6 +1136,7 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 		return EINVAL;
 	}
 	int space;
+	bool direct;
 
 	rpipe = (struct pipe *)fp->f_data;
 
@@ -983,7 +1209,26 @@ pipe_write(struct fileproc *fp, struct uio *uio, __unused int flags,
 		}
 	}
 
+	/*
+	 * Large blocking writes from user space are transferred
+	 * directly from the writer's pages.
+	 */
+	direct = pipe_direct && (fp->f_flag & FNONBLOCK) == 0 &&
+	    UIO_SEG_IS_USER_SPACE(uio->uio_segflg);
+
 	while (uio_resid(uio)) {
+		if (direct && uio_curriovlen(uio) >= PIPE_DIRECT_MIN) {
+			error = pipe_direct_write(fp, wpipe, uio);
+			if (error == 0) {
+				continue;
+			}
+			if (error != ENOTSUP) {
+				break;
+			}
+			/* the pages could not be wired, use the pipe buffer */
+			error = 0;
+			direct = false;
+		}
 retrywrite:
 		space = wpipe->pipe_buffer.size - wpipe->pipe_buffer.cnt;
 
@@ -992,6 +1237,11 @@ retrywrite:
 			space = 0;
 		}
 
+		/* A direct write is in progress, wait for it to complete. */
+		if (wpipe->pipe_state & PIPE_DIRECTW) {
+			space = 0;
+		}
+
 		if (space > 0) {
 			if ((error = pipeio_lock(wpipe, 1)) == 0) {
 				size_t size;       /* Transfer size */
@@ -1009,7 +1259,8 @@ retrywrite:
 				 * is dropped while we're blocked
 				 */
 				if (space > (int)(wpipe->pipe_buffer.size -
-				    wpipe->pipe_buffer.cnt)) {
+				    wpipe->pipe_buffer.cnt) ||
+				    (wpipe->pipe_state & PIPE_DIRECTW)) {
 					pipeio_unlock(wpipe);
 					goto retrywrite;
 				}
@@ -1206,7 +1457,7 @@ pipe_ioctl(struct fileproc *fp, u_long cmd, caddr_t data,
 		return 0;
 
 	case FIONREAD:
-		*(int *)data = mpipe->pipe_buffer.cnt;
+		*(int *)data = (int)pipe_readable(mpipe);
 		PIPE_UNLOCK(mpipe);
 		return 0;
 
@@ -1455,7 +1706,7 @@ filt_pipenotsupprocess(struct knote *kn, struct kevent_qos_s *kev)
 static int
 filt_piperead_common(struct knote *kn, struct kevent_qos_s *kev, struct pipe *rpipe)
 {
-	int64_t data = rpipe->pipe_buffer.cnt;
+	int64_t data = pipe_readable(rpipe);
 	int res = 0;
 
 	if (filt_pipe_draincommon(kn, rpipe)) {
@@ -1521,7 +1772,10 @@ filt_pipewrite_common(struct knote *kn, struct kevent_qos_s *kev, struct pipe *r
 	if (filt_pipe_draincommon(kn, rpipe)) {
 		res = 1;
 	} else {
-		data = MAX_PIPESIZE(rpipe) - rpipe->pipe_buffer.cnt;
+		/* writers block until a direct write completes */
+		if ((rpipe->pipe_state & PIPE_DIRECTW) == 0) {
+			data = MAX_PIPESIZE(rpipe) - rpipe->pipe_buffer.cnt;
+		}
 		res = data >= filt_pipelowwat(kn, rpipe, PIPE_BUF);
 	}
 	if (res && kev) {
@@ -1688,13 +1942,13 @@ fill_pipeinfo(struct pipe * cpipe, struct pipe_info * pinfo)
 			 * the peer still exists, use it's info
 			 */
 			pipe_size  = MAX_PIPESIZE(cpipe->pipe_peer);
-			pipe_count = cpipe->pipe_peer->pipe_buffer.cnt;
+			pipe_count = (int)pipe_readable(cpipe->pipe_peer);
 		} else {
 			pipe_count = 0;
 		}
 	} else {
 		pipe_size  = MAX_PIPESIZE(cpipe);
-		pipe_count = cpipe->pipe_buffer.cnt;
+		pipe_count = (int)pipe_readable(cpipe);
 	}
 	/*
 	 * since peer's buffer is setup ouside of lock
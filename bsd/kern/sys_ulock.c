@@ -840,8 +840,190 @@ ulock_wait_continue(__unused void * parameter, wait_result_t wr)
 	unix_syscall_return(ret);
 }
 
+/*
+ * Called by waitq_transfer64() with the thread locked, for every waiter
+ * moved to another ulock by ulock_requeue().
+ */
+static void
+ulock_requeue_thread(thread_t thread, void *arg)
+{
+	uthread_t uthread = (uthread_t)get_bsdthread_info(thread);
+
+	/* only waiters on non owner ulocks can be moved */
+	assert(uthread->uu_save.uus_ulock_wait_data.owner_thread == THREAD_NULL);
+	assert(uthread->uu_save.uus_ulock_wait_data.old_owner == THREAD_NULL);
+
+	uthread->uu_save.uus_ulock_wait_data.ull = arg;
+}
+
+/*
+ * Drops the references ulock_requeue() holds on both (locked) ulocks.
+ *
+ * Either put may free its ulock, which takes a bucket lock:
+ * do not hold the other ulock lock while doing so.
+ */
+static void
+ulock_requeue_put(ull_t *ull, ull_t *target)
+{
+	ull_unlock(target);
+	if (ull != NULL) {
+		ull_put(ull);
+	}
+	ull_lock(target);
+	ull_put(target);
+}
+
+/*
+ * Wake up the highest priority waiter of the ulock at `key`, and move the
+ * other ones to the ulock at `target_addr` (ULF_WAKE_REQUEUE).
+ *
+ * Every moved waiter takes its wait reference, its waiter count and its
+ * donated turnstile along to the target ulock, as if it had called
+ * ulock_wait() on it, so that ulock_wait_continue() finds a consistent
+ * state whichever ulock wakes it up.
+ */
+static int
+ulock_requeue(struct proc *p, ulk_t *key, uint8_t opcode, user_addr_t target_addr,
+    int32_t *retval)
+{
+	ulk_t target_key = {
+		.ulk_key_type = ULK_UADDR,
+		.ulk_pid = p->p_pid,
+		.ulk_addr = target_addr,
+	};
+	ull_t *unused_ull = NULL;
+	ull_t *ull, *target;
+	struct turnstile *ts, *target_ts;
+	kern_return_t kr;
+	int ret = 0, moved = 0;
+
+	/*
+	 * ull_get() takes the bucket lock before the ulock locks,
+	 * so look both ulocks up first, then lock them in address order.
+	 *
+	 * Count ourselves as a waiter of the target while it is unlocked,
+	 * so that nobody drops it from the hash (see ulock_wait_cleanup())
+	 * before the waiters we move there are accounted on it.
+	 */
+	target = ull_get(&target_key, 0, &unused_ull);
+	if (target == NULL) {
+		ret = ENOMEM;
+		goto out;
+	}
+	target->ull_nwaiters++;
+	ull_unlock(target);
+
+	ull = ull_get(key, ULL_MUST_EXIST, NULL);
+	if (ull == NULL) {
+		ull_lock(target);
+		ret = ENOENT;
+		goto out_put;
+	}
+	/* ull is locked */
+
+	if (target < ull) {
+		ull_unlock(ull);
+		ull_lock(target);
+		ull_lock(ull);
+	} else {
+		ull_lock(target);
+	}
+
+	if (opcode != ull->ull_opcode) {
+		ret = EDOM;
+		goto out_put;
+	}
+
+	if (target->ull_opcode == 0) {
+		target->ull_opcode = opcode;
+	} else if (target->ull_opcode != opcode &&
+	    target->ull_owner == THREAD_NULL) {
+		/*
+		 * Waiters can only be moved to a ulock of a different type
+		 * if it is an unfair lock the kernel knows the owner of:
+		 * that owner will redrive wakes when it unlocks.
+		 */
+		ret = EDOM;
+		goto out_put;
+	}
+
+	ts = ull->ull_turnstile;
+	if (ts == TURNSTILE_NULL) {
+		/* nobody is blocked on ull */
+		goto out_put;
+	}
+
+	/*
+	 * waitq_transfer64() can't move waiters to a turnstile that pushes
+	 * on ull's: the owner of the target must not be blocked on ull.
+	 */
+	if (target->ull_owner != THREAD_NULL &&
+	    thread_is_waiting_on_turnstile(target->ull_owner, ts)) {
+		ret = EDEADLK;
+		goto out_put;
+	}
+
+	/*
+	 * Prepare the target with our turnstile, in case nobody waits on it
+	 * yet: the turnstiles of the moved waiters will join its freelist.
+	 */
+	target_ts = turnstile_prepare((uintptr_t)target, &target->ull_turnstile,
+	    TURNSTILE_NULL, TURNSTILE_ULOCK);
+
+	kr = waitq_wakeup64_one(&ts->ts_waitq,
+	    CAST_EVENT64_T(ULOCK_TO_EVENT(ull)),
+	    THREAD_AWAKENED, WAITQ_ALL_PRIORITIES);
+	if (kr == KERN_SUCCESS) {
+		turnstile_update_inheritor(target_ts, target->ull_owner,
+		    (TURNSTILE_DELAYED_UPDATE | TURNSTILE_INHERITOR_THREAD));
+
+		/*
+		 * The thread we just woke up stays accounted on ull until it
+		 * runs ulock_wait_cleanup(), along with its turnstile: ull keeps
+		 * a waiter, and its freelist holds a turnstile for every other
+		 * thread in its waitq.
+		 */
+		moved = waitq_transfer64(&ts->ts_waitq,
+		    CAST_EVENT64_T(ULOCK_TO_EVENT(ull)),
+		    &target_ts->ts_waitq,
+		    CAST_EVENT64_T(ULOCK_TO_EVENT(target)),
+		    ull->ull_nwaiters - 1, ulock_requeue_thread, target);
+		turnstile_freelist_transfer(ts, target_ts, moved);
+
+		ull->ull_nwaiters -= moved;
+		ull->ull_refcount -= moved;
+		assert(ull->ull_nwaiters > 0);
+		target->ull_nwaiters += moved;
+		target->ull_refcount += moved;
+
+		turnstile_update_inheritor_complete(target_ts,
+		    TURNSTILE_INTERLOCK_HELD);
+	}
+
+	turnstile_complete((uintptr_t)target, &target->ull_turnstile, NULL,
+	    TURNSTILE_ULOCK);
+
+out_put:
+	if (--target->ull_nwaiters == 0) {
+		/* nobody waits on the target, see ulock_wait_cleanup() */
+		memset(&target->ull_key, 0, sizeof target->ull_key);
+		target->ull_refcount--;
+		assert(target->ull_refcount > 0);
+	}
+	ulock_requeue_put(ull, target);
+
+	/* Need to be called after dropping the interlock */
+	turnstile_cleanup();
+out:
+	if (unused_ull) {
+		ull_free(unused_ull);
+	}
+	*retval = moved;
+	return ret;
+}
+
 int
-ulock_wake(struct proc *p, struct ulock_wake_args *args, __unused int32_t *retval)
+ulock_wake(struct proc *p, struct ulock_wake_args *args, int32_t *retval)
 {
 	uint8_t opcode = (uint8_t)(args->operation & UL_OPCODE_MASK);
 	uint flags = args->operation & UL_FLAGS_MASK;
@@ -903,6 +1085,16 @@ ulock_wake(struct proc *p, struct ulock_wake_args *args, __unused int32_t *retva
 		allow_non_owner = true;
 	}
 
+	if (flags & ULF_WAKE_REQUEUE) {
+		if (set_owner || xproc ||
+		    (flags & (ULF_WAKE_ALL | ULF_WAKE_THREAD)) ||
+		    args->wake_value == 0 || (args->wake_value & 3) ||
+		    args->wake_value == args->addr) {
+			ret = EINVAL;
+			goto munge_retval;
+		}
+	}
+
 	if (args->addr == 0) {
 		ret = EINVAL;
 		goto munge_retval;
@@ -926,6 +1118,11 @@ ulock_wake(struct proc *p, struct ulock_wake_args *args, __unused int32_t *retva
 		key.ulk_addr = args->addr;
 	}
 
+	if (flags & ULF_WAKE_REQUEUE) {
+		ret = ulock_requeue(p, &key, opcode, (user_addr_t)args->wake_value, retval);
+		goto munge_retval;
+	}
+
 	if (flags & ULF_WAKE_THREAD) {
 		mach_port_name_t wake_thread_name = (mach_port_name_t)(args->wake_value);
 		wake_thread = port_name_to_thread(wake_thread_name,
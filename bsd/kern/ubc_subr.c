@@ -87,6 +87,10 @@ extern kern_return_t    memory_object_signed(memory_object_control_t control,
 extern boolean_t        memory_object_is_signed(memory_object_control_t);
 extern void             memory_object_mark_trusted(
 	memory_object_control_t         control);
+extern kern_return_t    memory_object_control_iopl_request(
+	memory_object_control_t control, memory_object_offset_t offset,
+	upl_size_t size, upl_t *upl_ptr, upl_control_flags_t cntrl_flags,
+	vm_tag_t tag);
 
 /* XXX Same for those. */
 
@@ -1135,6 +1139,10 @@ ubc_setsize_ex(struct vnode *vp, off_t nsize, ubc_setsize_opts_t opts)
 	 */
 	uip->ui_size = nsize;
 
+	if (nsize != osize) {
+		ubc_lcmds_invalidate(vp);
+	}
+
 	if (nsize >= osize) {   /* Nothing more to do */
 		if (nsize > osize) {
 			lock_vnode_and_post(vp, NOTE_EXTEND);
@@ -1870,6 +1878,7 @@ ubc_map(vnode_t vp, int flags)
 	int error = 0;
 	int need_ref = 0;
 	int need_wakeup = 0;
+	bool need_lcmds_invalidate = false;
 
 	if (UBCINFOEXISTS(vp)) {
 		vnode_lock(vp);
@@ -1908,6 +1917,7 @@ ubc_map(vnode_t vp, int flags)
 			SET(uip->ui_flags, (UI_WASMAPPED | UI_ISMAPPED));
 			if (flags & PROT_WRITE) {
 				SET(uip->ui_flags, UI_MAPPEDWRITE);
+				need_lcmds_invalidate = true;
 			}
 		}
 		CLR(uip->ui_flags, UI_MAPBUSY);
@@ -1918,6 +1928,11 @@ ubc_map(vnode_t vp, int flags)
 		}
 		vnode_unlock(vp);
 
+		if (need_lcmds_invalidate) {
+			/* the file can now change without a write */
+			ubc_lcmds_invalidate(vp);
+		}
+
 		if (need_wakeup) {
 			wakeup(&uip->ui_flags);
 		}
@@ -2512,6 +2527,70 @@ ubc_create_upl_kernel(
 }
 
 
+/*
+ * ubc_create_upl_wired
+ *
+ * Given a vnode, wire a portion of its vm_object for reading into a upl;
+ * unlike the pages of a upl from ubc_create_upl(), the pages are not left
+ * busy, so they can stay referenced for as long as it takes (e.g. until
+ * data sent from them has been acknowledged) without blocking anyone else
+ * who wants to read or map them.
+ *
+ * Parameters:	vp			The vnode from which to create the upl
+ *		f_offset		The start offset into the backing store
+ *					represented by the vnode
+ *		bufsize			The size of the upl to create
+ *		uplp			Pointer to the upl_t to receive the
+ *					created upl; MUST NOT be NULL
+ *		uplflags		UPL_REQUEST_NO_FAULT to fail rather
+ *					than read in pages that aren't
+ *					resident; other flags are ignored
+ *		tag			The vm tag to charge the wiring to
+ *
+ * Returns:	KERN_SUCCESS		The requested upl has been created
+ *		KERN_INVALID_ARGUMENT	The bufsize argument is not an even
+ *					multiple of the page size, or there
+ *					is no memory object control
+ *					associated with the vnode
+ *		KERN_MEMORY_ERROR	UPL_REQUEST_NO_FAULT was given, and
+ *					not all of the pages were resident
+ *
+ * Note:	If successful, the returned *uplp MUST subsequently be freed
+ *		via a call to ubc_upl_commit() or ubc_upl_commit_range(),
+ *		which unwire the pages.
+ */
+kern_return_t
+ubc_create_upl_wired(
+	struct vnode    *vp,
+	off_t           f_offset,
+	int             bufsize,
+	upl_t           *uplp,
+	int             uplflags,
+	vm_tag_t        tag)
+{
+	memory_object_control_t         control;
+
+	*uplp = NULL;
+
+	if (bufsize & PAGE_MASK) {
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	if (bufsize > MAX_UPL_SIZE_BYTES) {
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	control = ubc_getobject(vp, UBC_FLAGS_NONE);
+	if (control == MEMORY_OBJECT_CONTROL_NULL) {
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	return memory_object_control_iopl_request(control, f_offset, bufsize,
+	           uplp, (uplflags & UPL_REQUEST_NO_FAULT) | UPL_COPYOUT_FROM |
+	           UPL_SET_IO_WIRE | UPL_SET_LITE | UPL_SET_INTERNAL, tag);
+}
+
+
 /*
  * ubc_upl_maxbufsize
  *
@@ -4134,6 +4213,174 @@ ubc_cs_free(
 		uip->cs_blob_supplement = NULL;
 	}
 #endif
+	if (uip->ui_lcmds != NULL) {
+		ubc_lcmds_release(uip->ui_lcmds);
+		uip->ui_lcmds = NULL;
+	}
+}
+
+/*
+ * Load command cache
+ *
+ * Exec reads the mach header and load commands of an executable, and
+ * hashes them against its code directory, every time it is run.  Once
+ * they have been validated, a copy is kept with the code signature of
+ * the vnode and used instead, as long as the file data cannot have
+ * changed: ui_lcmds_gen is bumped by writes, size changes and writable
+ * mappings, and a copy read before it was bumped is never installed.
+ */
+#define UBC_LCMDS_MAX   (4 * PAGE_SIZE)
+
+static void
+ubc_lcmds_free(struct ubc_lcmds *ul)
+{
+	kfree(ul, sizeof(*ul) + ul->ul_size);
+}
+
+/*
+ * ubc_lcmds_gen
+ *
+ * Description:	Sample the generation to pass to ubc_lcmds_set(), before
+ *		reading the load commands from the file.
+ */
+uint32_t
+ubc_lcmds_gen(vnode_t vp)
+{
+	if (!UBCINFOEXISTS(vp)) {
+		return 0;
+	}
+	return os_atomic_load(&vp->v_ubcinfo->ui_lcmds_gen, acquire);
+}
+
+/*
+ * ubc_lcmds_get
+ *
+ * Description:	Look up the cached load commands of the mach-o at offset
+ *		in a vnode, whose mach header (header_size bytes) and page
+ *		rounded load commands (size bytes) must match.
+ *
+ * Returns:	A reference on the cached copy, to be released with
+ *		ubc_lcmds_release(), or NULL.
+ */
+struct ubc_lcmds *
+ubc_lcmds_get(vnode_t vp, off_t offset, const void *header, size_t header_size,
+    vm_size_t size)
+{
+	struct ubc_lcmds *ul = NULL;
+	struct ubc_info *uip;
+
+	vnode_lock_spin(vp);
+
+	if (!UBCINFOEXISTS(vp)) {
+		goto out;
+	}
+	uip = vp->v_ubcinfo;
+
+	if ((ul = uip->ui_lcmds) == NULL ||
+	    ISSET(uip->ui_flags, UI_MAPPEDWRITE) ||
+	    ul->ul_offset != offset || ul->ul_size != size ||
+	    memcmp(ul->ul_data, header, header_size) != 0) {
+		ul = NULL;
+		goto out;
+	}
+	os_ref_retain(&ul->ul_refs);
+
+out:
+	vnode_unlock(vp);
+
+	return ul;
+}
+
+/*
+ * ubc_lcmds_set
+ *
+ * Description:	Cache the load commands of the mach-o at offset in a
+ *		vnode, after they were validated against blob.
+ *
+ * Parameters:	gen				ubc_lcmds_gen() sampled
+ *						before the load commands were
+ *						read
+ */
+void
+ubc_lcmds_set(vnode_t vp, off_t offset, const void *data, vm_size_t size,
+    struct cs_blob *blob, uint32_t gen)
+{
+	struct ubc_lcmds *ul, *old = NULL;
+	struct ubc_info *uip;
+
+	if (size > UBC_LCMDS_MAX || blob == NULL) {
+		return;
+	}
+
+	ul = kalloc(sizeof(*ul) + size);
+	if (ul == NULL) {
+		return;
+	}
+	os_ref_init(&ul->ul_refs, NULL);
+	ul->ul_offset = offset;
+	ul->ul_size = size;
+	memcpy(ul->ul_cdhash, blob->csb_cdhash, sizeof(ul->ul_cdhash));
+	memcpy(ul->ul_data, data, size);
+
+	vnode_lock_spin(vp);
+	if (UBCINFOEXISTS(vp) &&
+	    (uip = vp->v_ubcinfo)->ui_lcmds_gen == gen &&
+	    !ISSET(uip->ui_flags, UI_MAPPEDWRITE)) {
+		old = uip->ui_lcmds;
+		uip->ui_lcmds = ul;
+		ul = NULL;
+	}
+	vnode_unlock(vp);
+
+	if (ul != NULL) {
+		ubc_lcmds_free(ul);
+	}
+	if (old != NULL) {
+		ubc_lcmds_release(old);
+	}
+}
+
+void
+ubc_lcmds_release(struct ubc_lcmds *ul)
+{
+	if (os_ref_release(&ul->ul_refs) == 0) {
+		ubc_lcmds_free(ul);
+	}
+}
+
+/*
+ * ubc_lcmds_invalidate
+ *
+ * Description:	Drop the cached load commands of a vnode whose data may
+ *		have changed, and keep copies read before from being cached.
+ *
+ * Notes:	Called for every write: only takes the vnode lock when
+ *		there is something to drop.
+ */
+void
+ubc_lcmds_invalidate(vnode_t vp)
+{
+	struct ubc_lcmds *ul;
+	struct ubc_info *uip;
+
+	if (!UBCINFOEXISTS(vp)) {
+		return;
+	}
+	uip = vp->v_ubcinfo;
+
+	os_atomic_inc(&uip->ui_lcmds_gen, release);
+	if (os_atomic_load(&uip->ui_lcmds, relaxed) == NULL) {
+		return;
+	}
+
+	vnode_lock_spin(vp);
+	ul = uip->ui_lcmds;
+	uip->ui_lcmds = NULL;
+	vnode_unlock(vp);
+
+	if (ul != NULL) {
+		ubc_lcmds_release(ul);
+	}
 }
 
 /* check cs blob generation on vnode
@@ -4071,6 +4071,20 @@ m_mclhasreference(struct mbuf *m)
 	return (MEXT_FLAGS(m) & EXTF_READONLY) ? 1 : 0;
 }
 
+/*
+ * m_set_ext_readonly() marks the external storage of an mbuf as not to be
+ * written to, e.g. because it is the page cache of a file; like the mark
+ * that m_incref() puts on shared clusters, it sticks until the storage
+ * is freed.
+ */
+__private_extern__ void
+m_set_ext_readonly(struct mbuf *m)
+{
+	VERIFY(m->m_flags & M_EXT);
+
+	(void) OSBitOrAtomic16(EXTF_READONLY, &MEXT_FLAGS(m));
+}
+
 __private_extern__ caddr_t
 m_bigalloc(int wait)
 {
@@ -86,8 +86,10 @@
 #include <sys/socketvar.h>
 #include <sys/kernel.h>
 #include <sys/uio_internal.h>
+#include <sys/ubc.h>
 #include <sys/kauth.h>
 #include <kern/task.h>
+#include <kern/thread_call.h>
 #include <sys/priv.h>
 #include <sys/sysctl.h>
 #include <sys/sys_domain.h>
@@ -100,11 +102,12 @@
 #include <net/route.h>
 #include <netinet/in_pcb.h>
 
+#include <os/atomic_private.h>
 #include <os/ptrtools.h>
 
-#if CONFIG_MACF_SOCKET_SUBSET
+#if CONFIG_MACF
 #include <security/mac_framework.h>
-#endif /* MAC_SOCKET_SUBSET */
+#endif /* CONFIG_MACF */
 
 #define f_flag fp_glob->fg_flag
 #define f_ops fp_glob->fg_ops
@@ -126,6 +129,7 @@
 #define DBG_FNC_SENDFILE_SEND   NETDBG_CODE(DBG_NETSOCK, ((10 << 8) | 3))
 #define DBG_FNC_SENDMSG_X       NETDBG_CODE(DBG_NETSOCK, (11 << 8))
 #define DBG_FNC_RECVMSG_X       NETDBG_CODE(DBG_NETSOCK, (12 << 8))
+#define DBG_FNC_SPLICE_X        NETDBG_CODE(DBG_NETSOCK, (13 << 8))
 
 #if DEBUG || DEVELOPMENT
 #define DEBUG_KERNEL_ADDRPERM(_v) (_v)
@@ -3333,6 +3337,258 @@ alloc_sendpkt(int how, size_t pktlen, unsigned int *maxchunks,
 	*maxchunks = needed;
 }
 
+/*
+ * Largest amount of headers or trailers that sendfile() copies in to go
+ * out along with the file data; more than that is written on its own.
+ */
+#define SENDFILE_MAX_HDTR       SENDFILE_MAX_BYTES
+
+/*
+ * Send file data that is in the page cache straight from the pages
+ * holding it, rather than copy it into mbuf clusters.
+ */
+static int sendfile_zerocopy = 1;
+SYSCTL_INT(_kern_ipc, OID_AUTO, sendfile_zerocopy,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &sendfile_zerocopy, 0, "");
+
+static uint64_t sendfile_zerocopy_bytes;
+SYSCTL_QUAD(_debug, OID_AUTO, sendfile_zerocopy_bytes,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &sendfile_zerocopy_bytes, "");
+
+static uint64_t sendfile_copy_bytes;
+SYSCTL_QUAD(_debug, OID_AUTO, sendfile_copy_bytes,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &sendfile_copy_bytes, "");
+
+/*
+ * A run of file pages wired and mapped by sendfile(), shared by the
+ * mbufs that point into it.  Mbufs get freed in places where the run
+ * can't be unmapped, so once the last of them is, the run is handed to
+ * a thread call to be released.
+ */
+struct sendfile_pages {
+	STAILQ_ENTRY(sendfile_pages) sp_link;
+	upl_t           sp_upl;
+	vm_offset_t     sp_kva;
+	upl_size_t      sp_size;
+	int             sp_flags;       /* SF_NOCACHE */
+	uint32_t        sp_refs;        /* mbufs pointing into the run */
+};
+
+static LCK_GRP_DECLARE(sendfile_lck_grp, "sendfile");
+static LCK_SPIN_DECLARE(sendfile_pages_lock, &sendfile_lck_grp);
+static STAILQ_HEAD(, sendfile_pages) sendfile_pages_done =
+    STAILQ_HEAD_INITIALIZER(sendfile_pages_done);
+static thread_call_t sendfile_pages_tcall;
+
+static void
+sendfile_pages_release(__unused thread_call_param_t p0,
+    __unused thread_call_param_t p1)
+{
+	struct sendfile_pages *sp;
+
+	lck_spin_lock(&sendfile_pages_lock);
+	while ((sp = STAILQ_FIRST(&sendfile_pages_done)) != NULL) {
+		STAILQ_REMOVE_HEAD(&sendfile_pages_done, sp_link);
+		lck_spin_unlock(&sendfile_pages_lock);
+
+		(void) ubc_upl_unmap(sp->sp_upl);
+		/* SF_NOCACHE: the pages are the first to go when memory is needed */
+		(void) ubc_upl_commit_range(sp->sp_upl, 0, sp->sp_size,
+		    UPL_COMMIT_FREE_ON_EMPTY |
+		    ((sp->sp_flags & SF_NOCACHE) ? UPL_COMMIT_INACTIVATE : 0));
+		FREE(sp, M_TEMP);
+
+		lck_spin_lock(&sendfile_pages_lock);
+	}
+	lck_spin_unlock(&sendfile_pages_lock);
+}
+
+static void
+sendfile_pages_rele(struct sendfile_pages *sp, uint32_t refs)
+{
+	if (os_atomic_sub(&sp->sp_refs, refs, acq_rel) != 0) {
+		return;
+	}
+
+	lck_spin_lock(&sendfile_pages_lock);
+	STAILQ_INSERT_TAIL(&sendfile_pages_done, sp, sp_link);
+	lck_spin_unlock(&sendfile_pages_lock);
+	thread_call_enter(sendfile_pages_tcall);
+}
+
+/* external storage free routine of the mbufs pointing into a run of pages */
+static void
+sendfile_pages_free(__unused caddr_t buf, __unused u_int size, caddr_t arg)
+{
+	sendfile_pages_rele((struct sendfile_pages *)(void *)arg, 1);
+}
+
+/*
+ * Build a chain of mbufs that point at the pages of the file holding
+ * [off, off + len), instead of copying them.  The pages are wired, not
+ * busied, so other readers of the file aren't held up while the data
+ * sits in the send buffer.  Unless SF_NOCACHE is given, the pages have
+ * to be resident already; the caller reads the data the usual way, with
+ * read-ahead, if they aren't.
+ */
+static int
+sendfile_wire_pages(vnode_t vp, off_t off, off_t len, int flags,
+    struct mbuf **mp)
+{
+	struct sendfile_pages *sp;
+	struct mbuf *m0 = NULL, *m, **mnext = &m0;
+	off_t start = trunc_page_64(off);
+	upl_size_t size = (upl_size_t)(round_page_64(off + len) - start);
+	uint32_t npages = (uint32_t)atop(size), i;
+	off_t resid = len;
+	vm_offset_t kva;
+	kern_return_t kr;
+	upl_t upl;
+
+	*mp = NULL;
+
+	if (sendfile_pages_tcall == NULL) {
+		thread_call_t tcall;
+
+		tcall = thread_call_allocate(sendfile_pages_release, NULL);
+		if (!os_atomic_cmpxchg(&sendfile_pages_tcall, NULL, tcall, release)) {
+			thread_call_free(tcall);
+		}
+	}
+
+	kr = ubc_create_upl_wired(vp, start, size, &upl,
+	    (flags & SF_NOCACHE) ? 0 : UPL_REQUEST_NO_FAULT, VM_KERN_MEMORY_FILE);
+	if (kr != KERN_SUCCESS) {
+		return mach_to_bsd_errno(kr);
+	}
+	kr = ubc_upl_map(upl, &kva);
+	if (kr != KERN_SUCCESS) {
+		(void) ubc_upl_commit_range(upl, 0, size, UPL_COMMIT_FREE_ON_EMPTY);
+		return mach_to_bsd_errno(kr);
+	}
+
+	MALLOC(sp, struct sendfile_pages *, sizeof(*sp), M_TEMP,
+	    M_WAITOK | M_ZERO);
+	sp->sp_upl = upl;
+	sp->sp_kva = kva;
+	sp->sp_size = size;
+	sp->sp_flags = flags;
+	sp->sp_refs = npages;
+
+	for (i = 0; i < npages; i++) {
+		off_t pgoff = (i == 0) ? off - start : 0;
+
+		m = (m0 == NULL) ? m_gethdr(M_WAIT, MT_DATA) :
+		    m_get(M_WAIT, MT_DATA);
+		if (m != NULL) {
+			m = m_clattach(m, MT_DATA, (caddr_t)(kva + ptoa(i)),
+			    sendfile_pages_free, PAGE_SIZE, (caddr_t)sp,
+			    M_WAIT, 0);
+		}
+		if (m == NULL) {
+			/* drop the references of the pages not attached yet */
+			sendfile_pages_rele(sp, npages - i);
+			m_freem(m0);
+			return ENOBUFS;
+		}
+		/* the page cache must not be scribbled on by the stack */
+		m_set_ext_readonly(m);
+		m->m_data += pgoff;
+		m->m_len = (int32_t)MIN((off_t)PAGE_SIZE - pgoff, resid);
+		resid -= m->m_len;
+
+		*mnext = m;
+		mnext = &m->m_next;
+	}
+	m0->m_pkthdr.len = (int32_t)len;
+
+	*mp = m0;
+	return 0;
+}
+
+/*
+ * Copy the headers or trailers of a sendfile() into a chain of mbufs,
+ * so that they go out along with the file data rather than as writes
+ * of their own.  Returns EMSGSIZE, before copying anything, if they
+ * are too large to be worth holding on to.
+ */
+static int
+sendfile_hdtr_copyin(struct proc *p, user_addr_t user_iovp, int iovcnt,
+    struct mbuf **mp, off_t *lenp)
+{
+	int spacetype = IS_64BIT_PROCESS(p) ? UIO_USERSPACE64 : UIO_USERSPACE32;
+	struct mbuf *m0 = NULL, *m, **mnext = &m0;
+	uio_t auio;
+	off_t len = 0;
+	int error;
+
+	*mp = NULL;
+	*lenp = 0;
+
+	if (iovcnt <= 0 || iovcnt > UIO_MAXIOV) {
+		return EINVAL;
+	}
+	auio = uio_create(iovcnt, 0, spacetype, UIO_WRITE);
+	if (auio == NULL) {
+		return ENOMEM;
+	}
+	error = copyin_user_iovec_array(user_iovp, spacetype, iovcnt,
+	    uio_iovsaddr(auio));
+	if (error == 0) {
+		error = uio_calculateresid(auio);
+	}
+	if (error == 0 && uio_resid(auio) > SENDFILE_MAX_HDTR) {
+		error = EMSGSIZE;
+	}
+	while (error == 0 && uio_resid(auio) > 0) {
+		int mlen = (int)MIN(uio_resid(auio), MCLBYTES);
+
+		m = m_getcl(M_WAIT, MT_DATA, (m0 == NULL) ? M_PKTHDR : 0);
+		if (m == NULL) {
+			error = ENOBUFS;
+			break;
+		}
+		*mnext = m;
+		mnext = &m->m_next;
+
+		error = uiomove(mtod(m, caddr_t), mlen, auio);
+		m->m_len = mlen;
+		len += mlen;
+	}
+	uio_free(auio);
+
+	if (error != 0) {
+		m_freem(m0);
+		return error;
+	}
+	if (m0 != NULL) {
+		m_fixhdr(m0);
+	}
+	*mp = m0;
+	*lenp = len;
+	return 0;
+}
+
+/*
+ * Append the chain n to the packet m0, which n's packet header gives
+ * way to.
+ */
+static struct mbuf *
+sendfile_append(struct mbuf *m0, struct mbuf *n)
+{
+	if (n == NULL) {
+		return m0;
+	}
+	if (n->m_flags & M_PKTHDR) {
+		m_tag_delete_chain(n, NULL);
+		n->m_flags &= ~M_PKTHDR;
+	}
+	m_cat(m0, n);
+	m_fixhdr(m0);
+
+	return m0;
+}
+
 /*
  * sendfile(2).
  * int sendfile(int fd, int s, off_t offset, off_t *nbytes,
@@ -3342,6 +3598,13 @@ alloc_sendpkt(int how, size_t pktlen, unsigned int *maxchunks,
  * specified by 's'. Send only '*nbytes' of the file or until EOF if
  * *nbytes == 0. Optionally add a header and/or trailer to the socket
  * output. If specified, write the total number of bytes sent into *nbytes.
+ *
+ * File data in the page cache of a local file system is sent from the
+ * pages holding it; with SF_NOCACHE, the pages are read in to be sent
+ * that way too, and are let go of once the data has been sent.  The
+ * mbufs then point at the file's pages until the data is acknowledged,
+ * so a write to that part of the file, or a truncation, in the meantime
+ * may change what goes out, including in retransmissions.
  */
 int
 sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
@@ -3360,6 +3623,10 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 	size_t sizeof_hdtr;
 	off_t file_size;
 	struct vfs_context context = *vfs_context_current();
+	struct mbuf *hdr_m = NULL, *trl_m = NULL;
+	off_t hdr_len = 0, trl_len = 0;
+	boolean_t hdr_pending = FALSE, trl_writev = FALSE;
+	boolean_t zerocopy, zerocopied = FALSE;
 
 	KERNEL_DEBUG_CONSTANT((DBG_FNC_SENDFILE | DBG_FUNC_START), uap->s,
 	    0, 0, 0, 0);
@@ -3406,7 +3673,7 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		error = EINVAL;
 		goto done2;
 	}
-	if (uap->flags != 0) {
+	if (uap->flags & ~SF_NOCACHE) {
 		error = EINVAL;
 		goto done2;
 	}
@@ -3462,18 +3729,39 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		}
 
 		/*
-		 * Send any headers. Wimp out and use writev(2).
+		 * Copy in any headers and trailers to send along with the
+		 * file data, so that they don't end up in segments of their
+		 * own.  If they're too large for that, wimp out and use
+		 * writev(2).
 		 */
 		if (user_hdtr.headers != USER_ADDR_NULL) {
-			bzero(&nuap, sizeof(struct writev_args));
-			nuap.fd = uap->s;
-			nuap.iovp = user_hdtr.headers;
-			nuap.iovcnt = user_hdtr.hdr_cnt;
-			error = writev_nocancel(p, &nuap, &writev_retval);
+			error = sendfile_hdtr_copyin(p, user_hdtr.headers,
+			    user_hdtr.hdr_cnt, &hdr_m, &hdr_len);
+			if (error == EMSGSIZE) {
+				bzero(&nuap, sizeof(struct writev_args));
+				nuap.fd = uap->s;
+				nuap.iovp = user_hdtr.headers;
+				nuap.iovcnt = user_hdtr.hdr_cnt;
+				error = writev_nocancel(p, &nuap, &writev_retval);
+				hdr_len = writev_retval;
+			}
+			if (error) {
+				goto done2;
+			}
+			/* counted as sent, and taken back if they don't go out */
+			sbytes += hdr_len;
+			hdr_pending = (hdr_m != NULL);
+		}
+		if (user_hdtr.trailers != USER_ADDR_NULL) {
+			error = sendfile_hdtr_copyin(p, user_hdtr.trailers,
+			    user_hdtr.trl_cnt, &trl_m, &trl_len);
+			if (error == EMSGSIZE) {
+				trl_writev = TRUE;
+				error = 0;
+			}
 			if (error) {
 				goto done2;
 			}
-			sbytes += writev_retval;
 		}
 	}
 
@@ -3487,10 +3775,23 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 	}
 
 	/*
-	 * Simply read file data into a chain of mbufs that used with scatter
-	 * gather reads. We're not (yet?) setup to use zero copy external
-	 * mbufs that point to the file pages.
+	 * Send the file data from the pages of the file where we can, and
+	 * otherwise read it into a chain of mbufs with scatter gather reads.
+	 * Reads of the raw data of encrypted files don't come from the page
+	 * cache.  Taking the pages skips VNOP_READ(), so only local file
+	 * systems qualify: remote ones revalidate their cache there, and
+	 * content protected ones check the file's class keys.
 	 */
+	zerocopy = sendfile_zerocopy && !vnode_isswap(vp) &&
+	    !(fp->f_flag & (FENCRYPTED | FUNENCRYPTED)) &&
+	    (vnode_vfsvisflags(vp) & (MNT_LOCAL | MNT_CPROTECT)) == MNT_LOCAL;
+#if CONFIG_MACF
+	/* checked by fo_read() for each read, and once for the pages */
+	if (zerocopy && mac_vnode_check_read(&context, context.vc_ucred, vp)) {
+		zerocopy = FALSE;
+	}
+#endif
+
 	socket_lock(so, 1);
 	error = sblock(&so->so_snd, SBL_WAIT);
 	if (error) {
@@ -3499,6 +3800,7 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 	}
 	for (off = uap->offset;; off += xfsize, sbytes += xfsize) {
 		mbuf_t  m0 = NULL, m;
+		off_t   trl_sent = 0;
 		unsigned int    nbufs = SFUIOBUFS, i;
 		uio_t   auio;
 		char    uio_buf[UIO_SIZEOF(SFUIOBUFS)]; /* 1 KB !!! */
@@ -3559,6 +3861,21 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 		    ((so->so_flags & SOF_MULTIPAGES) || sosendjcl_ignore_capab);
 
 		socket_unlock(so, 0);
+		if (zerocopy && vnode_getwithref(vp) == 0) {
+			error = sendfile_wire_pages(vp, off, xfsize,
+			    uap->flags, &m0);
+			vnode_put(vp);
+			socket_lock(so, 0);
+			if (error == 0) {
+				os_atomic_add(&sendfile_zerocopy_bytes, xfsize,
+				    relaxed);
+				zerocopied = TRUE;
+				goto retry_space;
+			}
+			/* not resident, or no mbufs: read it in instead */
+			error = 0;
+			socket_unlock(so, 0);
+		}
 		alloc_sendpkt(M_WAIT, xfsize, &nbufs, &m0, jumbocl);
 		pktlen = mbuf_pkthdr_maxlen(m0);
 		if (pktlen < (size_t)xfsize) {
@@ -3635,6 +3952,7 @@ sendfile(struct proc *p, struct sendfile_args *uap, __unused int *retval)
 			rlen += mlen;
 		}
 		mbuf_pkthdr_setlen(m0, xfsize);
+		os_atomic_add(&sendfile_copy_bytes, xfsize, relaxed);
 
 retry_space:
 		/*
@@ -3686,6 +4004,21 @@ retry_space:
 			goto retry_space;
 		}
 
+		/*
+		 * The headers go out with the first of the file data, and
+		 * the trailers with the last.
+		 */
+		if (hdr_m != NULL) {
+			m0 = sendfile_append(hdr_m, m0);
+			hdr_m = NULL;
+		}
+		if (trl_m != NULL && (off + xfsize >= file_size ||
+		    (nbytes && sbytes + xfsize >= nbytes))) {
+			m0 = sendfile_append(m0, trl_m);
+			trl_m = NULL;
+			trl_sent = trl_len;
+		}
+
 		struct mbuf *control = NULL;
 		{
 			/*
@@ -3696,6 +4029,8 @@ retry_space:
 			if (error) {
 				if (error == EJUSTRETURN) {
 					error = 0;
+					hdr_pending = FALSE;
+					sbytes += trl_sent;
 					continue;
 				}
 				goto done3;
@@ -3713,13 +4048,32 @@ retry_space:
 		if (error) {
 			goto done3;
 		}
+		hdr_pending = FALSE;
+		sbytes += trl_sent;
 	}
 	sbunlock(&so->so_snd, FALSE);   /* will unlock socket */
 	/*
-	 * Send trailers. Wimp out and use writev(2).
+	 * Send the headers and trailers that had no file data to go out
+	 * with, e.g. because there wasn't any.
 	 */
-	if (uap->hdtr != USER_ADDR_NULL &&
-	    user_hdtr.trailers != USER_ADDR_NULL) {
+	if (hdr_m != NULL || trl_m != NULL) {
+		struct mbuf *m0;
+		off_t trl_sent;
+
+		m0 = (hdr_m != NULL) ? sendfile_append(hdr_m, trl_m) : trl_m;
+		trl_sent = (trl_m != NULL) ? trl_len : 0;
+		hdr_m = trl_m = NULL;
+		error = sosend(so, NULL, NULL, m0, NULL, 0);
+		if (error) {
+			goto done2;
+		}
+		hdr_pending = FALSE;
+		sbytes += trl_sent;
+	}
+	/*
+	 * Send trailers too large to copy in. Wimp out and use writev(2).
+	 */
+	if (trl_writev) {
 		bzero(&nuap, sizeof(struct writev_args));
 		nuap.fd = uap->s;
 		nuap.iovp = user_hdtr.trailers;
@@ -3731,6 +4085,27 @@ retry_space:
 		sbytes += writev_retval;
 	}
 done2:
+	/* the data sent from the pages wasn't read, so touch the file here */
+	if (zerocopied && (vnode_vfsvisflags(vp) & MNT_NOATIME) == 0 &&
+	    vnode_getwithref(vp) == 0) {
+		struct vnode_attr va;
+
+		VATTR_INIT(&va);
+		nanotime(&va.va_access_time);
+		VATTR_SET_ACTIVE(&va, va_access_time);
+		(void) vnode_setattr(vp, &va, &context);
+		vnode_put(vp);
+	}
+	if (hdr_pending) {
+		/* the headers never made it out */
+		sbytes -= hdr_len;
+	}
+	if (hdr_m != NULL) {
+		m_freem(hdr_m);
+	}
+	if (trl_m != NULL) {
+		m_freem(trl_m);
+	}
 	file_drop(uap->s);
 done1:
 	file_drop(uap->fd);
@@ -3750,3 +4125,591 @@ done3:
 
 
 #endif /* SENDFILE */
+
+/*
+ * Largest amount of data moved by one step of splice_x(), and number
+ * of mbufs written to a file at once.
+ */
+#define SPLICE_MAX_BYTES        (1024 * 1024)
+#define SPLICE_FILE_IOVS        32
+
+/*
+ * Take up to len bytes of stream data from the receive buffer of so,
+ * as the mbuf chain that held them.  Returns the amount received in
+ * *rlen; at EOF, *mp is NULL and no error is returned.
+ */
+static int
+splice_receive(struct socket *so, user_ssize_t len, int flags,
+    struct mbuf **mp, user_ssize_t *rlen)
+{
+	char uio_buf[UIO_SIZEOF(0)];
+	uio_t auio;
+	int error;
+
+	auio = uio_createwithbuffer(0, 0, UIO_SYSSPACE, UIO_READ,
+	    &uio_buf[0], sizeof(uio_buf));
+	uio_setresid(auio, len);
+
+	*mp = NULL;
+	/* let pru_soreceive handle the socket locking */
+	error = so->so_proto->pr_usrreqs->pru_soreceive(so, NULL, auio, mp,
+	    NULL, &flags);
+	*rlen = len - uio_resid(auio);
+
+	return error;
+}
+
+/*
+ * Put stream data taken from the receive buffer of so by splice_receive(),
+ * and that could not be delivered, back at the front of that buffer, so
+ * that it is neither lost nor counted as moved.
+ */
+static void
+splice_unreceive(struct socket *so, struct mbuf *m)
+{
+	struct sockbuf *sb = &so->so_rcv;
+	struct mbuf *n, *tail = NULL;
+
+	while (m != NULL && m->m_len == 0) {
+		m = m_free(m);
+	}
+	if (m == NULL) {
+		return;
+	}
+
+	socket_lock(so, 1);
+	/* keep out readers that could hold on to sb_mb */
+	if (sblock(sb, SBL_WAIT | SBL_NOINTR) != 0) {
+		/* the socket was made defunct, its data is gone anyway */
+		socket_unlock(so, 1);
+		m_freem(m);
+		return;
+	}
+	for (n = m; n != NULL; n = n->m_next) {
+		n->m_nextpkt = NULL;
+		sballoc(sb, n);
+		tail = n;
+	}
+	if (sb->sb_mb != NULL) {
+		m->m_nextpkt = sb->sb_mb->m_nextpkt;
+		sb->sb_mb->m_nextpkt = NULL;
+	} else {
+		sb->sb_mbtail = tail;
+	}
+	tail->m_next = sb->sb_mb;
+	sb->sb_mb = m;
+	sb->sb_lastrecord = m;
+	SBLASTRECORDCHK(sb, __func__);
+	SBLASTMBUFCHK(sb, __func__);
+	sbunlock(sb, FALSE);    /* will unlock socket */
+}
+
+/*
+ * Read up to len bytes from the pipe fp into a fresh mbuf chain.  Only
+ * the first read may wait for data.  Returns the amount read in *rlen;
+ * at EOF, *mp is NULL and no error is returned.
+ */
+static int
+splice_pipe_read(struct fileproc *fp, user_ssize_t len, int flags,
+    struct mbuf **mp, user_ssize_t *rlen)
+{
+	char uio_buf[UIO_SIZEOF(SPLICE_FILE_IOVS)];
+	vfs_context_t ctx = vfs_context_current();
+	unsigned int num = 1;
+	struct mbuf *top, *m;
+	user_ssize_t resid, want;
+	uio_t auio;
+	int error = 0;
+
+	*mp = NULL;
+	*rlen = 0;
+	top = m_allocpacket_internal(&num, (size_t)len, NULL, M_WAIT, 1, 0);
+	if (top == NULL) {
+		return ENOBUFS;
+	}
+	resid = len;
+	for (m = top; m != NULL; m = m->m_next) {
+		m->m_len = (int32_t)MIN(M_TRAILINGSPACE(m), resid);
+		resid -= m->m_len;
+	}
+	top->m_pkthdr.len = (int32_t)len;
+
+	m = top;
+	while (m != NULL) {
+		auio = uio_createwithbuffer(SPLICE_FILE_IOVS, 0, UIO_SYSSPACE,
+		    UIO_READ, &uio_buf[0], sizeof(uio_buf));
+		for (int i = 0; i < SPLICE_FILE_IOVS && m != NULL; m = m->m_next) {
+			if (m->m_len > 0) {
+				uio_addiov(auio, CAST_USER_ADDR_T(mtod(m, caddr_t)),
+				    m->m_len);
+				i++;
+			}
+		}
+		want = uio_resid(auio);
+		if (want == 0) {
+			break;
+		}
+
+		error = fo_read(fp, auio, flags, ctx);
+		*rlen += want - uio_resid(auio);
+		if (error || uio_resid(auio) != 0) {
+			break;
+		}
+		flags |= FOF_NONBLOCK;
+	}
+	if (error == EAGAIN && *rlen != 0) {
+		/* the pipe was drained by an earlier read */
+		error = 0;
+	}
+
+	if (*rlen == 0) {
+		m_freem(top);
+	} else {
+		m_adj(top, -(int)(len - *rlen));
+		*mp = top;
+	}
+	return error;
+}
+
+/*
+ * Where splice_x() takes its data from: the receive buffer of a stream
+ * socket, or a pipe.
+ */
+struct splice_src {
+	struct socket   *ss_so;
+	struct fileproc *ss_fp;         /* the pipe, when ss_so is NULL */
+};
+
+static int
+splice_take(struct splice_src *src, user_ssize_t len, int flags,
+    struct mbuf **mp, user_ssize_t *rlen)
+{
+	if (src->ss_so != NULL) {
+		return splice_receive(src->ss_so, len, flags, mp, rlen);
+	}
+	return splice_pipe_read(src->ss_fp, len,
+	           (flags & MSG_DONTWAIT) ? FOF_NONBLOCK : 0, mp, rlen);
+}
+
+/*
+ * Give back data taken by splice_take() that could not be delivered.
+ * There is no putting data back into a pipe: it is dropped.
+ */
+static void
+splice_untake(struct splice_src *src, struct mbuf *m)
+{
+	if (src->ss_so != NULL) {
+		splice_unreceive(src->ss_so, m);
+	} else {
+		m_freem(m);
+	}
+}
+
+/*
+ * Turn stream data taken from a receive buffer into a packet that
+ * can be handed to pru_send(): the stale packet headers of the data
+ * mbufs are dropped and a fresh one is put in front of them.  Returns
+ * NULL, leaving m0 alone, if no packet header could be allocated.
+ */
+static struct mbuf *
+splice_mkpacket(struct mbuf *m0)
+{
+	struct mbuf *m, *hdr;
+
+	for (m = m0; m != NULL; m = m->m_next) {
+		if (m->m_flags & M_PKTHDR) {
+			m_tag_delete_chain(m, NULL);
+			m->m_flags &= ~M_PKTHDR;
+		}
+	}
+
+	hdr = m_gethdr(M_WAIT, MT_DATA);
+	if (hdr == NULL) {
+		return NULL;
+	}
+	hdr->m_len = 0;
+	hdr->m_next = m0;
+	m_fixhdr(hdr);
+
+	return hdr;
+}
+
+/*
+ * Move data from src to the send buffer of dst.  The mbufs are passed
+ * along as they are, so data from a socket is never copied, and data
+ * from a pipe is copied once, into the mbufs.
+ *
+ * The send buffer of dst stays locked for the whole transfer, and we
+ * only take from src what dst can accept at once: data that has left
+ * src can always be queued on dst.
+ */
+static int
+splice_to_socket(struct proc *p, struct splice_src *src, struct socket *dst,
+    user_ssize_t nbytes, int flags, user_ssize_t *moved)
+{
+	struct mbuf *m, *pkt, *control;
+	user_ssize_t len;
+	int space;
+	int error, send_error;
+
+	socket_lock(dst, 1);
+	error = sblock(&dst->so_snd, SBL_WAIT);
+	if (error) {
+		socket_unlock(dst, 1);
+		return error;
+	}
+
+	while (*moved < nbytes) {
+		if ((dst->so_state & SS_CANTSENDMORE) || dst->so_error) {
+			if (dst->so_state & SS_CANTSENDMORE) {
+				error = EPIPE;
+			} else {
+				error = dst->so_error;
+				dst->so_error = 0;
+			}
+			break;
+		}
+
+		space = sbspace(&dst->so_snd);
+		if (space < (int)dst->so_snd.sb_lowat) {
+			if ((dst->so_state & SS_NBIO) || (flags & MSG_DONTWAIT)) {
+				error = EWOULDBLOCK;
+				break;
+			}
+			error = sbwait(&dst->so_snd);
+			if (error) {
+				break;
+			}
+			continue;
+		}
+		len = MIN(MIN(space, SPLICE_MAX_BYTES), nbytes - *moved);
+
+		socket_unlock(dst, 0);
+		error = splice_take(src, len, flags, &m, &len);
+		socket_lock(dst, 0);
+		if (m == NULL) {
+			break;
+		}
+
+		pkt = splice_mkpacket(m);
+		if (pkt == NULL) {
+			socket_unlock(dst, 0);
+			splice_untake(src, m);
+			socket_lock(dst, 0);
+			error = ENOBUFS;
+			break;
+		}
+
+		control = NULL;
+		send_error = sflt_data_out(dst, NULL, &pkt, &control, 0);
+		if (send_error == 0) {
+			/*
+			 * pru_send() disposes of the data even when it fails,
+			 * so from here on it is counted as moved: it has left
+			 * src either way.
+			 */
+			send_error = (*dst->so_proto->pr_usrreqs->pru_send)(dst, 0,
+			    pkt, NULL, control, p);
+		} else if (send_error == EJUSTRETURN) {
+			/* a filter took the data */
+			send_error = 0;
+		} else {
+			/* a filter rejected the data, it is still ours */
+			if (control != NULL) {
+				m_freem(control);
+			}
+			socket_unlock(dst, 0);
+			splice_untake(src, pkt);
+			socket_lock(dst, 0);
+			error = send_error;
+			break;
+		}
+		*moved += len;
+		if (send_error) {
+			error = send_error;
+			break;
+		}
+		if (error) {
+			break;
+		}
+
+		/* like read(2), only wait for the first bytes */
+		if ((flags & MSG_WAITALL) == 0) {
+			flags |= MSG_DONTWAIT;
+		}
+	}
+
+	sbunlock(&dst->so_snd, FALSE);  /* will unlock socket */
+	return error;
+}
+
+/*
+ * Write an mbuf chain to a file, straight out of the mbufs.
+ */
+static int
+splice_write(struct fileproc *fp, struct mbuf *m, off_t *offset,
+    vfs_context_t ctx, user_ssize_t *written)
+{
+	char uio_buf[UIO_SIZEOF(SPLICE_FILE_IOVS)];
+	user_ssize_t len;
+	uio_t auio;
+	int error = 0;
+
+	*written = 0;
+	while (m != NULL) {
+		auio = uio_createwithbuffer(SPLICE_FILE_IOVS,
+		    offset != NULL ? *offset : 0, UIO_SYSSPACE, UIO_WRITE,
+		    &uio_buf[0], sizeof(uio_buf));
+		for (int i = 0; i < SPLICE_FILE_IOVS && m != NULL; m = m->m_next) {
+			if (m->m_len > 0) {
+				uio_addiov(auio, CAST_USER_ADDR_T(mtod(m, caddr_t)),
+				    m->m_len);
+				i++;
+			}
+		}
+		len = uio_resid(auio);
+		if (len == 0) {
+			break;
+		}
+
+		error = fo_write(fp, auio, offset != NULL ? FOF_OFFSET : 0, ctx);
+		len -= uio_resid(auio);
+		*written += len;
+		if (offset != NULL) {
+			*offset += len;
+		}
+		if (error || uio_resid(auio) != 0) {
+			break;
+		}
+	}
+
+	return error;
+}
+
+/*
+ * Move data from src to a file, through the UBC, or to a pipe: the data
+ * is copied once more, from the mbufs to the file pages or pipe buffer.
+ */
+static int
+splice_to_file(struct splice_src *src, struct fileproc *fp, off_t *offset,
+    user_ssize_t nbytes, int flags, user_ssize_t *moved)
+{
+	vfs_context_t ctx = vfs_context_current();
+	user_ssize_t len, written;
+	struct mbuf *m;
+	int error, write_error;
+
+	while (*moved < nbytes) {
+		len = MIN(SPLICE_MAX_BYTES, nbytes - *moved);
+
+		error = splice_take(src, len, flags, &m, &len);
+		if (m == NULL) {
+			break;
+		}
+
+		write_error = splice_write(fp, m, offset, ctx, &written);
+		*moved += written;
+		if (written != len) {
+			/* what the file didn't take goes back to src */
+			m_adj(m, (int)written);
+			splice_untake(src, m);
+			if (write_error == 0) {
+				write_error = EIO;
+			}
+		} else {
+			m_freem(m);
+		}
+		if (write_error) {
+			error = write_error;
+			break;
+		}
+		if (error) {
+			break;
+		}
+
+		/* like read(2), only wait for the first bytes */
+		if ((flags & MSG_WAITALL) == 0) {
+			flags |= MSG_DONTWAIT;
+		}
+	}
+
+	return error;
+}
+
+/*
+ * splice_x(2).
+ * ssize_t splice_x(int s, int fd, off_t *offset, size_t nbytes, int flags)
+ *
+ * Move up to 'nbytes' of data from the stream socket or pipe 's' to 'fd',
+ * without going through user space.  When 'fd' is a connected stream
+ * socket, the mbufs holding the data are moved as they are from the
+ * receive buffer of 's' to the send buffer of 'fd'; data from a pipe is
+ * first read into fresh mbufs.  When 'fd' is a pipe or a regular file, the
+ * data is written to it straight out of the mbufs, for a file at '*offset'
+ * if 'offset' is not NULL (it is then updated), at the file offset otherwise.
+ *
+ * Like read(2), this waits for some data to be available unless
+ * MSG_DONTWAIT is set or 's' is non blocking, and returns once the data
+ * available has been moved, unless MSG_WAITALL is set.  Returns the
+ * number of bytes moved, 0 at the end of the stream.  Data that 'fd'
+ * did not take is left on a socket 's', except when the protocol of 'fd'
+ * fails to send data it was handed: that data is dropped, and still
+ * counted.  Data read from a pipe 's' that 'fd' did not take is dropped,
+ * and not counted.
+ */
+int
+splice_x(struct proc *p, struct splice_x_args *uap, user_ssize_t *retval)
+{
+	struct fileproc *sfp = NULL, *fp = NULL;
+	struct splice_src src = { };
+	struct socket *dst = NULL;
+	user_ssize_t moved = 0;
+	off_t offset = 0;
+	int error;
+
+	KERNEL_DEBUG(DBG_FNC_SPLICE_X | DBG_FUNC_START, uap->s, uap->fd,
+	    uap->nbytes, 0, 0);
+
+	AUDIT_ARG(fd, uap->s);
+	AUDIT_ARG(value32, uap->fd);
+
+	*retval = 0;
+	if (uap->s == uap->fd || uap->nbytes > INT_MAX ||
+	    (uap->flags & ~(MSG_DONTWAIT | MSG_WAITALL)) != 0) {
+		error = EINVAL;
+		goto out;
+	}
+
+	error = fp_lookup(p, uap->s, &sfp, 0);
+	if (error) {
+		goto out;
+	}
+	switch (FILEGLOB_DTYPE(sfp->fp_glob)) {
+	case DTYPE_SOCKET:
+		src.ss_so = (struct socket *)sfp->f_data;
+		if (src.ss_so == NULL) {
+			error = EBADF;
+		} else if (src.ss_so->so_type != SOCK_STREAM) {
+			error = EINVAL;
+		}
+		break;
+	case DTYPE_PIPE:
+		src.ss_fp = sfp;
+		if ((sfp->f_flag & FREAD) == 0) {
+			error = EBADF;
+		}
+		break;
+	default:
+		error = ENOTSUP;
+		break;
+	}
+	if (error) {
+		goto drop_s;
+	}
+
+	error = fp_lookup(p, uap->fd, &fp, 0);
+	if (error) {
+		goto drop_s;
+	}
+	if ((fp->f_flag & FWRITE) == 0) {
+		error = EBADF;
+		goto drop_fd;
+	}
+	switch (FILEGLOB_DTYPE(fp->fp_glob)) {
+	case DTYPE_SOCKET:
+		dst = (struct socket *)fp->f_data;
+		if (uap->offset != USER_ADDR_NULL) {
+			error = ESPIPE;
+		} else if (dst->so_type != SOCK_STREAM) {
+			error = EINVAL;
+		} else if ((dst->so_state & SS_ISCONNECTED) == 0) {
+			error = ENOTCONN;
+		}
+		break;
+	case DTYPE_PIPE:
+		if (uap->offset != USER_ADDR_NULL) {
+			error = ESPIPE;
+		}
+		break;
+	case DTYPE_VNODE:
+		AUDIT_ARG(vnpath_withref, (struct vnode *)fp->f_data, ARG_VNODE1);
+		if (!vnode_isreg((struct vnode *)fp->f_data)) {
+			error = ENOTSUP;
+		}
+		break;
+	default:
+		error = ENOTSUP;
+		break;
+	}
+	if (error) {
+		goto drop_fd;
+	}
+
+	if (uap->offset != USER_ADDR_NULL) {
+		error = copyin(uap->offset, &offset, sizeof(off_t));
+		if (error) {
+			goto drop_fd;
+		}
+		if (offset < 0) {
+			error = EINVAL;
+			goto drop_fd;
+		}
+	}
+
+#if CONFIG_MACF_SOCKET_SUBSET
+	if (src.ss_so != NULL) {
+		error = mac_socket_check_receive(kauth_cred_get(), src.ss_so);
+	}
+	if (error == 0 && dst != NULL) {
+		error = mac_socket_check_send(kauth_cred_get(), dst, NULL);
+	}
+	if (error) {
+		goto drop_fd;
+	}
+#endif /* MAC_SOCKET_SUBSET */
+
+	if (uap->nbytes == 0) {
+		goto drop_fd;
+	}
+
+	if (dst != NULL) {
+		error = splice_to_socket(p, &src, dst, (user_ssize_t)uap->nbytes,
+		    uap->flags, &moved);
+	} else {
+		error = splice_to_file(&src, fp,
+		    uap->offset != USER_ADDR_NULL ? &offset : NULL,
+		    (user_ssize_t)uap->nbytes, uap->flags, &moved);
+		if (moved) {
+			os_atomic_or(&fp->fp_glob->fg_flag, FWASWRITTEN, relaxed);
+		}
+	}
+	/*
+	 * Like a short write(2), report what was moved before an error,
+	 * which the next call will run into.
+	 */
+	if (moved != 0) {
+		error = 0;
+	}
+	/* Generation of SIGPIPE can be controlled per socket */
+	if (error == EPIPE && (dst != NULL ?
+	    (dst->so_flags & SOF_NOSIGPIPE) == 0 :
+	    (fp->fp_glob->fg_lflags & FG_NOSIGPIPE) == 0)) {
+		psignal(p, SIGPIPE);
+	}
+	if (uap->offset != USER_ADDR_NULL && moved != 0) {
+		int copy_error = copyout(&offset, uap->offset, sizeof(off_t));
+
+		if (error == 0) {
+			error = copy_error;
+		}
+	}
+	*retval = moved;
+
+drop_fd:
+	fp_drop(p, uap->fd, fp, 0);
+drop_s:
+	fp_drop(p, uap->s, sfp, 0);
+out:
+	KERNEL_DEBUG(DBG_FNC_SPLICE_X | DBG_FUNC_END, error, moved, 0, 0, 0);
+	return error;
+}
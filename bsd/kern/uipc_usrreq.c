@@ -2195,7 +2195,7 @@ unp_externalize(struct mbuf *rights)
 			 * Take an iocount on the fp for completing the
 			 * removal from the global msg queue
 			 */
-			os_ref_retain_locked(&fp->fp_iocount);
+			os_ref_retain(&fp->fp_iocount);
 			fileproc_l[i] = fp;
 		} else {
 			fileproc_l[i] = NULL;
@@ -663,6 +663,29 @@ kaudit_to_bsm(struct kaudit_record *kar, struct au_record **pau)
 	 * The return token is added outside of the switch statement.
 	 */
 	switch (ar->ar_event) {
+	case AUE_SPLICE:
+		/*
+		 * For splice_x the source and destination descriptors are
+		 * both saved, and the destination file when it is one
+		 */
+		if (ARG_IS_VALID(kar, ARG_FD)) {
+			tok = au_to_arg32(1, "s", ar->ar_arg_fd);
+			kau_write(rec, tok);
+		}
+		if (ARG_IS_VALID(kar, ARG_VALUE32)) {
+			tok = au_to_arg32(2, "fd", ar->ar_arg_value32);
+			kau_write(rec, tok);
+		}
+		if (ARG_IS_VALID(kar, ARG_VNODE1)) {
+			if (ARG_IS_VALID(kar, ARG_KPATH1)) {
+				tok = au_to_path(ar->ar_arg_kpath1);
+				kau_write(rec, tok);
+			}
+			tok = au_to_attr32(&ar->ar_arg_vnode1);
+			kau_write(rec, tok);
+		}
+		break;
+
 	case AUE_SENDFILE:
 		/* For sendfile the file and socket descriptor are both saved */
 		if (ARG_IS_VALID(kar, ARG_VALUE32)) {
@@ -978,6 +1001,35 @@ kaudit_to_bsm(struct kaudit_record *kar, struct au_record **pau)
 		UPATH1_VNODE1_TOKENS;
 		break;
 
+	/*
+	 * Each descriptor these close gets an AUE_CLOSE record of its own.
+	 */
+	case AUE_CLOSE_RANGE_NP:
+		if (ARG_IS_VALID(kar, ARG_FD)) {
+			tok = au_to_arg32(1, "lowfd", ar->ar_arg_fd);
+			kau_write(rec, tok);
+		}
+		if (ARG_IS_VALID(kar, ARG_VALUE32)) {
+			tok = au_to_arg32(2, "highfd", ar->ar_arg_value32);
+			kau_write(rec, tok);
+		}
+		if (ARG_IS_VALID(kar, ARG_CMD)) {
+			tok = au_to_arg32(3, "flags", ar->ar_arg_cmd);
+			kau_write(rec, tok);
+		}
+		break;
+
+	case AUE_CLOSEV_NP:
+		if (ARG_IS_VALID(kar, ARG_VALUE32)) {
+			tok = au_to_arg32(2, "nfds", ar->ar_arg_value32);
+			kau_write(rec, tok);
+		}
+		if (ARG_IS_VALID(kar, ARG_CMD)) {
+			tok = au_to_arg32(3, "flags", ar->ar_arg_cmd);
+			kau_write(rec, tok);
+		}
+		break;
+
 	case AUE_CORE:
 		if (ARG_IS_VALID(kar, ARG_SIGNUM)) {
 			tok = au_to_arg32(0, "signal", ar->ar_arg_signum);
@@ -564,6 +564,34 @@ typedef struct vol_attributes_attr {
 /* Required attributes for getattrlistbulk(2) */
 #define ATTR_BULK_REQUIRED (ATTR_CMN_NAME | ATTR_CMN_RETURNED_ATTRS)
 
+#ifdef PRIVATE
+/*
+ * Predicates for getattrlistbulk_filter_np(), evaluated in the kernel against
+ * each directory entry before its attributes are copied out.  Entries that
+ * don't satisfy every predicate in abf_flags are skipped.  ATTR_CMN_OBJTYPE
+ * must be requested, as must the attribute each predicate tests.  Entries
+ * returned with ATTR_CMN_ERROR are never filtered out.  ATTRBULK_FILTER_SIZE
+ * can't be combined with directory attributes and FSOPT_PACK_INVAL_ATTRS.
+ */
+#define ATTRBULK_FILTER_NAME            0x00000001      /* name matches abf_name ('*' and '?' wildcards) */
+#define ATTRBULK_FILTER_OBJTYPE         0x00000002      /* object type is in abf_objtypes */
+#define ATTRBULK_FILTER_MTIME           0x00000004      /* ATTR_CMN_MODTIME is at or after abf_mtime_min */
+#define ATTRBULK_FILTER_SIZE            0x00000008      /* ATTR_FILE_DATALENGTH of regular files is in [abf_size_min, abf_size_max] */
+
+#define ATTRBULK_FILTER_VALIDMASK       0x0000000f
+
+#define ATTRBULK_OBJTYPE(type)          (1U << (type))  /* fsobj_type_t, as returned in ATTR_CMN_OBJTYPE */
+
+struct attrbulk_filter {
+	uint32_t        abf_flags;              /* ATTRBULK_FILTER_* */
+	uint32_t        abf_objtypes;           /* mask of ATTRBULK_OBJTYPE() */
+	int64_t         abf_mtime_min;          /* seconds since the epoch */
+	uint64_t        abf_size_min;
+	uint64_t        abf_size_max;
+	char            abf_name[256];          /* NUL terminated pattern */
+};
+#endif /* PRIVATE */
+
 /*
  * Searchfs
  */
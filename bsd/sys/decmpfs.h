@@ -188,6 +188,9 @@ struct decmpfs_cnode {
 	uint64_t total_size __attribute__((aligned(8)));/* for dataless directories (incl. packages) */
 	uint64_t decompression_flags;
 	lck_rw_t compressed_data_lock;
+	struct decmpfs_chunk *chunk_cache; /* decompressed data beyond the last pagein, see decmpfs_chunk_copyout */
+	off_t    chunk_next;         /* where the last pagein ended, to spot sequential readers */
+	uint32_t chunk_prefetching;  /* a prefetch of the next chunk is queued */
 };
 
 #endif // XNU_KERNEL_PRIVATE
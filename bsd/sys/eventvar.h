@@ -145,6 +145,8 @@ __options_decl(kq_state_t, uint16_t, {
 	KQ_DYNAMIC        = 0x0800, /* kqueue is dynamically managed */
 	KQ_R2K_ARMED      = 0x1000, /* ast notification armed */
 	KQ_HAS_TURNSTILE  = 0x2000, /* this kqueue has a turnstile */
+	KQ_POLL_CACHE     = 0x4000, /* kqueue caches a poll() interest set */
+	KQ_POLL_STALE     = 0x8000, /* knotes of the cached set were dropped */
 });
 
 /*
@@ -353,6 +355,9 @@ extern workq_threadreq_param_t kqueue_threadreq_workloop_param(workq_threadreq_t
 
 extern struct kqueue *kqueue_alloc(struct proc *);
 extern void kqueue_dealloc(struct kqueue *);
+extern void kqueue_poll_cache_enable(struct kqueue *);
+extern bool kqueue_poll_cache_is_stale(struct kqueue *);
+extern void poll_cache_free(struct uthread *);
 extern void kqworkq_dealloc(struct kqworkq *kqwq);
 
 extern void knotes_dealloc(struct proc *);
@@ -712,6 +712,11 @@ struct log2phys {
 #define O_ALERT    0x20000000   /* small, clean popup window */
 
 #ifdef PRIVATE
+/*
+ * SPI: flags for close_range_np()
+ */
+#define CLOSE_RANGE_CLOEXEC     0x0001  /* mark close-on-exec instead of closing */
+
 /*
  * SPI: Argument data for F_OPENFROM
  */
@@ -793,6 +798,17 @@ typedef __darwin_mach_port_t fileport_t;
 
 int     fileport_makeport(int, fileport_t*);
 int     fileport_makefd(fileport_t);
+
+/*
+ * close_range_np() closes every open descriptor numbered from lowfd to highfd,
+ * or only marks them close-on-exec with CLOSE_RANGE_CLOEXEC.  closev_np()
+ * closes the nfds descriptors of fds.  Both release the descriptors from the
+ * table in batches, which is much cheaper than one close(2) per descriptor.
+ *
+ * NOTE: These are private system calls, the API is subject to change.
+ */
+int     close_range_np(unsigned int lowfd, unsigned int highfd, int flags);
+int     closev_np(const int *fds, unsigned int nfds, int flags);
 #endif /* PRIVATE */
 int     openx_np(const char *, int, filesec_t);
 /*
@@ -162,6 +162,7 @@ struct fileops {
 	    int flags, vfs_context_t ctx);
 #define FOF_OFFSET      0x00000001      /* offset supplied to vn_write */
 #define FOF_PCRED       0x00000002      /* cred from proc, not current thread */
+#define FOF_NONBLOCK    0x00000004      /* don't wait, as with FNONBLOCK (pipes) */
 	int (*fo_ioctl)(struct fileproc *fp, u_long com,
 	    caddr_t data, vfs_context_t ctx);
 	int (*fo_select)    (struct fileproc *fp, int which,
@@ -86,6 +86,7 @@
 #ifdef BSD_KERNEL_PRIVATE
 
 #include <kern/locks.h>
+#include <kern/lock_brw.h>
 
 struct klist;
 struct kqwllist;
@@ -109,6 +110,8 @@ struct filedesc {
 	u_long  fd_knhashmask;          /* size of knhash */
 	struct  klist *fd_knhash;       /* hash table for attached knotes */
 	lck_mtx_t fd_knhashlock;        /* lock for hash table for attached knotes */
+	lck_brw_t fd_lookup_brw;        /* fences lookups made without proc_fdlock */
+	bool    fd_lookup_lockless;     /* fd_lookup_brw is initialized and used */
 };
 
 /*
@@ -252,7 +255,8 @@ extern int      falloc_withalloc(proc_t p, struct fileproc **resultfp,
     int *resultfd, vfs_context_t ctx,
     fp_allocfn_t fp_zalloc, void *crarg);
 
-extern struct   filedesc *fdcopy(proc_t p, struct vnode *uth_cdir);
+extern struct   filedesc *fdcopy(proc_t p, struct vnode *uth_cdir,
+    int exec_fdmin, bool exec_cloexec_default);
 extern void     fdfree(proc_t p);
 extern void     fdexec(proc_t p, short flags, int self_exec);
 
@@ -278,6 +278,18 @@ struct fsioc_cas_bsdflags {
 	uint32_t actual_flags;          /* [OUT] the actual flags in inode */
 };
 
+/*
+ * Read-ahead efficiency counters of the mount a file is on,
+ * see FSIOC_READAHEAD_STATS.
+ */
+struct fsioc_readahead_stats {
+	uint64_t        ra_streams;             /* read-ahead streams started */
+	uint64_t        ra_strided;             /* streams found to be strided */
+	uint64_t        ra_reads;               /* reads of streams with read-ahead running */
+	uint64_t        ra_misses;              /* reads issued for blocks that were read ahead */
+	uint64_t        ra_pages;               /* pages read ahead */
+};
+
 #define FSCTL_SYNC_FULLSYNC     (1<<0)  /* Flush the data fully to disk, if supported by the filesystem */
 #define FSCTL_SYNC_WAIT         (1<<1)  /* Wait for the sync to complete */
 
@@ -326,6 +338,9 @@ struct fsioc_cas_bsdflags {
 /* Check if a file is only open once (pass zero for the extra arg) */
 #define FSIOC_FD_ONLY_OPEN_ONCE _IOWR('A', 21, uint32_t)
 
+/* Get the read-ahead counters of the mount */
+#define FSIOC_READAHEAD_STATS   _IOR('A', 22, struct fsioc_readahead_stats)
+
 //
 // Spotlight and fseventsd use these fsctl()'s to find out
 // the mount time of a volume and the last time it was
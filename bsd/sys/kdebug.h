@@ -846,6 +846,7 @@ __BEGIN_DECLS
 /* Codes for TURNSTILE_PRIORITY_OPERATIONS */
 #define TURNSTILE_PRIORITY_CHANGE               0x1
 #define THREAD_USER_PROMOTION_CHANGE            0x2
+#define TURNSTILE_PRIORITY_PROPAGATION          0x3
 
 /* Codes for TURNSTILE_FREELIST_OPERATIONS */
 #define TURNSTILE_PREPARE                       0x1
@@ -1437,6 +1437,7 @@ __private_extern__ struct mbuf *m_pulldown(struct mbuf *, int, int, int *);
 __private_extern__ struct mbuf *m_getcl(int, int, int);
 __private_extern__ caddr_t m_mclalloc(int);
 __private_extern__ int m_mclhasreference(struct mbuf *);
+__private_extern__ void m_set_ext_readonly(struct mbuf *);
 __private_extern__ void m_copy_pkthdr(struct mbuf *, struct mbuf *);
 __private_extern__ void m_copy_pftag(struct mbuf *, struct mbuf *);
 __private_extern__ void m_copy_necptag(struct mbuf *, struct mbuf *);
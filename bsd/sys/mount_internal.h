@@ -139,6 +139,11 @@ struct mount {
 	struct timeval          mnt_last_write_issued_timestamp;
 	struct timeval          mnt_last_write_completed_timestamp;
 	int64_t                 mnt_max_swappin_available;
+	uint64_t                mnt_ra_streams;             /* read-ahead streams started */
+	uint64_t                mnt_ra_strided;             /* read-ahead streams found to be strided */
+	uint64_t                mnt_ra_reads;               /* reads of streams with read-ahead running */
+	uint64_t                mnt_ra_misses;              /* reads issued for blocks that were read ahead */
+	uint64_t                mnt_ra_pages;               /* pages read ahead */
 
 	lck_rw_t                mnt_rwlock;                 /* mutex readwrite lock */
 	lck_mtx_t               mnt_renamelock;             /* mutex that serializes renames that change shape of tree */
@@ -112,16 +112,16 @@ struct pipebuf {
 };
 
 
-#ifdef PIPE_DIRECT
+#ifdef BSD_KERNEL_PRIVATE
 /*
  * Information to support direct transfers between processes for pipes.
+ * Direct transfer is active when PIPE_DIRECTW is set.
  */
 struct pipemapping {
-	vm_offset_t     kva;            /* kernel virtual address */
-	vm_size_t       cnt;            /* number of chars in buffer */
+	vm_offset_t     kva;            /* kernel address of the writer's data */
+	vm_size_t       cnt;            /* number of chars left to transfer */
 	vm_size_t       pos;            /* current position of transfer */
-	int             npages;         /* number of pages */
-	vm_page_t       ms[PIPENPAGES]; /* pages in source process */
+	struct upl      *upl;           /* wired pages in source process */
 };
 #endif
 
@@ -154,9 +154,6 @@ struct label;
  */
 struct pipe {
 	struct  pipebuf pipe_buffer;    /* data storage */
-#ifdef PIPE_DIRECT
-	struct  pipemapping pipe_map;   /* pipe mapping for direct I/O */
-#endif
 	struct  selinfo pipe_sel;       /* for compat with select */
 	pid_t   pipe_pgid;              /* information for async I/O */
 	struct  pipe *pipe_peer;        /* link with other direction */
@@ -167,6 +164,9 @@ struct pipe {
 	struct  timespec st_mtimespec;  /* time of last data modification */
 	struct  timespec st_ctimespec;  /* time of last status change */
 	struct  label *pipe_label;      /* pipe MAC label - shared */
+#ifdef BSD_KERNEL_PRIVATE
+	struct  pipemapping pipe_map;   /* pipe mapping for direct I/O */
+#endif
 };
 
 #define PIPE_MTX(pipe)          ((pipe)->pipe_mtxp)
@@ -1167,6 +1167,13 @@ struct sf_hdtr {
 	int trl_cnt;            /* number of trailer iovec's */
 };
 
+#ifdef PRIVATE
+/*
+ * sendfile(2) flags
+ */
+#define SF_NOCACHE      0x00000010      /* don't keep the file data sent in the cache */
+#endif /* PRIVATE */
+
 #ifdef KERNEL
 
 /* In-kernel representation */
@@ -1431,6 +1438,32 @@ ssize_t recvmsg_x(int s, const struct msghdr_x *msgp, u_int cnt, int flags);
  * NOTE: This a private system call, the API is subject to change.
  */
 ssize_t sendmsg_x(int s, const struct msghdr_x *msgp, u_int cnt, int flags);
+
+/*
+ * splice_x() is a system call that moves up to "nbytes" of data from the
+ * stream socket or pipe "s" to "fd" without copying it to user space.
+ *
+ * When "fd" is a connected stream socket, the data is moved from the
+ * receive buffer of "s" to the send buffer of "fd" without being copied.
+ *
+ * When "fd" is a pipe, the data is written to it.  When "fd" is a regular
+ * file, the data is written at "*offset", which is then updated, or at
+ * the current file offset if "offset" is NULL.
+ *
+ * Data that "fd" does not take is left on a socket "s", but is lost when
+ * "s" is a pipe.
+ *
+ * The "flags" arguments supports only the values MSG_DONTWAIT and
+ * MSG_WAITALL. Like read(2), splice_x() waits for data to be available
+ * unless MSG_DONTWAIT is set or "s" is non-blocking, and returns as soon
+ * as the data available has been moved unless MSG_WAITALL is set.
+ *
+ * splice_x() returns the number of bytes that have been moved, 0 at the
+ * end of the stream, or -1 if an error occurred.
+ *
+ * NOTE: This a private system call, the API is subject to change.
+ */
+ssize_t splice_x(int s, int fd, off_t *offset, size_t nbytes, int flags);
 __END_DECLS
 #endif /* !KERNEL */
 #endif  /* (!_POSIX_C_SOURCE || _DARWIN_C_SOURCE) */
@@ -156,6 +156,7 @@ errno_t mach_to_bsd_errno(kern_return_t mach_err);
 int     ubc_create_upl_external(vnode_t, off_t, int, upl_t *, upl_page_info_t **, int);
 #ifdef  XNU_KERNEL_PRIVATE
 int     ubc_create_upl_kernel(vnode_t, off_t, int, upl_t *, upl_page_info_t **, int, vm_tag_t);
+int     ubc_create_upl_wired(vnode_t, off_t, int, upl_t *, int, vm_tag_t);
 #endif  /* XNU_KERNEL_PRIVATE */
 
 boolean_t ubc_is_mapped(const struct vnode *, boolean_t *writable);
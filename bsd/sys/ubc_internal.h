@@ -45,6 +45,7 @@
 #include <sys/ubc.h>
 #include <sys/mman.h>
 #include <sys/codesign.h>
+#include <sys/queue.h>
 
 #include <sys/cdefs.h>
 
@@ -52,6 +53,7 @@
 #include <mach/memory_object_types.h>
 
 #include <libkern/ptrauth_utils.h>
+#include <os/refcnt.h>
 
 #define UBC_INFO_NULL   ((struct ubc_info *) 0)
 
@@ -77,11 +79,20 @@ struct cl_wextent {
 	int             io_flags;
 };
 
+/*
+ * Read ahead state of one stream of reads; each vnode
+ * tracks CL_RA_STREAMS of them
+ */
+#define CL_RA_STREAMS   4
+
 struct cl_readahead {
 	lck_mtx_t       cl_lockr;
 	daddr64_t       cl_lastr;                       /* last block read by client */
 	daddr64_t       cl_maxra;                       /* last block prefetched by the read ahead */
-	int             cl_ralen;                       /* length of last prefetch */
+	int             cl_ralen;                       /* length of last prefetch (records when strided) */
+	daddr64_t       cl_firstr;                      /* first block of the last read by client */
+	daddr64_t       cl_stride;                      /* blocks between the starts of strided reads */
+	uint64_t        cl_lastuse;                     /* time of the last read, to recycle streams */
 };
 
 struct cl_writebehind {
@@ -93,6 +104,10 @@ struct cl_writebehind {
 	int             cl_sparse_wait;                 /* synchronous push is in progress */
 	int             cl_number;                      /* number of packed write behind clusters currently valid */
 	struct cl_wextent cl_clusters[MAX_CLUSTERS];    /* packed write behind clusters */
+	TAILQ_ENTRY(cl_writebehind) cl_wb_link;         /* on the background write behind queue */
+	vnode_t         cl_wb_vp;                       /* vnode to push, once queued */
+	uint32_t        cl_wb_vid;                      /* ... and its vid at the time */
+	int             cl_wb_queued;                   /* on the queue (protected by the queue lock) */
 };
 
 struct cs_hash;
@@ -134,6 +149,19 @@ struct cs_blob {
 
 };
 
+/*
+ * Copy of the mach header and load commands of a signed executable,
+ * kept with its code signature so that exec need not read and
+ * validate them again.  See ubc_lcmds_get().
+ */
+struct ubc_lcmds {
+	os_refcnt_t             ul_refs;
+	off_t                   ul_offset;      /* file offset of the mach header */
+	vm_size_t               ul_size;        /* size of ul_data */
+	unsigned char           ul_cdhash[CS_CDHASH_LEN]; /* code directory ul_data was validated with */
+	char                    ul_data[];      /* header and load commands, page rounded */
+};
+
 /*
  *	The following data structure keeps the information to associate
  *	a vnode to the correspondig VM objects.
@@ -147,12 +175,14 @@ struct ubc_info {
 	uint32_t                ui_flags;       /* flags */
 	uint32_t                cs_add_gen;     /* generation count when csblob was validated */
 
-	struct  cl_readahead   *cl_rahead;      /* cluster read ahead context */
+	struct  cl_readahead   *cl_rahead;      /* cluster read ahead streams */
 	struct  cl_writebehind *cl_wbehind;     /* cluster write behind context */
 
 	struct timespec         cs_mtime;       /* modify time of file when
 	                                         *   first cs_blob was loaded */
 	struct  cs_blob         * XNU_PTRAUTH_SIGNED_PTR("ubc_info.cs_blobs") cs_blobs; /* for CODE SIGNING */
+	struct  ubc_lcmds       *ui_lcmds;      /* cached load commands */
+	uint32_t                ui_lcmds_gen;   /* bumped when the file data may change */
 #if CONFIG_SUPPLEMENTAL_SIGNATURES
 	struct  cs_blob         * XNU_PTRAUTH_SIGNED_PTR("ubc_info.cs_blob_supplement") cs_blob_supplement;/* supplemental blob (note that there can only be one supplement) */
 #endif
@@ -230,6 +260,13 @@ boolean_t ubc_cs_is_range_codesigned(vnode_t, mach_vm_offset_t, mach_vm_size_t);
 
 kern_return_t   ubc_cs_validation_bitmap_allocate( vnode_t );
 void            ubc_cs_validation_bitmap_deallocate( vnode_t );
+
+/* load command cache */
+uint32_t        ubc_lcmds_gen(vnode_t);
+struct ubc_lcmds *ubc_lcmds_get(vnode_t, off_t, const void *, size_t, vm_size_t);
+void            ubc_lcmds_set(vnode_t, off_t, const void *, vm_size_t, struct cs_blob *, uint32_t);
+void            ubc_lcmds_release(struct ubc_lcmds *);
+void            ubc_lcmds_invalidate(vnode_t);
 __END_DECLS
 
 
@@ -91,10 +91,28 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
 
 /*
  * operation bits [15, 8] contain the flags for __ulock_wake
+ *
+ * @const ULF_WAKE_REQUEUE
+ * Wake up the highest priority waiter, and move the other waiters to the
+ * ulock whose address is passed as the wake value, without waking them up.
+ * They are then woken up by wakes on that ulock, and push on its owner if
+ * it is a UL_UNFAIR_LOCK.
+ *
+ * Only valid with UL_COMPARE_AND_WAIT and UL_COMPARE_AND_WAIT64 ulocks
+ * private to the process. The target must either be of the same type, or
+ * be a UL_UNFAIR_LOCK whose owner the kernel knows from its waiters;
+ * waiters are moved whether or not the target already has waiters.
+ *
+ * The value at the target address is not compared: the caller must have
+ * made sure that whoever releases the target will issue a wake for it
+ * (e.g. by marking it contended) before requeueing. Returns the number of
+ * moved waiters, or fails with EDEADLK if the owner of the target is itself
+ * waiting on the ulock.
  */
 #define ULF_WAKE_ALL                    0x00000100
 #define ULF_WAKE_THREAD                 0x00000200
 #define ULF_WAKE_ALLOW_NON_OWNER        0x00000400
+#define ULF_WAKE_REQUEUE                0x00000800
 
 /*
  * operation bits [23, 16] contain the flags for __ulock_wait
@@ -134,7 +152,8 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
 #define ULF_WAKE_MASK           (ULF_NO_ERRNO | \
 	                         ULF_WAKE_ALL | \
 	                         ULF_WAKE_THREAD | \
-	                         ULF_WAKE_ALLOW_NON_OWNER)
+	                         ULF_WAKE_ALLOW_NON_OWNER | \
+	                         ULF_WAKE_REQUEUE)
 
 #endif /* PRIVATE */
 
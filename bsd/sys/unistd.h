@@ -188,6 +188,15 @@ __BEGIN_DECLS
 int     getattrlistbulk(int, void *, void *, size_t, uint64_t) __OSX_AVAILABLE_STARTING(__MAC_10_10, __IPHONE_8_0);
 int     getattrlistat(int, const char *, void *, void *, size_t, unsigned long) __OSX_AVAILABLE_STARTING(__MAC_10_10, __IPHONE_8_0);
 int     setattrlistat(int, const char *, void *, void *, size_t, uint32_t) __OSX_AVAILABLE(10.13) __IOS_AVAILABLE(11.0) __TVOS_AVAILABLE(11.0) __WATCHOS_AVAILABLE(4.0);
+#ifdef PRIVATE
+struct attrbulk_filter;
+/*
+ * getattrlistbulk(2), returning only the entries that satisfy filter.
+ *
+ * NOTE: This is a private system call, the API is subject to change.
+ */
+int     getattrlistbulk_filter_np(int, void *, void *, size_t, uint64_t, const struct attrbulk_filter *);
+#endif /* PRIVATE */
 
 __END_DECLS
 
@@ -197,6 +197,7 @@ struct uthread {
 	void * uu_userstate;
 	struct waitq_set *uu_wqset;             /* waitq state cached across select calls */
 	size_t uu_wqstate_sz;                   /* ...size of uu_wqset buffer */
+	struct poll_cache *uu_poll_cache;       /* kqueue cached across poll calls */
 	int uu_flag;
 	sigset_t uu_siglist;                            /* signals pending for the thread */
 	sigset_t uu_sigwait;                            /*  sigwait on this thread*/
@@ -238,6 +239,8 @@ struct uthread {
 	vnode_t         uu_vreclaims;
 	vnode_t         uu_cdir;                /* per thread CWD */
 	int             uu_dupfd;               /* fd in fdesc_open/dupfdopen */
+	int             uu_spawn_fdmin;         /* fd from which posix_spawn's fdcopy may skip */
+	bool            uu_spawn_cloexec_default; /* ... and skips all, not only close-on-exec */
 
 	/*
 	 * Bound kqueue request. This field is only cleared by the current thread,
@@ -353,6 +356,7 @@ typedef struct uthread * uthread_t;
 #define UT_NSPACE_NODATALESSFAULTS 0x00001000 /* thread does not materialize dataless files */
 #define UT_ATIME_UPDATE 0x00002000      /* don't update atime for files accessed by this thread */
 #define UT_NSPACE_FORCEDATALESSFAULTS  0x00004000 /* thread always materializes dataless files */
+#define UT_SPAWN_FDCOPY 0x00008000      /* thread in posix_spawn() fork1, see uu_spawn_fdmin */
 #define UT_VFORK        0x02000000      /* thread has vfork children */
 #define UT_SETUID       0x04000000      /* thread is settugid() */
 #define UT_WASSETUID    0x08000000      /* thread was settugid() (in vfork) */
@@ -491,6 +491,13 @@ void    name_cache_lock(void);
 void    name_cache_unlock(void);
 void    cache_enter_with_gen(vnode_t dvp, vnode_t vp, struct componentname *cnp, int gen);
 const char *cache_enter_create(vnode_t dvp, vnode_t vp, struct componentname *cnp);
+bool    cache_dircomplete_enum_begin(vnode_t dvp, off_t offset, size_t bufsize, uint32_t *tokenp);
+void    cache_dircomplete_enum_end(vnode_t dvp, uint32_t token, off_t offset, off_t next,
+    const void *buf, size_t len, int eofflag);
+bool    cache_dircomplete_absent(vnode_t dvp, struct componentname *cnp);
+void    cache_dircomplete_mutation_begin(vnode_t dvp);
+void    cache_dircomplete_mutation_end(vnode_t dvp);
+void    cache_dircomplete_invalidate(vnode_t dvp);
 
 extern int nc_disabled;
 
@@ -616,6 +623,7 @@ void    nspace_resolver_init(void);
 void    nspace_resolver_exited(struct proc *);
 
 int     vnode_materialize_dataless_file(vnode_t, uint64_t);
+bool    vnode_isdataless(vnode_t, vfs_context_t);
 
 int     vnode_isinuse_locked(vnode_t, int, int );
 
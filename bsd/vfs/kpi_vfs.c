@@ -96,6 +96,7 @@
 #include <sys/mbuf.h>
 #include <sys/syslog.h>
 #include <sys/ubc.h>
+#include <sys/ubc_internal.h>
 #include <sys/vm.h>
 #include <sys/sysctl.h>
 #include <sys/filedesc.h>
@@ -3267,8 +3268,12 @@ VNOP_COMPOUND_OPEN(vnode_t dvp, vnode_t *vpp, struct nameidata *ndp, int32_t fla
 		panic("Don't want create, but have a vap?");
 	}
 
+	if (want_create) {
+		cache_dircomplete_mutation_begin(dvp);
+	}
 	_err = (*dvp->v_op[vnop_compound_open_desc.vdesc_offset])(&a);
 	if (want_create) {
+		cache_dircomplete_mutation_end(dvp);
 		if (_err == 0 && *vpp) {
 			DTRACE_FSINFO(compound_open, vnode_t, *vpp);
 		} else {
@@ -3331,7 +3336,9 @@ VNOP_CREATE(vnode_t dvp, vnode_t * vpp, struct componentname * cnp, struct vnode
 	a.a_vap = vap;
 	a.a_context = ctx;
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_create_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	if (_err == 0 && *vpp) {
 		DTRACE_FSINFO(create, vnode_t, *vpp);
 	}
@@ -3402,7 +3409,9 @@ VNOP_MKNOD(vnode_t dvp, vnode_t * vpp, struct componentname * cnp, struct vnode_
 	a.a_vap = vap;
 	a.a_context = ctx;
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_mknod_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	if (_err == 0 && *vpp) {
 		DTRACE_FSINFO(mknod, vnode_t, *vpp);
 	}
@@ -3718,6 +3727,9 @@ VNOP_WRITE(vnode_t vp, struct uio * uio, int ioflag, vfs_context_t ctx)
 	DTRACE_FSINFO_IO(write,
 	    vnode_t, vp, user_ssize_t, (resid - uio_resid(uio)));
 
+	/* even a failed write may have changed some of the data */
+	ubc_lcmds_invalidate(vp);
+
 	post_event_if_success(vp, _err, NOTE_WRITE);
 
 	return _err;
@@ -3856,6 +3868,9 @@ VNOP_EXCHANGE(vnode_t fvp, vnode_t tvp, int options, vfs_context_t ctx)
 	_err = (*fvp->v_op[vnop_exchange_desc.vdesc_offset])(&a);
 	DTRACE_FSINFO(exchange, vnode_t, fvp);
 
+	ubc_lcmds_invalidate(fvp);
+	ubc_lcmds_invalidate(tvp);
+
 	/* Don't post NOTE_WRITE because file descriptors follow the data ... */
 	post_event_if_success(fvp, _err, NOTE_ATTRIB);
 	post_event_if_success(tvp, _err, NOTE_ATTRIB);
@@ -4048,7 +4063,9 @@ VNOP_REMOVE(vnode_t dvp, vnode_t vp, struct componentname * cnp, int flags, vfs_
 	a.a_flags = flags;
 	a.a_context = ctx;
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_remove_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	DTRACE_FSINFO(remove, vnode_t, vp);
 
 	if (_err == 0) {
@@ -4085,7 +4102,9 @@ VNOP_COMPOUND_REMOVE(vnode_t dvp, vnode_t *vpp, struct nameidata *ndp, int32_t f
 	a.a_context = ctx;
 	a.a_remove_authorizer = vn_authorize_unlink;
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_compound_remove_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	if (_err == 0 && *vpp) {
 		DTRACE_FSINFO(compound_remove, vnode_t, *vpp);
 	} else {
@@ -4168,7 +4187,9 @@ VNOP_LINK(vnode_t vp, vnode_t tdvp, struct componentname * cnp, vfs_context_t ct
 	a.a_cnp = cnp;
 	a.a_context = ctx;
 
+	cache_dircomplete_mutation_begin(tdvp);
 	_err = (*tdvp->v_op[vnop_link_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(tdvp);
 	DTRACE_FSINFO(link, vnode_t, vp);
 
 	post_event_if_success(vp, _err, NOTE_LINK);
@@ -4484,7 +4505,11 @@ VNOP_RENAME(struct vnode *fdvp, struct vnode *fvp, struct componentname *fcnp,
 	a.a_context = ctx;
 
 	/* do the rename of the main file. */
+	cache_dircomplete_mutation_begin(fdvp);
+	cache_dircomplete_mutation_begin(tdvp);
 	_err = (*fdvp->v_op[vnop_rename_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(fdvp);
+	cache_dircomplete_mutation_end(tdvp);
 	DTRACE_FSINFO(rename, vnode_t, fdvp);
 
 	if (_err) {
@@ -4568,7 +4593,11 @@ VNOP_RENAMEX(struct vnode *fdvp, struct vnode *fvp, struct componentname *fcnp,
 	a.a_context = ctx;
 
 	/* do the rename of the main file. */
+	cache_dircomplete_mutation_begin(fdvp);
+	cache_dircomplete_mutation_begin(tdvp);
 	_err = (*fdvp->v_op[vnop_renamex_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(fdvp);
+	cache_dircomplete_mutation_end(tdvp);
 	DTRACE_FSINFO(renamex, vnode_t, fdvp);
 
 	if (_err) {
@@ -4611,7 +4640,11 @@ VNOP_COMPOUND_RENAME(
 	a.a_reserved = NULL;
 
 	/* do the rename of the main file. */
+	cache_dircomplete_mutation_begin(fdvp);
+	cache_dircomplete_mutation_begin(tdvp);
 	_err = (*fdvp->v_op[vnop_compound_rename_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(fdvp);
+	cache_dircomplete_mutation_end(tdvp);
 	DTRACE_FSINFO(compound_rename, vnode_t, fdvp);
 
 	if (_err == 0) {
@@ -4716,7 +4749,9 @@ VNOP_MKDIR(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp,
 	a.a_vap = vap;
 	a.a_context = ctx;
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_mkdir_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	if (_err == 0 && *vpp) {
 		DTRACE_FSINFO(mkdir, vnode_t, *vpp);
 	}
@@ -4753,7 +4788,9 @@ VNOP_COMPOUND_MKDIR(struct vnode *dvp, struct vnode **vpp, struct nameidata *ndp
 #endif /* 0 */
 	a.a_reserved = NULL;
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_compound_mkdir_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	if (_err == 0 && *vpp) {
 		DTRACE_FSINFO(compound_mkdir, vnode_t, *vpp);
 	}
@@ -4821,7 +4858,9 @@ VNOP_RMDIR(struct vnode *dvp, struct vnode *vp, struct componentname *cnp, vfs_c
 	a.a_cnp = cnp;
 	a.a_context = ctx;
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*vp->v_op[vnop_rmdir_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	DTRACE_FSINFO(rmdir, vnode_t, vp);
 
 	if (_err == 0) {
@@ -4863,7 +4902,9 @@ VNOP_COMPOUND_RMDIR(struct vnode *dvp, struct vnode **vpp, struct nameidata *ndp
 
 	no_vp = (*vpp == NULLVP);
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_compound_rmdir_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	if (_err == 0 && *vpp) {
 		DTRACE_FSINFO(compound_rmdir, vnode_t, *vpp);
 	}
@@ -5067,7 +5108,9 @@ VNOP_SYMLINK(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp,
 	a.a_target = target;
 	a.a_context = ctx;
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_symlink_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 	DTRACE_FSINFO(symlink, vnode_t, dvp);
 #if CONFIG_APPLEDOUBLE
 	if (_err == 0 && !NATIVE_XATTR(dvp)) {
@@ -5717,7 +5760,9 @@ VNOP_CLONEFILE(vnode_t fvp, vnode_t dvp, vnode_t *vpp,
 		a.a_dir_clone_authorizer = NULL;
 	}
 
+	cache_dircomplete_mutation_begin(dvp);
 	_err = (*dvp->v_op[vnop_clonefile_desc.vdesc_offset])(&a);
+	cache_dircomplete_mutation_end(dvp);
 
 	if (_err == 0 && *vpp) {
 		DTRACE_FSINFO(clonefile, vnode_t, *vpp);
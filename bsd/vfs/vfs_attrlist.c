@@ -60,7 +60,7 @@
 #define ATTR_TIME_SIZE  -1
 
 static int readdirattr(vnode_t, struct fd_vn_data *, uio_t, struct attrlist *,
-    uint64_t, int *, int *, vfs_context_t ctx) __attribute__((noinline));
+    uint64_t, struct attrbulk_filter *, int *, int *, vfs_context_t ctx) __attribute__((noinline));
 
 static void
 vattr_get_alt_data(vnode_t, struct attrlist *, struct vnode_attr *, int, int,
@@ -75,6 +75,9 @@ static int getvolattrlist(vfs_context_t, vnode_t, struct attrlist *, user_addr_t
 static int get_direntry(vfs_context_t, vnode_t, struct fd_vn_data *, int *,
     struct direntry **) __attribute__((noinline));
 
+static int getattrlistbulk_internal(proc_t, int, user_addr_t, user_addr_t,
+    user_size_t, uint64_t, struct attrbulk_filter *, int32_t *);
+
 /*
  * Structure describing the state of an in-progress attrlist operation.
  */
@@ -3752,13 +3755,206 @@ out:
 #define MIN_BUF_SIZE_REQUIRED  (sizeof(uint32_t) + sizeof(attribute_set_t) +\
     sizeof(attrreference_t))
 
+/*
+ * Matches name against pattern, where '*' matches any run
+ * of characters and '?' any single character.
+ */
+static boolean_t
+attrbulk_name_match(const char *pattern, const char *name)
+{
+	const char *star = NULL;
+	const char *resume = NULL;
+
+	while (*name) {
+		if (*pattern == '*') {
+			star = pattern++;
+			resume = name;
+		} else if (*pattern == '?' || *pattern == *name) {
+			pattern++;
+			name++;
+		} else if (star) {
+			pattern = star + 1;
+			name = ++resume;
+		} else {
+			return FALSE;
+		}
+	}
+	while (*pattern == '*') {
+		pattern++;
+	}
+	return *pattern == '\0';
+}
+
+/*
+ * Evaluates the predicates of a getattrlistbulk_filter_np() filter that can
+ * be decided from the directory entry alone, so that readdirattr can skip
+ * an entry without looking it up.
+ */
+static boolean_t
+attrbulk_filter_direntry(struct attrbulk_filter *filter, const char *name,
+    uint8_t d_type)
+{
+	if ((filter->abf_flags & ATTRBULK_FILTER_NAME) &&
+	    !attrbulk_name_match(filter->abf_name, name)) {
+		return FALSE;
+	}
+	if ((filter->abf_flags & ATTRBULK_FILTER_OBJTYPE) && d_type != DT_UNKNOWN &&
+	    !(filter->abf_objtypes & ATTRBULK_OBJTYPE(IFTOVT(DTTOIF(d_type))))) {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Offset of the fixed size part of attribute attr (of the common or, if
+ * is_file, the file group) within a packed entry laid out for the
+ * attributes in layout.  Entries start with their length and
+ * ATTR_CMN_RETURNED_ATTRS, then ATTR_CMN_ERROR, then the other common
+ * attributes in bit order, followed by the directory attributes and then
+ * the file attributes.
+ */
+static size_t
+attrbulk_field_offset(attribute_set_t *layout, attrgroup_t attr, int is_file,
+    int is_64bit)
+{
+	ssize_t off = sizeof(uint32_t) + sizeof(attribute_set_t);
+	attrgroup_t cmn = layout->commonattr & ~(ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_ERROR);
+
+	if (layout->commonattr & ATTR_CMN_ERROR) {
+		off += sizeof(uint32_t);
+	}
+	if (is_file) {
+		(void)getattrlist_parsetab(getattrlist_common_tab, cmn, NULL, &off,
+		    NULL, is_64bit, sizeof(getattrlist_common_tab) / sizeof(getattrlist_common_tab[0]));
+		(void)getattrlist_parsetab(getattrlist_dir_tab, layout->dirattr, NULL, &off,
+		    NULL, is_64bit, sizeof(getattrlist_dir_tab) / sizeof(getattrlist_dir_tab[0]));
+		(void)getattrlist_parsetab(getattrlist_file_tab, layout->fileattr & (attr - 1),
+		    NULL, &off, NULL, is_64bit, sizeof(getattrlist_file_tab) / sizeof(getattrlist_file_tab[0]));
+	} else {
+		(void)getattrlist_parsetab(getattrlist_common_tab, cmn & (attr - 1), NULL, &off,
+		    NULL, is_64bit, sizeof(getattrlist_common_tab) / sizeof(getattrlist_common_tab[0]));
+	}
+	return (size_t)off;
+}
+
+/*
+ * Evaluates a getattrlistbulk_filter_np() filter against one packed entry
+ * of len bytes.  A predicate whose attribute wasn't returned fails; one
+ * whose attribute doesn't fit in what was packed is given the benefit of
+ * the doubt, and the entry returned for the caller to sort out.
+ */
+static boolean_t
+attrbulk_filter_entry(struct attrbulk_filter *filter, struct attrlist *alp,
+    uint64_t options, const char *entry, size_t len, int is_64bit)
+{
+	attribute_set_t returned, layout;
+	fsobj_type_t objtype;
+	size_t off;
+
+#define ATTRBULK_FITS(off, size)        ((off) + (size) <= len)
+
+	if (!ATTRBULK_FITS(sizeof(uint32_t), sizeof(attribute_set_t))) {
+		return TRUE;
+	}
+	bcopy(entry + sizeof(uint32_t), &returned, sizeof(returned));
+	if (returned.commonattr & ATTR_CMN_ERROR) {
+		return TRUE;
+	}
+	if (options & FSOPT_PACK_INVAL_ATTRS) {
+		bcopy(&alp->commonattr, &layout, sizeof(layout));
+	} else {
+		layout = returned;
+	}
+
+	if (filter->abf_flags & ATTRBULK_FILTER_NAME) {
+		attrreference_t ref;
+		const char *name;
+
+		off = attrbulk_field_offset(&layout, ATTR_CMN_NAME, 0, is_64bit);
+		if (!ATTRBULK_FITS(off, sizeof(ref))) {
+			return TRUE;
+		}
+		bcopy(entry + off, &ref, sizeof(ref));
+		name = entry + off + ref.attr_dataoffset;
+		if (ref.attr_length == 0 || !ATTRBULK_FITS(off + ref.attr_dataoffset, ref.attr_length) ||
+		    name[ref.attr_length - 1] != '\0') {
+			return TRUE;
+		}
+		if (!attrbulk_name_match(filter->abf_name, name)) {
+			return FALSE;
+		}
+	}
+
+	if (!(returned.commonattr & ATTR_CMN_OBJTYPE)) {
+		return FALSE;
+	}
+	off = attrbulk_field_offset(&layout, ATTR_CMN_OBJTYPE, 0, is_64bit);
+	if (!ATTRBULK_FITS(off, sizeof(objtype))) {
+		return TRUE;
+	}
+	bcopy(entry + off, &objtype, sizeof(objtype));
+	if ((filter->abf_flags & ATTRBULK_FILTER_OBJTYPE) &&
+	    (objtype >= 32 || !(filter->abf_objtypes & ATTRBULK_OBJTYPE(objtype)))) {
+		return FALSE;
+	}
+
+	if (filter->abf_flags & ATTRBULK_FILTER_MTIME) {
+		int64_t sec;
+
+		if (!(returned.commonattr & ATTR_CMN_MODTIME)) {
+			return FALSE;
+		}
+		off = attrbulk_field_offset(&layout, ATTR_CMN_MODTIME, 0, is_64bit);
+		if (is_64bit) {
+			struct user64_timespec ts;
+
+			if (!ATTRBULK_FITS(off, sizeof(ts))) {
+				return TRUE;
+			}
+			bcopy(entry + off, &ts, sizeof(ts));
+			sec = ts.tv_sec;
+		} else {
+			struct user32_timespec ts;
+
+			if (!ATTRBULK_FITS(off, sizeof(ts))) {
+				return TRUE;
+			}
+			bcopy(entry + off, &ts, sizeof(ts));
+			sec = ts.tv_sec;
+		}
+		if (sec < filter->abf_mtime_min) {
+			return FALSE;
+		}
+	}
+
+	if ((filter->abf_flags & ATTRBULK_FILTER_SIZE) && objtype == VREG) {
+		off_t size;
+
+		if (!(returned.fileattr & ATTR_FILE_DATALENGTH)) {
+			return FALSE;
+		}
+		off = attrbulk_field_offset(&layout, ATTR_FILE_DATALENGTH, 1, is_64bit);
+		if (!ATTRBULK_FITS(off, sizeof(size))) {
+			return TRUE;
+		}
+		bcopy(entry + off, &size, sizeof(size));
+		if ((uint64_t)size < filter->abf_size_min ||
+		    (uint64_t)size > filter->abf_size_max) {
+			return FALSE;
+		}
+	}
+#undef ATTRBULK_FITS
+
+	return TRUE;
+}
+
 /*
  * Read directory entries and get attributes filled in for each directory
  */
 static int
 readdirattr(vnode_t dvp, struct fd_vn_data *fvd, uio_t auio,
-    struct attrlist *alp, uint64_t options, int *count, int *eofflagp,
-    vfs_context_t ctx)
+    struct attrlist *alp, uint64_t options, struct attrbulk_filter *filter,
+    int *count, int *eofflagp, vfs_context_t ctx)
 {
 	caddr_t kern_attr_buf;
 	size_t kern_attr_buf_siz;
@@ -3832,6 +4028,12 @@ readdirattr(vnode_t dvp, struct fd_vn_data *fvd, uio_t auio,
 			name_buffer = CAST_USER_ADDR_T(&(dp->d_name));
 		}
 
+		if (filter && !attrbulk_filter_direntry(filter,
+		    CAST_DOWN_EXPLICIT(char *, name_buffer), dp->d_type)) {
+			direntry_done(fvd);
+			continue;
+		}
+
 		/*
 		 * We have an iocount on the directory already.
 		 *
@@ -3903,6 +4105,13 @@ readdirattr(vnode_t dvp, struct fd_vn_data *fvd, uio_t auio,
 			break;
 		}
 
+		if (filter && !attrbulk_filter_entry(filter, alp, options,
+		    kern_attr_buf, MIN(entlen, kern_attr_buf_siz),
+		    proc_is64bit(vfs_context_proc(ctx)))) {
+			direntry_done(fvd);
+			continue;
+		}
+
 		/*
 		 * Will the pad bytes fit as well  ? If they can't be, still use
 		 * this entry but this will be the last entry returned.
@@ -3973,6 +4182,81 @@ readdirattr(vnode_t dvp, struct fd_vn_data *fvd, uio_t auio,
 	return error;
 }
 
+/*
+ * Size of the buffer VNOP_GETATTRLISTBULK packs into when the entries
+ * it returns have to be filtered before they are copied out
+ */
+#define ATTRBULK_FILTER_BUFSIZE (64 * 1024)
+
+/*
+ * VNOP_GETATTRLISTBULK, copying out only the entries that satisfy filter.
+ * The filesystem packs entries into a kernel buffer, and the ones that
+ * match are moved to auio... this carries on until auio is full or the
+ * directory is exhausted, so that a sparse match doesn't cost the caller
+ * a system call per buffer of entries.
+ */
+static int
+getattrlistbulk_filtered(vnode_t dvp, struct attrlist *alp, struct vnode_attr *va,
+    char *va_name, uio_t auio, uint64_t options, int use_fork,
+    struct attrbulk_filter *filter, int *eofflagp, int *countp, vfs_context_t ctx)
+{
+	char uio_buf[UIO_SIZEOF(1)];
+	int is_64bit = proc_is64bit(vfs_context_proc(ctx));
+	size_t bufsize;
+	char *buf;
+	int error = 0;
+
+	*eofflagp = 0;
+	*countp = 0;
+
+	bufsize = MIN((size_t)uio_resid(auio), ATTRBULK_FILTER_BUFSIZE);
+	buf = kheap_alloc(KHEAP_TEMP, bufsize, Z_WAITOK);
+
+	while (*eofflagp == 0 && uio_resid(auio) > (user_ssize_t)MIN_BUF_SIZE_REQUIRED) {
+		struct attrlist al = *alp;
+		size_t size, used, entlen;
+		uio_t kuio;
+		int count = 0;
+
+		size = MIN(bufsize, (size_t)uio_resid(auio));
+		kuio = uio_createwithbuffer(1, uio_offset(auio), UIO_SYSSPACE, UIO_READ,
+		    &uio_buf[0], sizeof(uio_buf));
+		uio_addiov(kuio, CAST_USER_ADDR_T(buf), (user_size_t)size);
+
+		VATTR_INIT(va);
+		va->va_name = va_name;
+		(void)getattrlist_setupvattr_all(&al, va, VNON, NULL, is_64bit, use_fork);
+
+		error = VNOP_GETATTRLISTBULK(dvp, &al, va, kuio, NULL,
+		    options, eofflagp, &count, ctx);
+		if (error || count == 0) {
+			break;
+		}
+
+		used = size - (size_t)uio_resid(kuio);
+		for (size_t off = 0; count > 0 && off + sizeof(uint32_t) <= used; off += entlen, count--) {
+			entlen = *(uint32_t *)(buf + off);
+			if (entlen == 0 || off + entlen > used) {
+				break;
+			}
+			if (!attrbulk_filter_entry(filter, alp, options, buf + off, entlen, is_64bit)) {
+				continue;
+			}
+			error = uiomove(buf + off, (int)entlen, auio);
+			if (error) {
+				goto out;
+			}
+			(*countp)++;
+		}
+		/* resume where the filesystem left off, not where the copyout did */
+		uio_setoffset(auio, uio_offset(kuio));
+	}
+out:
+	kheap_free(KHEAP_TEMP, buf, bufsize);
+
+	return error;
+}
+
 /* common attributes that only require KAUTH_VNODE_LIST_DIRECTORY */
 #define LIST_DIR_ATTRS    (ATTR_CMN_NAME | ATTR_CMN_OBJTYPE |  \
 	                   ATTR_CMN_FILEID | ATTR_CMN_RETURNED_ATTRS |  \
@@ -3989,6 +4273,46 @@ readdirattr(vnode_t dvp, struct fd_vn_data *fvd, uio_t auio,
  */
 int
 getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
+{
+	return getattrlistbulk_internal(p, uap->dirfd, uap->alist,
+	    uap->attributeBuffer, uap->bufferSize, uap->options, NULL, retval);
+}
+
+/*
+ * int getattrlistbulk_filter_np(int dirfd, struct attrlist *alist,
+ *    void *attributeBuffer, size_t bufferSize, uint64_t options,
+ *    const struct attrbulk_filter *filter)
+ *
+ * getattrlistbulk, except that only the entries satisfying filter are
+ * returned.  The entries that don't are consumed all the same.
+ */
+int
+getattrlistbulk_filter_np(proc_t p, struct getattrlistbulk_filter_np_args *uap,
+    int32_t *retval)
+{
+	struct attrbulk_filter filter;
+	int error;
+
+	*retval = 0;
+
+	if ((error = copyin(uap->filter, &filter, sizeof(filter)))) {
+		return error;
+	}
+	if ((filter.abf_flags & ~ATTRBULK_FILTER_VALIDMASK) ||
+	    strnlen(filter.abf_name, sizeof(filter.abf_name)) == sizeof(filter.abf_name) ||
+	    filter.abf_size_min > filter.abf_size_max) {
+		return EINVAL;
+	}
+
+	return getattrlistbulk_internal(p, uap->dirfd, uap->alist,
+	    uap->attributeBuffer, uap->bufferSize, uap->options,
+	    filter.abf_flags ? &filter : NULL, retval);
+}
+
+static int
+getattrlistbulk_internal(proc_t p, int dirfd, user_addr_t alist,
+    user_addr_t attributeBuffer, user_size_t bufferSize, uint64_t uoptions,
+    struct attrbulk_filter *filter, int32_t *retval)
 {
 	struct attrlist al;
 	vnode_t dvp = NULLVP;
@@ -4007,7 +4331,7 @@ getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
 
 	*retval = 0;
 
-	error = fp_getfvp(p, uap->dirfd, &fp, &dvp);
+	error = fp_getfvp(p, dirfd, &fp, &dvp);
 	if (error) {
 		return error;
 	}
@@ -4033,7 +4357,7 @@ getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
 		goto out;
 	}
 
-	if (uap->options & FSOPT_LIST_SNAPSHOT) {
+	if (uoptions & FSOPT_LIST_SNAPSHOT) {
 		vnode_t snapdvp;
 
 		if (!vnode_isvroot(dvp)) {
@@ -4067,10 +4391,9 @@ getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
 	 * AUDIT_ARG(vnpath, dvp, ARG_VNODE1);
 	 */
 
-	options = uap->options | FSOPT_ATTR_CMN_EXTENDED;
+	options = uoptions | FSOPT_ATTR_CMN_EXTENDED;
 
-	if ((error = copyin(CAST_USER_ADDR_T(uap->alist), &al,
-	    sizeof(struct attrlist)))) {
+	if ((error = copyin(alist, &al, sizeof(struct attrlist)))) {
 		goto out;
 	}
 
@@ -4080,6 +4403,23 @@ getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
 		goto out;
 	}
 
+	/*
+	 * A filter is evaluated against the packed attributes, so it
+	 * needs those it tests to be there.  With FSOPT_PACK_INVAL_ATTRS,
+	 * whether the directory attributes of a file are packed ahead of
+	 * its file attributes is up to the file system, so the size of a
+	 * file can't be found when directory attributes are requested.
+	 */
+	if (filter &&
+	    (!(al.commonattr & ATTR_CMN_OBJTYPE) ||
+	    ((filter->abf_flags & ATTRBULK_FILTER_MTIME) && !(al.commonattr & ATTR_CMN_MODTIME)) ||
+	    ((filter->abf_flags & ATTRBULK_FILTER_SIZE) && !(al.fileattr & ATTR_FILE_DATALENGTH)) ||
+	    ((filter->abf_flags & ATTRBULK_FILTER_SIZE) && al.dirattr &&
+	    (uoptions & FSOPT_PACK_INVAL_ATTRS)))) {
+		error = EINVAL;
+		goto out;
+	}
+
 #if CONFIG_MACF
 	error = mac_vnode_check_readdir(ctx, dvp);
 	if (error != 0) {
@@ -4128,7 +4468,7 @@ getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
 
 	auio = uio_createwithbuffer(1, fvdata->fv_offset, segflg, UIO_READ,
 	    &uio_buf[0], sizeof(uio_buf));
-	uio_addiov(auio, uap->attributeBuffer, (user_size_t)uap->bufferSize);
+	uio_addiov(auio, attributeBuffer, bufferSize);
 
 	/*
 	 * For "expensive" operations in which the native VNOP implementations
@@ -4165,15 +4505,21 @@ getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
 			va->va_name = va_name;
 
 			(void)getattrlist_setupvattr_all(&al, va, VNON, NULL,
-			    IS_64BIT_PROCESS(p), (uap->options & FSOPT_ATTR_CMN_EXTENDED));
+			    IS_64BIT_PROCESS(p), (uoptions & FSOPT_ATTR_CMN_EXTENDED));
 
 			/*
 			 * Set UT_KERN_RAGE_VNODES to cause all vnodes created by the
 			 * filesystem to be rapidly aged.
 			 */
 			ut->uu_flag |= UT_KERN_RAGE_VNODES;
-			error = VNOP_GETATTRLISTBULK(dvp, &al, va, auio, NULL,
-			    options, &eofflag, &count, ctx);
+			if (filter) {
+				error = getattrlistbulk_filtered(dvp, &al, va, va_name,
+				    auio, options, (uoptions & FSOPT_ATTR_CMN_EXTENDED),
+				    filter, &eofflag, &count, ctx);
+			} else {
+				error = VNOP_GETATTRLISTBULK(dvp, &al, va, auio, NULL,
+				    options, &eofflag, &count, ctx);
+			}
 			ut->uu_flag &= ~UT_KERN_RAGE_VNODES;
 
 			zfree(ZV_NAMEI, va_name);
@@ -4197,7 +4543,7 @@ getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
 		count = 0;
 
 		ut->uu_flag |= UT_KERN_RAGE_VNODES;
-		error = readdirattr(dvp, fvdata, auio, &al, options,
+		error = readdirattr(dvp, fvdata, auio, &al, options, filter,
 		    &count, &eofflag, ctx);
 		ut->uu_flag &= ~UT_KERN_RAGE_VNODES;
 	}
@@ -4221,7 +4567,7 @@ out:
 		vnode_put(dvp);
 	}
 
-	file_drop(uap->dirfd);
+	file_drop(dirfd);
 
 	return error;
 }
@@ -108,9 +108,11 @@
 
 #include <libkern/OSAtomic.h>
 #include <libkern/OSDebug.h>
+#include <os/atomic_private.h>
 #include <sys/ubc_internal.h>
 
 #include <sys/sdt.h>
+#include <sys/mcache.h>
 
 int     bcleanbuf(buf_t bp, boolean_t discard);
 static int      brecover_data(buf_t bp);
@@ -171,9 +173,32 @@ static lck_grp_t        *buf_mtx_grp;
 static lck_attr_t       *buf_mtx_attr;
 static lck_grp_attr_t   *buf_mtx_grp_attr;
 static lck_mtx_t        *iobuffer_mtxp;
+/*
+ * buf_mtxp covers the hash chains, the free queues and the busy state
+ * (BL_BUSY / BL_WANTED) of every buffer together: a cache hit in
+ * buf_getblk() marks the buffer busy and pulls it off its free queue
+ * in one step, and buf_brelse() undoes both, so splitting it per hash
+ * chain would still leave both paths on a shared free-queue lock.
+ */
 static lck_mtx_t        *buf_mtxp;
 static lck_mtx_t        *buf_gc_callout;
 
+/*
+ * buf_biowait and buf_biodone only need an interlock between
+ * the check for B_DONE and the sleep... they take one of these,
+ * picked by the buffer's address, instead of buf_mtxp
+ */
+#define BUF_WAIT_LOCKS          64
+#define BUF_WAIT_MTX(bp)        \
+	(&buf_wait_locks[((uintptr_t)(bp) / sizeof(struct buf)) % BUF_WAIT_LOCKS].bwl_mtx)
+
+static struct buf_wait_lock {
+	lck_mtx_t       bwl_mtx;
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE))) buf_wait_locks[BUF_WAIT_LOCKS];
+
+/* incore() gives up on the lockless walk after this many buffers */
+#define INCORE_WALK_MAX         64
+
 static uint32_t buf_busycount;
 
 #define FS_BUFFER_CACHE_GC_CALLOUTS_MAX_SIZE 16
@@ -2142,6 +2167,10 @@ bufinit(void)
 		panic("couldn't create buf_gc_callout mutex");
 	}
 
+	for (i = 0; i < BUF_WAIT_LOCKS; i++) {
+		lck_mtx_init(&buf_wait_locks[i].bwl_mtx, buf_mtx_grp, buf_mtx_attr);
+	}
+
 	/*
 	 * allocate and initialize cluster specific global locks...
 	 */
@@ -2927,15 +2956,35 @@ finish_shadow_master:
  * a pointer to it, unless it's marked invalid.  If it's marked invalid,
  * we normally don't return the buffer, unless the caller explicitly
  * wants us to.
+ *
+ * The answer is only a hint for read-ahead, so the chain is first
+ * walked without buf_mtxp.  Buffer headers are never freed and the
+ * hash table never changes, so the walk only ever sees buffers and
+ * NULL, even if they move to another chain under it... a buffer
+ * missed that way gets looked up again, properly, by buf_getblk.
  */
 static boolean_t
 incore(vnode_t vp, daddr64_t blkno)
 {
 	boolean_t retval;
 	struct  bufhashhdr *dp;
+	buf_t   bp;
+	int     walked = 0;
 
 	dp = BUFHASH(vp, blkno);
 
+	for (bp = os_atomic_load(&dp->lh_first, dependency);
+	    bp != NULL && walked < INCORE_WALK_MAX;
+	    bp = os_atomic_load(&bp->b_hash.le_next, dependency), walked++) {
+		if (bp->b_lblkno == blkno && bp->b_vp == vp &&
+		    !ISSET(bp->b_flags, B_INVAL)) {
+			return TRUE;
+		}
+	}
+	if (bp == NULL) {
+		return FALSE;
+	}
+
 	lck_mtx_lock_spin(buf_mtxp);
 
 	if (incore_locked(vp, blkno, dp)) {
@@ -4057,15 +4106,17 @@ buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo)
 errno_t
 buf_biowait(buf_t bp)
 {
+	lck_mtx_t *wait_mtx = BUF_WAIT_MTX(bp);
+
 	while (!ISSET(bp->b_flags, B_DONE)) {
-		lck_mtx_lock_spin(buf_mtxp);
+		lck_mtx_lock_spin(wait_mtx);
 
 		if (!ISSET(bp->b_flags, B_DONE)) {
 			DTRACE_IO1(wait__start, buf_t, bp);
-			(void) msleep(bp, buf_mtxp, PDROP | (PRIBIO + 1), "buf_biowait", NULL);
+			(void) msleep(bp, wait_mtx, PDROP | (PRIBIO + 1), "buf_biowait", NULL);
 			DTRACE_IO1(wait__done, buf_t, bp);
 		} else {
-			lck_mtx_unlock(buf_mtxp);
+			lck_mtx_unlock(wait_mtx);
 		}
 	}
 	/* check for interruption of I/O (e.g. via NFS), then errors. */
@@ -4245,26 +4296,27 @@ buf_biodone(buf_t bp)
 
 		buf_brelse(bp);
 	} else {                                /* or just wakeup the buffer */
+		lck_mtx_t *wait_mtx = BUF_WAIT_MTX(bp);
+
 		/*
-		 * by taking the mutex, we serialize
+		 * by taking the buffer's wait mutex, we serialize
 		 * the buf owner calling buf_biowait so that we'll
 		 * only see him in one of 2 states...
 		 * state 1: B_DONE wasn't set and he's
 		 * blocked in msleep
 		 * state 2: he's blocked trying to take the
 		 * mutex before looking at B_DONE
-		 * BL_WANTED is cleared in case anyone else
-		 * is blocked waiting for the buffer... note
-		 * that we haven't cleared B_BUSY yet, so if
-		 * they do get to run, their going to re-set
-		 * BL_WANTED and go back to sleep
+		 * BL_WANTED is protected by buf_mtxp and is left
+		 * alone... anyone else blocked waiting for the
+		 * buffer is woken up along with the owner, and
+		 * since we haven't cleared B_BUSY yet, they'll
+		 * re-set BL_WANTED and go back to sleep
 		 */
-		lck_mtx_lock_spin(buf_mtxp);
+		lck_mtx_lock_spin(wait_mtx);
 
-		CLR(bp->b_lflags, BL_WANTED);
 		SET(bp->b_flags, B_DONE);               /* note that it's done */
 
-		lck_mtx_unlock(buf_mtxp);
+		lck_mtx_unlock(wait_mtx);
 
 		wakeup(bp);
 	}
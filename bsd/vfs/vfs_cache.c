@@ -79,9 +79,14 @@
 #include <sys/namei.h>
 #include <sys/errno.h>
 #include <kern/kalloc.h>
+#include <kern/lock_brw.h>
+#include <kern/thread_call.h>
 #include <sys/kauth.h>
 #include <sys/user.h>
 #include <sys/paths.h>
+#include <sys/dirent.h>
+#include <sys/sysctl.h>
+#include <os/hash.h>
 #include <os/overflow.h>
 
 #if CONFIG_MACF
@@ -133,6 +138,7 @@ struct  nchstats nchstats;              /* cache effectiveness statistics */
 #define NAME_CACHE_LOCK()               name_cache_lock()
 #define NAME_CACHE_UNLOCK()             name_cache_unlock()
 #define NAME_CACHE_LOCK_SHARED()        name_cache_lock()
+#define NAME_CACHE_WALK_LOCKLESS        0
 
 #else
 
@@ -140,6 +146,7 @@ struct  nchstats nchstats;              /* cache effectiveness statistics */
 #define NAME_CACHE_LOCK()               name_cache_lock()
 #define NAME_CACHE_UNLOCK()             name_cache_unlock()
 #define NAME_CACHE_LOCK_SHARED()        name_cache_lock_shared()
+#define NAME_CACHE_WALK_LOCKLESS        1
 
 #endif
 
@@ -161,15 +168,94 @@ lck_rw_t  * namecache_rw_lock;
 lck_rw_t  * strtable_rw_lock;
 lck_rw_t  * rootvnode_rw_lock;
 
+/*
+ * Walks of the name cache made without NAME_CACHE_LOCK (see
+ * cache_lookup_path()) hold namecache_walk_brw for reading, and compare
+ * namecache_seq before and after to tell whether the cache changed under
+ * them: it is odd while NAME_CACHE_LOCK is held exclusive.
+ *
+ * Entries, and the names they hold, that such a walk might still be
+ * looking at are only freed by namecache_reclaim() once
+ * namecache_walk_synchronize() has waited for the walks in progress.
+ */
+static lck_brw_t        namecache_walk_brw;
+static uint32_t         namecache_seq;
+
+#define NC_RECLAIM_BATCH        128
+
+static TAILQ_HEAD(, namecache) nc_reclaimhead;  /* deleted, waiting for walks */
+static uint32_t         nc_reclaim_count;
+static thread_call_t    nc_reclaim_call;
+
+/*
+ * Begin a walk of the name cache without NAME_CACHE_LOCK.
+ *
+ * Returns false when the walk must be made under the lock instead:
+ * the lock is held exclusive, or namecache_walk_synchronize() is waiting.
+ */
+static bool
+namecache_walk_begin(uint32_t *seqp)
+{
+	uint32_t seq;
+
+	if (!lck_brw_try_lock_shared(&namecache_walk_brw)) {
+		return false;
+	}
+	seq = os_atomic_load(&namecache_seq, acquire);
+	if (seq & 1) {
+		lck_brw_unlock_shared(&namecache_walk_brw);
+		return false;
+	}
+	*seqp = seq;
+	return true;
+}
+
+/*
+ * Whether nothing a walk begun with seq has read so far may have
+ * been modified under it.
+ */
+static inline bool
+namecache_walk_valid(uint32_t seq)
+{
+	os_atomic_thread_fence(acquire);
+	return os_atomic_load(&namecache_seq, relaxed) == seq;
+}
+
+/*
+ * End a walk begun with namecache_walk_begin().  If it returns false,
+ * what the walk found can't be trusted and it must be redone under
+ * NAME_CACHE_LOCK.
+ */
+static bool
+namecache_walk_end(uint32_t seq)
+{
+	bool valid = namecache_walk_valid(seq);
+
+	lck_brw_unlock_shared(&namecache_walk_brw);
+	return valid;
+}
+
+/*
+ * Wait for the walks of the name cache made without NAME_CACHE_LOCK
+ * which are in progress.  Must be called without NAME_CACHE_LOCK held.
+ */
+static void
+namecache_walk_synchronize(void)
+{
+	lck_brw_lock_exclusive(&namecache_walk_brw);
+	lck_brw_unlock_exclusive(&namecache_walk_brw);
+}
+
 #define NUM_STRCACHE_LOCKS 1024
 
 lck_mtx_t strcache_mtx_locks[NUM_STRCACHE_LOCKS];
 
 
 static vnode_t cache_lookup_locked(vnode_t dvp, struct componentname *cnp);
+static bool cache_lookup_lockless(vnode_t dvp, struct componentname *cnp, uint32_t seq, vnode_t *vpp);
 static const char *add_name_internal(const char *, uint32_t, u_int, boolean_t, u_int);
 static void init_string_table(void);
-static void cache_delete(struct namecache *, int);
+static void cache_delete(struct namecache *);
 static void cache_enter_locked(vnode_t dvp, vnode_t vp, struct componentname *cnp, const char *strname);
 static void cache_purge_locked(vnode_t vp, kauth_cred_t *credp);
 
@@ -1023,11 +1109,11 @@ vnode_update_identity(vnode_t vp, vnode_t dvp, const char *name, int name_len, u
 			}
 
 			while ((ncp = LIST_FIRST(&vp->v_nclinks))) {
-				cache_delete(ncp, 1);
+				cache_delete(ncp);
 			}
 
 			while ((ncp = TAILQ_FIRST(&vp->v_ncchildren))) {
-				cache_delete(ncp, 1);
+				cache_delete(ncp);
 			}
 
 			/*
@@ -1055,7 +1141,7 @@ vnode_update_identity(vnode_t vp, vnode_t dvp, const char *name, int name_len, u
 		}
 		if (flags & VNODE_UPDATE_CACHE) {
 			while ((ncp = LIST_FIRST(&vp->v_nclinks))) {
-				cache_delete(ncp, 1);
+				cache_delete(ncp);
 			}
 		}
 		NAME_CACHE_UNLOCK();
@@ -1538,6 +1624,14 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 	unsigned int    hash;
 	int             error = 0;
 	boolean_t       dotdotchecked = FALSE;
+	bool            lockless;
+	uint32_t        seq = 0;
+	vnode_t         start_dp = dp;
+	char            *start_nameptr = cnp->cn_nameptr;
+	char            *start_next = ndp->ni_next;
+	u_int           start_pathlen = ndp->ni_pathlen;
+	uint32_t        start_flags = cnp->cn_flags;
+	char            *nul = NULL;    /* where a '/' of the path was cleared */
 
 #if CONFIG_TRIGGERS
 	vnode_t         trigger_vp;
@@ -1546,8 +1640,17 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 	ucred = vfs_context_ucred(ctx);
 	ndp->ni_flag &= ~(NAMEI_TRAILINGSLASH);
 
-	NAME_CACHE_LOCK_SHARED();
+	/*
+	 * Walk the cache without NAME_CACHE_LOCK if we can: that walk
+	 * checks that nothing changed under it once it's done, and is
+	 * redone under the lock otherwise.
+	 */
+	lockless = NAME_CACHE_WALK_LOCKLESS && namecache_walk_begin(&seq);
+	if (!lockless) {
+		NAME_CACHE_LOCK_SHARED();
+	}
 
+walk:
 	if (dp->v_mount && (dp->v_mount->mnt_kern_flag & (MNTK_AUTH_OPAQUE | MNTK_AUTH_CACHE_TTL))) {
 		ttl_enabled = TRUE;
 		microuptime(&tv);
@@ -1593,6 +1696,7 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 
 			if (*cp == '\0') {
 				ndp->ni_flag |= NAMEI_TRAILINGSLASH;
+				nul = ndp->ni_next;
 				*ndp->ni_next = '\0';
 			}
 		}
@@ -1626,6 +1730,7 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 			}
 			cnp->cn_flags |= CN_WANTSRSRCFORK;
 			cnp->cn_flags |= ISLASTCN;
+			nul = ndp->ni_next;
 			ndp->ni_next[0] = '\0';
 			ndp->ni_pathlen = 1;
 		}
@@ -1644,7 +1749,11 @@ skiprsrcfork:
 		if (!(cnp->cn_flags & DONOTAUTH)) {
 			error = mac_vnode_check_lookup(ctx, dp, cnp);
 			if (error) {
-				NAME_CACHE_UNLOCK();
+				if (!lockless) {
+					NAME_CACHE_UNLOCK();
+				} else if (!namecache_walk_end(seq)) {
+					goto restart_locked;
+				}
 				goto errorout;
 			}
 		}
@@ -1762,6 +1871,12 @@ skiprsrcfork:
 				boolean_t defer = FALSE;
 				boolean_t is_subdir = FALSE;
 
+				if (lockless) {
+					/* v_parent chains must not change under this */
+					(void)namecache_walk_end(seq);
+					goto restart_locked;
+				}
+
 				defer = cache_check_vnode_issubdir(tvp,
 				    ndp->ni_rootdir, &is_subdir, &tvp);
 
@@ -1788,7 +1903,13 @@ skiprsrcfork:
 				vp = dp->v_parent;
 			}
 		} else {
-			if ((vp = cache_lookup_locked(dp, cnp)) == NULLVP) {
+			if (!lockless) {
+				vp = cache_lookup_locked(dp, cnp);
+			} else if (!cache_lookup_lockless(dp, cnp, seq, &vp)) {
+				/* namecache_walk_end() will fail */
+				break;
+			}
+			if (vp == NULLVP) {
 				break;
 			}
 
@@ -1847,7 +1968,32 @@ skiprsrcfork:
 	}
 	vid = dp->v_id;
 
-	NAME_CACHE_UNLOCK();
+	if (!lockless) {
+		NAME_CACHE_UNLOCK();
+	} else if (!namecache_walk_end(seq)) {
+restart_locked:
+		/*
+		 * The cache changed under the walk: undo what it did to
+		 * the path and the nameidata, and redo it under the lock.
+		 */
+		if (nul != NULL) {
+			*nul = '/';
+			nul = NULL;
+		}
+		dp = start_dp;
+		vp = NULLVP;
+		dotdotchecked = FALSE;
+		error = 0;
+		cnp->cn_nameptr = start_nameptr;
+		cnp->cn_flags = start_flags;
+		ndp->ni_next = start_next;
+		ndp->ni_pathlen = start_pathlen;
+		ndp->ni_flag &= ~(NAMEI_TRAILINGSLASH);
+
+		lockless = false;
+		NAME_CACHE_LOCK_SHARED();
+		goto walk;
+	}
 
 	if ((vp != NULLVP) && (vp->v_type != VLNK) &&
 	    ((cnp->cn_flags & (ISLASTCN | LOCKPARENT | WANTPARENT | SAVESTART)) == ISLASTCN)) {
@@ -1999,6 +2145,61 @@ cache_lookup_locked(vnode_t dvp, struct componentname *cnp)
 }
 
 
+/*
+ * cache_lookup_lockless
+ *
+ * Description:	cache_lookup_locked() for walks of the cache begun with
+ *		namecache_walk_begin(), without NAME_CACHE_LOCK.
+ *
+ * Returns:	true			*vpp holds the vnode found, or NULLVP
+ *		false			The cache changed under the walk,
+ *						which must be redone under the lock
+ *
+ * Notes:	Entries reached from the hash chains, and their names, are
+ *		not freed before the walk ends (see cache_delete()), but
+ *		they may be deleted or the table resized while they are
+ *		looked at: namecache_seq is checked before following each
+ *		link, so that the walk never loops on chains being rewired.
+ */
+static bool
+cache_lookup_lockless(vnode_t dvp, struct componentname *cnp, uint32_t seq, vnode_t *vpp)
+{
+	struct namecache *ncp;
+	struct nchashhead *tbl;
+	u_long mask;
+	long namelen = cnp->cn_namelen;
+	unsigned int hashval = cnp->cn_hash;
+
+	*vpp = NULLVP;
+	if (nc_disabled) {
+		return true;
+	}
+
+	tbl = os_atomic_load(&nchashtbl, relaxed);
+	mask = os_atomic_load(&nchashmask, relaxed);
+	if (!namecache_walk_valid(seq)) {
+		return false;
+	}
+
+	ncp = os_atomic_load(&tbl[(dvp->v_id ^ hashval) & mask].lh_first, dependency);
+	while (ncp != NULL) {
+		if ((ncp->nc_dvp == dvp) && (ncp->nc_hashval == hashval)) {
+			const char *name = ncp->nc_name;
+
+			if (strncmp(name, cnp->cn_nameptr, namelen) == 0 && name[namelen] == 0) {
+				*vpp = ncp->nc_vp;
+				break;
+			}
+		}
+		ncp = os_atomic_load(&ncp->nc_hash.le_next, dependency);
+		if (!namecache_walk_valid(seq)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
 unsigned int hash_string(const char *cp, int len);
 //
 // Have to take a len argument because we may only need to
@@ -2087,7 +2288,7 @@ relook:
 	if ((cnp->cn_flags & MAKEENTRY) == 0) {
 		if (have_exclusive == TRUE) {
 			NCHSTAT(ncs_badhits);
-			cache_delete(ncp, 1);
+			cache_delete(ncp);
 			NAME_CACHE_UNLOCK();
 			return 0;
 		}
@@ -2121,7 +2322,7 @@ relook:
 	if (cnp->cn_nameiop == CREATE || cnp->cn_nameiop == RENAME) {
 		if (have_exclusive == TRUE) {
 			NCHSTAT(ncs_badhits);
-			cache_delete(ncp, 1);
+			cache_delete(ncp);
 			NAME_CACHE_UNLOCK();
 			return 0;
 		}
@@ -2241,34 +2442,17 @@ cache_enter_locked(struct vnode *dvp, struct vnode *vp, struct componentname *cn
 		return;
 	}
 	/*
-	 * We allocate a new entry if we are less than the maximum
-	 * allowed and the one at the front of the list is in use.
-	 * Otherwise we use the one at the front of the list.
+	 * If we are at the maximum allowed, delete the entry at the
+	 * front of the list to make room.  It is not reused right away:
+	 * walks of the cache made without the lock may still be looking
+	 * at it.
 	 */
-	if (numcache < desiredNodes &&
-	    ((ncp = nchead.tqh_first) == NULL ||
-	    ncp->nc_hash.le_prev != 0)) {
-		/*
-		 * Allocate one more entry
-		 */
-		ncp = zalloc(namecache_zone);
-		numcache++;
-	} else {
-		/*
-		 * reuse an old entry
-		 */
-		ncp = TAILQ_FIRST(&nchead);
-		TAILQ_REMOVE(&nchead, ncp, nc_entry);
-
-		if (ncp->nc_hash.le_prev != 0) {
-			/*
-			 * still in use... we need to
-			 * delete it before re-using it
-			 */
-			NCHSTAT(ncs_stolen);
-			cache_delete(ncp, 0);
-		}
+	if (numcache >= desiredNodes && (ncp = TAILQ_FIRST(&nchead)) != NULL) {
+		NCHSTAT(ncs_stolen);
+		cache_delete(ncp);
 	}
+	ncp = zalloc(namecache_zone);
+	numcache++;
 	NCHSTAT(ncs_enters);
 
 	/*
@@ -2321,8 +2505,11 @@ cache_enter_locked(struct vnode *dvp, struct vnode *vp, struct componentname *cn
 	}
 #endif
 	/*
-	 * make us available to be found via lookup
+	 * make us available to be found via lookup, including by
+	 * walks made without the lock once the entry is complete
 	 */
+	ncp->nc_hash.le_next = LIST_FIRST(ncpp);
+	os_atomic_thread_fence(release);
 	LIST_INSERT_HEAD(ncpp, ncp, nc_hash);
 
 	if (vp) {
@@ -2347,7 +2534,7 @@ cache_enter_locked(struct vnode *dvp, struct vnode *vp, struct componentname *cn
 			 * the oldest
 			 */
 			negp = TAILQ_FIRST(&neghead);
-			cache_delete(negp, 1);
+			cache_delete(negp);
 		}
 	}
 	/*
@@ -2427,6 +2614,11 @@ nchinit(void)
 	/* Allocate name cache lock */
 	namecache_rw_lock = lck_rw_alloc_init(namecache_lck_grp, namecache_lck_attr);
 
+	lck_brw_init(&namecache_walk_brw, namecache_lck_grp, namecache_lck_attr);
+	TAILQ_INIT(&nc_reclaimhead);
+	nc_reclaim_call = thread_call_allocate_with_options(namecache_reclaim,
+	    NULL, THREAD_CALL_PRIORITY_KERNEL, THREAD_CALL_OPTIONS_ONCE);
+
 
 	/* Allocate string cache lock group attribute and group */
 	strcache_lck_grp_attr = lck_grp_attr_alloc_init();
@@ -2465,14 +2657,46 @@ void
 name_cache_lock(void)
 {
 	lck_rw_lock_exclusive(namecache_rw_lock);
+	os_atomic_inc(&namecache_seq, relaxed);
+	os_atomic_thread_fence(release);
 }
 
 void
 name_cache_unlock(void)
 {
+	/* only the exclusive holder can see namecache_seq odd */
+	if (os_atomic_load(&namecache_seq, relaxed) & 1) {
+		os_atomic_inc(&namecache_seq, release);
+	}
 	lck_rw_done(namecache_rw_lock);
 }
 
+/*
+ * Free the entries deleted from the cache, and release their names,
+ * once no walk can be looking at them anymore.
+ */
+static void
+namecache_reclaim(__unused thread_call_param_t p0, __unused thread_call_param_t p1)
+{
+	TAILQ_HEAD(, namecache) head = TAILQ_HEAD_INITIALIZER(head);
+	struct namecache *ncp;
+
+	NAME_CACHE_LOCK();
+	TAILQ_CONCAT(&head, &nc_reclaimhead, nc_entry);
+	nc_reclaim_count = 0;
+	NAME_CACHE_UNLOCK();
+
+	namecache_walk_synchronize();
+
+	while ((ncp = TAILQ_FIRST(&head))) {
+		TAILQ_REMOVE(&head, ncp, nc_entry);
+		if (ncp->nc_name) {
+			vfs_removename(ncp->nc_name);
+		}
+		zfree(namecache_zone, ncp);
+	}
+}
+
 
 int
 resize_namecache(int newsize)
@@ -2483,7 +2707,7 @@ resize_namecache(int newsize)
 	struct namecache    *entry, *next;
 	uint32_t            i, hashval;
 	int                 dNodes, dNegNodes, nelements;
-	u_long              new_size, old_size;
+	u_long              new_size, old_size, new_mask;
 
 	if (newsize < 0) {
 		return EINVAL;
@@ -2500,8 +2724,8 @@ resize_namecache(int newsize)
 		return EINVAL;
 	}
 
-	new_table = hashinit(nelements, M_CACHE, &nchashmask);
-	new_size  = nchashmask + 1;
+	new_table = hashinit(nelements, M_CACHE, &new_mask);
+	new_size  = new_mask + 1;
 
 	if (new_table == NULL) {
 		return ENOMEM;
@@ -2511,6 +2735,7 @@ resize_namecache(int newsize)
 	// do the switch!
 	old_table = nchashtbl;
 	nchashtbl = new_table;
+	nchashmask = new_mask;
 	old_size  = nchash;
 	nchash    = new_size;
 
@@ -2536,13 +2761,20 @@ resize_namecache(int newsize)
 	desiredNegNodes = dNegNodes;
 
 	NAME_CACHE_UNLOCK();
+
+	namecache_walk_synchronize();
 	FREE(old_table, M_CACHE);
 
 	return 0;
 }
 
+/*
+ * Remove an entry from the cache.  It is freed, and its name released,
+ * by namecache_reclaim() once walks of the cache made without the lock
+ * can no longer be looking at it.
+ */
 static void
-cache_delete(struct namecache *ncp, int free_entry)
+cache_delete(struct namecache *ncp)
 {
 	NCHSTAT(ncs_deletes);
 
@@ -2563,12 +2795,12 @@ cache_delete(struct namecache *ncp, int free_entry)
 	 */
 	ncp->nc_hash.le_prev = NULL;
 
-	vfs_removename(ncp->nc_name);
-	ncp->nc_name = NULL;
-	if (free_entry) {
-		TAILQ_REMOVE(&nchead, ncp, nc_entry);
-		zfree(namecache_zone, ncp);
-		numcache--;
+	TAILQ_REMOVE(&nchead, ncp, nc_entry);
+	numcache--;
+
+	TAILQ_INSERT_TAIL(&nc_reclaimhead, ncp, nc_entry);
+	if (++nc_reclaim_count == NC_RECLAIM_BATCH) {
+		thread_call_enter(nc_reclaim_call);
 	}
 }
 
@@ -2595,11 +2827,11 @@ cache_purge_locked(vnode_t vp, kauth_cred_t *credp)
 	}
 
 	while ((ncp = LIST_FIRST(&vp->v_nclinks))) {
-		cache_delete(ncp, 1);
+		cache_delete(ncp);
 	}
 
 	while ((ncp = TAILQ_FIRST(&vp->v_ncchildren))) {
-		cache_delete(ncp, 1);
+		cache_delete(ncp);
 	}
 
 	/*
@@ -2615,6 +2847,8 @@ cache_purge(vnode_t vp)
 {
 	kauth_cred_t tcred = NULL;
 
+	cache_dircomplete_invalidate(vp);
+
 	if ((LIST_FIRST(&vp->v_nclinks) == NULL) &&
 	    (TAILQ_FIRST(&vp->v_ncchildren) == NULL) &&
 	    (vp->v_cred == NOCRED) &&
@@ -2652,7 +2886,7 @@ cache_purge_negatives(vnode_t vp)
 			break;
 		}
 
-		cache_delete(ncp, 1);
+		cache_delete(ncp);
 	}
 
 	NAME_CACHE_UNLOCK();
@@ -2676,12 +2910,470 @@ cache_purgevfs(struct mount *mp)
 restart:
 		for (ncp = ncpp->lh_first; ncp != 0; ncp = ncp->nc_hash.le_next) {
 			if (ncp->nc_dvp->v_mount == mp) {
-				cache_delete(ncp, 0);
+				cache_delete(ncp);
 				goto restart;
 			}
 		}
 	}
 	NAME_CACHE_UNLOCK();
+
+	/*
+	 * The mount is about to go away: wait for the walks that might
+	 * have reached it through these entries or v_mountedhere.
+	 */
+	namecache_walk_synchronize();
+}
+
+
+/*
+ * Directory completeness.
+ *
+ * A miss in the name cache says nothing about whether the name exists,
+ * so every lookup of a name that isn't there goes to VNOP_LOOKUP, even in
+ * directories whose every entry was just listed.  Compilers searching
+ * include paths and dyld searching rpaths make many such lookups.
+ *
+ * While a directory is read with getdirentries64() from offset 0 to its
+ * end in consecutive calls, we record the names returned in a small Bloom
+ * filter, and once the end is reached without the directory having been
+ * modified, the directory is "complete": a lookup of a name that the
+ * filter doesn't contain is answered ENOENT without asking the file
+ * system.  A name the filter does contain, even by false positive, is
+ * looked up as usual.
+ *
+ * Every VNOP that adds, removes or renames an entry invalidates the
+ * directory before it is called, as does its vnode being purged, and
+ * bumps a generation count for the directory both before it is called
+ * and when it returns.  The count is kept in a small table indexed by a
+ * hash of the vnode's address, along with the number of such VNOPs in
+ * progress, so that it exists whether or not the directory is tracked.
+ * An enumeration isn't started while a VNOP is in progress, and one
+ * during which the generation changed or a VNOP started is thrown away,
+ * so a complete directory never misses a name created before it became
+ * complete, even if the file system showed it to readdir only after the
+ * VNOP that created it was called.  Directories sharing a slot of the
+ * table only make each other less likely to become complete.  Reads
+ * that don't follow on from the previous one are not recorded.
+ *
+ * Only directories of local file systems that don't have other names for
+ * an entry than the one readdir returns, other than in case, are eligible:
+ * names are compared folding ASCII case, and directories with names that
+ * aren't ASCII (subject to normalization) are not tracked.  The root of a
+ * volume isn't either, as it can hold entries that readdir hides, nor
+ * are dataless directories, whose entries aren't on the volume.
+ */
+#define DC_HASHSIZE             64
+#define DC_MUTATIONSIZE         256
+#define DC_BLOOM_BITS           (1 << 16)
+#define DC_MAX_NAMES            16384
+#define DC_MAX_BUFSIZE          (128 * 1024)
+
+struct dircomplete {
+	LIST_ENTRY(dircomplete) dc_hash;
+	TAILQ_ENTRY(dircomplete) dc_lru;
+	vnode_t         dc_dvp;
+	uint32_t        dc_vid;
+	uint32_t        dc_token;       /* identifies this enumeration */
+	uint32_t        dc_gen;         /* mutation generation when it began */
+	bool            dc_complete;
+	uint32_t        dc_count;       /* names seen so far */
+	off_t           dc_next;        /* offset the next read must start at */
+	uint8_t         dc_bloom[DC_BLOOM_BITS / NBBY];
+};
+
+static LCK_GRP_DECLARE(dircomplete_lck_grp, "namecache dircomplete");
+static LCK_MTX_DECLARE(dircomplete_mtx, &dircomplete_lck_grp);
+
+static LIST_HEAD(dircomplete_head, dircomplete) dircomplete_hashtbl[DC_HASHSIZE];
+static TAILQ_HEAD(dircomplete_lru_head, dircomplete) dircomplete_lru = TAILQ_HEAD_INITIALIZER(dircomplete_lru);
+static uint32_t dircomplete_entries;    /* in the table, so worth looking */
+static uint32_t dircomplete_token;
+
+static struct dircomplete_mutation {
+	uint32_t        dm_inflight;    /* mutating VNOPs in progress */
+	uint32_t        dm_gen;         /* bumped as each starts and ends */
+} dircomplete_mutations[DC_MUTATIONSIZE];
+
+static int dircomplete_enabled = 1;
+static int dircomplete_max = 128;       /* directories tracked at once */
+
+static uint64_t dircomplete_checks;     /* misses in complete directories */
+static uint64_t dircomplete_hits;       /* ... answered without the file system */
+static uint64_t dircomplete_dirs;       /* enumerations that completed */
+static uint64_t dircomplete_invalidations;
+
+SYSCTL_INT(_vfs, OID_AUTO, namecache_dircomplete, CTLFLAG_RW | CTLFLAG_LOCKED, &dircomplete_enabled, 0, "");
+SYSCTL_INT(_vfs, OID_AUTO, namecache_dircomplete_max, CTLFLAG_RW | CTLFLAG_LOCKED, &dircomplete_max, 0, "");
+SYSCTL_QUAD(_debug, OID_AUTO, namecache_dircomplete_checks, CTLFLAG_RD | CTLFLAG_LOCKED, &dircomplete_checks, "");
+SYSCTL_QUAD(_debug, OID_AUTO, namecache_dircomplete_hits, CTLFLAG_RD | CTLFLAG_LOCKED, &dircomplete_hits, "");
+SYSCTL_QUAD(_debug, OID_AUTO, namecache_dircomplete_dirs, CTLFLAG_RD | CTLFLAG_LOCKED, &dircomplete_dirs, "");
+SYSCTL_QUAD(_debug, OID_AUTO, namecache_dircomplete_invalidations, CTLFLAG_RD | CTLFLAG_LOCKED, &dircomplete_invalidations, "");
+
+/*
+ * Hashes a name folding ASCII case.  Returns false if the name
+ * isn't ASCII, in which case it might have other names.
+ */
+static bool
+dircomplete_hash(const char *name, size_t len, uint32_t *hashp)
+{
+	uint32_t hash = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)name[i];
+
+		if (c >= 0x80) {
+			return false;
+		}
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+		hash = crc32tab[((hash >> 24) ^ c)] ^ hash << 8;
+	}
+	*hashp = hash;
+	return true;
+}
+
+static inline bool
+dircomplete_bloom_test(struct dircomplete *dc, uint32_t hash)
+{
+	uint32_t b1 = hash & (DC_BLOOM_BITS - 1), b2 = hash >> 16;
+
+	return (dc->dc_bloom[b1 / NBBY] & (1 << (b1 % NBBY))) &&
+	       (dc->dc_bloom[b2 / NBBY] & (1 << (b2 % NBBY)));
+}
+
+static inline void
+dircomplete_bloom_set(struct dircomplete *dc, uint32_t hash)
+{
+	uint32_t b1 = hash & (DC_BLOOM_BITS - 1), b2 = hash >> 16;
+
+	dc->dc_bloom[b1 / NBBY] |= (uint8_t)(1 << (b1 % NBBY));
+	dc->dc_bloom[b2 / NBBY] |= (uint8_t)(1 << (b2 % NBBY));
+}
+
+static inline struct dircomplete_head *
+dircomplete_bucket(vnode_t dvp)
+{
+	return &dircomplete_hashtbl[os_hash_kernel_pointer(dvp) % DC_HASHSIZE];
+}
+
+static inline struct dircomplete_mutation *
+dircomplete_mutation(vnode_t dvp)
+{
+	return &dircomplete_mutations[os_hash_kernel_pointer(dvp) % DC_MUTATIONSIZE];
+}
+
+/*
+ * Returns true if no mutating VNOP is in progress in dvp, or in a
+ * directory sharing its slot, with the generation in *genp.
+ */
+static bool
+dircomplete_quiescent(vnode_t dvp, uint32_t *genp)
+{
+	struct dircomplete_mutation *dm = dircomplete_mutation(dvp);
+
+	*genp = os_atomic_load(&dm->dm_gen, acquire);
+	return os_atomic_load(&dm->dm_inflight, acquire) == 0;
+}
+
+/* must be called with dircomplete_mtx held */
+static struct dircomplete *
+dircomplete_find(vnode_t dvp)
+{
+	struct dircomplete *dc;
+
+	LIST_FOREACH(dc, dircomplete_bucket(dvp), dc_hash) {
+		if (dc->dc_dvp == dvp) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+/* must be called with dircomplete_mtx held; the caller frees the entry */
+static void
+dircomplete_remove(struct dircomplete *dc)
+{
+	LIST_REMOVE(dc, dc_hash);
+	TAILQ_REMOVE(&dircomplete_lru, dc, dc_lru);
+	dircomplete_entries--;
+}
+
+static bool
+dircomplete_eligible(vnode_t dvp)
+{
+	mount_t mp = dvp->v_mount;
+
+	if (!dircomplete_enabled || nc_disabled || mp == NULL ||
+	    dvp->v_type != VDIR || (dvp->v_flag & VROOT)) {
+		return false;
+	}
+	if ((mp->mnt_flag & (MNT_LOCAL | MNT_UNION)) != MNT_LOCAL) {
+		return false;
+	}
+	/* names must come back from readdir whole, as they were created */
+	if (!(mp->mnt_vtable->vfc_vfsflags & VFC_VFSREADDIR_EXTENDED) ||
+	    (mp->mnt_kern_flag & MNTK_DENY_READDIREXT)) {
+		return false;
+	}
+	if (strcmp(mp->mnt_vfsstat.f_fstypename, "apfs") != 0 &&
+	    strcmp(mp->mnt_vfsstat.f_fstypename, "hfs") != 0) {
+		return false;
+	}
+	/* readdir of a dataless directory needn't return what it will hold */
+	return !vnode_isdataless(dvp, vfs_context_current());
+}
+
+/*
+ * Called by getdirentries64() before reading bufsize bytes of dvp's
+ * entries at offset.  Returns true, with a token for
+ * cache_dircomplete_enum_end(), if the entries read should be recorded.
+ */
+bool
+cache_dircomplete_enum_begin(vnode_t dvp, off_t offset, size_t bufsize, uint32_t *tokenp)
+{
+	struct dircomplete *dc, *ndc = NULL, *stale = NULL, *victim = NULL;
+	bool record = false;
+	uint32_t gen;
+
+	if (bufsize > DC_MAX_BUFSIZE || !dircomplete_eligible(dvp)) {
+		return false;
+	}
+	if (!dircomplete_quiescent(dvp, &gen)) {
+		return false;
+	}
+	if (offset == 0) {
+		ndc = kheap_alloc(KHEAP_DEFAULT, sizeof(*ndc), Z_WAITOK | Z_ZERO);
+	}
+
+	lck_mtx_lock(&dircomplete_mtx);
+	dc = dircomplete_find(dvp);
+	if (dc && dc->dc_vid != dvp->v_id) {
+		/* left behind by a previous identity of the vnode */
+		dircomplete_remove(dc);
+		stale = dc;
+		dc = NULL;
+	}
+	if (offset == 0 && dc == NULL && ndc != NULL) {
+		if (dircomplete_entries >= (uint32_t)MAX(dircomplete_max, 1)) {
+			victim = TAILQ_LAST(&dircomplete_lru, dircomplete_lru_head);
+			dircomplete_remove(victim);
+		}
+		dc = ndc;
+		ndc = NULL;
+		dc->dc_dvp = dvp;
+		dc->dc_vid = dvp->v_id;
+		LIST_INSERT_HEAD(dircomplete_bucket(dvp), dc, dc_hash);
+		TAILQ_INSERT_HEAD(&dircomplete_lru, dc, dc_lru);
+		dircomplete_entries++;
+		dc->dc_token = ++dircomplete_token;
+		dc->dc_gen = gen;
+		record = true;
+	} else if (offset == 0 && dc && !dc->dc_complete) {
+		/* start over */
+		bzero(dc->dc_bloom, sizeof(dc->dc_bloom));
+		dc->dc_count = 0;
+		dc->dc_next = 0;
+		dc->dc_token = ++dircomplete_token;
+		dc->dc_gen = gen;
+		record = true;
+	} else if (dc && !dc->dc_complete && dc->dc_next == offset) {
+		record = true;
+	}
+	if (record) {
+		*tokenp = dc->dc_token;
+	}
+	lck_mtx_unlock(&dircomplete_mtx);
+
+	if (ndc) {
+		kheap_free(KHEAP_DEFAULT, ndc, sizeof(*ndc));
+	}
+	if (stale) {
+		kheap_free(KHEAP_DEFAULT, stale, sizeof(*stale));
+	}
+	if (victim) {
+		kheap_free(KHEAP_DEFAULT, victim, sizeof(*victim));
+	}
+	return record;
+}
+
+/*
+ * Called by getdirentries64() with the extended directory entries it read
+ * from offset up to next, in a kernel buffer, after a successful
+ * cache_dircomplete_enum_begin().
+ */
+void
+cache_dircomplete_enum_end(vnode_t dvp, uint32_t token, off_t offset, off_t next,
+    const void *buf, size_t len, int eofflag)
+{
+	const char *cp = buf, *end = cp + len;
+	struct dircomplete *dc, *victim = NULL;
+	uint32_t *hashes, nhashes = 0, gen;
+	size_t maxhashes;
+	bool ok = true;
+
+	/* the smallest direntry has a one byte name */
+	maxhashes = len / ((offsetof(struct direntry, d_name) + 2 + 7) & ~7) + 1;
+	hashes = kheap_alloc(KHEAP_TEMP, maxhashes * sizeof(uint32_t), Z_WAITOK);
+	if (hashes == NULL) {
+		ok = false;
+	}
+
+	while (ok && cp < end) {
+		const struct direntry *dep = (const struct direntry *)(const void *)cp;
+
+		if (cp + offsetof(struct direntry, d_name) > end ||
+		    dep->d_reclen == 0 || cp + dep->d_reclen > end ||
+		    offsetof(struct direntry, d_name) + dep->d_namlen > dep->d_reclen ||
+		    nhashes >= maxhashes) {
+			ok = false;
+			break;
+		}
+		cp += dep->d_reclen;
+
+		if (dep->d_type == DT_WHT ||
+		    (dep->d_namlen == 1 && dep->d_name[0] == '.') ||
+		    (dep->d_namlen == 2 && dep->d_name[0] == '.' && dep->d_name[1] == '.')) {
+			continue;
+		}
+		ok = dircomplete_hash(dep->d_name, dep->d_namlen, &hashes[nhashes++]);
+	}
+
+	lck_mtx_lock(&dircomplete_mtx);
+	dc = dircomplete_find(dvp);
+	if (dc && dc->dc_token == token && dc->dc_vid == dvp->v_id &&
+	    !dc->dc_complete && dc->dc_next == offset) {
+		/* an entry might have changed under the read */
+		if (!dircomplete_quiescent(dvp, &gen) || gen != dc->dc_gen) {
+			ok = false;
+		}
+		if (!ok || dc->dc_count + nhashes > DC_MAX_NAMES) {
+			dircomplete_remove(dc);
+			victim = dc;
+		} else {
+			for (uint32_t i = 0; i < nhashes; i++) {
+				dircomplete_bloom_set(dc, hashes[i]);
+			}
+			dc->dc_count += nhashes;
+			dc->dc_next = next;
+			if (eofflag) {
+				dc->dc_complete = true;
+				dircomplete_dirs++;
+			}
+		}
+	}
+	lck_mtx_unlock(&dircomplete_mtx);
+
+	if (hashes) {
+		kheap_free(KHEAP_TEMP, hashes, maxhashes * sizeof(uint32_t));
+	}
+	if (victim) {
+		kheap_free(KHEAP_DEFAULT, victim, sizeof(*victim));
+	}
+}
+
+/*
+ * Returns true if dvp is complete and doesn't have an entry named by cnp,
+ * so that a lookup of it can fail with ENOENT without calling VNOP_LOOKUP.
+ */
+bool
+cache_dircomplete_absent(vnode_t dvp, struct componentname *cnp)
+{
+	struct dircomplete *dc;
+	uint32_t hash;
+	bool absent = false;
+
+	if (os_atomic_load(&dircomplete_entries, relaxed) == 0 || !dircomplete_enabled) {
+		return false;
+	}
+	if (cnp->cn_namelen <= 0 || (cnp->cn_flags & ISDOTDOT) ||
+	    (cnp->cn_namelen == 1 && cnp->cn_nameptr[0] == '.') ||
+	    (cnp->cn_namelen == 2 && cnp->cn_nameptr[0] == '.' && cnp->cn_nameptr[1] == '.')) {
+		return false;
+	}
+	if (!dircomplete_hash(cnp->cn_nameptr, cnp->cn_namelen, &hash)) {
+		return false;
+	}
+
+	lck_mtx_lock(&dircomplete_mtx);
+	dc = dircomplete_find(dvp);
+	if (dc && dc->dc_complete && dc->dc_vid == dvp->v_id) {
+		dircomplete_checks++;
+		if (!dircomplete_bloom_test(dc, hash)) {
+			dircomplete_hits++;
+			absent = true;
+		}
+		if (dc != TAILQ_FIRST(&dircomplete_lru)) {
+			TAILQ_REMOVE(&dircomplete_lru, dc, dc_lru);
+			TAILQ_INSERT_HEAD(&dircomplete_lru, dc, dc_lru);
+		}
+	}
+	lck_mtx_unlock(&dircomplete_mtx);
+
+	return absent;
+}
+
+/*
+ * Called before a VNOP that might create, remove or rename an entry of
+ * dvp: forget that it is complete, and keep it from becoming so until
+ * the matching cache_dircomplete_mutation_end().
+ */
+void
+cache_dircomplete_mutation_begin(vnode_t dvp)
+{
+	struct dircomplete_mutation *dm;
+
+	if (dvp == NULLVP) {
+		return;
+	}
+	dm = dircomplete_mutation(dvp);
+	os_atomic_inc(&dm->dm_inflight, relaxed);
+	os_atomic_inc(&dm->dm_gen, seq_cst);
+
+	cache_dircomplete_invalidate(dvp);
+}
+
+/*
+ * Called when a VNOP that cache_dircomplete_mutation_begin() was called
+ * for returns, whether or not it succeeded.
+ */
+void
+cache_dircomplete_mutation_end(vnode_t dvp)
+{
+	struct dircomplete_mutation *dm;
+
+	if (dvp == NULLVP) {
+		return;
+	}
+	dm = dircomplete_mutation(dvp);
+	os_atomic_inc(&dm->dm_gen, relaxed);
+	os_atomic_dec(&dm->dm_inflight, release);
+}
+
+/*
+ * An entry of dvp was, or might have been, created, removed or renamed:
+ * forget that it is complete, and any enumeration of it in progress.
+ */
+void
+cache_dircomplete_invalidate(vnode_t dvp)
+{
+	struct dircomplete *dc;
+
+	if (dvp == NULLVP || os_atomic_load(&dircomplete_entries, relaxed) == 0) {
+		return;
+	}
+
+	lck_mtx_lock(&dircomplete_mtx);
+	dc = dircomplete_find(dvp);
+	if (dc) {
+		dircomplete_remove(dc);
+		dircomplete_invalidations++;
+	}
+	lck_mtx_unlock(&dircomplete_mtx);
+
+	if (dc) {
+		kheap_free(KHEAP_DEFAULT, dc, sizeof(*dc));
+	}
 }
 
 
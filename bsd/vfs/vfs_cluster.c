@@ -68,6 +68,7 @@
 #include <sys/vnode_internal.h>
 #include <sys/trace.h>
 #include <kern/kalloc.h>
+#include <kern/clock.h>
 #include <sys/time.h>
 #include <sys/kernel.h>
 #include <sys/resourcevar.h>
@@ -85,6 +86,8 @@
 #include <mach/upl.h>
 #include <kern/task.h>
 #include <kern/policy_internal.h>
+#include <kern/thread.h>
+#include <kern/sched_prim.h>
 
 #include <vm/vm_kern.h>
 #include <vm/vm_map.h>
@@ -93,6 +96,7 @@
 
 #include <sys/kdebug.h>
 #include <libkern/OSAtomic.h>
+#include <os/atomic_private.h>
 
 #include <sys/sdt.h>
 
@@ -162,7 +166,13 @@ static LCK_MTX_DECLARE(cl_transaction_mtxp, &cl_mtx_grp);
 static LCK_SPIN_DECLARE(cl_direct_read_spin_lock, &cl_mtx_grp);
 
 static ZONE_DECLARE(cl_rd_zone, "cluster_read",
-    sizeof(struct cl_readahead), ZC_ZFREE_CLEARMEM | ZC_NOENCRYPT);
+    sizeof(struct cl_readahead) * CL_RA_STREAMS, ZC_ZFREE_CLEARMEM | ZC_NOENCRYPT);
+
+/*
+ * furthest apart, in pages, the starts of two reads can be
+ * for the second one to be taken as the next of a strided stream
+ */
+#define CL_RA_MAX_STRIDE        256
 
 static ZONE_DECLARE(cl_wr_zone, "cluster_write",
     sizeof(struct cl_writebehind), ZC_ZFREE_CLEARMEM | ZC_NOENCRYPT);
@@ -176,6 +186,29 @@ static ZONE_DECLARE(cl_wr_zone, "cluster_write",
 #define PUSH_ALL        0x02
 #define PUSH_SYNC       0x04
 
+/*
+ * background write behind: once a sequential writer has filled a
+ * cluster and moved on to the next one, its vnode is queued for one
+ * of CL_WB_THREADS threads, which push the full clusters while the
+ * writer carries on copying... the writer only pushes for itself if
+ * the threads fall behind and all MAX_CLUSTERS fill up
+ *
+ * the threads stop issuing writes to a mount while more than
+ * mnt_ioqueue_depth maximal writes are already in flight to it
+ */
+#define CL_WB_THREADS           4
+#define CL_WB_THROTTLE_MSECS    10
+#define CL_WB_THROTTLE_MAX      100     /* give up waiting after a second */
+
+static TAILQ_HEAD(, cl_writebehind) cl_wb_queue = TAILQ_HEAD_INITIALIZER(cl_wb_queue);
+static LCK_MTX_DECLARE(cl_wb_mtx, &cl_mtx_grp);
+
+static uint64_t cl_wb_pushes;           /* clusters pushed by the write behind threads */
+static uint64_t cl_wb_throttled;        /* times they waited for writes in flight to drain */
+
+static void cluster_wb_queue_locked(struct cl_writebehind *wbp, vnode_t vp);
+static void cluster_wb_continue(void);
+
 
 static void cluster_EOT(buf_t cbp_head, buf_t cbp_tail, int zero_offset);
 static void cluster_wait_IO(buf_t cbp_head, int async);
@@ -216,6 +249,7 @@ static void cluster_update_state_internal(vnode_t vp, struct cl_extent *cl, int
 static int cluster_align_phys_io(vnode_t vp, struct uio *uio, addr64_t usr_paddr, u_int32_t xsize, int flags, int (*)(buf_t, void *), void *callback_arg);
 
 static int      cluster_read_prefetch(vnode_t vp, off_t f_offset, u_int size, off_t filesize, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
+static void     cluster_read_ahead_done(vnode_t vp, struct cl_extent *extent, struct cl_readahead *rap);
 static void     cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *ra,
     int (*callback)(buf_t, void *), void *callback_arg, int bflag);
 
@@ -310,14 +344,22 @@ uint32_t throttle_max_iosize = (128 * 1024);
 #define THROTTLE_MAX_IOSIZE (throttle_max_iosize)
 
 SYSCTL_INT(_debug, OID_AUTO, lowpri_throttle_max_iosize, CTLFLAG_RW | CTLFLAG_LOCKED, &throttle_max_iosize, 0, "");
+SYSCTL_QUAD(_debug, OID_AUTO, cluster_wb_pushes, CTLFLAG_RD | CTLFLAG_LOCKED, &cl_wb_pushes, "");
+SYSCTL_QUAD(_debug, OID_AUTO, cluster_wb_throttled, CTLFLAG_RD | CTLFLAG_LOCKED, &cl_wb_throttled, "");
 
 
 void
 cluster_init(void)
 {
+	thread_t thread = THREAD_NULL;
+
 	for (int i = 0; i < CL_DIRECT_READ_LOCK_BUCKETS; ++i) {
 		LIST_INIT(&cl_direct_read_locks[i]);
 	}
+	for (int i = 0; i < CL_WB_THREADS; i++) {
+		kernel_thread_start((thread_continue_t)cluster_wb_continue, NULL, &thread);
+		thread_deallocate(thread);
+	}
 }
 
 
@@ -373,51 +415,117 @@ cluster_max_io_size(mount_t mp, int type)
 #define CLW_IOPASSIVE   0x08
 
 /*
- * if the read ahead context doesn't yet exist,
- * allocate and initialize it...
+ * true if a read starting at b_addr looks like the next
+ * read of the stream rap is tracking... either right where
+ * the last one ended, or one stride further for a strided
+ * stream.  a stream that isn't reading ahead yet also takes
+ * reads a little further on, they may turn out to be strided
+ *
+ * this looks at the stream without its lock, it's only used
+ * to pick which stream a read belongs to
+ */
+static boolean_t
+cluster_ra_continues(struct cl_readahead *rap, daddr64_t b_addr)
+{
+	if (rap->cl_lastr == -1) {
+		return FALSE;
+	}
+	if (b_addr == rap->cl_lastr || b_addr == rap->cl_lastr + 1) {
+		return TRUE;
+	}
+	if (rap->cl_stride) {
+		return b_addr == rap->cl_firstr + rap->cl_stride;
+	}
+	return rap->cl_ralen == 0 && b_addr > rap->cl_lastr + 1 &&
+	       b_addr - rap->cl_firstr <= CL_RA_MAX_STRIDE;
+}
+
+/*
+ * if the read ahead streams don't yet exist,
+ * allocate and initialize them...
  * the vnode lock serializes multiple callers
  * during the actual assignment... first one
  * to grab the lock wins... the other callers
  * will release the now unnecessary storage
  *
- * once the context is present, try to grab (but don't block on)
- * the lock associated with it... if someone
- * else currently owns it, than the read
- * will run without read-ahead.  this allows
- * multiple readers to run in parallel and
- * since there's only 1 read ahead context,
- * there's no real loss in only allowing 1
- * reader to have read-ahead enabled.
+ * once the streams are present, find the one this
+ * read continues and try to grab (but don't block on)
+ * the lock associated with it... if someone else
+ * currently owns it, than the read will run without
+ * read-ahead, there's no real loss in only allowing
+ * 1 reader of a stream to have read-ahead enabled.
+ * a read that doesn't continue any stream starts a
+ * new one in place of the least recently used one,
+ * so that readers interleaving their reads of the
+ * same file each keep their own read-ahead going
  */
 static struct cl_readahead *
-cluster_get_rap(vnode_t vp)
+cluster_get_rap(vnode_t vp, daddr64_t b_addr)
 {
 	struct ubc_info         *ubc;
+	struct cl_readahead     *raps;
 	struct cl_readahead     *rap;
+	struct cl_readahead     *lru = NULL;
+	int                     i;
 
 	ubc = vp->v_ubcinfo;
 
-	if ((rap = ubc->cl_rahead) == NULL) {
-		rap = zalloc_flags(cl_rd_zone, Z_WAITOK | Z_ZERO);
-		rap->cl_lastr = -1;
-		lck_mtx_init(&rap->cl_lockr, &cl_mtx_grp, LCK_ATTR_NULL);
+	if ((raps = ubc->cl_rahead) == NULL) {
+		raps = zalloc_flags(cl_rd_zone, Z_WAITOK | Z_ZERO);
 
+		for (i = 0; i < CL_RA_STREAMS; i++) {
+			raps[i].cl_lastr = -1;
+			lck_mtx_init(&raps[i].cl_lockr, &cl_mtx_grp, LCK_ATTR_NULL);
+		}
 		vnode_lock(vp);
 
 		if (ubc->cl_rahead == NULL) {
-			ubc->cl_rahead = rap;
+			ubc->cl_rahead = raps;
 		} else {
-			lck_mtx_destroy(&rap->cl_lockr, &cl_mtx_grp);
-			zfree(cl_rd_zone, rap);
-			rap = ubc->cl_rahead;
+			for (i = 0; i < CL_RA_STREAMS; i++) {
+				lck_mtx_destroy(&raps[i].cl_lockr, &cl_mtx_grp);
+			}
+			zfree(cl_rd_zone, raps);
+			raps = ubc->cl_rahead;
 		}
 		vnode_unlock(vp);
 	}
-	if (lck_mtx_try_lock(&rap->cl_lockr) == TRUE) {
-		return rap;
+	for (i = 0; i < CL_RA_STREAMS; i++) {
+		rap = &raps[i];
+
+		if (cluster_ra_continues(rap, b_addr)) {
+			if (lck_mtx_try_lock(&rap->cl_lockr) == TRUE) {
+				return rap;
+			}
+			return (struct cl_readahead *)NULL;
+		}
 	}
+	for (i = 0; i < CL_RA_STREAMS; i++) {
+		rap = &raps[i];
 
-	return (struct cl_readahead *)NULL;
+		if (lck_mtx_try_lock(&rap->cl_lockr) == FALSE) {
+			continue;
+		}
+		if (lru == NULL || rap->cl_lastuse < lru->cl_lastuse) {
+			if (lru) {
+				lck_mtx_unlock(&lru->cl_lockr);
+			}
+			lru = rap;
+		} else {
+			lck_mtx_unlock(&rap->cl_lockr);
+		}
+	}
+	if (lru) {
+		lru->cl_lastr = -1;
+		lru->cl_maxra = 0;
+		lru->cl_ralen = 0;
+		lru->cl_stride = 0;
+
+		if (vp->v_mount) {
+			os_atomic_inc(&vp->v_mount->mnt_ra_streams, relaxed);
+		}
+	}
+	return lru;
 }
 
 
@@ -2025,6 +2133,60 @@ cluster_read_prefetch(vnode_t vp, off_t f_offset, u_int size, off_t filesize, in
 
 
 
+/*
+ * read ahead for a stream of reads of the same size, a fixed
+ * stride apart: prefetch the next records of the stream instead
+ * of the pages right after this read... cl_ralen counts records
+ * and ramps up the same way it does for sequential streams
+ */
+static void
+cluster_read_ahead_strided(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *rap, u_int max_prefetch,
+    int (*callback)(buf_t, void *), void *callback_arg, int bflag)
+{
+	daddr64_t       rec_len;
+	daddr64_t       r_addr;
+	daddr64_t       last_addr;
+	off_t           f_offset;
+	int             max_records;
+	int             pages = 0;
+
+	rec_len = (extent->e_addr + 1) - extent->b_addr;
+
+	if (rec_len >= rap->cl_stride) {
+		return;
+	}
+	if (rap->cl_ralen == 0 && vp->v_mount) {
+		os_atomic_inc(&vp->v_mount->mnt_ra_strided, relaxed);
+	}
+	max_records = (int)MAX(1, (max_prefetch / PAGE_SIZE) / rec_len);
+
+	rap->cl_ralen = rap->cl_ralen ? min(max_records, rap->cl_ralen << 1) : 1;
+
+	last_addr = extent->b_addr + rap->cl_ralen * rap->cl_stride;
+	r_addr = extent->b_addr + rap->cl_stride;
+
+	if (rap->cl_maxra >= r_addr) {
+		/*
+		 * skip the records the previous read ahead already covered
+		 */
+		r_addr += ((rap->cl_maxra - r_addr) / rap->cl_stride + 1) * rap->cl_stride;
+	}
+	for (; r_addr <= last_addr; r_addr += rap->cl_stride) {
+		f_offset = (off_t)(r_addr * PAGE_SIZE_64);
+
+		if (f_offset >= filesize) {
+			break;
+		}
+		pages += cluster_read_prefetch(vp, f_offset, (u_int)(rec_len * PAGE_SIZE), filesize, callback, callback_arg, bflag);
+
+		rap->cl_maxra = r_addr + rec_len - 1;
+	}
+	if (pages && vp->v_mount) {
+		os_atomic_add(&vp->v_mount->mnt_ra_pages, pages, relaxed);
+	}
+}
+
+
 static void
 cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *rap, int (*callback)(buf_t, void *), void *callback_arg,
     int bflag)
@@ -2033,6 +2195,7 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 	off_t           f_offset;
 	int             size_of_prefetch;
 	u_int           max_prefetch;
+	boolean_t       strided = FALSE;
 
 
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_START,
@@ -2044,13 +2207,36 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 		return;
 	}
 	if (rap->cl_lastr == -1 || (extent->b_addr != rap->cl_lastr && extent->b_addr != (rap->cl_lastr + 1))) {
-		rap->cl_ralen = 0;
-		rap->cl_maxra = 0;
+		daddr64_t stride = 0;
 
-		KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
-		    rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 1, 0);
+		/*
+		 * not sequential... if this read is as far from the
+		 * last one as that one was from the one before, the
+		 * stream is strided, otherwise remember the distance
+		 * to check the next read against
+		 */
+		if (rap->cl_lastr != -1 && extent->b_addr > rap->cl_lastr + 1) {
+			stride = extent->b_addr - rap->cl_firstr;
+		}
+		if (stride && stride == rap->cl_stride) {
+			strided = TRUE;
+		} else {
+			rap->cl_stride = (stride <= CL_RA_MAX_STRIDE) ? stride : 0;
+			rap->cl_ralen = 0;
+			rap->cl_maxra = 0;
 
-		return;
+			KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
+			    rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 1, 0);
+
+			return;
+		}
+	} else if (rap->cl_stride) {
+		/*
+		 * a strided stream that turned sequential
+		 */
+		rap->cl_stride = 0;
+		rap->cl_ralen = 0;
+		rap->cl_maxra = 0;
 	}
 	max_prefetch = MAX_PREFETCH(vp, cluster_max_io_size(vp->v_mount, CL_READ), disk_conditioner_mount_is_ssd(vp->v_mount));
 
@@ -2063,6 +2249,13 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 		    rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 6, 0);
 		return;
 	}
+	if (strided) {
+		cluster_read_ahead_strided(vp, extent, filesize, rap, max_prefetch, callback, callback_arg, bflag);
+
+		KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
+		    rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 5, 0);
+		return;
+	}
 	if (extent->e_addr < rap->cl_maxra && rap->cl_ralen >= 4) {
 		if ((rap->cl_maxra - extent->e_addr) > (rap->cl_ralen / 4)) {
 			KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
@@ -2100,6 +2293,10 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 
 		if (size_of_prefetch) {
 			rap->cl_maxra = (r_addr + size_of_prefetch) - 1;
+
+			if (vp->v_mount) {
+				os_atomic_add(&vp->v_mount->mnt_ra_pages, size_of_prefetch, relaxed);
+			}
 		}
 	}
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
@@ -2107,6 +2304,25 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 }
 
 
+/*
+ * a read of the stream rap is done: remember where it
+ * was for the next read to be checked against
+ */
+static void
+cluster_read_ahead_done(vnode_t vp, struct cl_extent *extent, struct cl_readahead *rap)
+{
+	if (rap->cl_ralen && vp->v_mount) {
+		os_atomic_inc(&vp->v_mount->mnt_ra_reads, relaxed);
+	}
+	if (extent->e_addr < rap->cl_lastr) {
+		rap->cl_maxra = 0;
+	}
+	rap->cl_firstr = extent->b_addr;
+	rap->cl_lastr = extent->e_addr;
+	rap->cl_lastuse = mach_absolute_time();
+}
+
+
 int
 cluster_pageout(vnode_t vp, upl_t upl, upl_offset_t upl_offset, off_t f_offset,
     int size, off_t filesize, int flags)
@@ -3365,12 +3581,226 @@ start_new_cluster:
 	}
 
 	wbp->cl_number++;
+
+	if (defer_writes == FALSE && vm_initiated == FALSE && !(flags & IO_NOCACHE) &&
+	    callback_arg == NULL && wbp->cl_number > 1 &&
+	    wbp->cl_seq_written >= (off_t)max_cluster_pgcount * PAGE_SIZE) {
+		/*
+		 * a sequential writer just moved on to a new cluster...
+		 * let the write behind threads push the ones behind it
+		 * through the pageout path, which doesn't involve the
+		 * writer's callback (writers that need an argument
+		 * for it keep pushing their clusters themselves)
+		 */
+		cluster_wb_queue_locked(wbp, vp);
+	}
 delay_io:
 	lck_mtx_unlock(&wbp->cl_lockw);
 	return;
 }
 
 
+/*
+ * queue vp for the write behind threads
+ * called with the write behind lock held
+ */
+static void
+cluster_wb_queue_locked(struct cl_writebehind *wbp, vnode_t vp)
+{
+	lck_mtx_lock(&cl_wb_mtx);
+
+	if (wbp->cl_wb_queued == 0) {
+		wbp->cl_wb_vp = vp;
+		wbp->cl_wb_vid = vnode_vid(vp);
+		wbp->cl_wb_queued = 1;
+
+		TAILQ_INSERT_TAIL(&cl_wb_queue, wbp, cl_wb_link);
+		wakeup_one((caddr_t)&cl_wb_queue);
+	}
+	lck_mtx_unlock(&cl_wb_mtx);
+}
+
+
+/*
+ * true if the writes already in flight to mp are
+ * enough to keep its device busy
+ */
+static boolean_t
+cluster_wb_saturated(mount_t mp)
+{
+	uint64_t budget;
+
+	budget = (uint64_t)mp->mnt_ioqueue_depth * cluster_max_io_size(mp, CL_WRITE);
+
+	return (uint64_t)mp->mnt_pending_write_size > budget;
+}
+
+
+/*
+ * push all but the newest of vp's clusters, the one its writer
+ * is still filling... the older clusters are taken out of wbp and
+ * go out in ascending file offset order through the pageout path,
+ * the same as those pushed on behalf of the VM, so the write behind
+ * lock is dropped while they are being written... the newest cluster
+ * stays in wbp for the writer to keep growing
+ */
+static void
+cluster_wb_push(vnode_t vp)
+{
+	struct cl_writebehind *wbp;
+	struct cl_wextent l_clusters[MAX_CLUSTERS];
+	struct cl_extent cl;
+	struct timespec ts;
+	int cl_len, cl_index, cl_index1;
+	int waits = 0, failed = 0;
+	off_t EOF;
+
+	if (!UBCINFOEXISTS(vp) || (wbp = cluster_get_wbp(vp, CLW_RETURNLOCKED)) == NULL) {
+		return;
+	}
+	while (wbp->cl_number > 1 && wbp->cl_scmap == NULL && wbp->cl_sparse_wait == 0 && !failed) {
+		if (waits < CL_WB_THROTTLE_MAX && cluster_wb_saturated(vp->v_mount)) {
+			os_atomic_inc(&cl_wb_throttled, relaxed);
+			waits++;
+
+			ts.tv_sec = 0;
+			ts.tv_nsec = CL_WB_THROTTLE_MSECS * NSEC_PER_MSEC;
+			msleep((caddr_t)&cl_wb_throttled, &wbp->cl_lockw, PRIBIO + 1, "cluster_wb", &ts);
+			continue;
+		}
+		/*
+		 * detach the completed clusters, sorting them by offset,
+		 * and leave the active one alone in the first slot
+		 */
+		cl_len = wbp->cl_number - 1;
+
+		for (cl_index = 0; cl_index < cl_len; cl_index++) {
+			for (cl_index1 = cl_index; cl_index1 > 0 &&
+			    l_clusters[cl_index1 - 1].b_addr > wbp->cl_clusters[cl_index].b_addr; cl_index1--) {
+				l_clusters[cl_index1] = l_clusters[cl_index1 - 1];
+			}
+			l_clusters[cl_index1] = wbp->cl_clusters[cl_index];
+		}
+		wbp->cl_clusters[0] = wbp->cl_clusters[cl_len];
+		wbp->cl_number = 1;
+
+		EOF = ubc_getsize(vp);
+		/*
+		 * counted as a push outside of the lock so that an
+		 * fsync waits for it before looking at the clusters
+		 */
+		wbp->cl_sparse_pushes++;
+		lck_mtx_unlock(&wbp->cl_lockw);
+
+		for (cl_index = 0; cl_index < cl_len; cl_index++) {
+			int flags = 0;
+
+			if (l_clusters[cl_index].io_flags & CLW_IONOCACHE) {
+				flags |= IO_NOCACHE;
+			}
+			if (l_clusters[cl_index].io_flags & CLW_IOPASSIVE) {
+				flags |= IO_PASSIVE;
+			}
+			cl.b_addr = l_clusters[cl_index].b_addr;
+			cl.e_addr = l_clusters[cl_index].e_addr;
+
+			if (cluster_push_now(vp, &cl, EOF, flags, NULL, NULL, TRUE) == 0) {
+				l_clusters[cl_index].b_addr = l_clusters[cl_index].e_addr;
+			} else {
+				failed = 1;
+			}
+		}
+
+		lck_mtx_lock(&wbp->cl_lockw);
+		wbp->cl_sparse_pushes--;
+
+		/*
+		 * the pages of a cluster that failed to go out are still
+		 * dirty and must stay tracked for cluster_push to find...
+		 * merge the leftovers back in if there's room for them,
+		 * and if not (or the writer has gone sparse meanwhile)
+		 * switch to the sparse cluster mechanism the way
+		 * cluster_try_push does... either way, don't retry them
+		 * until the next write queues this vnode again
+		 */
+		for (cl_index = 0, cl_index1 = 0; cl_index < cl_len; cl_index++) {
+			if (l_clusters[cl_index].b_addr == l_clusters[cl_index].e_addr) {
+				continue;
+			}
+			l_clusters[cl_index1++] = l_clusters[cl_index];
+		}
+		cl_len = cl_index1;
+
+		if (cl_len && wbp->cl_scmap == NULL && (MAX_CLUSTERS - wbp->cl_number) >= cl_len) {
+			for (cl_index = 0; cl_index < cl_len; cl_index++) {
+				wbp->cl_clusters[wbp->cl_number++] = l_clusters[cl_index];
+			}
+		} else if (cl_len) {
+			/*
+			 * collect the active public clusters, then the
+			 * leftovers put in their place
+			 */
+			sparse_cluster_switch(wbp, vp, EOF, NULL, NULL, TRUE);
+
+			for (cl_index = 0; cl_index < cl_len; cl_index++) {
+				wbp->cl_clusters[cl_index] = l_clusters[cl_index];
+			}
+			wbp->cl_number = cl_len;
+
+			sparse_cluster_switch(wbp, vp, EOF, NULL, NULL, TRUE);
+		}
+
+		if (wbp->cl_sparse_wait && wbp->cl_sparse_pushes == 0) {
+			wakeup((caddr_t)&wbp->cl_sparse_pushes);
+		}
+		os_atomic_inc(&cl_wb_pushes, relaxed);
+	}
+	lck_mtx_unlock(&wbp->cl_lockw);
+}
+
+
+__attribute__((noreturn))
+static void
+cluster_wb_continue(void)
+{
+	struct cl_writebehind *wbp;
+	uint32_t vid;
+	vnode_t  vp;
+
+	for (;;) {
+		lck_mtx_lock(&cl_wb_mtx);
+
+		if ((wbp = TAILQ_FIRST(&cl_wb_queue)) == NULL) {
+			assert_wait((event_t)&cl_wb_queue, (THREAD_UNINT));
+
+			lck_mtx_unlock(&cl_wb_mtx);
+
+			thread_block((thread_continue_t)cluster_wb_continue);
+
+			continue;
+		}
+		TAILQ_REMOVE(&cl_wb_queue, wbp, cl_wb_link);
+		wbp->cl_wb_queued = 0;
+
+		vp = wbp->cl_wb_vp;
+		vid = wbp->cl_wb_vid;
+
+		lck_mtx_unlock(&cl_wb_mtx);
+
+		/*
+		 * wbp may be gone as soon as the queue lock is dropped...
+		 * vnodes aren't freed, so the vid tells us whether vp
+		 * is still the vnode that was queued
+		 */
+		if (vnode_getwithvid(vp, vid) == 0) {
+			cluster_wb_push(vp);
+
+			vnode_put(vp);
+		}
+	}
+}
+
+
 static int
 cluster_write_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t oldEOF, off_t newEOF, off_t headOff,
     off_t tailOff, int flags, int (*callback)(buf_t, void *), void *callback_arg)
@@ -3985,11 +4415,11 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 
 			max_rd_size = THROTTLE_MAX_IOSIZE;
 		}
-		if ((rap = cluster_get_rap(vp)) == NULL) {
+		extent.b_addr = uio->uio_offset / PAGE_SIZE_64;
+		extent.e_addr = (last_request_offset - 1) / PAGE_SIZE_64;
+
+		if ((rap = cluster_get_rap(vp, extent.b_addr)) == NULL) {
 			rd_ahead_enabled = 0;
-		} else {
-			extent.b_addr = uio->uio_offset / PAGE_SIZE_64;
-			extent.e_addr = (last_request_offset - 1) / PAGE_SIZE_64;
 		}
 	}
 	if (rap != NULL && rap->cl_ralen && (rap->cl_lastr == extent.b_addr || (rap->cl_lastr + 1) == extent.b_addr)) {
@@ -4097,10 +4527,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 			}
 			if (io_size == 0) {
 				if (rap != NULL) {
-					if (extent.e_addr < rap->cl_lastr) {
-						rap->cl_maxra = 0;
-					}
-					rap->cl_lastr = extent.e_addr;
+					cluster_read_ahead_done(vp, &extent, rap);
 				}
 				break;
 			}
@@ -4266,9 +4693,17 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 					 * we've just issued a read for a block that should have been
 					 * in the cache courtesy of the read-ahead engine... something
 					 * has gone wrong with the pipeline, so reset the read-ahead
-					 * logic which will cause us to restart from scratch
+					 * logic which will cause us to restart from scratch...
+					 * if the pages were read ahead and got evicted before
+					 * they were used, a smaller window will waste less,
+					 * so take back the last doubling and then some
 					 */
 					rap->cl_maxra = 0;
+					rap->cl_ralen >>= 2;
+
+					if (vp->v_mount) {
+						os_atomic_inc(&vp->v_mount->mnt_ra_misses, relaxed);
+					}
 				}
 			}
 		}
@@ -4351,10 +4786,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 				}
 
 				if (rap != NULL) {
-					if (extent.e_addr < rap->cl_lastr) {
-						rap->cl_maxra = 0;
-					}
-					rap->cl_lastr = extent.e_addr;
+					cluster_read_ahead_done(vp, &extent, rap);
 				}
 			}
 			if (iolock_inited == TRUE) {
@@ -5803,6 +6235,14 @@ cluster_release(struct ubc_info *ubc)
 		if (wbp->cl_scmap) {
 			vfs_drt_control(&(wbp->cl_scmap), 0);
 		}
+		if (wbp->cl_wb_vp != NULLVP) {
+			lck_mtx_lock(&cl_wb_mtx);
+
+			if (wbp->cl_wb_queued) {
+				TAILQ_REMOVE(&cl_wb_queue, wbp, cl_wb_link);
+			}
+			lck_mtx_unlock(&cl_wb_mtx);
+		}
 		lck_mtx_destroy(&wbp->cl_lockw, &cl_mtx_grp);
 		zfree(cl_wr_zone, wbp);
 		ubc->cl_wbehind = NULL;
@@ -5811,7 +6251,9 @@ cluster_release(struct ubc_info *ubc)
 	}
 
 	if ((rap = ubc->cl_rahead)) {
-		lck_mtx_destroy(&rap->cl_lockr, &cl_mtx_grp);
+		for (int i = 0; i < CL_RA_STREAMS; i++) {
+			lck_mtx_destroy(&rap[i].cl_lockr, &cl_mtx_grp);
+		}
 		zfree(cl_rd_zone, rap);
 		ubc->cl_rahead  = NULL;
 	}
@@ -63,12 +63,14 @@
 
 #include <pexpert/pexpert.h>
 #include <libkern/section_keywords.h>
+#include <os/hash.h>
 
 typedef struct kfs_event {
 	LIST_ENTRY(kfs_event) kevent_list;
 	int16_t        type;       // type code of this event
 	u_int16_t      flags,      // per-event flags
 	    len;                   // the length of the path in "str"
+	int16_t        coalesce_slot; // kfse_coalesce[] slot that recorded this event, or -1
 	int32_t        refcount;   // number of clients referencing this
 	pid_t          pid;        // pid of the process that did the op
 
@@ -103,7 +105,7 @@ typedef struct fs_event_watcher {
 	dev_t       *devices_not_to_watch;// report events from devices not in this list
 	uint32_t     num_devices;
 	int32_t      flags;
-	kfs_event  **event_queue;
+	kfs_event  **event_queue;        // grows, see watcher_grow_queue()
 	int32_t      eventq_size;        // number of event pointers in queue
 	int32_t      num_readers;
 	int32_t      rd;                 // read index into the event_queue
@@ -130,6 +132,14 @@ static fs_event_watcher *watcher_table[MAX_WATCHERS];
 #define DEFAULT_MAX_KFS_EVENTS   4096
 static int max_kfs_events = DEFAULT_MAX_KFS_EVENTS;
 
+//
+// a watcher's event queue starts out at the depth it asked for
+// and doubles whenever it gets 3/4 full, up to this many entries.
+// defaults to max_kfs_events, past which it could never fill up.
+//
+static int max_kfs_eventq = 0;
+static int num_eventq_grows = 0;
+
 // we allocate kfs_event structures out of this zone
 static zone_t     event_zone;
 static int        fs_event_init = 0;
@@ -216,6 +226,11 @@ fsevents_internal_init(void)
 	lck_rw_init(&event_handling_lock, fsevent_rw_group, fsevent_lock_attr);
 
 	PE_get_default("kern.maxkfsevents", &max_kfs_events, sizeof(max_kfs_events));
+	max_kfs_eventq = max_kfs_events;
+	PE_get_default("kern.maxkfseventq", &max_kfs_eventq, sizeof(max_kfs_eventq));
+	if (max_kfs_eventq < 1 || max_kfs_eventq > max_kfs_events) {
+		max_kfs_eventq = max_kfs_events;
+	}
 
 	event_zone = zone_create_ext("fs-event-buf", sizeof(kfs_event),
 	    ZC_NOGC | ZC_NOCALLOUT, ZONE_ID_ANY, ^(zone_t z) {
@@ -349,6 +364,76 @@ static pid_t last_pid = -1;
 int            last_coalesced = 0;
 static mach_timebase_info_data_t    sTimebaseInfo = { 0, 0 };
 
+//
+// Events on a vnode are also coalesced against a table of the last
+// event on each of the recent ones, hashed by vnode, so that a storm
+// of changes to many files (a checkout, a package install) still
+// collapses the repeats for each file rather than only back-to-back
+// duplicates.  A slot only coalesces while the event it recorded
+// is queued: once that event has been read (or released), the
+// next change to the file has to be reported again.  Any other
+// event on the vnode replaces it, and renames, exchanges, clones
+// and deletes (which name files by path) bump a generation that
+// the slots are only good for, so that a change after any of those
+// is reported again.
+//
+#define KFSE_COALESCE_SLOTS  256
+
+static struct kfse_coalesce {
+	kfs_event *kfse;
+	void      *vp;
+	uint64_t   abstime;
+	uint32_t   vid;
+	uint32_t   gen;
+	pid_t      pid;
+	int16_t    type;
+} kfse_coalesce[KFSE_COALESCE_SLOTS];
+static uint64_t kfse_coalesce_window = 0;
+static uint32_t kfse_coalesce_gen = 0;
+
+SYSCTL_INT(_debug, OID_AUTO, fsevents_coalesced, CTLFLAG_RD | CTLFLAG_LOCKED, &last_coalesced, 0, "");
+SYSCTL_INT(_debug, OID_AUTO, fsevents_eventq_grows, CTLFLAG_RD | CTLFLAG_LOCKED, &num_eventq_grows, 0, "");
+
+static int
+sysctl_maxkfseventq(__unused struct sysctl_oid *oidp,
+    __unused void *arg1, __unused int arg2, struct sysctl_req *req)
+{
+	int new_value, changed = 0;
+	int error;
+
+	error = sysctl_io_number(req, max_kfs_eventq, sizeof(int), &new_value,
+	    &changed);
+	if (error == 0 && changed) {
+		if (new_value < 1 || new_value > max_kfs_events) {
+			return EINVAL;
+		}
+		max_kfs_eventq = new_value;
+	}
+	return error;
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, maxkfseventq, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+    0, 0, sysctl_maxkfseventq, "I", "");
+
+static int16_t
+kfse_coalesce_slot(void *vp)
+{
+	return (int16_t)(os_hash_kernel_pointer(vp) % KFSE_COALESCE_SLOTS);
+}
+
+//
+// NOTE: called with the fs event list locked, except from
+//       fmod_watch() which (like last_event_ptr) tolerates
+//       racing with add_fsevent()
+//
+static void
+kfse_coalesce_forget(kfs_event *kfse)
+{
+	if (kfse->coalesce_slot >= 0 && kfse_coalesce[kfse->coalesce_slot].kfse == kfse) {
+		kfse_coalesce[kfse->coalesce_slot].kfse = NULL;
+	}
+}
+
 
 int
 add_fsevent(int type, vfs_context_t ctx, ...)
@@ -363,6 +448,8 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 	uint64_t          now, elapsed;
 	char             *pathbuff = NULL;
 	int               pathbuff_len;
+	struct kfse_coalesce *kc = NULL;
+	int16_t           slot = -1;
 
 
 
@@ -387,6 +474,10 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 	//       the lock is dropped.
 	lock_fs_event_list();
 
+	if (type == FSE_DELETE || type == FSE_RENAME || type == FSE_EXCHANGE || type == FSE_CLONE) {
+		kfse_coalesce_gen++;
+	}
+
 	//
 	// check if this event is identical to the previous one...
 	// (as long as it's not an event type that can never be the
@@ -401,7 +492,6 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 			case FSE_ARG_VNODE: {
 				ptr = va_arg(ap, void *);
 				vid = vnode_vid((struct vnode *)ptr);
-				last_str[0] = '\0';
 				break;
 			}
 			case FSE_ARG_STRING: {
@@ -416,6 +506,47 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 			}
 		}
 
+		if (ptr != NULL && !was_str) {
+			if (kfse_coalesce_window == 0) {
+				nanoseconds_to_absolutetime(NSEC_PER_SEC, &kfse_coalesce_window);
+			}
+
+			slot = kfse_coalesce_slot(ptr);
+			kc = &kfse_coalesce[slot];
+			if (kc->kfse != NULL
+			    && kc->vp == ptr
+			    && kc->vid == (uint32_t)vid
+			    && kc->gen == kfse_coalesce_gen
+			    && kc->type == type
+			    && kc->pid == p->p_pid
+			    && (now - kc->abstime) < kfse_coalesce_window) {
+				last_coalesced++;
+				unlock_fs_event_list();
+				va_end(ap);
+
+				return 0;
+			}
+
+			// the event is recorded in the slot once it's allocated
+			kc->kfse    = NULL;
+			kc->vp      = ptr;
+			kc->vid     = (uint32_t)vid;
+			kc->gen     = kfse_coalesce_gen;
+			kc->type    = (int16_t)type;
+			kc->pid     = p->p_pid;
+			kc->abstime = now;
+
+			// and this is the previous event for path events
+			last_ptr = ptr;
+			last_str[0] = '\0';
+			last_nlen = nlen;
+			last_vid = vid;
+			last_event_type = type;
+			last_coalesced_time = now;
+			last_pid = p->p_pid;
+			goto coalesce_done;
+		}
+
 		if (sTimebaseInfo.denom == 0) {
 			(void) clock_timebase_info(&sTimebaseInfo);
 		}
@@ -435,10 +566,7 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 		if (type == last_event_type
 		    && (elapsed < 1000000000)
 		    && (last_pid == p->p_pid)
-		    &&
-		    ((vid && vid == last_vid && last_ptr == ptr)
-		    ||
-		    (last_str[0] && last_nlen == nlen && ptr && strcmp(last_str, ptr) == 0))
+		    && (last_str[0] && last_nlen == nlen && ptr && strcmp(last_str, ptr) == 0)
 		    ) {
 			last_coalesced++;
 			unlock_fs_event_list();
@@ -449,6 +577,8 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 			last_ptr = ptr;
 			if (was_str) {
 				strlcpy(last_str, ptr, sizeof(last_str));
+			} else {
+				last_str[0] = '\0';
 			}
 			last_nlen = nlen;
 			last_vid = vid;
@@ -457,6 +587,7 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 			last_pid = p->p_pid;
 		}
 	}
+coalesce_done:
 	va_start(ap, ctx);
 
 
@@ -533,13 +664,20 @@ add_fsevent(int type, vfs_context_t ctx, ...)
 	kfse->refcount = 1;
 	OSBitOrAtomic16(KFSE_BEING_CREATED, &kfse->flags);
 
-	last_event_ptr = kfse;
+	if (kc != NULL) {
+		kc->kfse = kfse;
+		kfse->coalesce_slot = slot;
+	} else {
+		last_event_ptr = kfse;
+		kfse->coalesce_slot = -1;
+	}
 	kfse->type     = (int16_t)type;
 	kfse->abstime  = now;
 	kfse->pid      = p->p_pid;
 	if (type == FSE_RENAME || type == FSE_EXCHANGE || type == FSE_CLONE) {
 		memset(kfse_dest, 0, sizeof(kfs_event));
 		kfse_dest->refcount = 1;
+		kfse_dest->coalesce_slot = -1;
 		OSBitOrAtomic16(KFSE_BEING_CREATED, &kfse_dest->flags);
 		kfse_dest->type     = (int16_t)type;
 		kfse_dest->pid      = p->p_pid;
@@ -844,6 +982,7 @@ release_event_ref(kfs_event *kfse)
 		last_event_type = -1;
 		last_coalesced_time = 0;
 	}
+	kfse_coalesce_forget(kfse);
 
 	if (kfse->refcount < 0) {
 		panic("release_event_ref: bogus kfse refcount %d\n", kfse->refcount);
@@ -949,20 +1088,24 @@ add_watcher(int8_t *event_list, int32_t num_events, int32_t eventq_size, fs_even
 		eventq_size = max_kfs_events;
 	}
 
-	// Note: the event_queue follows the fs_event_watcher struct
-	//       in memory so we only have to do one allocation
-	watcher = kheap_alloc(KHEAP_DEFAULT,
-	    sizeof(fs_event_watcher) + eventq_size * sizeof(kfs_event *), Z_WAITOK);
+	// Note: the event_queue is allocated separately from the
+	//       fs_event_watcher struct so that it can grow
+	watcher = kheap_alloc(KHEAP_DEFAULT, sizeof(fs_event_watcher), Z_WAITOK);
 	if (watcher == NULL) {
 		return ENOMEM;
 	}
+	watcher->event_queue = kheap_alloc(KHEAP_DEFAULT,
+	    eventq_size * sizeof(kfs_event *), Z_WAITOK);
+	if (watcher->event_queue == NULL) {
+		kheap_free(KHEAP_DEFAULT, watcher, sizeof(fs_event_watcher));
+		return ENOMEM;
+	}
 
 	watcher->event_list   = event_list;
 	watcher->num_events   = num_events;
 	watcher->devices_not_to_watch = NULL;
 	watcher->num_devices  = 0;
 	watcher->flags        = 0;
-	watcher->event_queue  = (kfs_event **)&watcher[1];
 	watcher->eventq_size  = eventq_size;
 	watcher->rd           = 0;
 	watcher->wr           = 0;
@@ -999,8 +1142,9 @@ add_watcher(int8_t *event_list, int32_t num_events, int32_t eventq_size, fs_even
 	if (i >= MAX_WATCHERS) {
 		printf("fsevents: too many watchers!\n");
 		unlock_watch_table();
-		kheap_free(KHEAP_DEFAULT, watcher,
-		    sizeof(fs_event_watcher) + watcher->eventq_size * sizeof(kfs_event *));
+		kheap_free(KHEAP_DEFAULT, watcher->event_queue,
+		    watcher->eventq_size * sizeof(kfs_event *));
+		kheap_free(KHEAP_DEFAULT, watcher, sizeof(fs_event_watcher));
 		return ENOSPC;
 	}
 
@@ -1085,8 +1229,9 @@ remove_watcher(fs_event_watcher *target)
 		    watcher->num_events * sizeof(int8_t));
 		kheap_free(KHEAP_DEFAULT, watcher->devices_not_to_watch,
 		    watcher->num_devices * sizeof(dev_t));
-		kheap_free(KHEAP_DEFAULT, watcher,
-		    sizeof(fs_event_watcher) + watcher->eventq_size * sizeof(kfs_event *));
+		kheap_free(KHEAP_DEFAULT, watcher->event_queue,
+		    watcher->eventq_size * sizeof(kfs_event *));
+		kheap_free(KHEAP_DEFAULT, watcher, sizeof(fs_event_watcher));
 		return;
 	}
 
@@ -1140,6 +1285,58 @@ schedule_event_wakeup(void)
 
 #define MAX_NUM_PENDING  16
 
+//
+// Double the size of a watcher's event queue (up to max_kfs_eventq)
+// so that a burst of events doesn't overrun a reader that is merely
+// slow.  The watch table lock keeps other writers out and the event
+// handling lock keeps the reader out while the entries move; if the
+// reader holds it we don't wait (it's draining the queue anyway and
+// may itself be waiting for the watch table lock).
+//
+// NOTE: the watch table must be locked before calling
+//       this routine.
+//
+static int
+watcher_grow_queue(fs_event_watcher *watcher)
+{
+	kfs_event **queue, **old_queue;
+	int32_t     size, old_size, n = 0;
+
+	old_size = watcher->eventq_size;
+	if (old_size >= max_kfs_eventq) {
+		return ENOSPC;
+	}
+	size = (old_size > max_kfs_eventq / 2) ? max_kfs_eventq : old_size * 2;
+
+	queue = kheap_alloc(KHEAP_DEFAULT, size * sizeof(kfs_event *), Z_NOWAIT | Z_ZERO);
+	if (queue == NULL) {
+		return ENOMEM;
+	}
+
+	if (!lck_rw_try_lock_exclusive(&event_handling_lock)) {
+		kheap_free(KHEAP_DEFAULT, queue, size * sizeof(kfs_event *));
+		return EBUSY;
+	}
+
+	old_queue = watcher->event_queue;
+	while (watcher->rd != watcher->wr) {
+		queue[n++] = old_queue[watcher->rd];
+		watcher->rd = (watcher->rd + 1) % old_size;
+	}
+	watcher->event_queue = queue;
+	watcher->eventq_size = size;
+	watcher->rd          = 0;
+	watcher->wr          = n;
+	OSSynchronizeIO();
+
+	lck_rw_unlock_exclusive(&event_handling_lock);
+
+	kheap_free(KHEAP_DEFAULT, old_queue, old_size * sizeof(kfs_event *));
+	num_eventq_grows++;
+
+	return 0;
+}
+
 //
 // NOTE: the watch table must be locked before calling
 //       this routine.
@@ -1147,6 +1344,8 @@ schedule_event_wakeup(void)
 static int
 watcher_add_event(fs_event_watcher *watcher, kfs_event *kfse)
 {
+	int error = 0;
+
 	if (kfse->abstime > watcher->max_event_id) {
 		watcher->max_event_id = kfse->abstime;
 	}
@@ -1177,8 +1376,12 @@ watcher_add_event(fs_event_watcher *watcher, kfs_event *kfse)
 		num_pending = watcher->wr + watcher->eventq_size - watcher->rd;
 	}
 
-	if (num_pending > (watcher->eventq_size * 3 / 4) && !(watcher->flags & WATCHER_APPLE_SYSTEM_SERVICE)) {
-		/* Non-Apple Service is falling behind, start dropping events for this process */
+	if (num_pending > (watcher->eventq_size * 3 / 4)) {
+		error = watcher_grow_queue(watcher);
+	}
+
+	if (error != 0 && error != EBUSY && !(watcher->flags & WATCHER_APPLE_SYSTEM_SERVICE)) {
+		/* Non-Apple Service is falling behind and its queue is as big as it gets, start dropping events for this process */
 		lck_rw_lock_exclusive(&event_handling_lock);
 		while (watcher->rd != watcher->wr) {
 			kfse = watcher->event_queue[watcher->rd];
@@ -1579,6 +1782,7 @@ restart_watch:
 						last_event_type = -1;
 						last_coalesced_time = 0;
 					}
+					kfse_coalesce_forget(kfse);
 					error = copy_out_kfse(watcher, kfse, uio);
 					if (error != 0) {
 						// if an event won't fit or encountered an error while
@@ -1318,7 +1318,15 @@ unionlookup:
 	 * not fix whether or not you should or should not get /tmp/a vs. /foo/b.
 	 */
 
-	error = VNOP_LOOKUP(dp, &ndp->ni_vp, cnp, ctx);
+	/*
+	 * A name that isn't in a directory the name cache knows all the
+	 * entries of doesn't need to be looked for.
+	 */
+	if (cnp->cn_nameiop == LOOKUP && cache_dircomplete_absent(dp, cnp)) {
+		error = ENOENT;
+	} else {
+		error = VNOP_LOOKUP(dp, &ndp->ni_vp, cnp, ctx);
+	}
 
 	if (error) {
 lookup_error:
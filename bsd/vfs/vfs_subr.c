@@ -264,6 +264,14 @@ static  int vfs_unmountall_started = 0;
 #define RAGE_LIMIT_MIN  100
 #define RAGE_TIME_LIMIT 5
 
+/*
+ * The vnode reclaimer keeps this many dead vnodes around, a fraction of
+ * desiredvnodes, so that new_vnode() rarely has to reclaim one itself.
+ */
+#define VNODE_HEADROOM_MIN      32
+#define VNODE_HEADROOM_MAX      1024
+static  boolean_t vnode_reclaimer_active = FALSE;
+
 /*
  * ROSV definitions
  * NOTE: These are shadowed from PlatformSupport definitions, but XNU
@@ -348,6 +356,7 @@ static int print_busy_vnodes = 0;                               /* print out bus
 	} while(0)
 
 static void async_work_continue(void);
+static void vnode_reclaimer_continue(void);
 
 /*
  * Initialize the vnode management data structures.
@@ -375,6 +384,9 @@ vntblinit(void)
 	 */
 	kernel_thread_start((thread_continue_t)async_work_continue, NULL, &thread);
 	thread_deallocate(thread);
+
+	kernel_thread_start((thread_continue_t)vnode_reclaimer_continue, NULL, &thread);
+	thread_deallocate(thread);
 }
 
 /* the timeout is in 10 msecs */
@@ -1916,6 +1928,9 @@ int async_work_timed_out = 0;
 int async_work_handled = 0;
 int dead_vnode_wanted = 0;
 int dead_vnode_waited = 0;
+static int vnode_reclaimer_reclaimed = 0;
+SYSCTL_INT(_debug, OID_AUTO, vnode_reclaimer_reclaimed, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &vnode_reclaimer_reclaimed, 0, "vnodes reclaimed ahead of allocation by the reclaimer thread");
 
 /*
  * Move a vnode from one mount queue to another.
@@ -4987,6 +5002,134 @@ async_work_continue(void)
 	}
 }
 
+#define MAX_WALK_COUNT 1000
+
+static long
+vnode_reclaim_headroom(void)
+{
+	long headroom = desiredvnodes / 256;
+
+	if (headroom < VNODE_HEADROOM_MIN) {
+		headroom = VNODE_HEADROOM_MIN;
+	} else if (headroom > VNODE_HEADROOM_MAX) {
+		headroom = VNODE_HEADROOM_MAX;
+	}
+	return headroom;
+}
+
+/*
+ * true when the vnode table is close enough to desiredvnodes that
+ * new_vnode() is about to start stealing vnodes, and there aren't
+ * enough dead ones left for it.
+ * called with the list lock held
+ */
+static boolean_t
+vnode_reclaim_wanted_locked(void)
+{
+	long headroom = vnode_reclaim_headroom();
+
+	return (numvnodes - deadvnodes) + headroom > desiredvnodes &&
+	       deadvnodes < headroom;
+}
+
+/*
+ * pick the vnode the reclaimer should clean next, with the same
+ * preference for the RAGE list as new_vnode... vnodes on unreliable
+ * media are left alone so that the reclaimer can't get stuck on them
+ * called with the list lock held
+ */
+static vnode_t
+vnode_reclaim_candidate_locked(void)
+{
+	struct timeval current_tv;
+	int walk_count = 0;
+	vnode_t vp;
+
+	microuptime(&current_tv);
+
+	if (!TAILQ_EMPTY(&vnode_rage_list) &&
+	    (ragevnodes >= rage_limit ||
+	    (current_tv.tv_sec - rage_tv.tv_sec) >= RAGE_TIME_LIMIT)) {
+		TAILQ_FOREACH(vp, &vnode_rage_list, v_freelist) {
+			if (!(vp->v_flag & VBDEVVP) && vnode_on_reliable_media(vp) == TRUE) {
+				return vp;
+			}
+			if (walk_count++ > MAX_WALK_COUNT) {
+				break;
+			}
+		}
+	}
+	walk_count = 0;
+	TAILQ_FOREACH(vp, &vnode_free_list, v_freelist) {
+		if (!(vp->v_flag & VBDEVVP) && vnode_on_reliable_media(vp) == TRUE) {
+			return vp;
+		}
+		if (walk_count++ > MAX_WALK_COUNT) {
+			break;
+		}
+	}
+	return NULLVP;
+}
+
+/*
+ * wake up the reclaimer if new_vnode is about to run out of dead vnodes
+ * called with the list lock held
+ */
+static void
+vnode_reclaimer_kick_locked(void)
+{
+	if (vnode_reclaimer_active == FALSE && vnode_reclaim_wanted_locked()) {
+		vnode_reclaimer_active = TRUE;
+		wakeup(&vnode_reclaimer_active);
+	}
+}
+
+/*
+ * Background reclaimer: cleans vnodes off the head of the free lists
+ * ahead of time, so that they sit on the dead list ready for new_vnode
+ * instead of being reclaimed, with whatever I/O that takes, by the
+ * thread that wants a vnode.
+ */
+__attribute__((noreturn))
+static void
+vnode_reclaimer_continue(void)
+{
+	int     deferred;
+	vnode_t vp;
+
+	for (;;) {
+		vnode_list_lock();
+
+		if (vnode_reclaim_wanted_locked() == FALSE ||
+		    (vp = vnode_reclaim_candidate_locked()) == NULLVP) {
+			vnode_reclaimer_active = FALSE;
+			assert_wait(&vnode_reclaimer_active, (THREAD_UNINT));
+
+			vnode_list_unlock();
+
+			thread_block((thread_continue_t)vnode_reclaimer_continue);
+
+			continue;
+		}
+		vnode_reclaimer_reclaimed++;
+
+		/*
+		 * process_vp drops the list lock... the vnode ends up
+		 * on the dead list once vnode_reclaim_internal is done
+		 */
+		vp = process_vp(vp, 0, &deferred);
+
+		if (vp != NULLVP) {
+			/*
+			 * already VBAD, just put it back
+			 * on the appropriate list
+			 */
+			vnode_list_add(vp);
+			vnode_unlock(vp);
+		}
+	}
+}
+
 
 static int
 new_vnode(vnode_t *vpp)
@@ -5010,6 +5153,7 @@ retry:
 	if (need_reliable_vp == TRUE) {
 		async_work_timed_out++;
 	}
+	vnode_reclaimer_kick_locked();
 
 	if ((numvnodes - deadvnodes) < desiredvnodes || force_alloc) {
 		struct timespec ts;
@@ -5050,8 +5194,6 @@ retry:
 	}
 	microuptime(&current_tv);
 
-#define MAX_WALK_COUNT 1000
-
 	if (!TAILQ_EMPTY(&vnode_rage_list) &&
 	    (ragevnodes >= rage_limit ||
 	    (current_tv.tv_sec - rage_tv.tv_sec) >= RAGE_TIME_LIMIT)) {
@@ -10077,6 +10219,21 @@ vn_clearunionwait(vnode_t vp, int locked)
 	}
 }
 
+/*
+ * Returns true if vp is a dataless object, or if that can't be told:
+ * what it holds isn't on the volume, so its contents aren't its own.
+ */
+bool
+vnode_isdataless(vnode_t vp, vfs_context_t ctx)
+{
+	uint32_t flags = 0;
+
+	if (vnode_flags(vp, &flags, ctx) != 0) {
+		return true;
+	}
+	return (flags & SF_DATALESS) != 0;
+}
+
 int
 vnode_materialize_dataless_file(vnode_t vp, uint64_t op_type)
 {
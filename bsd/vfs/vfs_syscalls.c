@@ -9604,6 +9604,8 @@ getdirentries_common(int fd, user_addr_t bufp, user_size_t bufsize, ssize_t *byt
 	off_t loff;
 	int error, numdirent;
 	char uio_buf[UIO_SIZEOF(1)];
+	void *kbuf;
+	uint32_t dc_token = 0;
 
 	error = fp_getfvp(vfs_context_proc(&context), fd, &fp, &vp);
 	if (error) {
@@ -9646,8 +9648,24 @@ unionread:
 #endif /* MAC */
 
 	loff = fp->fp_glob->fg_offset;
-	auio = uio_createwithbuffer(1, loff, spacetype, UIO_READ, &uio_buf[0], sizeof(uio_buf));
-	uio_addiov(auio, bufp, bufsize);
+
+	/*
+	 * If the name cache is following an enumeration of the directory,
+	 * read into a kernel buffer so that it sees the names the file
+	 * system returned, not what the user buffer holds by then.
+	 */
+	kbuf = NULL;
+	if ((flags & VNODE_READDIR_EXTENDED) &&
+	    cache_dircomplete_enum_begin(vp, loff, bufsize, &dc_token)) {
+		kbuf = kheap_alloc(KHEAP_DATA_BUFFERS, bufsize, Z_WAITOK);
+	}
+	if (kbuf) {
+		auio = uio_createwithbuffer(1, loff, UIO_SYSSPACE, UIO_READ, &uio_buf[0], sizeof(uio_buf));
+		uio_addiov(auio, (uintptr_t)kbuf, bufsize);
+	} else {
+		auio = uio_createwithbuffer(1, loff, spacetype, UIO_READ, &uio_buf[0], sizeof(uio_buf));
+		uio_addiov(auio, bufp, bufsize);
+	}
 
 	if (flags & VNODE_READDIR_EXTENDED) {
 		error = vnode_readdir64(vp, auio, flags, eofflag, &numdirent, &context);
@@ -9656,6 +9674,21 @@ unionread:
 		error = VNOP_READDIR(vp, auio, 0, eofflag, &numdirent, &context);
 		fp->fp_glob->fg_offset = uio_offset(auio);
 	}
+	if (kbuf) {
+		size_t nread = bufsize - (size_t)uio_resid(auio);
+
+		if (error == 0) {
+			error = copyout(kbuf, bufp, nread);
+			if (error) {
+				fp->fp_glob->fg_offset = loff;
+			}
+		}
+		if (error == 0) {
+			cache_dircomplete_enum_end(vp, dc_token, loff, uio_offset(auio),
+			    kbuf, nread, *eofflag);
+		}
+		kheap_free(KHEAP_DATA_BUFFERS, kbuf, bufsize);
+	}
 	if (error) {
 		(void)vnode_put(vp);
 		goto out;
@@ -11641,6 +11674,19 @@ unlock:
 		error = handle_auth(vp, cmd, data, options, ctx);
 		break;
 
+	case FSIOC_READAHEAD_STATS: {
+		struct fsioc_readahead_stats *ras = (struct fsioc_readahead_stats *)data;
+		mount_t mp = vp->v_mount;
+
+		ras->ra_streams = os_atomic_load(&mp->mnt_ra_streams, relaxed);
+		ras->ra_strided = os_atomic_load(&mp->mnt_ra_strided, relaxed);
+		ras->ra_reads = os_atomic_load(&mp->mnt_ra_reads, relaxed);
+		ras->ra_misses = os_atomic_load(&mp->mnt_ra_misses, relaxed);
+		ras->ra_pages = os_atomic_load(&mp->mnt_ra_pages, relaxed);
+		error = 0;
+	}
+	break;
+
 	default: {
 		/* other, known commands shouldn't be passed down here */
 		switch (cmd) {
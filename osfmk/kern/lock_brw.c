@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2021 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <machine/atomic.h>
+#include <kern/cpu_data.h>
+#include <kern/lock_brw.h>
+#include <kern/sched_prim.h>
+#include <kern/thread.h>
+#include <kern/zalloc.h>
+
+/*
+ * Big reader locks
+ *
+ * The per-CPU reader counts are only meaningful as a sum: a reader may
+ * increment the counter of the CPU it acquired the lock on, and decrement
+ * the counter of another CPU when it drops it, so individual slots can go
+ * negative.
+ *
+ * The reader fastpath and the writer form a Dekker-style handshake:
+ *
+ *     reader                          writer
+ *     ------                          ------
+ *     readers[cpu]++                  brw_writer = 1
+ *     fence(seq_cst)                  fence(seq_cst)
+ *     if (brw_writer) back out        wait for sum(readers) == 0
+ *
+ * which guarantees that either the reader sees the pending writer, or the
+ * writer sees the reader's increment.
+ */
+
+static ZONE_DECLARE(lck_brw_readers_zone, "lck_brw readers",
+    sizeof(int32_t), ZC_PERCPU);
+
+void
+lck_brw_init(lck_brw_t *lck, lck_grp_t *grp, lck_attr_t *attr)
+{
+	lck_rw_init(&lck->brw_rw, grp, attr);
+	os_atomic_init(&lck->brw_writer, 0);
+	lck->brw_readers = zalloc_percpu(lck_brw_readers_zone,
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+}
+
+void
+lck_brw_destroy(lck_brw_t *lck, lck_grp_t *grp)
+{
+	zfree_percpu(lck_brw_readers_zone, lck->brw_readers);
+	lck->brw_readers = NULL;
+	lck_rw_destroy(&lck->brw_rw, grp);
+}
+
+static int64_t
+lck_brw_reader_count(lck_brw_t *lck)
+{
+	int64_t count = 0;
+
+	zpercpu_foreach(it, lck->brw_readers) {
+		count += os_atomic_load(it, relaxed);
+	}
+
+	return count;
+}
+
+static void
+lck_brw_reader_inc(lck_brw_t *lck)
+{
+	disable_preemption();
+	os_atomic_inc(zpercpu_get(lck->brw_readers), relaxed);
+	enable_preemption();
+}
+
+static void
+lck_brw_reader_dec(lck_brw_t *lck)
+{
+	disable_preemption();
+	os_atomic_dec(zpercpu_get(lck->brw_readers), release);
+	enable_preemption();
+}
+
+/*
+ * Must be called by readers after they decremented their counter,
+ * to wake up a writer that might be waiting for readers to drain.
+ */
+static void
+lck_brw_reader_done(lck_brw_t *lck)
+{
+	os_atomic_thread_fence(seq_cst);
+	if (__improbable(os_atomic_load(&lck->brw_writer, relaxed))) {
+		thread_wakeup((event_t)&lck->brw_writer);
+	}
+}
+
+static bool
+lck_brw_lock_shared_fastpath(lck_brw_t *lck)
+{
+	lck_brw_reader_inc(lck);
+
+	os_atomic_thread_fence(seq_cst);
+	if (__probable(os_atomic_load(&lck->brw_writer, relaxed) == 0)) {
+		os_atomic_thread_fence(acquire);
+		return true;
+	}
+
+	/* a writer is pending: back out and let it make progress */
+	lck_brw_reader_dec(lck);
+	lck_brw_reader_done(lck);
+	return false;
+}
+
+void
+lck_brw_lock_shared(lck_brw_t *lck)
+{
+	if (lck_brw_lock_shared_fastpath(lck)) {
+		return;
+	}
+
+	/*
+	 * Queue behind the writer. Holding the embedded lock shared
+	 * prevents any other writer from setting brw_writer while we
+	 * register ourselves as a reader.
+	 */
+	lck_rw_lock_shared(&lck->brw_rw);
+	lck_brw_reader_inc(lck);
+	lck_rw_unlock_shared(&lck->brw_rw);
+}
+
+bool
+lck_brw_try_lock_shared(lck_brw_t *lck)
+{
+	if (lck_brw_lock_shared_fastpath(lck)) {
+		return true;
+	}
+
+	if (!lck_rw_try_lock_shared(&lck->brw_rw)) {
+		return false;
+	}
+	lck_brw_reader_inc(lck);
+	lck_rw_unlock_shared(&lck->brw_rw);
+	return true;
+}
+
+void
+lck_brw_unlock_shared(lck_brw_t *lck)
+{
+	lck_brw_reader_dec(lck);
+	lck_brw_reader_done(lck);
+}
+
+void
+lck_brw_lock_exclusive(lck_brw_t *lck)
+{
+	lck_rw_lock_exclusive(&lck->brw_rw);
+
+	os_atomic_store(&lck->brw_writer, 1, relaxed);
+	os_atomic_thread_fence(seq_cst);
+
+	while (lck_brw_reader_count(lck) != 0) {
+		assert_wait((event_t)&lck->brw_writer, THREAD_UNINT);
+		if (lck_brw_reader_count(lck) != 0) {
+			thread_block(THREAD_CONTINUE_NULL);
+		} else {
+			clear_wait(current_thread(), THREAD_AWAKENED);
+		}
+	}
+
+	os_atomic_thread_fence(acquire);
+}
+
+void
+lck_brw_unlock_exclusive(lck_brw_t *lck)
+{
+	LCK_BRW_ASSERT_EXCLUSIVE(lck);
+
+	os_atomic_store(&lck->brw_writer, 0, release);
+	lck_rw_unlock_exclusive(&lck->brw_rw);
+}
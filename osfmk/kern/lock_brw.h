@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2021 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _KERN_LOCK_BRW_H_
+#define _KERN_LOCK_BRW_H_
+
+#ifdef XNU_KERNEL_PRIVATE
+
+#include <kern/locks.h>
+#include <kern/zalloc.h>
+
+__BEGIN_DECLS
+
+/*!
+ * @typedef lck_brw_t
+ *
+ * @brief
+ * A "big reader" read-write lock with per-CPU reader indicators.
+ *
+ * @discussion
+ * A regular @c lck_rw_t keeps the reader count in the lock word itself,
+ * which means that every shared acquisition and release of a heavily
+ * read-shared lock bounces that cacheline between all the CPUs using it.
+ *
+ * @c lck_brw_t instead accounts readers in a per-CPU counter: an uncontended
+ * shared acquisition is an increment of a CPU-local cacheline followed by
+ * a check that no writer is pending. Writers pay for this: they serialize
+ * through an embedded @c lck_rw_t, flag themselves as pending, then wait for
+ * the sum of all per-CPU reader counts to drain to zero.
+ *
+ * Readers that observe a pending writer back out and queue behind it on the
+ * embedded @c lck_rw_t in shared mode, so that writers can not be starved.
+ *
+ * This lock is only a good fit for locks that are taken shared orders of
+ * magnitude more often than they are taken exclusive. Its footprint is also
+ * larger than a @c lck_rw_t (one counter per CPU), which makes it unsuitable
+ * for locks embedded in objects with a large population.
+ *
+ * Shared acquisitions must not recurse: a recursive reader could block behind
+ * a pending writer that is waiting for the outer acquisition to be dropped.
+ */
+typedef struct lck_brw {
+	lck_rw_t                brw_rw;
+	uint32_t _Atomic        brw_writer;
+	int32_t __zpercpu      *brw_readers;
+} lck_brw_t;
+
+#define decl_lck_brw_data(class, name)     class lck_brw_t name
+
+/*!
+ * @function lck_brw_init()
+ *
+ * @brief
+ * Initializes a big reader lock.
+ *
+ * @discussion
+ * Lock statistics for the embedded read-write lock (writers and readers
+ * that had to wait for a writer) are accounted against @c grp.
+ *
+ * This function may block to allocate the per-CPU reader counters.
+ */
+extern void lck_brw_init(
+	lck_brw_t              *lck,
+	lck_grp_t              *grp,
+	lck_attr_t             *attr);
+
+/*!
+ * @function lck_brw_destroy()
+ *
+ * @brief
+ * Destroys a big reader lock previously initialized with @c lck_brw_init().
+ */
+extern void lck_brw_destroy(
+	lck_brw_t              *lck,
+	lck_grp_t              *grp);
+
+/*!
+ * @function lck_brw_lock_shared()
+ *
+ * @brief
+ * Takes a big reader lock for reading.
+ */
+extern void lck_brw_lock_shared(
+	lck_brw_t              *lck);
+
+/*!
+ * @function lck_brw_try_lock_shared()
+ *
+ * @brief
+ * Attempts to take a big reader lock for reading without blocking.
+ *
+ * @returns
+ * Whether the lock was acquired.
+ */
+extern bool lck_brw_try_lock_shared(
+	lck_brw_t              *lck);
+
+/*!
+ * @function lck_brw_unlock_shared()
+ *
+ * @brief
+ * Drops a big reader lock previously taken for reading.
+ *
+ * @discussion
+ * The lock doesn't need to be dropped on the CPU it was acquired on.
+ */
+extern void lck_brw_unlock_shared(
+	lck_brw_t              *lck);
+
+/*!
+ * @function lck_brw_lock_exclusive()
+ *
+ * @brief
+ * Takes a big reader lock for writing.
+ *
+ * @discussion
+ * This waits for all readers on all CPUs to drain and is expected to be
+ * considerably more expensive than @c lck_rw_lock_exclusive().
+ */
+extern void lck_brw_lock_exclusive(
+	lck_brw_t              *lck);
+
+/*!
+ * @function lck_brw_unlock_exclusive()
+ *
+ * @brief
+ * Drops a big reader lock previously taken for writing.
+ */
+extern void lck_brw_unlock_exclusive(
+	lck_brw_t              *lck);
+
+/*!
+ * @macro LCK_BRW_ASSERT_EXCLUSIVE()
+ *
+ * @brief
+ * Asserts that the lock is held for writing.
+ *
+ * @discussion
+ * Like @c lck_rw_assert(), this doesn't check that the caller is the writer.
+ */
+#define LCK_BRW_ASSERT_EXCLUSIVE(lck) \
+	LCK_RW_ASSERT(&(lck)->brw_rw, LCK_RW_ASSERT_EXCLUSIVE)
+
+__END_DECLS
+
+#endif /* XNU_KERNEL_PRIVATE */
+
+#endif /* _KERN_LOCK_BRW_H_ */
@@ -97,6 +97,15 @@ static LCK_SPIN_DECLARE(global_turnstile_lock, &turnstiles_dev_lock_grp);
 /* Array to store stats for multi-hop boosting */
 static struct turnstile_stats turnstile_boost_stats[TURNSTILE_MAX_HOP_DEFAULT] = {};
 static struct turnstile_stats turnstile_unboost_stats[TURNSTILE_MAX_HOP_DEFAULT] = {};
+/*
+ * Chain length / duration histograms of priority propagation walks.
+ * Walks longer than TURNSTILE_MAX_HOP_DEFAULT (possible when the
+ * turnstile_max_hop boot-arg is raised) are accounted in the last bucket.
+ * Times are kept in nanoseconds, converted from absolute time as each
+ * walk is accounted.
+ */
+static struct turnstile_chain_stats turnstile_boost_chain_stats[TURNSTILE_MAX_HOP_DEFAULT] = {};
+static struct turnstile_chain_stats turnstile_unboost_chain_stats[TURNSTILE_MAX_HOP_DEFAULT] = {};
 uint64_t thread_block_on_turnstile_count;
 uint64_t thread_block_on_regular_waitq_count;
 #endif /* DEVELOPMENT || DEBUG */
@@ -118,6 +127,9 @@ static void
 turnstile_init(struct turnstile *turnstile);
 static void
 turnstile_update_inheritor_workq_priority_chain(struct turnstile *in_turnstile, spl_t s);
+static int
+turnstile_walk_inheritor_priority_chain(turnstile_inheritor_t inheritor,
+    turnstile_update_flags_t turnstile_flags);
 static void
 turnstile_update_inheritor_thread_priority_chain(struct turnstile **in_turnstile,
     thread_t *out_thread, int total_hop, turnstile_stats_update_flags_t tsu_flags);
@@ -964,6 +976,39 @@ turnstile_destroy(struct turnstile *turnstile)
 	zfree(turnstiles_zone, turnstile);
 }
 
+/*
+ * Name: turnstile_freelist_transfer
+ *
+ * Description: Moves turnstiles from the freelist of a primitive turnstile
+ *              to the freelist of another one, when the primitive moves
+ *              waiters from one to the other: each moved waiter donated
+ *              a turnstile that must be returned by the new primitive.
+ *              Should be called with both primitives IL held.
+ *
+ * Args:
+ *   Arg1: source primitive turnstile
+ *   Arg2: destination primitive turnstile
+ *   Arg3: number of turnstiles to move
+ *
+ * Returns: None.
+ */
+void
+turnstile_freelist_transfer(
+	struct turnstile *src_ts,
+	struct turnstile *dst_ts,
+	int count)
+{
+	struct turnstile *free_ts;
+
+	assert(turnstile_get_type(src_ts) == turnstile_get_type(dst_ts));
+
+	for (; count > 0; count--) {
+		free_ts = turnstile_freelist_remove(src_ts);
+		free_ts->ts_proprietor = dst_ts->ts_proprietor;
+		turnstile_freelist_insert(dst_ts, free_ts);
+	}
+}
+
 /*
  * Name: turnstile_prepare
  *
@@ -1924,6 +1969,33 @@ thread_get_waiting_turnstile(thread_t thread)
 	return turnstile;
 }
 
+/*
+ * Name: thread_is_waiting_on_turnstile
+ *
+ * Description: Check if the thread is blocked on the given turnstile.
+ *
+ * Arg1: thread
+ * Arg2: turnstile
+ *
+ * Returns: TRUE if the thread is blocked on the turnstile.
+ *
+ * Condition: thread unlocked.
+ */
+boolean_t
+thread_is_waiting_on_turnstile(thread_t thread, struct turnstile *turnstile)
+{
+	boolean_t waiting;
+	spl_t s;
+
+	s = splsched();
+	thread_lock(thread);
+	waiting = (thread_get_waiting_turnstile(thread) == turnstile);
+	thread_unlock(thread);
+	splx(s);
+
+	return waiting;
+}
+
 /*
  * Name: turnstile_lookup_by_proprietor
  *
@@ -2623,11 +2695,54 @@ turnstile_has_waiters(struct turnstile *turnstile)
 	return ret;
 }
 
+#if DEVELOPMENT || DEBUG
+/*
+ * Name: turnstile_chain_stats_update
+ *
+ * Description: Account a priority propagation walk in the chain histograms.
+ *
+ * Arg1: hops : number of hops the walk took
+ * Arg2: elapsed : duration of the walk in absolute time units
+ * Arg3: boost : whether the walk propagated a boost or an unboost
+ *
+ * Returns: None.
+ */
+static void
+turnstile_chain_stats_update(
+	int hops,
+	uint64_t elapsed,
+	bool boost)
+{
+	struct turnstile_chain_stats *tcs;
+	uint64_t elapsed_ns;
+
+	if (hops <= 0) {
+		return;
+	}
+	if (hops > TURNSTILE_MAX_HOP_DEFAULT) {
+		hops = TURNSTILE_MAX_HOP_DEFAULT;
+	}
+	absolutetime_to_nanoseconds(elapsed, &elapsed_ns);
+
+	tcs = boost ? &turnstile_boost_chain_stats[hops - 1] :
+	    &turnstile_unboost_chain_stats[hops - 1];
+
+	os_atomic_inc(&tcs->tcs_count, relaxed);
+	os_atomic_add(&tcs->tcs_time_total_ns, elapsed_ns, relaxed);
+	/* racy, but good enough for statistics */
+	if (elapsed_ns > os_atomic_load(&tcs->tcs_time_max_ns, relaxed)) {
+		os_atomic_store(&tcs->tcs_time_max_ns, elapsed_ns, relaxed);
+	}
+}
+#endif /* DEVELOPMENT || DEBUG */
+
 /*
  * Name: turnstile_update_inheritor_priority_chain
  *
  * Description: Update turnstile inheritor's priority and propagate
  *              the priority if the inheritor is blocked on a turnstile.
+ *              The walk is bracketed by TURNSTILE_PRIORITY_PROPAGATION
+ *              tracepoints, the end one reporting the number of hops.
  *
  * Arg1: inheritor
  * Arg2: inheritor flags
@@ -2638,6 +2753,51 @@ static void
 turnstile_update_inheritor_priority_chain(
 	turnstile_inheritor_t inheritor,
 	turnstile_update_flags_t turnstile_flags)
+{
+	int hops;
+#if DEVELOPMENT || DEBUG
+	uint64_t start;
+#endif /* DEVELOPMENT || DEBUG */
+
+	if (inheritor == NULL) {
+		return;
+	}
+
+	KERNEL_DEBUG_CONSTANT_IST(KDEBUG_TRACE,
+	    (TURNSTILE_CODE(TURNSTILE_PRIORITY_OPERATIONS,
+	    (TURNSTILE_PRIORITY_PROPAGATION))) | DBG_FUNC_START,
+	    VM_KERNEL_UNSLIDE_OR_PERM(inheritor), turnstile_flags, 0, 0, 0);
+#if DEVELOPMENT || DEBUG
+	start = mach_absolute_time();
+#endif /* DEVELOPMENT || DEBUG */
+
+	hops = turnstile_walk_inheritor_priority_chain(inheritor, turnstile_flags);
+
+#if DEVELOPMENT || DEBUG
+	turnstile_chain_stats_update(hops, mach_absolute_time() - start,
+	    (turnstile_flags & TURNSTILE_UPDATE_BOOST) != 0);
+#endif /* DEVELOPMENT || DEBUG */
+	KERNEL_DEBUG_CONSTANT_IST(KDEBUG_TRACE,
+	    (TURNSTILE_CODE(TURNSTILE_PRIORITY_OPERATIONS,
+	    (TURNSTILE_PRIORITY_PROPAGATION))) | DBG_FUNC_END,
+	    VM_KERNEL_UNSLIDE_OR_PERM(inheritor), hops, 0, 0, 0);
+}
+
+/*
+ * Name: turnstile_walk_inheritor_priority_chain
+ *
+ * Description: Walk the inheritor chain for
+ *              turnstile_update_inheritor_priority_chain().
+ *
+ * Arg1: inheritor
+ * Arg2: inheritor flags
+ *
+ * Returns: number of hops walked.
+ */
+static int
+turnstile_walk_inheritor_priority_chain(
+	turnstile_inheritor_t inheritor,
+	turnstile_update_flags_t turnstile_flags)
 {
 	struct turnstile *turnstile = TURNSTILE_NULL;
 	thread_t thread = THREAD_NULL;
@@ -2646,10 +2806,6 @@ turnstile_update_inheritor_priority_chain(
 	turnstile_stats_update_flags_t tsu_flags = ((turnstile_flags & TURNSTILE_UPDATE_BOOST) ?
 	    TSU_BOOST_ARG : TSU_FLAGS_NONE) | TSU_PRI_PROPAGATION;
 
-	if (inheritor == NULL) {
-		return;
-	}
-
 	s = splsched();
 
 	if (turnstile_flags & TURNSTILE_INHERITOR_THREAD) {
@@ -2690,7 +2846,7 @@ turnstile_update_inheritor_priority_chain(
 				turnstile_update_inheritor_workq_priority_chain(turnstile, s);
 				turnstile_stats_update(total_hop + 1, TSU_NO_PRI_CHANGE_NEEDED | tsu_flags,
 				    NULL);
-				return;
+				return total_hop + 1;
 			} else {
 				panic("Inheritor flags not passed in turnstile_update_inheritor");
 			}
@@ -2703,7 +2859,7 @@ turnstile_update_inheritor_priority_chain(
 	}
 
 	splx(s);
-	return;
+	return total_hop;
 }
 
 /*
@@ -3327,6 +3483,54 @@ turnstile_get_unboost_stats_sysctl(
 	return sysctl_io_opaque(req, turnstile_unboost_stats, sizeof(struct turnstile_stats) * TURNSTILE_MAX_HOP_DEFAULT, NULL);
 }
 
+static int
+turnstile_get_chain_stats_sysctl(
+	void *req,
+	struct turnstile_chain_stats *stats)
+{
+	struct turnstile_chain_stats out[TURNSTILE_MAX_HOP_DEFAULT];
+
+	for (int i = 0; i < TURNSTILE_MAX_HOP_DEFAULT; i++) {
+		out[i].tcs_count = os_atomic_load(&stats[i].tcs_count, relaxed);
+		out[i].tcs_time_total_ns = os_atomic_load(&stats[i].tcs_time_total_ns, relaxed);
+		out[i].tcs_time_max_ns = os_atomic_load(&stats[i].tcs_time_max_ns, relaxed);
+	}
+
+	return sysctl_io_opaque(req, out, sizeof(out), NULL);
+}
+
+/*
+ * Name: turnstile_get_boost_chain_stats_sysctl
+ *
+ * Description: Function to get the chain length histogram of boosts.
+ *
+ * Args: req : opaque struct to pass to sysctl_io_opaque
+ *
+ * Returns: errorno
+ */
+int
+turnstile_get_boost_chain_stats_sysctl(
+	void *req)
+{
+	return turnstile_get_chain_stats_sysctl(req, turnstile_boost_chain_stats);
+}
+
+/*
+ * Name: turnstile_get_unboost_chain_stats_sysctl
+ *
+ * Description: Function to get the chain length histogram of unboosts.
+ *
+ * Args: req : opaque struct to pass to sysctl_io_opaque
+ *
+ * Returns: errorno
+ */
+int
+turnstile_get_unboost_chain_stats_sysctl(
+	void *req)
+{
+	return turnstile_get_chain_stats_sysctl(req, turnstile_unboost_chain_stats);
+}
+
 /* Testing interface for Development kernels */
 #define tstile_test_prim_lock_interlock(test_prim) \
 	lck_spin_lock(&test_prim->ttprim_interlock)
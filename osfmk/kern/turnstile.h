@@ -43,6 +43,16 @@ struct turnstile_stats {
 	uint64_t ts_above_ui_pri_change;
 	uint64_t ts_no_turnstile;
 };
+
+/*
+ * Histogram bucket for priority propagation chain walks,
+ * indexed by the number of hops the walk took.
+ */
+struct turnstile_chain_stats {
+	uint64_t tcs_count;
+	uint64_t tcs_time_total_ns;
+	uint64_t tcs_time_max_ns;
+};
 #endif
 
 #ifdef KERNEL_PRIVATE
@@ -600,6 +610,21 @@ thread_get_inheritor_turnstile_sched_priority(thread_t thread);
 struct turnstile *
 thread_get_waiting_turnstile(thread_t thread);
 
+/*
+ * Name: thread_is_waiting_on_turnstile
+ *
+ * Description: Check if the thread is blocked on the given turnstile.
+ *
+ * Arg1: thread
+ * Arg2: turnstile
+ *
+ * Returns: TRUE if the thread is blocked on the turnstile.
+ *
+ * Condition: thread unlocked.
+ */
+boolean_t
+thread_is_waiting_on_turnstile(thread_t thread, struct turnstile *turnstile);
+
 /*
  * Name: turnstile_lookup_by_proprietor
  *
@@ -665,6 +690,10 @@ int
 turnstile_get_boost_stats_sysctl(void *req);
 int
 turnstile_get_unboost_stats_sysctl(void *req);
+int
+turnstile_get_boost_chain_stats_sysctl(void *req);
+int
+turnstile_get_unboost_chain_stats_sysctl(void *req);
 #endif /* DEVELOPMENT || DEBUG */
 #endif /* XNU_KERNEL_PRIVATE */
 
@@ -754,6 +783,27 @@ turnstile_complete(
 	struct turnstile **turnstile,
 	turnstile_type_t type);
 
+/*
+ * Name: turnstile_freelist_transfer
+ *
+ * Description: Moves turnstiles from the freelist of a primitive turnstile
+ *              to the freelist of another one, when the primitive moves
+ *              waiters from one to the other (see waitq_transfer64()).
+ *              Function is called holding the interlock of both primitives.
+ *
+ * Args:
+ *   Arg1: source primitive turnstile
+ *   Arg2: destination primitive turnstile
+ *   Arg3: number of turnstiles to move
+ *
+ * Returns: None.
+ */
+void
+turnstile_freelist_transfer(
+	struct turnstile *src_ts,
+	struct turnstile *dst_ts,
+	int count);
+
 /*
  * Name: turnstile_update_inheritor
  *
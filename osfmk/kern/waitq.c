@@ -626,6 +626,12 @@ struct wq_prepost {
 		/* wqt_type == WQP_WQ (LT_ELEM) */
 		struct {
 			struct waitq *wqp_wq_ptr;
+			/*
+			 * Upper bound on the number of set prepost lists
+			 * referencing this object: it can be stale high,
+			 * but never lower than the actual count.
+			 */
+			uint32_t      wqp_wq_nposts;
 		} wqp_wq;
 		/* wqt_type == WQP_POST (LT_LINK) */
 		struct {
@@ -943,6 +949,40 @@ wq_prepost_reset_rnext(struct wq_prepost *wqp)
 	(void)lt_elem_list_break(&g_prepost_table, &wqp->wqte);
 }
 
+/*
+ * Account for a set prepost list no longer referencing the WQP_WQ
+ * object 'wqp'.
+ *
+ * Increments happen with the waitq locked, but decrements only hold the
+ * lock of the set the prepost is removed from, hence the atomics.
+ * Paths that drop a set's prepost list wholesale don't decrement:
+ * over-counting only disables the wq_is_preposted_on_set() fastpath.
+ */
+static void
+wq_prepost_wq_unref(struct wq_prepost *wqp)
+{
+	uint32_t ov, nv;
+
+	assert(wqp_type(wqp) == WQP_WQ);
+	os_atomic_rmw_loop(&wqp->wqp_wq.wqp_wq_nposts, ov, nv, relaxed, {
+		if (ov == 0) {
+		        os_atomic_rmw_loop_give_up(return );
+		}
+		nv = ov - 1;
+	});
+}
+
+static void
+wq_prepost_wq_unref_id(uint64_t wqp_wq_id)
+{
+	struct wq_prepost *wqp = wq_prepost_get(wqp_wq_id);
+
+	if (wqp) {
+		wq_prepost_wq_unref(wqp);
+		wq_prepost_put(wqp);
+	}
+}
+
 
 /**
  * remove 'wqp' from the prepost list on 'wqset'
@@ -968,6 +1008,8 @@ wq_prepost_remove(struct waitq_set *wqset,
 	assert(wqp_type(wqp) == WQP_POST);
 	assert(wqset->wqset_q.waitq_prepost == 1);
 
+	wq_prepost_wq_unref_id(wqp->wqp_post.wqp_wq_id);
+
 	if (next_id == wqp_id) {
 		/* the list is singular and becoming empty */
 		wqset->wqset_prepost_id = 0;
@@ -1129,6 +1171,7 @@ restart:
 			/* the caller wants to remove the only prepost here */
 			assert(wqp_id == wqset->wqset_prepost_id);
 			wqset->wqset_prepost_id = 0;
+			wq_prepost_wq_unref(wqp);
 			OS_FALLTHROUGH;
 		case WQ_ITERATE_CONTINUE:
 			wq_prepost_put(wqp);
@@ -1403,16 +1446,39 @@ wq_is_preposted_on_set(struct waitq *waitq, struct waitq_set *wqset)
 {
 	int ret;
 	struct _is_posted_ctx pctx;
+	struct wq_prepost *wqp;
+	uint32_t nposts = 1;
+
+	/* a waitq without a prepost object can't be on any prepost list */
+	if (waitq->waitq_prepost_id == 0) {
+		return 0;
+	}
 
 	/*
 	 * If the set's only prepost matches the waitq's prepost ID,
 	 * then it obviously already preposted to the set.
 	 */
-	if (waitq->waitq_prepost_id != 0 &&
-	    wqset->wqset_prepost_id == waitq->waitq_prepost_id) {
+	if (wqset->wqset_prepost_id == waitq->waitq_prepost_id) {
 		return 1;
 	}
 
+	/*
+	 * If no set references this waitq's prepost object, avoid walking
+	 * the set's entire prepost list, which makes preposting quadratic
+	 * when many members of a set prepost before it is drained.
+	 *
+	 * New references are only added with the waitq locked, so the
+	 * count can't go from 0 to non-zero under us.
+	 */
+	wqp = wq_prepost_get(waitq->waitq_prepost_id);
+	if (wqp) {
+		nposts = os_atomic_load(&wqp->wqp_wq.wqp_wq_nposts, relaxed);
+		wq_prepost_put(wqp);
+	}
+	if (nposts == 0) {
+		return 0;
+	}
+
 	/* use full prepost iteration: always trim the list */
 	pctx.posting_wq = waitq;
 	pctx.did_prepost = 0;
@@ -1491,9 +1557,18 @@ wq_prepost_do_post_locked(struct waitq_set *wqset,
 		struct wq_prepost *wqp;
 		wqp = wq_get_prepost_obj(reserved, WQP_WQ);
 		wqp->wqp_wq.wqp_wq_ptr = waitq;
+		wqp->wqp_wq.wqp_wq_nposts = 1;
 		wqp_set_valid(wqp);
 		waitq->waitq_prepost_id = wqp->wqp_prepostid.id;
 		wq_prepost_put(wqp);
+	} else {
+		/* every path below links the waitq into the set's prepost list */
+		struct wq_prepost *wqp;
+		wqp = wq_prepost_get(waitq->waitq_prepost_id);
+		if (wqp) {
+			os_atomic_inc(&wqp->wqp_wq.wqp_wq_nposts, relaxed);
+			wq_prepost_put(wqp);
+		}
 	}
 
 #if CONFIG_LTABLE_STATS
@@ -1782,11 +1857,21 @@ waitq_stats_count_fail(struct waitq *waitq)
 		waitq_grab_backtrace(wqs->last_failed_wakeup, 2);
 	}
 }
+
+static __inline__ void
+waitq_stats_count_scan(struct waitq *waitq, uint32_t scanned)
+{
+	struct wq_stats *wqs = waitq_global_stats(waitq);
+	if (wqs != NULL) {
+		wqs->scanned += scanned;
+	}
+}
 #else /* !CONFIG_WAITQ_STATS */
 #define waitq_stats_count_wait(q)         do { } while (0)
 #define waitq_stats_count_wakeup(q)       do { } while (0)
 #define waitq_stats_count_clear_wakeup(q) do { } while (0)
 #define waitq_stats_count_fail(q)         do { } while (0)
+#define waitq_stats_count_scan(q, n)      do { } while (0)
 #endif
 
 int
@@ -1842,6 +1927,78 @@ waitq_get_safeq(struct waitq *waitq)
 	return global_eventq(waitq);
 }
 
+#if DEVELOPMENT || DEBUG
+void
+waitq_global_stats_snapshot(struct wq_global_stats *stats)
+{
+	bzero(stats, sizeof(*stats));
+	stats->version = WAITQ_GLOBAL_STATS_VERSION;
+	stats->num_queues = g_num_waitqs;
+
+	for (uint32_t i = 0; i < g_num_waitqs; i++) {
+		struct waitq *wq = &global_waitqs[i];
+		uint32_t len = 0;
+		thread_t thread;
+		spl_t s;
+
+		s = splsched();
+		waitq_lock(wq);
+		qe_foreach_element(thread, &wq->waitq_queue, wait_links) {
+			len++;
+		}
+		waitq_unlock(wq);
+		splx(s);
+
+		if (len) {
+			stats->nonempty_queues++;
+			stats->waiters += len;
+			stats->max_chain_len = MAX(stats->max_chain_len, len);
+		}
+
+#if CONFIG_WAITQ_STATS
+		struct wq_stats *wqs = &g_waitq_stats[i];
+
+		stats->waits += wqs->waits;
+		stats->wakeups += wqs->wakeups;
+		stats->clears += wqs->clears;
+		stats->failed_wakeups += wqs->failed_wakeups;
+		stats->wakeup_scanned += wqs->scanned;
+#endif /* CONFIG_WAITQ_STATS */
+	}
+}
+
+int sysctl_io_opaque(void *req, void *pValue, size_t valueSize, int *changed);
+
+/*
+ * Name: waitq_global_stats_sysctl
+ *
+ * Description: Function to get global waitq hash table stats.
+ *
+ * Args: req : opaque struct to pass to sysctl_io_opaque
+ *
+ * Returns: errorno
+ */
+int
+waitq_global_stats_sysctl(void *req)
+{
+	struct wq_global_stats stats;
+
+	waitq_global_stats_snapshot(&stats);
+	return sysctl_io_opaque(req, &stats, sizeof(stats), NULL);
+}
+#endif /* DEVELOPMENT || DEBUG */
+
+/*
+ * Minimum number of global wait queues per CPU.
+ *
+ * Every CPU can have a thread asserting a wait or issuing a wakeup
+ * at any given time, and each of them takes the lock of the global
+ * queue its event hashes to: on machines with many CPUs and a comparatively
+ * small thread_max, sizing the table from thread_max alone makes unrelated
+ * events collide on the same queue lock.
+ */
+#define WAITQ_HASH_QUEUES_PER_CPU       128
+
 static uint32_t
 waitq_hash_size(void)
 {
@@ -1851,7 +2008,7 @@ waitq_hash_size(void)
 		return hsize;
 	}
 
-	queues = thread_max / 5;
+	queues = MAX(thread_max / 5, zpercpu_count() * WAITQ_HASH_QUEUES_PER_CPU);
 	hsize = P2ROUNDUP(queues * sizeof(struct waitq), PAGE_SIZE);
 
 	return hsize;
@@ -2190,10 +2347,12 @@ waitq_queue_iterate_locked(struct waitq *safeq, struct waitq *waitq,
 	int *nthreads = args->nthreads;
 	thread_t thread = THREAD_NULL;
 	thread_t first_thread = THREAD_NULL;
+	uint32_t scanned = 0;
 
 	qe_foreach_element_safe(thread, &safeq->waitq_queue, wait_links) {
 		thread_t t = THREAD_NULL;
 		assert_thread_magic(thread);
+		scanned++;
 
 		/*
 		 * For non-priority ordered waitqs, we allow multiple events to be
@@ -2236,6 +2395,8 @@ waitq_queue_iterate_locked(struct waitq *safeq, struct waitq *waitq,
 		}
 	}
 
+	waitq_stats_count_scan(safeq, scanned);
+
 	return first_thread;
 }
 
@@ -3921,6 +4082,7 @@ waitq_get_prepost_id(struct waitq *waitq)
 	}
 
 	wqp->wqp_wq.wqp_wq_ptr = waitq;
+	wqp->wqp_wq.wqp_wq_nposts = 0;
 
 	wqp_set_valid(wqp);
 	wqp_id = wqp->wqp_prepostid.id;
@@ -4490,6 +4652,7 @@ waitq_unlink_prepost_cb(struct waitq_set __unused *wqset, void *ctx,
 		/* this is the only prepost on this wait queue set */
 		wqdbg_v("unlink wqp (WQ) 0x%llx", wqp->wqp_prepostid.id);
 		ulctx->unlink_wqset->wqset_prepost_id = 0;
+		wq_prepost_wq_unref(wqp);
 		return WQ_ITERATE_BREAK;
 	}
 
@@ -5653,6 +5816,92 @@ waitq_wakeup64_thread(struct waitq *waitq,
 	return ret;
 }
 
+/**
+ * move threads waiting on 'src' for 'src_event' to 'dst', where they
+ * wait for 'dst_event' instead, without waking them up
+ *
+ * Conditions:
+ *	'src' and 'dst' are distinct turnstile waitqs, neither is locked,
+ *	and neither turnstile pushes on the other
+ *	the current thread has stashed the (possibly unchanged) inheritor
+ *	of the 'dst' turnstile with TURNSTILE_DELAYED_UPDATE
+ *
+ * Notes:
+ *	Threads are moved highest priority first, at most 'max_threads' of
+ *	them. 'fn' is called with each moved thread locked, so that the owner
+ *	of the waitqs can update whatever state it keeps about the wait.
+ *
+ *	Wait timers and interruptibility are preserved: a moved thread that
+ *	times out or is interrupted is pulled from 'dst'.
+ *
+ *	The priority of both turnstiles is recomputed, and the inheritor of the
+ *	'dst' turnstile is updated; the caller must complete the propagation
+ *	with turnstile_update_inheritor_complete() like after an assert wait.
+ *
+ * Returns:
+ *	the number of threads moved
+ */
+int
+waitq_transfer64(struct waitq *src,
+    event64_t src_event,
+    struct waitq *dst,
+    event64_t dst_event,
+    int max_threads,
+    waitq_transfer_fn_t fn,
+    void *arg)
+{
+	int moved = 0;
+	thread_t thread;
+	spl_t s;
+
+	assert(waitq_is_turnstile_queue(src) && waitq_is_turnstile_queue(dst));
+	assert(src != dst);
+
+	s = splsched();
+	/* the turnstiles don't push on each other: address order is safe */
+	if (src < dst) {
+		waitq_lock(src);
+		waitq_lock(dst);
+	} else {
+		waitq_lock(dst);
+		waitq_lock(src);
+	}
+
+	while (moved < max_threads &&
+	    !priority_queue_empty(&src->waitq_prio_queue)) {
+		thread = priority_queue_max(&src->waitq_prio_queue,
+		    struct thread, wait_prioq_links);
+
+		thread_lock(thread);
+		assert(thread->waitq == src);
+		if (thread->wait_event != src_event) {
+			thread_unlock(thread);
+			break;
+		}
+
+		waitq_thread_remove(src, thread);
+		turnstile_waitq_add_thread_priority_queue(dst, thread);
+		thread->wait_event = dst_event;
+		thread->waitq = dst;
+
+		fn(thread, arg);
+		thread_unlock(thread);
+		moved++;
+	}
+
+	if (moved) {
+		turnstile_recompute_priority_locked(waitq_to_turnstile(src));
+		turnstile_recompute_priority_locked(waitq_to_turnstile(dst));
+	}
+	turnstile_update_inheritor_locked(waitq_to_turnstile(dst));
+
+	waitq_unlock(src);
+	waitq_unlock(dst);
+	splx(s);
+
+	return moved;
+}
+
 /**
  * wakeup a single thread from a waitq that's waiting for a given event
  * and return a reference to that thread
@@ -118,6 +118,7 @@ struct wq_stats {
 	uint64_t wakeups;
 	uint64_t clears;
 	uint64_t failed_wakeups;
+	uint64_t scanned;
 
 	uintptr_t last_wait[NWAITQ_BTFRAMES];
 	uintptr_t last_wakeup[NWAITQ_BTFRAMES];
@@ -499,6 +500,32 @@ extern void waitq_link_stats(struct wq_table_stats *stats);
 extern void waitq_prepost_stats(struct wq_table_stats *stats);
 #endif /* CONFIG_WAITQ_STATS */
 
+/*
+ * global waitq hash table statistics
+ *
+ * The occupancy fields are a snapshot taken when the statistics are
+ * collected. The event counters are only maintained on kernels built
+ * with CONFIG_WAITQ_STATS, and are reported as 0 otherwise.
+ */
+#define WAITQ_GLOBAL_STATS_VERSION 1
+struct wq_global_stats {
+	uint32_t version;
+	uint32_t num_queues;            /* number of hash buckets */
+	uint32_t nonempty_queues;       /* buckets with at least one waiter */
+	uint32_t max_chain_len;         /* waiters in the most loaded bucket */
+	uint64_t waiters;               /* waiters across all buckets */
+
+	uint64_t waits;
+	uint64_t wakeups;
+	uint64_t clears;
+	uint64_t failed_wakeups;
+	uint64_t wakeup_scanned;        /* waiters inspected by wakeups */
+};
+
+#if DEVELOPMENT || DEBUG
+extern void waitq_global_stats_snapshot(struct wq_global_stats *stats);
+#endif /* DEVELOPMENT || DEBUG */
+
 /*
  *
  * higher-level waiting APIs
@@ -545,6 +572,17 @@ waitq_wakeup64_identify(struct waitq    *waitq,
     wait_result_t   result,
     int             priority);
 
+typedef void (*waitq_transfer_fn_t)(thread_t thread, void *arg);
+
+/* move waiters of <src,src_event> to <dst,dst_event> without waking them */
+extern int waitq_transfer64(struct waitq *src,
+    event64_t src_event,
+    struct waitq *dst,
+    event64_t dst_event,
+    int max_threads,
+    waitq_transfer_fn_t fn,
+    void *arg);
+
 /* take the waitq lock */
 extern void waitq_unlock(struct waitq *wq);
 
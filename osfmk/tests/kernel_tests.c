@@ -32,6 +32,8 @@
 #include <kern/macro_help.h>
 #include <kern/sched.h>
 #include <kern/locks.h>
+#include <kern/lock_brw.h>
+#include <kern/processor.h>
 #include <kern/sched_prim.h>
 #include <kern/misc_protos.h>
 #include <kern/thread_call.h>
@@ -68,6 +70,7 @@ kern_return_t ts_kernel_sleep_inheritor_test(void);
 kern_return_t ts_kernel_gate_test(void);
 kern_return_t ts_kernel_turnstile_chain_test(void);
 kern_return_t ts_kernel_timingsafe_bcmp_test(void);
+kern_return_t lck_brw_contention_test(void);
 
 #if __ARM_VFP__
 extern kern_return_t vfp_state_test(void);
@@ -134,6 +137,7 @@ struct xnupost_test kernel_post_tests[] = {XNUPOST_TEST_CONFIG_BASIC(zalloc_test
 	                                   XNUPOST_TEST_CONFIG_BASIC(ts_kernel_gate_test),
 	                                   XNUPOST_TEST_CONFIG_BASIC(ts_kernel_turnstile_chain_test),
 	                                   XNUPOST_TEST_CONFIG_BASIC(ts_kernel_timingsafe_bcmp_test),
+	                                   XNUPOST_TEST_CONFIG_BASIC(lck_brw_contention_test),
 	                                   XNUPOST_TEST_CONFIG_BASIC(kprintf_hhx_test),
 #if __ARM_VFP__
 	                                   XNUPOST_TEST_CONFIG_BASIC(vfp_state_test),
@@ -2477,6 +2481,128 @@ ts_kernel_turnstile_chain_test(void)
 	return KERN_SUCCESS;
 }
 
+#define BRW_TEST_ITERATIONS     100000
+#define BRW_TEST_WRITE_PERIOD   1000 /* one exclusive acquisition every N */
+
+struct brw_contention_test {
+	struct synch_test_common head;
+	bool use_brw;
+	lck_rw_t rw_lock;
+	lck_brw_t brw_lock;
+	uint64_t value_a;
+	uint64_t value_b;
+	int ready;
+	int go;
+	uint32_t mismatches;
+	uint64_t elapsed;
+};
+
+static void
+thread_brw_contention_work(
+	void *args,
+	__unused wait_result_t wr)
+{
+	struct brw_contention_test *info = (struct brw_contention_test *) args;
+	uint32_t mismatches = 0;
+	uint64_t start, end;
+
+	wake_threads(&info->ready);
+	wait_threads(&info->go, 1);
+
+	start = mach_absolute_time();
+	for (uint32_t i = 1; i <= BRW_TEST_ITERATIONS; i++) {
+		if (i % BRW_TEST_WRITE_PERIOD == 0) {
+			if (info->use_brw) {
+				lck_brw_lock_exclusive(&info->brw_lock);
+			} else {
+				lck_rw_lock_exclusive(&info->rw_lock);
+			}
+			info->value_a++;
+			info->value_b++;
+			if (info->use_brw) {
+				lck_brw_unlock_exclusive(&info->brw_lock);
+			} else {
+				lck_rw_unlock_exclusive(&info->rw_lock);
+			}
+		} else {
+			if (info->use_brw) {
+				lck_brw_lock_shared(&info->brw_lock);
+			} else {
+				lck_rw_lock_shared(&info->rw_lock);
+			}
+			if (info->value_a != info->value_b) {
+				mismatches++;
+			}
+			if (info->use_brw) {
+				lck_brw_unlock_shared(&info->brw_lock);
+			} else {
+				lck_rw_unlock_shared(&info->rw_lock);
+			}
+		}
+	}
+	end = mach_absolute_time();
+
+	os_atomic_add(&info->elapsed, end - start, relaxed);
+	os_atomic_add(&info->mismatches, mismatches, relaxed);
+
+	notify_waiter((struct synch_test_common *)info);
+	thread_terminate_self();
+}
+
+static uint64_t
+test_brw_contention(struct brw_contention_test *info, bool use_brw)
+{
+	uint64_t ns;
+
+	info->use_brw = use_brw;
+	info->ready = 0;
+	info->go = 0;
+	info->elapsed = 0;
+
+	start_threads((thread_continue_t)thread_brw_contention_work, (struct synch_test_common *)info, FALSE);
+	wait_threads(&info->ready, info->head.nthreads);
+	wake_threads(&info->go);
+	wait_all_thread((struct synch_test_common *)info);
+
+	absolutetime_to_nanoseconds(info->elapsed, &ns);
+	return ns / ((uint64_t)info->head.nthreads * BRW_TEST_ITERATIONS);
+}
+
+kern_return_t
+lck_brw_contention_test(void)
+{
+	struct brw_contention_test info = {};
+	uint64_t rw_ns, brw_ns;
+
+	init_synch_test_common((struct synch_test_common *)&info, processor_avail_count);
+	lck_attr_t* lck_attr = lck_attr_alloc_init();
+	lck_grp_attr_t* lck_grp_attr = lck_grp_attr_alloc_init();
+	lck_grp_t* lck_grp = lck_grp_alloc_init("test brw", lck_grp_attr);
+
+	lck_rw_init(&info.rw_lock, lck_grp, lck_attr);
+	lck_brw_init(&info.brw_lock, lck_grp, lck_attr);
+
+	T_LOG("Testing read-mostly contention on %u threads, lck_rw", info.head.nthreads);
+	rw_ns = test_brw_contention(&info, false);
+
+	T_LOG("Testing read-mostly contention on %u threads, lck_brw", info.head.nthreads);
+	brw_ns = test_brw_contention(&info, true);
+
+	T_LOG("lck_rw: %llu ns/acquisition, lck_brw: %llu ns/acquisition", rw_ns, brw_ns);
+	T_ASSERT(info.mismatches == 0, "readers never observed a torn update");
+	T_ASSERT(info.value_a == 2 * info.head.nthreads *
+	    (BRW_TEST_ITERATIONS / BRW_TEST_WRITE_PERIOD), "all writes were applied");
+
+	destroy_synch_test_common((struct synch_test_common *)&info);
+	lck_attr_free(lck_attr);
+	lck_grp_attr_free(lck_grp_attr);
+	lck_rw_destroy(&info.rw_lock, lck_grp);
+	lck_brw_destroy(&info.brw_lock, lck_grp);
+	lck_grp_free(lck_grp);
+
+	return KERN_SUCCESS;
+}
+
 kern_return_t
 ts_kernel_timingsafe_bcmp_test(void)
 {
@@ -1501,6 +1501,46 @@ memory_object_iopl_request(
 	return ret;
 }
 
+/*
+ *	Routine:	memory_object_control_iopl_request
+ *	Purpose:
+ *		Wire a portion of the vm_object behind a memory object
+ *		control into an I/O UPL, as memory_object_iopl_request()
+ *		does for named entries.  Unlike memory_object_upl_request(),
+ *		the pages are wired rather than kept busy, so they can be
+ *		referenced for a long time without blocking other users.
+ */
+kern_return_t
+memory_object_control_iopl_request(
+	memory_object_control_t control,
+	memory_object_offset_t  offset,
+	upl_size_t              size,
+	upl_t                   *upl_ptr,
+	upl_control_flags_t     cntrl_flags,
+	vm_tag_t                tag)
+{
+	vm_object_t             object;
+	kern_return_t           ret;
+
+	object = memory_object_control_to_vm_object(control);
+	if (object == VM_OBJECT_NULL) {
+		return KERN_TERMINATED;
+	}
+
+	vm_object_reference(object);
+	ret = vm_object_iopl_request(object,
+	    offset,
+	    size,
+	    upl_ptr,
+	    NULL,
+	    NULL,
+	    cntrl_flags,
+	    tag);
+	vm_object_deallocate(object);
+
+	return ret;
+}
+
 /*
  *	Routine:	memory_object_upl_request [interface]
  *	Purpose:
@@ -120,6 +120,14 @@ extern kern_return_t    memory_object_pages_resident(
 	memory_object_control_t         control,
 	boolean_t                       *               has_pages_resident);
 
+extern kern_return_t    memory_object_control_iopl_request(
+	memory_object_control_t         control,
+	memory_object_offset_t          offset,
+	upl_size_t                      size,
+	upl_t                           *upl_ptr,
+	upl_control_flags_t             cntrl_flags,
+	vm_tag_t                        tag);
+
 extern kern_return_t    memory_object_signed(
 	memory_object_control_t         control,
 	boolean_t                       is_signed);
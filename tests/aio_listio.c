@@ -0,0 +1,148 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/aio.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs.aio"),
+    T_META_CHECK_LEAKS(false));
+
+#define CHUNK_SIZE      4096
+#define FILE_SIZE       (AIO_LISTIO_MAX * CHUNK_SIZE)
+#define ROUNDS          2000
+
+static int
+make_test_file(const char *name)
+{
+	char path[PATH_MAX];
+	uint8_t *buf;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dt_tmpdir(), name);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(unlink(path), "unlink %s", path);
+
+	buf = malloc(FILE_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	for (size_t i = 0; i < FILE_SIZE; i++) {
+		buf[i] = (uint8_t)(i / CHUNK_SIZE + i);
+	}
+	T_QUIET; T_ASSERT_EQ(pwrite(fd, buf, FILE_SIZE, 0), (ssize_t)FILE_SIZE,
+	    "fill test file");
+	free(buf);
+
+	return fd;
+}
+
+static void
+prepare_reads(struct aiocb *cbs, struct aiocb **list, uint8_t *buf, int fd, int n)
+{
+	for (int i = 0; i < n; i++) {
+		cbs[i] = (struct aiocb){
+			.aio_fildes = fd,
+			.aio_offset = (off_t)i * CHUNK_SIZE,
+			.aio_buf = buf + i * CHUNK_SIZE,
+			.aio_nbytes = CHUNK_SIZE,
+			.aio_lio_opcode = LIO_READ,
+			.aio_sigevent.sigev_notify = SIGEV_NONE,
+		};
+		list[i] = &cbs[i];
+	}
+}
+
+T_DECL(aio_listio_wait,
+    "lio_listio(LIO_WAIT) completes every request of the batch")
+{
+	struct aiocb cbs[AIO_LISTIO_MAX], *list[AIO_LISTIO_MAX];
+	uint8_t *buf;
+	int fd;
+
+	fd = make_test_file("aio_listio_wait");
+	buf = calloc(1, FILE_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "calloc");
+
+	prepare_reads(cbs, list, buf, fd, AIO_LISTIO_MAX);
+	/* a NOP in the middle of the batch must be skipped */
+	cbs[AIO_LISTIO_MAX / 2].aio_lio_opcode = LIO_NOP;
+
+	T_ASSERT_POSIX_SUCCESS(lio_listio(LIO_WAIT, list, AIO_LISTIO_MAX, NULL),
+	    "lio_listio(LIO_WAIT, %d requests)", AIO_LISTIO_MAX);
+
+	for (int i = 0; i < AIO_LISTIO_MAX; i++) {
+		if (i == AIO_LISTIO_MAX / 2) {
+			(void)aio_return(&cbs[i]);
+			continue;
+		}
+		T_QUIET; T_EXPECT_EQ(aio_error(&cbs[i]), 0, "request %d succeeded", i);
+		T_QUIET; T_EXPECT_EQ(aio_return(&cbs[i]), (ssize_t)CHUNK_SIZE,
+		    "request %d read a full chunk", i);
+		for (size_t j = 0; j < CHUNK_SIZE; j++) {
+			size_t off = (size_t)i * CHUNK_SIZE + j;
+
+			if (buf[off] != (uint8_t)(off / CHUNK_SIZE + off)) {
+				T_FAIL("request %d: bad data at offset %zu", i, off);
+				break;
+			}
+		}
+	}
+	T_PASS("every request of the batch read the expected data");
+
+	free(buf);
+	close(fd);
+}
+
+static double
+listio_ns_per_request(int fd, uint8_t *buf, int n)
+{
+	struct aiocb cbs[AIO_LISTIO_MAX], *list[AIO_LISTIO_MAX];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+
+	start = mach_absolute_time();
+	for (int r = 0; r < ROUNDS; r++) {
+		prepare_reads(cbs, list, buf, fd, n);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(lio_listio(LIO_WAIT, list, n, NULL),
+		    "lio_listio");
+		for (int i = 0; i < n; i++) {
+			T_QUIET; T_ASSERT_EQ(aio_return(&cbs[i]), (ssize_t)CHUNK_SIZE,
+			    "aio_return");
+		}
+	}
+	end = mach_absolute_time();
+
+	mach_timebase_info(&tb);
+	return (double)((end - start) * tb.numer / tb.denom) / ((double)ROUNDS * n);
+}
+
+T_DECL(aio_listio_wait_perf,
+    "cost per request of cached reads submitted with lio_listio(LIO_WAIT)",
+    T_META_TAG_PERF)
+{
+	double single_ns, batch_ns;
+	uint8_t *buf;
+	int fd;
+
+	fd = make_test_file("aio_listio_wait_perf");
+	buf = malloc(FILE_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+
+	single_ns = listio_ns_per_request(fd, buf, 1);
+	batch_ns = listio_ns_per_request(fd, buf, AIO_LISTIO_MAX);
+
+	T_PERF("listio_1", single_ns, "ns", "ns per request, one request per batch");
+	T_PERF("listio_max", batch_ns, "ns", "ns per request, AIO_LISTIO_MAX requests per batch");
+	T_LOG("lio_listio(LIO_WAIT): %.0f ns/request alone, %.0f ns/request in batches of %d",
+	    single_ns, batch_ns, AIO_LISTIO_MAX);
+
+	free(buf);
+	close(fd);
+}
@@ -0,0 +1,204 @@
+/*
+ * Userspace model of the kernel's lck_brw_t ("big reader" lock with per-CPU
+ * reader indicators), benchmarked against pthread_rwlock_t, which like
+ * lck_rw_t keeps its reader count in a single shared word.
+ *
+ * The in-kernel equivalent lives in osfmk/tests/kernel_tests.c
+ * (lck_brw_contention_test).
+ */
+#include <darwintest.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/sysctl.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.locks"),
+    T_META_CHECK_LEAKS(false));
+
+#define ITERATIONS      1000000
+#define WRITE_PERIOD    1000
+#define MAX_THREADS     64
+#define CACHELINE       128
+
+struct brlock_slot {
+	_Atomic int32_t count;
+} __attribute__((aligned(CACHELINE)));
+
+struct brlock {
+	pthread_rwlock_t        writer_lock;
+	_Atomic uint32_t        writer;
+	struct brlock_slot      readers[MAX_THREADS];
+};
+
+static struct brlock g_brlock = {
+	.writer_lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+static pthread_rwlock_t g_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+static bool g_use_brlock;
+static uint64_t g_value_a, g_value_b;
+static _Atomic uint32_t g_mismatches;
+static _Atomic uint32_t g_ready;
+static _Atomic bool g_go;
+
+static int64_t
+brlock_reader_count(struct brlock *l)
+{
+	int64_t count = 0;
+
+	for (int i = 0; i < MAX_THREADS; i++) {
+		count += atomic_load_explicit(&l->readers[i].count, memory_order_relaxed);
+	}
+	return count;
+}
+
+static void
+brlock_lock_shared(struct brlock *l, int slot)
+{
+	atomic_fetch_add_explicit(&l->readers[slot].count, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&l->writer, memory_order_relaxed) == 0) {
+		atomic_thread_fence(memory_order_acquire);
+		return;
+	}
+
+	atomic_fetch_sub_explicit(&l->readers[slot].count, 1, memory_order_release);
+	pthread_rwlock_rdlock(&l->writer_lock);
+	atomic_fetch_add_explicit(&l->readers[slot].count, 1, memory_order_relaxed);
+	pthread_rwlock_unlock(&l->writer_lock);
+}
+
+static void
+brlock_unlock_shared(struct brlock *l, int slot)
+{
+	atomic_fetch_sub_explicit(&l->readers[slot].count, 1, memory_order_release);
+}
+
+static void
+brlock_lock_exclusive(struct brlock *l)
+{
+	pthread_rwlock_wrlock(&l->writer_lock);
+	atomic_store_explicit(&l->writer, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	/* the kernel blocks on an event here, the model just spins */
+	while (brlock_reader_count(l) != 0) {
+		pthread_yield_np();
+	}
+	atomic_thread_fence(memory_order_acquire);
+}
+
+static void
+brlock_unlock_exclusive(struct brlock *l)
+{
+	atomic_store_explicit(&l->writer, 0, memory_order_release);
+	pthread_rwlock_unlock(&l->writer_lock);
+}
+
+static void *
+contention_thread(void *arg)
+{
+	int slot = (int)(uintptr_t)arg;
+	uint32_t mismatches = 0;
+
+	atomic_fetch_add(&g_ready, 1);
+	while (!atomic_load(&g_go)) {
+		;
+	}
+
+	for (uint32_t i = 1; i <= ITERATIONS; i++) {
+		if (i % WRITE_PERIOD == 0) {
+			if (g_use_brlock) {
+				brlock_lock_exclusive(&g_brlock);
+			} else {
+				pthread_rwlock_wrlock(&g_rwlock);
+			}
+			g_value_a++;
+			g_value_b++;
+			if (g_use_brlock) {
+				brlock_unlock_exclusive(&g_brlock);
+			} else {
+				pthread_rwlock_unlock(&g_rwlock);
+			}
+		} else {
+			if (g_use_brlock) {
+				brlock_lock_shared(&g_brlock, slot);
+			} else {
+				pthread_rwlock_rdlock(&g_rwlock);
+			}
+			if (g_value_a != g_value_b) {
+				mismatches++;
+			}
+			if (g_use_brlock) {
+				brlock_unlock_shared(&g_brlock, slot);
+			} else {
+				pthread_rwlock_unlock(&g_rwlock);
+			}
+		}
+	}
+
+	atomic_fetch_add(&g_mismatches, mismatches);
+	return NULL;
+}
+
+static double
+run_contention(bool use_brlock, int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+
+	g_use_brlock = use_brlock;
+	g_value_a = g_value_b = 0;
+	atomic_store(&g_ready, 0);
+	atomic_store(&g_go, false);
+
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    contention_thread, (void *)(uintptr_t)i), "pthread_create");
+	}
+	while (atomic_load(&g_ready) != (uint32_t)nthreads) {
+		pthread_yield_np();
+	}
+
+	start = mach_absolute_time();
+	atomic_store(&g_go, true);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	end = mach_absolute_time();
+
+	T_QUIET; T_ASSERT_EQ(g_value_a, (uint64_t)nthreads * (ITERATIONS / WRITE_PERIOD),
+	    "all writes were applied");
+
+	mach_timebase_info(&tb);
+	return (double)((end - start) * tb.numer / tb.denom) /
+	       ((double)nthreads * ITERATIONS);
+}
+
+T_DECL(big_reader_lock_contention,
+    "read-mostly contention: single word rwlock vs. per-CPU reader indicators",
+    T_META_TAG_PERF)
+{
+	int ncpu = 0;
+	size_t size = sizeof(ncpu);
+	double rw_ns, br_ns;
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0),
+	    "hw.ncpu");
+	if (ncpu > MAX_THREADS) {
+		ncpu = MAX_THREADS;
+	}
+
+	rw_ns = run_contention(false, ncpu);
+	br_ns = run_contention(true, ncpu);
+
+	T_ASSERT_EQ(atomic_load(&g_mismatches), 0u, "readers never observed a torn update");
+
+	T_PERF("pthread_rwlock", rw_ns, "ns", "ns per acquisition, single reader word");
+	T_PERF("brlock", br_ns, "ns", "ns per acquisition, per-CPU reader indicators");
+	T_LOG("%d threads: rwlock %.1f ns/op, brlock %.1f ns/op", ncpu, rw_ns, br_ns);
+}
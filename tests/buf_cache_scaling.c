@@ -0,0 +1,145 @@
+#include <darwintest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+#define MAX_THREADS     64
+#define RAMDISK_SECTORS 32768           /* 16MB */
+#define BLOCK_SIZE      4096
+#define NBLOCKS         (RAMDISK_SECTORS * 512 / BLOCK_SIZE)
+#define READS           100000
+
+static char g_disk[64];
+static int g_fd = -1;
+static _Atomic uint32_t g_ready;
+static _Atomic bool g_go;
+
+static int
+ncpus(void)
+{
+	int ncpu = 0;
+	size_t size = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0),
+	    "hw.ncpu");
+	return ncpu > MAX_THREADS ? MAX_THREADS : ncpu;
+}
+
+static void
+eject_ramdisk(void)
+{
+	char cmd[128];
+
+	if (g_fd != -1) {
+		close(g_fd);
+	}
+	snprintf(cmd, sizeof(cmd), "hdik -e %s", g_disk);
+	system(cmd);
+}
+
+/* attaches an unmounted ramdisk and opens its block device */
+static void
+attach_ramdisk(void)
+{
+	char cmd[128];
+	FILE *out;
+
+	snprintf(cmd, sizeof(cmd), "hdik -nomount ram://%d", RAMDISK_SECTORS);
+	out = popen(cmd, "r");
+	T_QUIET; T_ASSERT_NOTNULL(out, "hdik");
+	T_QUIET; T_ASSERT_NOTNULL(fgets(g_disk, sizeof(g_disk), out), "read device name");
+	pclose(out);
+	g_disk[strcspn(g_disk, " \t\n")] = '\0';
+	T_QUIET; T_ASSERT_EQ(strncmp(g_disk, "/dev/disk", 9), 0, "ramdisk %s", g_disk);
+	T_ATEND(eject_ramdisk);
+
+	/* the block device, not /dev/rdisk: reads go through the buffer cache */
+	g_fd = open(g_disk, O_RDWR);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(g_fd, "open %s", g_disk);
+}
+
+static void *
+reader(void *arg)
+{
+	uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+	char buf[BLOCK_SIZE];
+
+	atomic_fetch_add(&g_ready, 1);
+	while (!atomic_load(&g_go)) {
+		;
+	}
+
+	for (int i = 0; i < READS; i++) {
+		off_t blk;
+
+		seed = seed * 1103515245u + 12345u;
+		blk = (off_t)(seed >> 8) % NBLOCKS;
+		T_QUIET; T_ASSERT_EQ(pread(g_fd, buf, sizeof(buf), blk * BLOCK_SIZE),
+		    (ssize_t)sizeof(buf), "pread block %lld", blk);
+	}
+	return NULL;
+}
+
+static double
+run_readers(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+
+	atomic_store(&g_ready, 0);
+	atomic_store(&g_go, false);
+
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    reader, (void *)(uintptr_t)i), "pthread_create");
+	}
+	while (atomic_load(&g_ready) != (uint32_t)nthreads) {
+		pthread_yield_np();
+	}
+
+	start = mach_absolute_time();
+	atomic_store(&g_go, true);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	end = mach_absolute_time();
+
+	mach_timebase_info(&tb);
+	/* wall clock time per read, per thread: flat when the cache scales */
+	return (double)((end - start) * tb.numer / tb.denom) / READS;
+}
+
+T_DECL(buf_cache_scaling,
+    "buf_getblk()/buf_brelse() of cached blocks of a ramdisk from many threads",
+    T_META_TAG_PERF, T_META_ASROOT(true))
+{
+	int ncpu = ncpus();
+
+	attach_ramdisk();
+
+	/* warm up the cache: the disk is small enough to fit in it */
+	run_readers(1);
+	for (int n = 1; n <= ncpu; n *= 2) {
+		char name[32];
+		double ns;
+
+		ns = run_readers(n);
+		snprintf(name, sizeof(name), "getblk_%d_threads", n);
+		T_PERF(name, ns, "ns", "wall clock ns per cached block read of each thread");
+		T_LOG("%2d threads: %.0f ns per block read", n, ns);
+	}
+}
@@ -0,0 +1,202 @@
+#include <darwintest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.fd"),
+    T_META_CHECK_LEAKS(false));
+
+/* private system calls, see <sys/fcntl.h> */
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC     0x0001
+#endif
+int close_range_np(unsigned int lowfd, unsigned int highfd, int flags);
+int closev_np(const int *fds, unsigned int nfds, int flags);
+
+#define MANY_FDS        100000
+
+/* opens n descriptors from the first free one up, returns the first */
+static int
+open_fds(int n)
+{
+	int first, fd;
+
+	first = open("/dev/null", O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(first, "open /dev/null");
+	for (int i = 1; i < n; i++) {
+		fd = dup(first);
+		T_QUIET; T_ASSERT_EQ(fd, first + i, "dup %d", i);
+	}
+	return first;
+}
+
+static bool
+fd_is_open(int fd)
+{
+	return fcntl(fd, F_GETFD) != -1;
+}
+
+/* returns how many descriptors the process can open, up to n */
+static int
+raise_fd_limit(int n)
+{
+	int maxfiles = 0;
+	size_t size = sizeof(maxfiles);
+	struct rlimit rl;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.maxfilesperproc",
+	    &maxfiles, &size, NULL, 0), "kern.maxfilesperproc");
+	if (n > maxfiles - 64) {
+		n = maxfiles - 64;
+	}
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getrlimit(RLIMIT_NOFILE, &rl), "getrlimit");
+	if (rl.rlim_cur < (rlim_t)n + 64) {
+		rl.rlim_cur = (rlim_t)n + 64;
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(setrlimit(RLIMIT_NOFILE, &rl), "setrlimit");
+	}
+	return n;
+}
+
+T_DECL(close_range_np,
+    "close_range_np() closes or marks close-on-exec the descriptors of a range")
+{
+	int first = open_fds(64);
+
+	T_ASSERT_POSIX_SUCCESS(close_range_np((unsigned)first + 8, (unsigned)first + 15, 0),
+	    "close a range of 8 descriptors");
+	for (int fd = first; fd < first + 64; fd++) {
+		bool inside = fd >= first + 8 && fd <= first + 15;
+
+		T_QUIET; T_EXPECT_EQ(fd_is_open(fd), !inside, "descriptor %d", fd);
+	}
+
+	T_ASSERT_POSIX_SUCCESS(close_range_np((unsigned)first + 32, (unsigned)first + 47,
+	    CLOSE_RANGE_CLOEXEC), "mark a range close-on-exec");
+	for (int fd = first + 16; fd < first + 64; fd++) {
+		bool inside = fd >= first + 32 && fd <= first + 47;
+
+		T_QUIET; T_EXPECT_EQ(fcntl(fd, F_GETFD), inside ? FD_CLOEXEC : 0,
+		    "descriptor %d", fd);
+	}
+
+	T_ASSERT_POSIX_SUCCESS(close_range_np((unsigned)first + 60, ~0u, 0),
+	    "close a range running past the end of the table");
+	T_EXPECT_FALSE(fd_is_open(first + 63), "the last descriptor is closed");
+	T_EXPECT_TRUE(fd_is_open(first + 59), "the one before the range is open");
+
+	T_EXPECT_POSIX_FAILURE(close_range_np(10, 9, 0), EINVAL, "inverted range");
+	T_EXPECT_POSIX_FAILURE(close_range_np(0, 0, 0x100), EINVAL, "unknown flags");
+
+	T_ASSERT_POSIX_SUCCESS(close_range_np((unsigned)first, (unsigned)first + 63, 0),
+	    "close everything left");
+	T_EXPECT_EQ(open("/dev/null", O_RDONLY), first, "the lowest descriptor is reused");
+	close(first);
+}
+
+T_DECL(closev_np,
+    "closev_np() closes every descriptor of a set and reports bad ones")
+{
+	int first = open_fds(16);
+	int set[] = { first + 3, first + 7, first + 1, first + 12 };
+	int bad[] = { first + 2, first + 3, first + 4 };
+
+	T_ASSERT_POSIX_SUCCESS(closev_np(set, 4, 0), "close a set of 4 descriptors");
+	for (int fd = first; fd < first + 16; fd++) {
+		bool inside = fd == first + 1 || fd == first + 3 ||
+		    fd == first + 7 || fd == first + 12;
+
+		T_QUIET; T_EXPECT_EQ(fd_is_open(fd), !inside, "descriptor %d", fd);
+	}
+
+	T_EXPECT_POSIX_FAILURE(closev_np(bad, 3, 0), EBADF,
+	    "a set with a closed descriptor");
+	T_EXPECT_FALSE(fd_is_open(first + 2), "the open ones are closed anyway");
+	T_EXPECT_FALSE(fd_is_open(first + 4), "the open ones are closed anyway");
+
+	T_EXPECT_POSIX_FAILURE(closev_np(set, 4, 1), EINVAL, "unknown flags");
+	T_EXPECT_POSIX_FAILURE(closev_np((const int *)8, 4, 0), EFAULT, "bad address");
+
+	close_range_np((unsigned)first, (unsigned)first + 15, 0);
+}
+
+static double
+ns_since(uint64_t start)
+{
+	mach_timebase_info_data_t tb;
+
+	mach_timebase_info(&tb);
+	return (double)((mach_absolute_time() - start) * tb.numer / tb.denom);
+}
+
+T_DECL(close_range_perf,
+    "cost of closing many descriptors one by one and with close_range_np()",
+    T_META_TAG_PERF)
+{
+	int n = raise_fd_limit(MANY_FDS);
+	double loop_ns, range_ns;
+	uint64_t start;
+	int first;
+
+	first = open_fds(n);
+	start = mach_absolute_time();
+	for (int fd = first; fd < first + n; fd++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(close(fd), "close");
+	}
+	loop_ns = ns_since(start) / n;
+
+	first = open_fds(n);
+	start = mach_absolute_time();
+	T_ASSERT_POSIX_SUCCESS(close_range_np((unsigned)first, (unsigned)first + n, 0),
+	    "close_range_np");
+	range_ns = ns_since(start) / n;
+	T_QUIET; T_ASSERT_FALSE(fd_is_open(first + n / 2), "descriptors are closed");
+
+	T_PERF("close_loop", loop_ns, "ns", "ns per descriptor, one close() each");
+	T_PERF("close_range", range_ns, "ns", "ns per descriptor, close_range_np()");
+	T_LOG("%d descriptors: %.0f ns each with close(), %.0f ns each with close_range_np()",
+	    n, loop_ns, range_ns);
+}
+
+T_DECL(close_range_spawn_perf,
+    "posix_spawn() with POSIX_SPAWN_CLOEXEC_DEFAULT from a process with many descriptors",
+    T_META_TAG_PERF)
+{
+	int n = raise_fd_limit(MANY_FDS);
+	char *argv[] = { "/usr/bin/true", NULL };
+	posix_spawnattr_t attr;
+	double spawn_ns;
+	uint64_t start;
+	int first, status;
+	pid_t pid;
+
+	first = open_fds(n);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawnattr_init(&attr), "posix_spawnattr_init");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawnattr_setflags(&attr,
+	    POSIX_SPAWN_CLOEXEC_DEFAULT), "posix_spawnattr_setflags");
+
+	start = mach_absolute_time();
+	T_ASSERT_POSIX_ZERO(posix_spawn(&pid, argv[0], NULL, &attr, argv, NULL),
+	    "posix_spawn");
+	T_QUIET; T_ASSERT_EQ(waitpid(pid, &status, 0), pid, "waitpid");
+	spawn_ns = ns_since(start);
+	T_EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child succeeded");
+
+	posix_spawnattr_destroy(&attr);
+	close_range_np((unsigned)first, (unsigned)first + n, 0);
+
+	T_PERF("spawn_cloexec_default", spawn_ns / 1000, "us",
+	    "posix_spawn() and wait with POSIX_SPAWN_CLOEXEC_DEFAULT");
+	T_LOG("posix_spawn() with %d descriptors to close: %.0f us", n, spawn_ns / 1000);
+}
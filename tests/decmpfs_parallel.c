@@ -0,0 +1,161 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+#define FILE_SIZE       (64 << 20)
+#define BLOCK_SIZE      4096
+#define STRIDE          (48 << 10)
+
+/* kinds of payload: text that compresses very well, and data that barely does */
+enum { PAYLOAD_TEXT, PAYLOAD_NOISY };
+
+static uint64_t
+counter(const char *name)
+{
+	uint64_t val = 0;
+	size_t size = sizeof(val);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &val, &size, NULL, 0), "%s", name);
+	return val;
+}
+
+/* the expected contents of a block: its number, then filler */
+static void
+fill_block(char *buf, uint64_t blkno, int payload)
+{
+	uint32_t seed = (uint32_t)blkno * 2654435761u + 1;
+
+	memset(buf, 0, BLOCK_SIZE);
+	memcpy(buf, &blkno, sizeof(blkno));
+	for (size_t i = sizeof(blkno); i < BLOCK_SIZE; i++) {
+		if (payload == PAYLOAD_TEXT) {
+			buf[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+		} else {
+			seed = seed * 1103515245u + 12345u;
+			/* a few bits of noise per byte, so it compresses some */
+			buf[i] = (char)('a' + ((seed >> 16) & 0x7));
+		}
+	}
+}
+
+/* creates a transparently compressed file, skipping if that isn't possible here */
+static void
+make_compressed_file(const char *path, int payload)
+{
+	char src[PATH_MAX], cmd[2 * PATH_MAX + 64];
+	char *buf = malloc(BLOCK_SIZE);
+	struct stat st;
+	int fd;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	snprintf(src, sizeof(src), "%s.src", path);
+	fd = open(src, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create %s", src);
+	for (uint64_t blk = 0; blk < FILE_SIZE / BLOCK_SIZE; blk++) {
+		fill_block(buf, blk, payload);
+		T_QUIET; T_ASSERT_EQ(write(fd, buf, BLOCK_SIZE), (ssize_t)BLOCK_SIZE, "write");
+	}
+	close(fd);
+	free(buf);
+
+	snprintf(cmd, sizeof(cmd), "ditto --hfsCompression '%s' '%s'", src, path);
+	T_QUIET; T_ASSERT_EQ(system(cmd), 0, "%s", cmd);
+	unlink(src);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(stat(path, &st), "stat %s", path);
+	if (!(st.st_flags & UF_COMPRESSED)) {
+		T_SKIP("%s is not compressed; the file system doesn't support it", path);
+	}
+	T_QUIET; T_ASSERT_EQ(st.st_size, (off_t)FILE_SIZE, "uncompressed size");
+}
+
+/* touches every stride'th block of the mapped file, checking its contents */
+static double
+scan(const char *path, int payload, size_t stride)
+{
+	char *expected = malloc(BLOCK_SIZE);
+	mach_timebase_info_data_t tb;
+	uint64_t start, ns;
+	char *map;
+	int fd;
+
+	T_QUIET; T_ASSERT_NOTNULL(expected, "malloc");
+	fd = open(path, O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", path);
+	map = mmap(NULL, FILE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)map, MAP_FAILED, "mmap");
+
+	start = mach_absolute_time();
+	for (size_t off = 0; off < FILE_SIZE; off += stride) {
+		fill_block(expected, off / BLOCK_SIZE, payload);
+		T_QUIET; T_ASSERT_EQ(memcmp(map + off, expected, BLOCK_SIZE), 0,
+		    "contents of block %zu", off / BLOCK_SIZE);
+	}
+	mach_timebase_info(&tb);
+	ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	munmap(map, FILE_SIZE);
+	close(fd);
+	free(expected);
+	return (double)FILE_SIZE / (1 << 20) / ((double)ns / 1e9);
+}
+
+static void
+run(const char *name, int payload)
+{
+	uint64_t parallel, hits, prefetches;
+	char path[PATH_MAX], perf[64];
+	double mbs;
+
+	snprintf(path, sizeof(path), "%s/%s_seq", dt_tmpdir(), name);
+	make_compressed_file(path, payload);
+	parallel = counter("debug.decmpfs_parallel_fetches");
+	prefetches = counter("debug.decmpfs_prefetches");
+	mbs = scan(path, payload, BLOCK_SIZE);
+	snprintf(perf, sizeof(perf), "%s_sequential", name);
+	T_PERF(perf, mbs, "MB/s", "sequential page faults on a cold compressed file");
+	T_LOG("%s: sequential faults %.0f MB/s, %llu parallel fetches, %llu prefetches", name, mbs,
+	    counter("debug.decmpfs_parallel_fetches") - parallel,
+	    counter("debug.decmpfs_prefetches") - prefetches);
+	T_EXPECT_GT(counter("debug.decmpfs_parallel_fetches") + counter("debug.decmpfs_prefetches"),
+	    parallel + prefetches, "pageins were decompressed in parallel or ahead");
+	unlink(path);
+
+	snprintf(path, sizeof(path), "%s/%s_strided", dt_tmpdir(), name);
+	make_compressed_file(path, payload);
+	hits = counter("debug.decmpfs_chunk_hits");
+	mbs = scan(path, payload, STRIDE);
+	snprintf(perf, sizeof(perf), "%s_strided", name);
+	T_PERF(perf, mbs, "MB/s", "strided page faults on a cold compressed file");
+	T_LOG("%s: strided faults %.0f MB/s, %llu chunk cache hits", name, mbs,
+	    counter("debug.decmpfs_chunk_hits") - hits);
+	unlink(path);
+}
+
+T_DECL(decmpfs_parallel_text,
+    "page faults on a compressed file of text return the right data",
+    T_META_TAG_PERF)
+{
+	run("text", PAYLOAD_TEXT);
+}
+
+T_DECL(decmpfs_parallel_noisy,
+    "page faults on a compressed file of poorly compressible data return the right data",
+    T_META_TAG_PERF)
+{
+	run("noisy", PAYLOAD_NOISY);
+}
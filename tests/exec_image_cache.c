@@ -0,0 +1,118 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.exec"),
+    T_META_CHECK_LEAKS(false));
+
+#define SPAWNS          200
+
+/* returns the wait status, or -1 if posix_spawn() itself failed */
+static int
+spawn_status(const char *path)
+{
+	char *argv[] = { (char *)path, NULL };
+	int error, status;
+	pid_t pid;
+
+	error = posix_spawn(&pid, path, NULL, NULL, argv, NULL);
+	if (error) {
+		T_LOG("posix_spawn(%s): %d", path, error);
+		return -1;
+	}
+	T_QUIET; T_ASSERT_EQ(waitpid(pid, &status, 0), pid, "waitpid");
+	return status;
+}
+
+/* copies src over the data of dst, in place: dst keeps its vnode */
+static void
+copy_in_place(const char *src, const char *dst)
+{
+	char buf[16384];
+	int in, out;
+	ssize_t n;
+
+	in = open(src, O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(in, "open %s", src);
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(out, "open %s", dst);
+
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		T_QUIET; T_ASSERT_EQ(write(out, buf, (size_t)n), n, "write");
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "read");
+
+	close(in);
+	close(out);
+}
+
+T_DECL(exec_image_cache_invalidate,
+    "exec does not run load commands cached from before the file changed")
+{
+	char path[PATH_MAX];
+	int status;
+
+	snprintf(path, sizeof(path), "%s/exec_image_cache", dt_tmpdir());
+	copy_in_place("/usr/bin/true", path);
+
+	for (int i = 0; i < 3; i++) {
+		status = spawn_status(path);
+		T_QUIET; T_ASSERT_TRUE(status != -1 && WIFEXITED(status) &&
+		    WEXITSTATUS(status) == 0, "copy of true succeeds");
+	}
+
+	/* may be killed for its stale signature, but must not be true again */
+	copy_in_place("/usr/bin/false", path);
+	status = spawn_status(path);
+	T_EXPECT_FALSE(status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	    "true rewritten in place as false does not succeed");
+
+	copy_in_place("/usr/bin/true", path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(truncate(path, 4096), "truncate");
+	status = spawn_status(path);
+	T_EXPECT_FALSE(status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	    "a truncated executable does not run");
+
+	unlink(path);
+}
+
+T_DECL(exec_image_cache_perf,
+    "posix_spawn() latency when the same executable is run again and again",
+    T_META_TAG_PERF)
+{
+	char *argv[] = { "/usr/bin/true", NULL };
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+	double spawn_us;
+	int status;
+	pid_t pid;
+
+	/* the first spawn fills the caches */
+	T_QUIET; T_ASSERT_NE(spawn_status(argv[0]), -1, "posix_spawn");
+
+	start = mach_absolute_time();
+	for (int i = 0; i < SPAWNS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn(&pid, argv[0], NULL, NULL, argv, NULL),
+		    "posix_spawn");
+		T_QUIET; T_ASSERT_EQ(waitpid(pid, &status, 0), pid, "waitpid");
+	}
+	end = mach_absolute_time();
+
+	mach_timebase_info(&tb);
+	spawn_us = (double)((end - start) * tb.numer / tb.denom) / SPAWNS / 1000;
+
+	T_PERF("spawn_true", spawn_us, "us", "posix_spawn() and wait of the same executable");
+	T_LOG("posix_spawn() of %s: %.1f us", argv[0], spawn_us);
+}
@@ -0,0 +1,174 @@
+#include <darwintest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.fd"),
+    T_META_CHECK_LEAKS(false));
+
+#define MAX_THREADS     64
+#define READS           500000
+#define CHURN_ROUNDS    20000
+
+static _Atomic uint32_t g_ready;
+static _Atomic bool g_go;
+static _Atomic bool g_stop;
+
+static int
+ncpus(void)
+{
+	int ncpu = 0;
+	size_t size = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0),
+	    "hw.ncpu");
+	return ncpu > MAX_THREADS ? MAX_THREADS : ncpu;
+}
+
+/* every thread reads from a descriptor of its own: only the fd table is shared */
+static void *
+distinct_fd_reader(void *arg __unused)
+{
+	char c;
+	int fd;
+
+	fd = open("/dev/null", O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open /dev/null");
+
+	atomic_fetch_add(&g_ready, 1);
+	while (!atomic_load(&g_go)) {
+		;
+	}
+
+	for (int i = 0; i < READS; i++) {
+		T_QUIET; T_ASSERT_EQ(read(fd, &c, 1), 0L, "read");
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static double
+run_readers(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+
+	atomic_store(&g_ready, 0);
+	atomic_store(&g_go, false);
+
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    distinct_fd_reader, NULL), "pthread_create");
+	}
+	while (atomic_load(&g_ready) != (uint32_t)nthreads) {
+		pthread_yield_np();
+	}
+
+	start = mach_absolute_time();
+	atomic_store(&g_go, true);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	end = mach_absolute_time();
+
+	mach_timebase_info(&tb);
+	/* wall clock time per read, per thread: flat when reads scale */
+	return (double)((end - start) * tb.numer / tb.denom) / READS;
+}
+
+T_DECL(fd_lookup_scaling,
+    "read() on distinct descriptors from an increasing number of threads",
+    T_META_TAG_PERF)
+{
+	int ncpu = ncpus();
+
+	for (int n = 1; n <= ncpu; n *= 2) {
+		char name[32];
+		double ns;
+
+		ns = run_readers(n);
+		snprintf(name, sizeof(name), "read_%d_threads", n);
+		T_PERF(name, ns, "ns", "wall clock ns per read() of each thread");
+		T_LOG("%2d threads: %.1f ns per read, %.1f Mreads/s", n, ns,
+		    (double)n * 1000.0 / ns);
+	}
+}
+
+static int g_churn_fd;
+
+static void *
+churn_reader(void *arg __unused)
+{
+	char c;
+
+	while (!atomic_load(&g_stop)) {
+		ssize_t rc = read(g_churn_fd, &c, 1);
+
+		if (rc < 0) {
+			T_QUIET; T_ASSERT_EQ(errno, EBADF, "read fails only with EBADF");
+		} else {
+			T_QUIET; T_ASSERT_EQ(rc, 0L, "read returns EOF");
+		}
+	}
+	return NULL;
+}
+
+T_DECL(fd_lookup_close_race,
+    "reads racing with close(), dup2() and table growth on their descriptor")
+{
+	pthread_t threads[MAX_THREADS];
+	int nthreads = ncpus();
+	int spare[256];
+
+	g_churn_fd = open("/dev/null", O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(g_churn_fd, "open /dev/null");
+	atomic_store(&g_stop, false);
+
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    churn_reader, NULL), "pthread_create");
+	}
+
+	for (int round = 0; round < CHURN_ROUNDS; round++) {
+		int fd = open("/dev/null", O_RDONLY);
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open /dev/null");
+		if (round & 1) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(close(g_churn_fd), "close");
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(dup2(fd, g_churn_fd), "dup2");
+		} else {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(dup2(fd, g_churn_fd), "dup2");
+		}
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(close(fd), "close");
+
+		/* every so often, make the table grow */
+		if (round % 1000 == 0) {
+			for (int i = 0; i < 256; i++) {
+				spare[i] = dup(g_churn_fd);
+			}
+			for (int i = 0; i < 256; i++) {
+				if (spare[i] >= 0) {
+					close(spare[i]);
+				}
+			}
+		}
+	}
+
+	atomic_store(&g_stop, true);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	close(g_churn_fd);
+
+	T_PASS("%d rounds of descriptor churn under concurrent reads", CHURN_ROUNDS);
+}
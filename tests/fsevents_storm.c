@@ -0,0 +1,257 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fsevents.h>
+#include <sys/ioctl.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+#define NFILES          2048
+#define WINDOW          32              /* files being written "in parallel" */
+#define ROUNDS          8
+#define QUEUE_DEPTH     256
+#define READ_SIZE       (64 << 10)
+
+static char g_dir[PATH_MAX];
+
+static int
+sysctl_int(const char *name)
+{
+	int val = 0;
+	size_t size = sizeof(val);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &val, &size, NULL, 0), "%s", name);
+	return val;
+}
+
+/* clones a watcher of content-modified (and rename) events with a small queue */
+static int
+open_watcher(bool renames)
+{
+	int8_t events[FSE_MAX_EVENTS];
+	fsevent_clone_args args;
+	int fd, cfd = -1;
+
+	memset(events, FSE_IGNORE, sizeof(events));
+	events[FSE_CONTENT_MODIFIED] = FSE_REPORT;
+	if (renames) {
+		events[FSE_RENAME] = FSE_REPORT;
+	}
+
+	fd = open("/dev/fsevents", O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open /dev/fsevents");
+	args = (fsevent_clone_args){
+		.event_list = events,
+		.num_events = FSE_MAX_EVENTS,
+		.event_queue_depth = QUEUE_DEPTH,
+		.fd = &cfd,
+	};
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, FSEVENTS_CLONE, &args), "FSEVENTS_CLONE");
+	close(fd);
+	return cfd;
+}
+
+/* rewrites every file ROUNDS times, WINDOW files at a time */
+static void
+storm(void)
+{
+	char path[PATH_MAX];
+
+	for (int base = 0; base < NFILES; base += WINDOW) {
+		for (int round = 0; round < ROUNDS; round++) {
+			for (int i = base; i < base + WINDOW; i++) {
+				int fd;
+
+				snprintf(path, sizeof(path), "%s/f%d", g_dir, i);
+				fd = open(path, O_CREAT | O_WRONLY, 0644);
+				T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", path);
+				T_QUIET; T_ASSERT_EQ(pwrite(fd, &round, sizeof(round), 0), (ssize_t)sizeof(round),
+				    "pwrite");
+				close(fd);
+			}
+		}
+	}
+}
+
+/*
+ * reads events until the watcher goes quiet, counting the ones for
+ * files in g_dir and noting whether any were dropped
+ */
+static int
+drain(int fd, bool *seen, bool *dropped)
+{
+	char *buf = malloc(READ_SIZE);
+	size_t dirlen = strlen(g_dir);
+	int count = 0;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	for (;;) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		ssize_t n, off = 0;
+
+		if (poll(&pfd, 1, 1000) <= 0) {
+			break;
+		}
+		n = read(fd, buf, READ_SIZE);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "read");
+
+		while (off < n) {
+			int32_t type;
+			uint16_t arg, len;
+
+			memcpy(&type, buf + off, sizeof(type));
+			off += 2 * sizeof(int32_t);                 /* type, pid */
+			if (type == FSE_EVENTS_DROPPED) {
+				*dropped = true;
+			}
+			for (;;) {
+				memcpy(&arg, buf + off, sizeof(arg));
+				off += sizeof(arg);
+				if (arg == FSE_ARG_DONE) {
+					break;
+				}
+				memcpy(&len, buf + off, sizeof(len));
+				off += sizeof(len);
+				if (arg == FSE_ARG_STRING && strncmp(buf + off, g_dir, dirlen) == 0 &&
+				    buf[off + dirlen] == '/') {
+					int i = atoi(buf + off + dirlen + 2);
+
+					if (i >= 0 && i < NFILES) {
+						seen[i] = true;
+					}
+					count++;
+				}
+				off += len;
+			}
+		}
+	}
+	free(buf);
+	return count;
+}
+
+T_DECL(fsevents_storm,
+    "a watcher with a small queue sees every file of a modification storm, coalesced",
+    T_META_TAG_PERF, T_META_ASROOT(true))
+{
+	bool *seen = calloc(NFILES, sizeof(bool));
+	int coalesced, grows, events, missing = 0;
+	mach_timebase_info_data_t tb;
+	bool dropped = false;
+	uint64_t start, ns;
+	int fd;
+
+	T_QUIET; T_ASSERT_NOTNULL(seen, "calloc");
+	T_QUIET; T_ASSERT_NOTNULL(realpath(dt_tmpdir(), g_dir), "realpath");
+	strlcat(g_dir, "/storm", sizeof(g_dir));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(g_dir, 0755), "mkdir %s", g_dir);
+
+	fd = open_watcher(false);
+	coalesced = sysctl_int("debug.fsevents_coalesced");
+	grows = sysctl_int("debug.fsevents_eventq_grows");
+
+	start = mach_absolute_time();
+	storm();
+	mach_timebase_info(&tb);
+	ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	events = drain(fd, seen, &dropped);
+	for (int i = 0; i < NFILES; i++) {
+		missing += !seen[i];
+	}
+
+	T_EXPECT_FALSE(dropped, "no events were dropped");
+	T_EXPECT_EQ(missing, 0, "every modified file was reported");
+	T_EXPECT_LT(events, NFILES * ROUNDS, "repeated modifications were coalesced");
+	T_EXPECT_GT(sysctl_int("debug.fsevents_coalesced"), coalesced, "events were coalesced in the kernel");
+	T_EXPECT_GT(sysctl_int("debug.fsevents_eventq_grows"), grows, "the watcher's queue grew");
+	T_PERF("fsevents_storm", (double)NFILES * ROUNDS / ((double)ns / 1e9), "ops/s",
+	    "open/write/close of files with an fsevents watcher");
+	T_LOG("%d modifications: %d events, %.0f ops/s", NFILES * ROUNDS, events,
+	    (double)NFILES * ROUNDS / ((double)ns / 1e9));
+
+	close(fd);
+	free(seen);
+}
+
+static void
+write_file(const char *path)
+{
+	int fd = open(path, O_CREAT | O_WRONLY, 0644);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", path);
+	T_QUIET; T_ASSERT_EQ(write(fd, "x", 1), 1L, "write %s", path);
+	close(fd);
+}
+
+T_DECL(fsevents_coalesce_rename,
+    "a modification after a rename is reported even within the coalescing window",
+    T_META_ASROOT(true))
+{
+	char a[PATH_MAX], b[PATH_MAX];
+	char *buf = malloc(READ_SIZE);
+	bool renamed = false, modified_after = false;
+	ssize_t n, off = 0;
+	int fd;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	T_QUIET; T_ASSERT_NOTNULL(realpath(dt_tmpdir(), g_dir), "realpath");
+	snprintf(a, sizeof(a), "%s/a", g_dir);
+	snprintf(b, sizeof(b), "%s/b", g_dir);
+
+	fd = open_watcher(true);
+	write_file(a);
+	T_ASSERT_POSIX_SUCCESS(rename(a, b), "rename %s to %s", a, b);
+	write_file(b);
+
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	T_ASSERT_GT(poll(&pfd, 1, 1000), 0, "events were reported");
+	usleep(100000);
+	n = read(fd, buf, READ_SIZE);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "read");
+
+	while (off < n) {
+		int32_t type;
+		uint16_t arg, len;
+		bool first = true;
+
+		memcpy(&type, buf + off, sizeof(type));
+		off += 2 * sizeof(int32_t);                 /* type, pid */
+		for (;;) {
+			memcpy(&arg, buf + off, sizeof(arg));
+			off += sizeof(arg);
+			if (arg == FSE_ARG_DONE) {
+				break;
+			}
+			memcpy(&len, buf + off, sizeof(len));
+			off += sizeof(len);
+			if (arg == FSE_ARG_STRING && first) {
+				if (type == FSE_RENAME && strcmp(buf + off, a) == 0) {
+					renamed = true;
+				} else if (type == FSE_CONTENT_MODIFIED && renamed &&
+				    strcmp(buf + off, b) == 0) {
+					modified_after = true;
+				}
+				first = false;
+			}
+			off += len;
+		}
+	}
+
+	T_EXPECT_TRUE(renamed, "the rename was reported");
+	T_EXPECT_TRUE(modified_after, "the modification after the rename was reported");
+
+	close(fd);
+	free(buf);
+}
@@ -0,0 +1,201 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/attr.h>
+#include <sys/stat.h>
+#include <sys/vnode.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+/* private system call, see <sys/attr.h> */
+#ifndef ATTRBULK_FILTER_NAME
+#define ATTRBULK_FILTER_NAME            0x00000001
+#define ATTRBULK_FILTER_OBJTYPE         0x00000002
+#define ATTRBULK_FILTER_MTIME           0x00000004
+#define ATTRBULK_FILTER_SIZE            0x00000008
+#define ATTRBULK_OBJTYPE(type)          (1U << (type))
+
+struct attrbulk_filter {
+	uint32_t        abf_flags;
+	uint32_t        abf_objtypes;
+	int64_t         abf_mtime_min;
+	uint64_t        abf_size_min;
+	uint64_t        abf_size_max;
+	char            abf_name[256];
+};
+#endif
+int getattrlistbulk_filter_np(int, void *, void *, size_t, uint64_t, const struct attrbulk_filter *);
+
+#define NFILES          50000
+#define MATCH_EVERY     100
+#define BUF_SIZE        (256 << 10)
+
+static char g_dir[PATH_MAX];
+
+static void
+make_dir(void)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(g_dir, sizeof(g_dir), "%s/bulk", dt_tmpdir());
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(g_dir, 0755), "mkdir %s", g_dir);
+	for (int i = 0; i < NFILES; i++) {
+		bool match = (i % MATCH_EVERY) == 0;
+
+		snprintf(path, sizeof(path), "%s/%s%d", g_dir, match ? "match_" : "f_", i);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create %s", path);
+		if (match) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(ftruncate(fd, 4096), "ftruncate");
+		}
+		close(fd);
+	}
+	snprintf(path, sizeof(path), "%s/match_dir", g_dir);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(path, 0755), "mkdir %s", path);
+}
+
+/*
+ * reads the whole directory, also asking for dirattr, checking the
+ * names returned against pattern
+ */
+static int
+scan(const struct attrbulk_filter *filter, const char *pattern, attrgroup_t dirattr,
+    uint64_t *ns)
+{
+	struct attrlist al = {
+		.bitmapcount = ATTR_BIT_MAP_COUNT,
+		.commonattr = ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME | ATTR_CMN_OBJTYPE |
+		    ATTR_CMN_MODTIME,
+		.dirattr = dirattr,
+		.fileattr = ATTR_FILE_DATALENGTH,
+	};
+	mach_timebase_info_data_t tb;
+	char *buf = malloc(BUF_SIZE);
+	uint64_t start;
+	int total = 0;
+	int fd, n;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	fd = open(g_dir, O_RDONLY | O_DIRECTORY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", g_dir);
+
+	start = mach_absolute_time();
+	for (;;) {
+		char *entry = buf;
+
+		if (filter) {
+			n = getattrlistbulk_filter_np(fd, &al, buf, BUF_SIZE, 0, filter);
+		} else {
+			n = getattrlistbulk(fd, &al, buf, BUF_SIZE, 0);
+		}
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "getattrlistbulk");
+		if (n == 0) {
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			attrreference_t *name = (attrreference_t *)(entry +
+			    sizeof(uint32_t) + sizeof(attribute_set_t));
+			const char *s = (const char *)name + name->attr_dataoffset;
+
+			T_QUIET; T_ASSERT_EQ(fnmatch(pattern, s, 0), 0, "%s matches %s", s, pattern);
+			entry += *(uint32_t *)entry;
+		}
+		total += n;
+	}
+	mach_timebase_info(&tb);
+	*ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	close(fd);
+	free(buf);
+	return total;
+}
+
+/* the error of a filtered read of the directory with dirattr and options */
+static int
+scan_errno(const struct attrbulk_filter *filter, attrgroup_t dirattr, uint64_t options)
+{
+	struct attrlist al = {
+		.bitmapcount = ATTR_BIT_MAP_COUNT,
+		.commonattr = ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME | ATTR_CMN_OBJTYPE,
+		.dirattr = dirattr,
+		.fileattr = ATTR_FILE_DATALENGTH,
+	};
+	char *buf = malloc(BUF_SIZE);
+	int fd, n;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	fd = open(g_dir, O_RDONLY | O_DIRECTORY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", g_dir);
+	n = getattrlistbulk_filter_np(fd, &al, buf, BUF_SIZE, options, filter);
+	close(fd);
+	free(buf);
+	return n < 0 ? errno : 0;
+}
+
+T_DECL(getattrlistbulk_filter,
+    "getattrlistbulk_filter_np() returns exactly the entries its predicates match",
+    T_META_TAG_PERF)
+{
+	struct attrbulk_filter filter;
+	uint64_t ns;
+	int n;
+
+	make_dir();
+
+	n = scan(NULL, "*", 0, &ns);
+	T_EXPECT_EQ(n, NFILES + 1, "unfiltered scan returns every entry");
+	T_PERF("bulk_unfiltered", (double)n / ((double)ns / 1e9), "entries/s",
+	    "getattrlistbulk() of a large directory");
+	T_LOG("unfiltered: %d entries, %.0f entries/s", n, (double)n / ((double)ns / 1e9));
+
+	memset(&filter, 0, sizeof(filter));
+	filter.abf_flags = ATTRBULK_FILTER_NAME;
+	strlcpy(filter.abf_name, "match_*", sizeof(filter.abf_name));
+	n = scan(&filter, "match_*", 0, &ns);
+	T_EXPECT_EQ(n, NFILES / MATCH_EVERY + 1, "name filter");
+	T_PERF("bulk_name_filter", (double)NFILES / ((double)ns / 1e9), "entries/s",
+	    "entries scanned per second with a name filter");
+	T_LOG("name filter: %d entries, %.0f entries/s scanned", n, (double)NFILES / ((double)ns / 1e9));
+
+	filter.abf_flags = ATTRBULK_FILTER_NAME | ATTRBULK_FILTER_OBJTYPE;
+	filter.abf_objtypes = ATTRBULK_OBJTYPE(VDIR);
+	n = scan(&filter, "match_dir", 0, &ns);
+	T_EXPECT_EQ(n, 1, "name and type filter");
+
+	memset(&filter, 0, sizeof(filter));
+	filter.abf_flags = ATTRBULK_FILTER_SIZE | ATTRBULK_FILTER_OBJTYPE;
+	filter.abf_objtypes = ATTRBULK_OBJTYPE(VREG);
+	filter.abf_size_min = 1;
+	filter.abf_size_max = UINT64_MAX;
+	n = scan(&filter, "match_*", 0, &ns);
+	T_EXPECT_EQ(n, NFILES / MATCH_EVERY, "size filter");
+	T_PERF("bulk_size_filter", (double)NFILES / ((double)ns / 1e9), "entries/s",
+	    "entries scanned per second with a size filter");
+	T_LOG("size filter: %d entries, %.0f entries/s scanned", n, (double)NFILES / ((double)ns / 1e9));
+
+	/* the size is found past the directory attributes */
+	n = scan(&filter, "match_*", ATTR_DIR_LINKCOUNT | ATTR_DIR_ENTRYCOUNT |
+	    ATTR_DIR_ALLOCSIZE | ATTR_DIR_DATALENGTH, &ns);
+	T_EXPECT_EQ(n, NFILES / MATCH_EVERY, "size filter, with directory attributes");
+	T_EXPECT_EQ(scan_errno(&filter, ATTR_DIR_ENTRYCOUNT, FSOPT_PACK_INVAL_ATTRS), EINVAL,
+	    "size filter, with directory attributes and FSOPT_PACK_INVAL_ATTRS");
+
+	memset(&filter, 0, sizeof(filter));
+	filter.abf_flags = ATTRBULK_FILTER_MTIME;
+	filter.abf_mtime_min = INT64_MAX;
+	n = scan(&filter, "", 0, &ns);
+	T_EXPECT_EQ(n, 0, "nothing was modified in the future");
+}
@@ -0,0 +1,179 @@
+#include <darwintest.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/event.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.kevent"),
+    T_META_CHECK_LEAKS(false));
+
+#define NKNOTES         1000
+#define HARVEST_EVENTS  2000000
+
+/*
+ * Register NKNOTES level-triggered EVFILT_USER knotes and fire them:
+ * without EV_CLEAR they stay active, so every kevent call can harvest them.
+ */
+static int
+make_fired_kqueue(void)
+{
+	struct kevent64_s kev;
+	int kq, rc;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+
+	for (uint64_t i = 0; i < NKNOTES; i++) {
+		EV_SET64(&kev, i, EVFILT_USER, EV_ADD, NOTE_TRIGGER, 0, ~i, 0, 0);
+		rc = kevent64(kq, &kev, 1, NULL, 0, 0, NULL);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "register knote %llu", i);
+	}
+	return kq;
+}
+
+static void
+check_idents(const uint64_t *idents, const uint64_t *udatas, int n)
+{
+	bool seen[NKNOTES] = { };
+
+	T_QUIET; T_ASSERT_EQ(n, NKNOTES, "harvested every knote");
+	for (int i = 0; i < n; i++) {
+		T_QUIET; T_ASSERT_LT(idents[i], (uint64_t)NKNOTES, "ident is valid");
+		T_QUIET; T_ASSERT_FALSE(seen[idents[i]], "ident %llu seen once", idents[i]);
+		T_QUIET; T_ASSERT_EQ(udatas[i], ~idents[i], "udata of %llu", idents[i]);
+		seen[idents[i]] = true;
+	}
+}
+
+T_DECL(kevent_harvest_layouts,
+    "harvesting many events returns each of them once, in every event layout")
+{
+	const struct timespec zero_ts = { };
+	uint64_t *idents, *udatas;
+	int kq, n;
+
+	idents = calloc(NKNOTES, sizeof(uint64_t));
+	udatas = calloc(NKNOTES, sizeof(uint64_t));
+	T_QUIET; T_ASSERT_NOTNULL(idents, "calloc");
+	T_QUIET; T_ASSERT_NOTNULL(udatas, "calloc");
+	kq = make_fired_kqueue();
+
+	struct kevent *kevs = calloc(NKNOTES, sizeof(*kevs));
+	T_QUIET; T_ASSERT_NOTNULL(kevs, "calloc");
+	n = kevent(kq, NULL, 0, kevs, NKNOTES, &zero_ts);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent");
+	for (int i = 0; i < n; i++) {
+		idents[i] = kevs[i].ident;
+		udatas[i] = (uint64_t)kevs[i].udata;
+	}
+	check_idents(idents, udatas, n);
+	T_PASS("kevent");
+	free(kevs);
+
+	struct kevent64_s *kevs64 = calloc(NKNOTES, sizeof(*kevs64));
+	T_QUIET; T_ASSERT_NOTNULL(kevs64, "calloc");
+	n = kevent64(kq, NULL, 0, kevs64, NKNOTES, 0, &zero_ts);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent64");
+	for (int i = 0; i < n; i++) {
+		idents[i] = kevs64[i].ident;
+		udatas[i] = kevs64[i].udata;
+	}
+	check_idents(idents, udatas, n);
+	T_PASS("kevent64");
+	free(kevs64);
+
+	struct kevent_qos_s *kevsq = calloc(NKNOTES, sizeof(*kevsq));
+	T_QUIET; T_ASSERT_NOTNULL(kevsq, "calloc");
+	n = kevent_qos(kq, NULL, 0, kevsq, NKNOTES, NULL, NULL,
+	    KEVENT_FLAG_IMMEDIATE);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent_qos");
+	for (int i = 0; i < n; i++) {
+		idents[i] = kevsq[i].ident;
+		udatas[i] = kevsq[i].udata;
+	}
+	check_idents(idents, udatas, n);
+	T_PASS("kevent_qos");
+	free(kevsq);
+
+	close(kq);
+	free(idents);
+	free(udatas);
+}
+
+T_DECL(kevent_harvest_efault,
+    "a partially unmapped event list fails with EFAULT")
+{
+	const struct timespec zero_ts = { };
+	size_t page = (size_t)getpagesize();
+	struct kevent64_s *kevs;
+	char *buf;
+	int kq, n;
+
+	kq = make_fired_kqueue();
+
+	buf = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE(buf, MAP_FAILED, "mmap");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mprotect(buf + page, page, PROT_NONE),
+	    "mprotect");
+
+	/* the first few events fit, the list runs into the guard page */
+	kevs = (struct kevent64_s *)(buf + page) - 3;
+	n = kevent64(kq, NULL, 0, kevs, NKNOTES, 0, &zero_ts);
+	T_EXPECT_POSIX_FAILURE(n, EFAULT, "kevent64 into a guard page");
+
+	munmap(buf, 2 * page);
+	close(kq);
+}
+
+static double
+harvest_ns_per_event(int kq, struct kevent64_s *kevs, int nevents)
+{
+	const struct timespec zero_ts = { };
+	mach_timebase_info_data_t tb;
+	uint64_t start, end, total = 0;
+
+	start = mach_absolute_time();
+	for (int i = 0; i < HARVEST_EVENTS / nevents; i++) {
+		int n = kevent64(kq, NULL, 0, kevs, nevents, 0, &zero_ts);
+		T_QUIET; T_ASSERT_EQ(n, nevents, "kevent64 harvested a full list");
+		total += (uint64_t)n;
+	}
+	end = mach_absolute_time();
+
+	mach_timebase_info(&tb);
+	return (double)((end - start) * tb.numer / tb.denom) / (double)total;
+}
+
+T_DECL(kevent_harvest_throughput,
+    "cost per event of harvesting fired knotes, per event list size",
+    T_META_TAG_PERF)
+{
+	static const int sizes[] = { 1, 8, 64, 512 };
+	struct kevent64_s *kevs;
+	int kq;
+
+	kq = make_fired_kqueue();
+	kevs = calloc(512, sizeof(*kevs));
+	T_QUIET; T_ASSERT_NOTNULL(kevs, "calloc");
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		char name[32];
+		double ns;
+
+		ns = harvest_ns_per_event(kq, kevs, sizes[i]);
+		snprintf(name, sizeof(name), "harvest_%d", sizes[i]);
+		T_PERF(name, ns, "ns", "ns per event harvested by kevent64");
+		T_LOG("%3d events per kevent64: %.1f ns/event", sizes[i], ns);
+	}
+
+	free(kevs);
+	close(kq);
+}
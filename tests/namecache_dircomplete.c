@@ -0,0 +1,158 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+#define NFILES          2000
+#define NPROBES         20000
+#define NMISSING        1000
+
+static char g_dir[PATH_MAX];
+
+static uint64_t
+counter(const char *name)
+{
+	uint64_t val = 0;
+	size_t size = sizeof(val);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &val, &size, NULL, 0), "%s", name);
+	return val;
+}
+
+static void
+make_dir(void)
+{
+	char path[PATH_MAX];
+	struct statfs sfs;
+	int enabled = 0;
+	size_t size = sizeof(enabled);
+	int fd;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("vfs.namecache_dircomplete",
+	    &enabled, &size, NULL, 0), "vfs.namecache_dircomplete");
+	if (!enabled) {
+		T_SKIP("directory completeness is disabled");
+	}
+
+	snprintf(g_dir, sizeof(g_dir), "%s/include", dt_tmpdir());
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(g_dir, 0755), "mkdir %s", g_dir);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(statfs(g_dir, &sfs), "statfs");
+	if (strcmp(sfs.f_fstypename, "apfs") != 0 && strcmp(sfs.f_fstypename, "hfs") != 0) {
+		T_SKIP("%s is on %s, which isn't tracked", g_dir, sfs.f_fstypename);
+	}
+
+	for (int i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "%s/header_%d.h", g_dir, i);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create %s", path);
+		close(fd);
+	}
+}
+
+static int
+enumerate(void)
+{
+	struct dirent *dp;
+	int count = 0;
+	DIR *dir;
+
+	dir = opendir(g_dir);
+	T_QUIET; T_ASSERT_NOTNULL(dir, "opendir %s", g_dir);
+	while ((dp = readdir(dir)) != NULL) {
+		if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0) {
+			count++;
+		}
+	}
+	closedir(dir);
+	return count;
+}
+
+/*
+ * looks for headers that aren't there, the way a compiler searching
+ * its include paths does, returning the fraction of the lookups that
+ * were answered by the name cache
+ */
+static double
+probe(const char *what)
+{
+	uint64_t checks = counter("debug.namecache_dircomplete_checks");
+	uint64_t hits = counter("debug.namecache_dircomplete_hits");
+	mach_timebase_info_data_t tb;
+	char path[PATH_MAX], perf[64];
+	uint64_t start, ns;
+	struct stat st;
+	double ratio;
+
+	start = mach_absolute_time();
+	for (int i = 0; i < NPROBES; i++) {
+		snprintf(path, sizeof(path), "%s/missing_%d.h", g_dir, i % NMISSING);
+		T_QUIET; T_ASSERT_EQ(stat(path, &st), -1, "stat %s", path);
+		T_QUIET; T_ASSERT_EQ(errno, ENOENT, "stat %s", path);
+	}
+	mach_timebase_info(&tb);
+	ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	hits = counter("debug.namecache_dircomplete_hits") - hits;
+	checks = counter("debug.namecache_dircomplete_checks") - checks;
+	ratio = (double)hits / NPROBES;
+	snprintf(perf, sizeof(perf), "negative_lookups_%s", what);
+	T_PERF(perf, (double)NPROBES / ((double)ns / 1e9), "lookups/s",
+	    "stat() of names missing from a directory");
+	T_LOG("%s enumeration: %.0f lookups/s, %llu of %d misses checked, hit ratio %.2f",
+	    what, (double)NPROBES / ((double)ns / 1e9), checks, NPROBES, ratio);
+	return ratio;
+}
+
+T_DECL(namecache_dircomplete,
+    "lookups of missing names in a fully read directory are answered by the name cache",
+    T_META_TAG_PERF)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t invalidations;
+	int fd;
+
+	make_dir();
+
+	(void)probe("before");
+
+	T_ASSERT_EQ(enumerate(), NFILES, "readdir returns every entry");
+	T_EXPECT_GT(probe("after"), 0.9, "misses were answered without the file system");
+
+	/* names that exist are still found */
+	for (int i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "%s/header_%d.h", g_dir, i);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(stat(path, &st), "stat %s", path);
+	}
+
+	/* creating an entry invalidates the directory */
+	invalidations = counter("debug.namecache_dircomplete_invalidations");
+	snprintf(path, sizeof(path), "%s/missing_0.h", g_dir);
+	fd = open(path, O_CREAT | O_WRONLY, 0644);
+	T_ASSERT_POSIX_SUCCESS(fd, "create %s", path);
+	close(fd);
+	T_EXPECT_POSIX_SUCCESS(stat(path, &st), "a new entry is found");
+	T_EXPECT_GT(counter("debug.namecache_dircomplete_invalidations"), invalidations,
+	    "the directory was invalidated");
+
+	/* and so does removing one, after the directory is read again */
+	T_ASSERT_EQ(enumerate(), NFILES + 1, "readdir returns every entry");
+	T_ASSERT_POSIX_SUCCESS(unlink(path), "unlink %s", path);
+	T_EXPECT_EQ(stat(path, &st), -1, "a removed entry is gone");
+	snprintf(path, sizeof(path), "%s/header_0.h", g_dir);
+	T_EXPECT_POSIX_SUCCESS(stat(path, &st), "other entries are still found");
+}
@@ -0,0 +1,224 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+#define MAX_THREADS     64
+#define TREE_DEPTH      16
+#define LEAF_FILES      64
+#define STATS           200000
+#define RENAME_ROUNDS   20000
+
+static char g_leaf[PATH_MAX];
+static _Atomic uint32_t g_ready;
+static _Atomic bool g_go;
+static _Atomic bool g_stop;
+
+static int
+ncpus(void)
+{
+	int ncpu = 0;
+	size_t size = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0),
+	    "hw.ncpu");
+	return ncpu > MAX_THREADS ? MAX_THREADS : ncpu;
+}
+
+/* builds <tmpdir>/storm/d0/d1/.../d15 with LEAF_FILES files in the last one */
+static void
+make_tree(void)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(g_leaf, sizeof(g_leaf), "%s/storm", dt_tmpdir());
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(g_leaf, 0755), "mkdir %s", g_leaf);
+	for (int i = 0; i < TREE_DEPTH; i++) {
+		size_t len = strlen(g_leaf);
+
+		snprintf(g_leaf + len, sizeof(g_leaf) - len, "/d%d", i);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(g_leaf, 0755), "mkdir %s", g_leaf);
+	}
+	for (int i = 0; i < LEAF_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", g_leaf, i);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create %s", path);
+		close(fd);
+	}
+}
+
+static void *
+stat_storm(void *arg)
+{
+	uintptr_t id = (uintptr_t)arg;
+	char path[PATH_MAX];
+	struct stat st;
+
+	atomic_fetch_add(&g_ready, 1);
+	while (!atomic_load(&g_go)) {
+		;
+	}
+
+	for (int i = 0; i < STATS; i++) {
+		snprintf(path, sizeof(path), "%s/f%lu", g_leaf,
+		    (unsigned long)((id + (uintptr_t)i) % LEAF_FILES));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(stat(path, &st), "stat");
+	}
+	return NULL;
+}
+
+static double
+run_storm(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+
+	atomic_store(&g_ready, 0);
+	atomic_store(&g_go, false);
+
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    stat_storm, (void *)(uintptr_t)i), "pthread_create");
+	}
+	while (atomic_load(&g_ready) != (uint32_t)nthreads) {
+		pthread_yield_np();
+	}
+
+	start = mach_absolute_time();
+	atomic_store(&g_go, true);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	end = mach_absolute_time();
+
+	mach_timebase_info(&tb);
+	/* wall clock time per stat, per thread: flat when lookups scale */
+	return (double)((end - start) * tb.numer / tb.denom) / STATS;
+}
+
+T_DECL(namecache_stat_storm,
+    "stat() of files deep in a tree from an increasing number of threads",
+    T_META_TAG_PERF)
+{
+	int ncpu = ncpus();
+
+	make_tree();
+
+	for (int n = 1; n <= ncpu; n *= 2) {
+		char name[32];
+		double ns;
+
+		ns = run_storm(n);
+		snprintf(name, sizeof(name), "stat_%d_threads", n);
+		T_PERF(name, ns, "ns", "wall clock ns per stat() of each thread");
+		T_LOG("%2d threads: %.0f ns per stat, %.2f Mstats/s", n, ns,
+		    (double)n * 1000.0 / ns);
+	}
+}
+
+static char g_dir[PATH_MAX];
+static char g_stable[PATH_MAX];
+static char g_a[PATH_MAX];
+static char g_b[PATH_MAX];
+static ino_t g_stable_ino;
+static ino_t g_moving_ino;
+
+/* stats paths whose cache entries are being replaced under it */
+static void *
+rename_checker(void *arg __unused)
+{
+	struct stat st;
+
+	while (!atomic_load(&g_stop)) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(stat(g_stable, &st), "stat stable");
+		T_QUIET; T_ASSERT_EQ(st.st_ino, g_stable_ino, "stable file is the same file");
+
+		if (stat(g_a, &st) == 0) {
+			T_QUIET; T_ASSERT_EQ(st.st_ino, g_moving_ino, "a is the moving file");
+		} else {
+			T_QUIET; T_ASSERT_EQ(errno, ENOENT, "a is missing");
+		}
+		if (stat(g_b, &st) == 0) {
+			T_QUIET; T_ASSERT_EQ(st.st_ino, g_moving_ino, "b is the moving file");
+		} else {
+			T_QUIET; T_ASSERT_EQ(errno, ENOENT, "b is missing");
+		}
+	}
+	return NULL;
+}
+
+T_DECL(namecache_rename_race,
+    "path lookups racing with renames and creations in the same directory")
+{
+	pthread_t threads[MAX_THREADS];
+	int nthreads = ncpus();
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	snprintf(g_dir, sizeof(g_dir), "%s/race/d0/d1/d2", dt_tmpdir());
+	snprintf(path, sizeof(path), "%s/race", dt_tmpdir());
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(path, 0755), "mkdir");
+	snprintf(path, sizeof(path), "%s/race/d0", dt_tmpdir());
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(path, 0755), "mkdir");
+	snprintf(path, sizeof(path), "%s/race/d0/d1", dt_tmpdir());
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(path, 0755), "mkdir");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(mkdir(g_dir, 0755), "mkdir");
+
+	snprintf(g_stable, sizeof(g_stable), "%s/stable", g_dir);
+	snprintf(g_a, sizeof(g_a), "%s/a", g_dir);
+	snprintf(g_b, sizeof(g_b), "%s/b", g_dir);
+
+	fd = open(g_stable, O_CREAT | O_WRONLY, 0644);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create stable");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fstat(fd, &st), "fstat");
+	g_stable_ino = st.st_ino;
+	close(fd);
+
+	fd = open(g_a, O_CREAT | O_WRONLY, 0644);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create a");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fstat(fd, &st), "fstat");
+	g_moving_ino = st.st_ino;
+	close(fd);
+
+	atomic_store(&g_stop, false);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    rename_checker, NULL), "pthread_create");
+	}
+
+	for (int round = 0; round < RENAME_ROUNDS; round++) {
+		/* churn the cache: renames, and negative entries turning positive */
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rename(g_a, g_b), "rename a b");
+		snprintf(path, sizeof(path), "%s/tmp%d", g_dir, round % 16);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create %s", path);
+		close(fd);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rename(g_b, g_a), "rename b a");
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(unlink(path), "unlink %s", path);
+	}
+
+	atomic_store(&g_stop, true);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+
+	T_PASS("%d rounds of renames under concurrent lookups", RENAME_ROUNDS);
+}
@@ -0,0 +1,233 @@
+#include <darwintest.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sysctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.ipc.pipe"),
+    T_META_CHECK_LEAKS(false));
+
+#define DATA_SIZE       (8 << 20)
+#define BENCH_SIZE      (1ull << 30)
+
+static uint8_t *g_data;
+
+static void
+make_data(void)
+{
+	g_data = malloc(DATA_SIZE + 1);
+	T_QUIET; T_ASSERT_NOTNULL(g_data, "malloc");
+	for (size_t i = 0; i <= DATA_SIZE; i++) {
+		g_data[i] = (uint8_t)(i * 7 + (i >> 12));
+	}
+}
+
+struct reader_args {
+	int     fd;
+	size_t  read_size;
+	size_t  expected;
+	size_t  offset;         /* of the first byte in g_data */
+};
+
+static void *
+checking_reader(void *arg)
+{
+	struct reader_args *ra = arg;
+	uint8_t *buf = malloc(ra->read_size);
+	size_t total = 0;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	while (total < ra->expected) {
+		ssize_t n = read(ra->fd, buf, ra->read_size);
+
+		T_QUIET; T_ASSERT_GT(n, 0L, "read");
+		if (memcmp(buf, g_data + ra->offset + total, (size_t)n) != 0) {
+			T_FAIL("bad data between offsets %zu and %zu", total, total + (size_t)n);
+			break;
+		}
+		total += (size_t)n;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void
+check_write(const char *what, size_t read_size, size_t offset,
+    ssize_t (^do_write)(int fd), size_t expected)
+{
+	struct reader_args ra = {
+		.read_size = read_size,
+		.expected = expected,
+		.offset = offset,
+	};
+	pthread_t reader;
+	int fds[2];
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+	ra.fd = fds[0];
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&reader, NULL,
+	    checking_reader, &ra), "pthread_create");
+
+	T_EXPECT_EQ(do_write(fds[1]), (ssize_t)expected, "%s", what);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(reader, NULL), "pthread_join");
+	close(fds[0]);
+	close(fds[1]);
+}
+
+T_DECL(pipe_direct_write_data,
+    "large pipe writes deliver the data in order, whatever the read size")
+{
+	make_data();
+
+	check_write("aligned write", 1 << 20, 0, ^ssize_t (int fd) {
+		return write(fd, g_data, DATA_SIZE);
+	}, DATA_SIZE);
+
+	check_write("unaligned write, small reads", 1000, 1, ^ssize_t (int fd) {
+		return write(fd, g_data + 1, DATA_SIZE);
+	}, DATA_SIZE);
+
+	check_write("writev mixing large and small iovecs", 65536 + 3, 0, ^ssize_t (int fd) {
+		struct iovec iov[] = {
+			{ g_data, 100 },
+			{ g_data + 100, 3 << 20 },
+			{ g_data + 100 + (3 << 20), 5000 },
+			{ g_data + 5100 + (3 << 20), DATA_SIZE - 5100 - (3 << 20) },
+		};
+		return writev(fd, iov, 4);
+	}, DATA_SIZE);
+
+	free(g_data);
+}
+
+static void *
+reading_closer(void *arg)
+{
+	int fd = *(int *)arg;
+	char buf[1000];
+	int avail = 0;
+
+	T_QUIET; T_ASSERT_EQ(read(fd, buf, sizeof(buf)), (ssize_t)sizeof(buf), "read");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(fd, FIONREAD, &avail), "FIONREAD");
+	T_EXPECT_GT(avail, 0, "FIONREAD reports the data of the pending write");
+	close(fd);
+	return NULL;
+}
+
+T_DECL(pipe_direct_write_epipe,
+    "a large write fails with EPIPE when the reader goes away")
+{
+	pthread_t reader;
+	int fds[2];
+
+	make_data();
+	T_QUIET; T_ASSERT_NE(signal(SIGPIPE, SIG_IGN), SIG_ERR, "signal");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&reader, NULL,
+	    reading_closer, &fds[0]), "pthread_create");
+
+	T_EXPECT_POSIX_FAILURE(write(fds[1], g_data, DATA_SIZE), EPIPE,
+	    "write to a pipe closed by its reader");
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(reader, NULL), "pthread_join");
+	close(fds[1]);
+	free(g_data);
+}
+
+static void *
+draining_reader(void *arg)
+{
+	int fd = *(int *)arg;
+	size_t size = 1 << 20;
+	char *buf = malloc(size);
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	while (read(fd, buf, size) > 0) {
+		;
+	}
+	free(buf);
+	return NULL;
+}
+
+static double
+pipe_throughput(size_t write_size)
+{
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+	pthread_t reader;
+	char *buf;
+	int fds[2];
+
+	buf = malloc(write_size);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	memset(buf, 'x', write_size);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&reader, NULL,
+	    draining_reader, &fds[0]), "pthread_create");
+
+	start = mach_absolute_time();
+	for (size_t done = 0; done < BENCH_SIZE; done += write_size) {
+		T_QUIET; T_ASSERT_EQ(write(fds[1], buf, write_size), (ssize_t)write_size,
+		    "write");
+	}
+	close(fds[1]);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(reader, NULL), "pthread_join");
+	end = mach_absolute_time();
+
+	close(fds[0]);
+	free(buf);
+
+	mach_timebase_info(&tb);
+	return (double)BENCH_SIZE / (double)((end - start) * tb.numer / tb.denom);
+}
+
+T_DECL(pipe_direct_write_perf,
+    "pipe throughput for small and large writes",
+    T_META_TAG_PERF)
+{
+	static const size_t sizes[] = { 4096, 65536, 1 << 20, 4 << 20 };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		char name[32];
+		double gbps;
+
+		gbps = pipe_throughput(sizes[i]);
+		snprintf(name, sizeof(name), "pipe_write_%zuk", sizes[i] >> 10);
+		T_PERF(name, gbps, "GB/s", "pipe throughput for writes of this size");
+		T_LOG("%5zuk writes: %.2f GB/s", sizes[i] >> 10, gbps);
+	}
+}
+
+T_DECL(pipe_direct_write_vs_buffered,
+    "pipe throughput of 1M writes, with and without direct transfers",
+    T_META_REQUIRES_SYSCTL_EQ("kern.development", 1),
+    T_META_ASROOT(true), T_META_TAG_PERF)
+{
+	int enable = 1, disable = 0, old;
+	size_t size = sizeof(old);
+	double direct, buffered;
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.ipc.pipe_direct", &old, &size,
+	    &disable, sizeof(disable)), "disable direct pipe writes");
+	buffered = pipe_throughput(1 << 20);
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.ipc.pipe_direct", NULL, NULL,
+	    &enable, sizeof(enable)), "enable direct pipe writes");
+	direct = pipe_throughput(1 << 20);
+	sysctlbyname("kern.ipc.pipe_direct", NULL, NULL, &old, sizeof(old));
+
+	T_PERF("pipe_buffered_1m", buffered, "GB/s", "1M writes through the pipe buffer");
+	T_PERF("pipe_direct_1m", direct, "GB/s", "1M writes transferred directly");
+	T_LOG("1M writes: %.2f GB/s buffered, %.2f GB/s direct", buffered, direct);
+}
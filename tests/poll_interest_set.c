@@ -0,0 +1,145 @@
+#include <darwintest.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.poll"),
+    T_META_CHECK_LEAKS(false));
+
+#define NPIPES          512
+#define ROUNDS          20000
+
+static int g_pipes[NPIPES][2];
+static struct pollfd g_fds[NPIPES];
+
+static void
+make_pipes(int n)
+{
+	struct rlimit rl;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getrlimit(RLIMIT_NOFILE, &rl), "getrlimit");
+	if (rl.rlim_cur < 2 * NPIPES + 64) {
+		rl.rlim_cur = 2 * NPIPES + 64;
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(setrlimit(RLIMIT_NOFILE, &rl), "setrlimit");
+	}
+
+	for (int i = 0; i < n; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(g_pipes[i]), "pipe %d", i);
+		g_fds[i] = (struct pollfd){
+			.fd = g_pipes[i][0],
+			.events = POLLIN,
+		};
+	}
+}
+
+static void
+close_pipes(int n)
+{
+	for (int i = 0; i < n; i++) {
+		close(g_pipes[i][0]);
+		close(g_pipes[i][1]);
+	}
+}
+
+static int
+poll_ready(int n)
+{
+	int rc = poll(g_fds, (nfds_t)n, 0);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "poll");
+	return rc;
+}
+
+T_DECL(poll_interest_set_changes,
+    "repeated poll() calls notice changes to the descriptors they are passed")
+{
+	char c = 'x';
+	int fds[2];
+
+	make_pipes(8);
+
+	T_EXPECT_EQ(poll_ready(8), 0, "no pipe is readable");
+	T_QUIET; T_ASSERT_EQ(write(g_pipes[3][1], &c, 1), 1L, "write");
+	T_EXPECT_EQ(poll_ready(8), 1, "one pipe is readable");
+	T_EXPECT_EQ(g_fds[3].revents, POLLIN, "it is the one that was written to");
+	T_EXPECT_EQ(poll_ready(8), 1, "the same array still reports it");
+	T_QUIET; T_ASSERT_EQ(read(g_pipes[3][0], &c, 1), 1L, "read");
+	T_EXPECT_EQ(poll_ready(8), 0, "draining the pipe is noticed");
+
+	/* only the events change: the write end of a pipe is writable */
+	g_fds[5] = (struct pollfd){ .fd = g_pipes[5][1], .events = POLLOUT };
+	T_EXPECT_EQ(poll_ready(8), 1, "replacing an entry is noticed");
+	T_EXPECT_EQ(g_fds[5].revents, POLLOUT, "the new entry is writable");
+	g_fds[5].events = POLLIN;
+	T_EXPECT_EQ(poll_ready(8), 0, "changing its events is noticed");
+	g_fds[5] = (struct pollfd){ .fd = g_pipes[5][0], .events = POLLIN };
+
+	/* reuse the number of a pipe for a socket pair that is ready */
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, fds),
+	    "socketpair");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(dup2(fds[0], g_pipes[6][0]), "dup2");
+	close(fds[0]);
+	T_QUIET; T_ASSERT_EQ(write(fds[1], &c, 1), 1L, "write");
+	T_EXPECT_EQ(poll_ready(8), 1, "a descriptor closed and reopened is noticed");
+	T_EXPECT_EQ(g_fds[6].revents, POLLIN, "the new descriptor is readable");
+	T_QUIET; T_ASSERT_EQ(read(g_pipes[6][0], &c, 1), 1L, "read");
+
+	/* a closed descriptor must be reported invalid */
+	close(g_pipes[7][0]);
+	T_EXPECT_EQ(poll_ready(8), 1, "a closed descriptor is noticed");
+	T_EXPECT_EQ(g_fds[7].revents, POLLNVAL, "it is reported invalid");
+	g_pipes[7][0] = -1;
+
+	g_fds[2].fd = -1;
+	T_EXPECT_EQ(poll_ready(7), 0, "negative descriptors are ignored");
+
+	close_pipes(8);
+	close(fds[1]);
+}
+
+static double
+poll_ns_per_call(int n)
+{
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+	char c = 'x';
+
+	make_pipes(n);
+	/* one descriptor is ready, poll() never blocks */
+	T_QUIET; T_ASSERT_EQ(write(g_pipes[n / 2][1], &c, 1), 1L, "write");
+
+	start = mach_absolute_time();
+	for (int i = 0; i < ROUNDS; i++) {
+		T_QUIET; T_ASSERT_EQ(poll(g_fds, (nfds_t)n, -1), 1, "poll");
+	}
+	end = mach_absolute_time();
+
+	close_pipes(n);
+
+	mach_timebase_info(&tb);
+	return (double)((end - start) * tb.numer / tb.denom) / ROUNDS;
+}
+
+T_DECL(poll_interest_set_perf,
+    "cost of poll() over an unchanged set with one ready descriptor",
+    T_META_TAG_PERF)
+{
+	static const int sizes[] = { 1, 16, 128, NPIPES };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		char name[32];
+		double ns;
+
+		ns = poll_ns_per_call(sizes[i]);
+		snprintf(name, sizeof(name), "poll_%d", sizes[i]);
+		T_PERF(name, ns, "ns", "ns per poll call with one ready descriptor");
+		T_LOG("poll over %3d descriptors: %.0f ns/call", sizes[i], ns);
+	}
+}
@@ -0,0 +1,105 @@
+#include <darwintest.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/message.h>
+#include <stdlib.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.ipc"),
+    T_META_CHECK_LEAKS(false));
+
+#define NPORTS  20000
+
+typedef struct {
+	mach_msg_header_t header;
+	mach_msg_trailer_t trailer;
+} port_set_scale_msg_t;
+
+static mach_timebase_info_data_t timebase;
+
+static double
+ns_per_op(uint64_t start, uint64_t end, unsigned nops)
+{
+	return (double)((end - start) * timebase.numer / timebase.denom) / nops;
+}
+
+T_DECL(port_set_scale,
+    "insert, prepost, drain and remove many ports in a single port set",
+    T_META_TAG_PERF)
+{
+	mach_port_t task = mach_task_self();
+	mach_port_name_t pset, *ports;
+	port_set_scale_msg_t msg;
+	uint64_t start, end;
+	kern_return_t kr;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase), "mach_timebase_info");
+
+	ports = calloc(NPORTS, sizeof(ports[0]));
+	T_QUIET; T_ASSERT_NOTNULL(ports, "calloc");
+
+	kr = mach_port_allocate(task, MACH_PORT_RIGHT_PORT_SET, &pset);
+	T_ASSERT_MACH_SUCCESS(kr, "allocate port set");
+
+	for (unsigned i = 0; i < NPORTS; i++) {
+		kr = mach_port_allocate(task, MACH_PORT_RIGHT_RECEIVE, &ports[i]);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "allocate port %u", i);
+		kr = mach_port_insert_right(task, ports[i], ports[i], MACH_MSG_TYPE_MAKE_SEND);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "make send right %u", i);
+	}
+
+	start = mach_absolute_time();
+	for (unsigned i = 0; i < NPORTS; i++) {
+		kr = mach_port_insert_member(task, ports[i], pset);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "insert member %u", i);
+	}
+	end = mach_absolute_time();
+	T_PERF("insert_member", ns_per_op(start, end, NPORTS), "ns",
+	    "mach_port_insert_member into a growing port set");
+
+	/* nobody is waiting on the set: every send preposts its port */
+	start = mach_absolute_time();
+	for (unsigned i = 0; i < NPORTS; i++) {
+		msg.header = (mach_msg_header_t){
+			.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0),
+			.msgh_size = sizeof(msg.header),
+			.msgh_remote_port = ports[i],
+		};
+		kr = mach_msg(&msg.header, MACH_SEND_MSG | MACH_SEND_TIMEOUT,
+		    sizeof(msg.header), 0, MACH_PORT_NULL, 0, MACH_PORT_NULL);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "send to port %u", i);
+	}
+	end = mach_absolute_time();
+	T_PERF("prepost", ns_per_op(start, end, NPORTS), "ns",
+	    "message send preposting a port set member");
+
+	start = mach_absolute_time();
+	for (unsigned i = 0; i < NPORTS; i++) {
+		kr = mach_msg(&msg.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT,
+		    0, sizeof(msg), pset, 0, MACH_PORT_NULL);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "receive %u from port set", i);
+	}
+	end = mach_absolute_time();
+	T_PERF("drain", ns_per_op(start, end, NPORTS), "ns",
+	    "message receive on a port set with preposted members");
+
+	kr = mach_msg(&msg.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT,
+	    0, sizeof(msg), pset, 0, MACH_PORT_NULL);
+	T_ASSERT_MACH_ERROR(kr, MACH_RCV_TIMED_OUT, "port set is drained");
+
+	start = mach_absolute_time();
+	for (unsigned i = 0; i < NPORTS; i++) {
+		kr = mach_port_extract_member(task, ports[i], pset);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "extract member %u", i);
+	}
+	end = mach_absolute_time();
+	T_PERF("extract_member", ns_per_op(start, end, NPORTS), "ns",
+	    "mach_port_extract_member from a shrinking port set");
+
+	for (unsigned i = 0; i < NPORTS; i++) {
+		(void)mach_port_mod_refs(task, ports[i], MACH_PORT_RIGHT_RECEIVE, -1);
+		(void)mach_port_deallocate(task, ports[i]);
+	}
+	(void)mach_port_mod_refs(task, pset, MACH_PORT_RIGHT_PORT_SET, -1);
+	free(ports);
+}
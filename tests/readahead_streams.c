@@ -0,0 +1,164 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fsctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+#define FILE_SIZE       (256 << 20)
+#define RECORD_SIZE     (16 << 10)
+#define STRIDE          (256 << 10)
+#define NSTREAMS        4
+
+static char g_path[PATH_MAX];
+
+/* writes the file around the cache, so that the reads have to go to disk */
+static void
+make_cold_file(const char *name)
+{
+	char *buf = malloc(1 << 20);
+	int fd;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	memset(buf, 'r', 1 << 20);
+
+	snprintf(g_path, sizeof(g_path), "%s/%s", dt_tmpdir(), name);
+	unlink(g_path);
+	fd = open(g_path, O_CREAT | O_RDWR, 0644);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create %s", g_path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fcntl(fd, F_NOCACHE, 1), "F_NOCACHE");
+	for (off_t off = 0; off < FILE_SIZE; off += 1 << 20) {
+		T_QUIET; T_ASSERT_EQ(pwrite(fd, buf, 1 << 20, off), (ssize_t)(1 << 20), "pwrite");
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fsync(fd), "fsync");
+	close(fd);
+	free(buf);
+}
+
+static struct fsioc_readahead_stats
+ra_stats(void)
+{
+	struct fsioc_readahead_stats st;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fsctl(g_path, FSIOC_READAHEAD_STATS, &st, 0),
+	    "FSIOC_READAHEAD_STATS");
+	return st;
+}
+
+static double
+mb_per_sec(uint64_t bytes, uint64_t start)
+{
+	mach_timebase_info_data_t tb;
+	uint64_t ns;
+
+	mach_timebase_info(&tb);
+	ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+	return (double)bytes / (1 << 20) / ((double)ns / 1e9);
+}
+
+struct stream {
+	int     fd;
+	off_t   start;
+	off_t   len;
+};
+
+static void *
+stream_reader(void *arg)
+{
+	struct stream *s = arg;
+	char buf[RECORD_SIZE];
+
+	for (off_t off = s->start; off < s->start + s->len; off += RECORD_SIZE) {
+		T_QUIET; T_ASSERT_EQ(pread(s->fd, buf, sizeof(buf), off), (ssize_t)sizeof(buf),
+		    "pread");
+	}
+	return NULL;
+}
+
+T_DECL(readahead_interleaved_streams,
+    "sequential readers of different parts of one file all get read-ahead",
+    T_META_TAG_PERF)
+{
+	struct fsioc_readahead_stats before, after;
+	struct stream streams[NSTREAMS];
+	pthread_t threads[NSTREAMS];
+	uint64_t start;
+	double mbs;
+	int fd;
+
+	make_cold_file("readahead_streams");
+	fd = open(g_path, O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open");
+
+	before = ra_stats();
+	start = mach_absolute_time();
+	for (int i = 0; i < NSTREAMS; i++) {
+		streams[i] = (struct stream){
+			.fd = fd,
+			.start = (off_t)i * (FILE_SIZE / NSTREAMS),
+			.len = FILE_SIZE / NSTREAMS,
+		};
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    stream_reader, &streams[i]), "pthread_create");
+	}
+	for (int i = 0; i < NSTREAMS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	mbs = mb_per_sec(FILE_SIZE, start);
+	after = ra_stats();
+
+	T_EXPECT_GE(after.ra_streams - before.ra_streams, (uint64_t)NSTREAMS,
+	    "each reader got a read-ahead stream");
+	T_EXPECT_GT(after.ra_pages - before.ra_pages, 0ULL, "pages were read ahead");
+	T_PERF("interleaved_read", mbs, "MB/s", "4 sequential readers of one cold file");
+	T_LOG("%d interleaved readers: %.0f MB/s, %llu pages read ahead, %llu of %llu reads missed",
+	    NSTREAMS, mbs, after.ra_pages - before.ra_pages,
+	    after.ra_misses - before.ra_misses, after.ra_reads - before.ra_reads);
+
+	close(fd);
+	unlink(g_path);
+}
+
+T_DECL(readahead_strided,
+    "fixed-size reads a fixed distance apart are detected and read ahead",
+    T_META_TAG_PERF)
+{
+	struct fsioc_readahead_stats before, after;
+	char buf[RECORD_SIZE];
+	uint64_t start;
+	double mbs;
+	int fd;
+
+	make_cold_file("readahead_strided");
+	fd = open(g_path, O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open");
+
+	before = ra_stats();
+	start = mach_absolute_time();
+	for (off_t off = 0; off < FILE_SIZE; off += STRIDE) {
+		T_QUIET; T_ASSERT_EQ(pread(fd, buf, sizeof(buf), off), (ssize_t)sizeof(buf),
+		    "pread");
+	}
+	mbs = mb_per_sec(FILE_SIZE / STRIDE * RECORD_SIZE, start);
+	after = ra_stats();
+
+	T_EXPECT_GT(after.ra_strided - before.ra_strided, 0ULL, "the stream was found to be strided");
+	T_EXPECT_GT(after.ra_pages - before.ra_pages, 0ULL, "records were read ahead");
+	T_PERF("strided_read", mbs, "MB/s", "16KB records 256KB apart of one cold file");
+	T_LOG("strided reads: %.0f MB/s, %llu pages read ahead, %llu of %llu reads missed",
+	    mbs, after.ra_pages - before.ra_pages,
+	    after.ra_misses - before.ra_misses, after.ra_reads - before.ra_reads);
+
+	close(fd);
+	unlink(g_path);
+}
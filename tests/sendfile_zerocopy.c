@@ -0,0 +1,404 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.net.sendfile"),
+    T_META_CHECK_LEAKS(false));
+
+/* private flag, see <sys/socket.h> */
+#ifndef SF_NOCACHE
+#define SF_NOCACHE      0x00000010
+#endif
+
+#define FILE_SIZE       (16 << 20)
+#define BENCH_ROUNDS    64
+#define READ_SIZE       (1 << 20)
+
+static uint8_t *g_data;
+static char g_path[PATH_MAX];
+static int g_zerocopy = -1;
+
+static uint64_t
+counter(const char *name)
+{
+	uint64_t val = 0;
+	size_t size = sizeof(val);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &val, &size, NULL, 0), "%s", name);
+	return val;
+}
+
+/* writes the file, and reads it back so that it's in the page cache */
+static int
+make_file(void)
+{
+	int fd;
+
+	g_data = malloc(FILE_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(g_data, "malloc");
+	for (size_t i = 0; i < FILE_SIZE; i++) {
+		g_data[i] = (uint8_t)(i * 7 + (i >> 12));
+	}
+
+	snprintf(g_path, sizeof(g_path), "%s/sendfile_zerocopy", dt_tmpdir());
+	fd = open(g_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", g_path);
+	T_QUIET; T_ASSERT_EQ(write(fd, g_data, FILE_SIZE), (ssize_t)FILE_SIZE, "write");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fsync(fd), "fsync");
+	T_QUIET; T_ASSERT_EQ(pread(fd, g_data, FILE_SIZE, 0), (ssize_t)FILE_SIZE, "pread");
+	return fd;
+}
+
+static void
+make_tcp_pair(int fds[2])
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(sin);
+	int ls;
+
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ls, "socket");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(ls, (struct sockaddr *)&sin, len), "bind");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(ls, 1), "listen");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(ls, (struct sockaddr *)&sin, &len),
+	    "getsockname");
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[0], "socket");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(fds[0], (struct sockaddr *)&sin, len),
+	    "connect");
+	fds[1] = accept(ls, NULL, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[1], "accept");
+	close(ls);
+}
+
+struct reader_args {
+	int     fd;
+	uint8_t *buf;           /* where to put what is received, or NULL */
+	size_t  size;           /* room in buf */
+	size_t  total;          /* received */
+};
+
+static void *
+reader(void *arg)
+{
+	struct reader_args *ra = arg;
+	uint8_t *scratch = malloc(READ_SIZE);
+	ssize_t n;
+
+	T_QUIET; T_ASSERT_NOTNULL(scratch, "malloc");
+	for (;;) {
+		if (ra->buf != NULL) {
+			n = read(ra->fd, ra->buf + ra->total, ra->size - ra->total);
+		} else {
+			n = read(ra->fd, scratch, READ_SIZE);
+		}
+		if (n <= 0) {
+			break;
+		}
+		ra->total += (size_t)n;
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "read");
+	free(scratch);
+	return NULL;
+}
+
+/*
+ * sendfile()s len bytes (counting the headers) of the file at off over
+ * a loopback connection, with hdtr, and returns what came out the other
+ * end.
+ */
+static uint8_t *
+send_and_receive(int fd, off_t off, off_t len, struct sf_hdtr *hdtr, int flags,
+    size_t *received)
+{
+	struct reader_args ra = { .size = FILE_SIZE + 2 * READ_SIZE };
+	off_t sent = len, expected = len;
+	pthread_t thread;
+	int s[2];
+
+	ra.buf = malloc(ra.size);
+	T_QUIET; T_ASSERT_NOTNULL(ra.buf, "malloc");
+	make_tcp_pair(s);
+	ra.fd = s[1];
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, reader, &ra),
+	    "pthread_create");
+
+	if (len == 0) {
+		expected = FILE_SIZE - off;
+		for (int i = 0; hdtr != NULL && i < hdtr->hdr_cnt; i++) {
+			expected += (off_t)hdtr->headers[i].iov_len;
+		}
+	}
+	for (int i = 0; hdtr != NULL && i < hdtr->trl_cnt; i++) {
+		expected += (off_t)hdtr->trailers[i].iov_len;
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sendfile(fd, s[0], off, &sent, hdtr, flags), "sendfile");
+	T_QUIET; T_ASSERT_EQ(sent, expected, "sendfile() reports what it sent");
+	shutdown(s[0], SHUT_WR);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), "pthread_join");
+	close(s[0]);
+	close(s[1]);
+	*received = ra.total;
+	return ra.buf;
+}
+
+T_DECL(sendfile_zerocopy_data,
+    "sendfile() of file data in the page cache sends it intact, from the cache")
+{
+	static const struct {
+		off_t   off;
+		off_t   len;
+	} ranges[] = {
+		{ 0, 0 },                               /* the whole file */
+		{ 1000, 3 * 4096 + 17 },                /* unaligned */
+		{ FILE_SIZE - 5000, 0 },                /* the tail */
+		{ 16384, 1 },
+	};
+	uint64_t zerocopy;
+	size_t received;
+	off_t sent = 1;
+	uint8_t *buf;
+	int fd, s[2];
+
+	fd = make_file();
+	zerocopy = counter("debug.sendfile_zerocopy_bytes");
+
+	for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+		off_t len = ranges[i].len ? ranges[i].len : FILE_SIZE - ranges[i].off;
+
+		buf = send_and_receive(fd, ranges[i].off, ranges[i].len, NULL, 0, &received);
+		T_EXPECT_EQ(received, (size_t)len, "received %lld bytes at %lld",
+		    (long long)len, (long long)ranges[i].off);
+		T_EXPECT_EQ(memcmp(buf, g_data + ranges[i].off, (size_t)len), 0,
+		    "the data at %lld is intact", (long long)ranges[i].off);
+		free(buf);
+	}
+	T_EXPECT_GT(counter("debug.sendfile_zerocopy_bytes"), zerocopy,
+	    "data was sent from the page cache");
+
+	/* SF_NOCACHE sends the same thing */
+	buf = send_and_receive(fd, 0, 0, NULL, SF_NOCACHE, &received);
+	T_EXPECT_EQ(received, (size_t)FILE_SIZE, "SF_NOCACHE: received the whole file");
+	T_EXPECT_EQ(memcmp(buf, g_data, FILE_SIZE), 0, "SF_NOCACHE: the data is intact");
+	free(buf);
+
+	/* the pages sent from were left alone */
+	buf = malloc(FILE_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	T_QUIET; T_ASSERT_EQ(pread(fd, buf, FILE_SIZE, 0), (ssize_t)FILE_SIZE, "pread");
+	T_EXPECT_EQ(memcmp(buf, g_data, FILE_SIZE), 0, "the file is unchanged");
+	free(buf);
+
+	make_tcp_pair(s);
+	T_EXPECT_POSIX_FAILURE(sendfile(fd, s[0], 0, &sent, NULL, 0x8000), EINVAL,
+	    "unknown flags are rejected");
+	close(s[0]);
+	close(s[1]);
+	close(fd);
+	unlink(g_path);
+	free(g_data);
+}
+
+T_DECL(sendfile_hdtr,
+    "sendfile() headers and trailers come out around the file data")
+{
+	char h1[] = "HTTP/1.1 200 OK\r\n", h2[] = "Content-Type: text/plain\r\n\r\n";
+	char t1[] = "\r\n0\r\n\r\n";
+	struct iovec hdrs[] = {
+		{ .iov_base = h1, .iov_len = sizeof(h1) - 1 },
+		{ .iov_base = h2, .iov_len = sizeof(h2) - 1 },
+	};
+	struct iovec trls[] = {
+		{ .iov_base = t1, .iov_len = sizeof(t1) - 1 },
+	};
+	struct sf_hdtr hdtr = {
+		.headers = hdrs, .hdr_cnt = 2, .trailers = trls, .trl_cnt = 1,
+	};
+	size_t hlen = hdrs[0].iov_len + hdrs[1].iov_len, tlen = trls[0].iov_len;
+	size_t received;
+	uint8_t *buf;
+	int fd;
+
+	fd = make_file();
+
+	/* the headers count towards the bytes to send */
+	buf = send_and_receive(fd, 4096, 100000, &hdtr, 0, &received);
+	T_EXPECT_EQ(received, 100000 + tlen, "received headers, data and trailers");
+	T_EXPECT_EQ(memcmp(buf, h1, hdrs[0].iov_len), 0, "the first header");
+	T_EXPECT_EQ(memcmp(buf + hdrs[0].iov_len, h2, hdrs[1].iov_len), 0, "the second header");
+	T_EXPECT_EQ(memcmp(buf + hlen, g_data + 4096, 100000 - hlen), 0, "the file data");
+	T_EXPECT_EQ(memcmp(buf + 100000, t1, tlen), 0, "the trailer");
+	free(buf);
+
+	/* at the end of the file, there is nothing to send them with */
+	buf = send_and_receive(fd, FILE_SIZE, 0, &hdtr, 0, &received);
+	T_EXPECT_EQ(received, hlen + tlen, "received only headers and trailers");
+	T_EXPECT_EQ(memcmp(buf + hlen, t1, tlen), 0, "the trailer follows the headers");
+	free(buf);
+
+	/* no file data at all, and only headers */
+	hdtr.trailers = NULL;
+	hdtr.trl_cnt = 0;
+	buf = send_and_receive(fd, 0, 0, &hdtr, 0, &received);
+	T_EXPECT_EQ(received, hlen + FILE_SIZE, "received headers and the whole file");
+	T_EXPECT_EQ(memcmp(buf + hlen, g_data, FILE_SIZE), 0, "the file data");
+	free(buf);
+
+	close(fd);
+	unlink(g_path);
+	free(g_data);
+}
+
+T_DECL(sendfile_zerocopy_live_pages,
+    "data sent from the page cache reflects writes made before it is received")
+{
+	const size_t len = 64 << 10;
+	uint64_t zerocopy;
+	uint8_t *newdata, *buf;
+	off_t sent = (off_t)len;
+	size_t old = 0, changed = 0;
+	int fd, s[2];
+
+	fd = make_file();
+	newdata = malloc(len);
+	buf = malloc(len);
+	T_QUIET; T_ASSERT_NOTNULL(newdata, "malloc");
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	for (size_t i = 0; i < len; i++) {
+		newdata[i] = ~g_data[i];
+	}
+
+	/* nobody reads, so the data stays queued on the peer */
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, s), "socketpair");
+	zerocopy = counter("debug.sendfile_zerocopy_bytes");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sendfile(fd, s[0], 0, &sent, NULL, 0), "sendfile");
+	T_QUIET; T_ASSERT_EQ(sent, (off_t)len, "sendfile() sent everything");
+	if (counter("debug.sendfile_zerocopy_bytes") == zerocopy) {
+		T_SKIP("%s wasn't sent from the page cache", g_path);
+	}
+
+	T_QUIET; T_ASSERT_EQ(pwrite(fd, newdata, len, 0), (ssize_t)len, "pwrite");
+	T_QUIET; T_ASSERT_EQ(recv(s[1], buf, len, MSG_WAITALL), (ssize_t)len, "recv");
+
+	/* each page is the file as it was, or as it is now: never anything else */
+	for (size_t off = 0; off < len; off += 4096) {
+		if (memcmp(buf + off, g_data + off, 4096) == 0) {
+			old++;
+		} else if (memcmp(buf + off, newdata + off, 4096) == 0) {
+			changed++;
+		}
+	}
+	T_EXPECT_EQ(old + changed, len / 4096, "every page received is one of the versions");
+	T_LOG("%zu pages received as sent, %zu as rewritten after sendfile() returned",
+	    old, changed);
+
+	close(s[0]);
+	close(s[1]);
+	close(fd);
+	unlink(g_path);
+	free(buf);
+	free(newdata);
+	free(g_data);
+}
+
+static void
+restore_zerocopy(void)
+{
+	if (g_zerocopy != -1) {
+		sysctlbyname("kern.ipc.sendfile_zerocopy", NULL, NULL, &g_zerocopy,
+		    sizeof(g_zerocopy));
+	}
+}
+
+/* sendfile()s the cached file BENCH_ROUNDS times, returns the throughput in GB/s */
+static double
+sendfile_throughput(int fd, int zerocopy)
+{
+	struct reader_args ra = { 0 };
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+	pthread_t thread;
+	int s[2];
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.ipc.sendfile_zerocopy", NULL, NULL,
+	    &zerocopy, sizeof(zerocopy)), "kern.ipc.sendfile_zerocopy");
+
+	make_tcp_pair(s);
+	ra.fd = s[1];
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&thread, NULL, reader, &ra),
+	    "pthread_create");
+
+	start = mach_absolute_time();
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		off_t sent = 0;
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(sendfile(fd, s[0], 0, &sent, NULL, 0), "sendfile");
+		T_QUIET; T_ASSERT_EQ(sent, (off_t)FILE_SIZE, "sent the whole file");
+	}
+	shutdown(s[0], SHUT_WR);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(thread, NULL), "pthread_join");
+	end = mach_absolute_time();
+
+	T_QUIET; T_ASSERT_EQ(ra.total, (size_t)BENCH_ROUNDS * FILE_SIZE, "received everything");
+	close(s[0]);
+	close(s[1]);
+
+	mach_timebase_info(&tb);
+	return (double)BENCH_ROUNDS * FILE_SIZE / (double)((end - start) * tb.numer / tb.denom);
+}
+
+T_DECL(sendfile_zerocopy_perf,
+    "loopback TCP throughput of sendfile() copying the file data or not",
+    T_META_TAG_PERF, T_META_ASROOT(true))
+{
+	size_t size = sizeof(g_zerocopy);
+	uint64_t zerocopy, copied;
+	double copy, nocopy;
+	int fd;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.ipc.sendfile_zerocopy", &g_zerocopy,
+	    &size, NULL, 0), "kern.ipc.sendfile_zerocopy");
+	T_ATEND(restore_zerocopy);
+
+	fd = make_file();
+
+	copied = counter("debug.sendfile_copy_bytes");
+	copy = sendfile_throughput(fd, 0);
+	T_EXPECT_GE(counter("debug.sendfile_copy_bytes") - copied,
+	    (uint64_t)BENCH_ROUNDS * FILE_SIZE, "the copy path copied everything");
+
+	zerocopy = counter("debug.sendfile_zerocopy_bytes");
+	nocopy = sendfile_throughput(fd, 1);
+	T_EXPECT_GT(counter("debug.sendfile_zerocopy_bytes"), zerocopy,
+	    "data was sent from the page cache");
+
+	T_PERF("sendfile_copy", copy, "GB/s", "sendfile() reading the file into mbufs");
+	T_PERF("sendfile_zerocopy", nocopy, "GB/s", "sendfile() from the page cache");
+	T_LOG("loopback sendfile: %.2f GB/s copying, %.2f GB/s from the page cache",
+	    copy, nocopy);
+
+	close(fd);
+	unlink(g_path);
+	free(g_data);
+}
@@ -0,0 +1,467 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.net.splice"),
+    T_META_CHECK_LEAKS(false));
+
+ssize_t splice_x(int s, int fd, off_t *offset, size_t nbytes, int flags);
+
+#define DATA_SIZE       (4 << 20)
+#define BENCH_SIZE      (1ull << 30)
+#define RELAY_SIZE      (1 << 20)
+
+static uint8_t *g_data;
+
+static void
+make_data(void)
+{
+	g_data = malloc(DATA_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(g_data, "malloc");
+	for (size_t i = 0; i < DATA_SIZE; i++) {
+		g_data[i] = (uint8_t)(i * 13 + (i >> 10));
+	}
+}
+
+static void
+make_tcp_pair(int fds[2])
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(sin);
+	int ls;
+
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ls, "socket");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bind(ls, (struct sockaddr *)&sin, len), "bind");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen(ls, 1), "listen");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getsockname(ls, (struct sockaddr *)&sin, &len),
+	    "getsockname");
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[0], "socket");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(fds[0], (struct sockaddr *)&sin, len),
+	    "connect");
+	fds[1] = accept(ls, NULL, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[1], "accept");
+	close(ls);
+}
+
+struct peer_args {
+	int     fd;
+	size_t  size;
+};
+
+static void *
+writer(void *arg)
+{
+	struct peer_args *pa = arg;
+
+	for (size_t done = 0; done < pa->size;) {
+		size_t len = MIN(pa->size - done, DATA_SIZE);
+		ssize_t n = write(pa->fd, g_data, len);
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "write");
+		done += (size_t)n;
+	}
+	shutdown(pa->fd, SHUT_WR);
+	return NULL;
+}
+
+static void *
+checking_reader(void *arg)
+{
+	struct peer_args *pa = arg;
+	uint8_t *buf = malloc(DATA_SIZE);
+	size_t total = 0;
+	ssize_t n;
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	while ((n = read(pa->fd, buf + total, DATA_SIZE - total)) > 0) {
+		total += (size_t)n;
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "read");
+	T_EXPECT_EQ(total, (size_t)DATA_SIZE, "received all the data");
+	T_EXPECT_EQ(memcmp(buf, g_data, DATA_SIZE), 0, "the data is intact");
+	free(buf);
+	return NULL;
+}
+
+/* relay everything from "from" to "to" with splice_x, return how much */
+static size_t
+splice_relay(int from, int to, int flags)
+{
+	size_t total = 0;
+	ssize_t n;
+
+	while ((n = splice_x(from, to, NULL, RELAY_SIZE, flags)) > 0) {
+		total += (size_t)n;
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "splice_x");
+	return total;
+}
+
+static void
+check_socket_relay(const char *what, int in[2], int out[2], int flags)
+{
+	struct peer_args wa = { .fd = in[0], .size = DATA_SIZE };
+	struct peer_args ra = { .fd = out[1] };
+	pthread_t wthread, rthread;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&wthread, NULL, writer, &wa),
+	    "pthread_create");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&rthread, NULL, checking_reader, &ra),
+	    "pthread_create");
+
+	T_EXPECT_EQ(splice_relay(in[1], out[0], flags), (size_t)DATA_SIZE,
+	    "%s: relayed all the data", what);
+	shutdown(out[0], SHUT_WR);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(wthread, NULL), "pthread_join");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(rthread, NULL), "pthread_join");
+	for (int i = 0; i < 2; i++) {
+		close(in[i]);
+		close(out[i]);
+	}
+}
+
+T_DECL(splice_socket_to_socket,
+    "splice_x() relays a stream from a socket to another, intact")
+{
+	int in[2], out[2];
+
+	make_data();
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, in), "socketpair");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, out), "socketpair");
+	check_socket_relay("unix to unix", in, out, 0);
+
+	make_tcp_pair(in);
+	make_tcp_pair(out);
+	check_socket_relay("tcp to tcp", in, out, 0);
+
+	make_tcp_pair(in);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, out), "socketpair");
+	check_socket_relay("tcp to unix, waiting for all the data", in, out, MSG_WAITALL);
+
+	free(g_data);
+}
+
+struct relay_pipe_args {
+	int     from;
+	int     to;
+	size_t  total;
+};
+
+static void *
+pipe_relay(void *arg)
+{
+	struct relay_pipe_args *ra = arg;
+
+	ra->total = splice_relay(ra->from, ra->to, 0);
+	close(ra->to);
+	return NULL;
+}
+
+T_DECL(splice_through_pipe,
+    "splice_x() relays a stream from a socket to a pipe, and from the pipe to a socket")
+{
+	struct peer_args wa = { .size = DATA_SIZE };
+	struct peer_args ra = { };
+	struct relay_pipe_args pa = { };
+	pthread_t wthread, rthread, pthr;
+	int in[2], out[2], fds[2];
+
+	make_data();
+
+	make_tcp_pair(in);
+	make_tcp_pair(out);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+	wa.fd = in[0];
+	ra.fd = out[1];
+	pa.from = in[1];
+	pa.to = fds[1];
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&wthread, NULL, writer, &wa),
+	    "pthread_create");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&rthread, NULL, checking_reader, &ra),
+	    "pthread_create");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&pthr, NULL, pipe_relay, &pa),
+	    "pthread_create");
+
+	T_EXPECT_EQ(splice_relay(fds[0], out[0], 0), (size_t)DATA_SIZE,
+	    "relayed all the data out of the pipe");
+	shutdown(out[0], SHUT_WR);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(pthr, NULL), "pthread_join");
+	T_EXPECT_EQ(pa.total, (size_t)DATA_SIZE, "relayed all the data into the pipe");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(wthread, NULL), "pthread_join");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(rthread, NULL), "pthread_join");
+	close(fds[0]);
+	for (int i = 0; i < 2; i++) {
+		close(in[i]);
+		close(out[i]);
+	}
+	free(g_data);
+}
+
+T_DECL(splice_socket_to_file,
+    "splice_x() writes a stream to a file, at an offset or at the file offset")
+{
+	char path[PATH_MAX];
+	struct peer_args wa = { .size = DATA_SIZE };
+	pthread_t wthread;
+	uint8_t *buf;
+	off_t offset = 4096;
+	size_t total = 0;
+	ssize_t n;
+	int fd, in[2];
+
+	make_data();
+	buf = malloc(DATA_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+
+	snprintf(path, sizeof(path), "%s/splice_socket_to_file", dt_tmpdir());
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(unlink(path), "unlink %s", path);
+
+	make_tcp_pair(in);
+	wa.fd = in[0];
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&wthread, NULL, writer, &wa),
+	    "pthread_create");
+	while ((n = splice_x(in[1], fd, &offset, RELAY_SIZE, 0)) > 0) {
+		total += (size_t)n;
+	}
+	T_ASSERT_POSIX_SUCCESS(n, "splice_x to a file at an offset");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(wthread, NULL), "pthread_join");
+
+	T_EXPECT_EQ(total, (size_t)DATA_SIZE, "moved all the data");
+	T_EXPECT_EQ(offset, (off_t)(4096 + DATA_SIZE), "the offset was updated");
+	T_EXPECT_EQ(lseek(fd, 0, SEEK_CUR), (off_t)0, "the file offset was left alone");
+	T_QUIET; T_ASSERT_EQ(pread(fd, buf, DATA_SIZE, 4096), (ssize_t)DATA_SIZE, "pread");
+	T_EXPECT_EQ(memcmp(buf, g_data, DATA_SIZE), 0, "the file has the data");
+	close(in[0]);
+	close(in[1]);
+
+	/* without an offset, append at the file offset */
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, in), "socketpair");
+	T_QUIET; T_ASSERT_EQ(write(in[0], g_data, 1000), 1000L, "write");
+	T_QUIET; T_ASSERT_EQ(lseek(fd, 100, SEEK_SET), (off_t)100, "lseek");
+	T_EXPECT_EQ(splice_x(in[1], fd, NULL, 5000, MSG_DONTWAIT), 1000L,
+	    "splice_x moves the data available");
+	T_EXPECT_EQ(lseek(fd, 0, SEEK_CUR), (off_t)1100, "the file offset moved");
+	T_QUIET; T_ASSERT_EQ(pread(fd, buf, 1000, 100), 1000L, "pread");
+	T_EXPECT_EQ(memcmp(buf, g_data, 1000), 0, "the file has the data");
+
+	close(in[0]);
+	close(in[1]);
+	close(fd);
+	free(buf);
+	free(g_data);
+}
+
+T_DECL(splice_errors,
+    "splice_x() argument checking and non blocking behavior")
+{
+	int s[2], t[2], fds[2], fd;
+	off_t offset = 0;
+	char c = 'x';
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, s), "socketpair");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, t), "socketpair");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+	fd = open("/dev/null", O_RDONLY);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open /dev/null");
+
+	T_EXPECT_POSIX_FAILURE(splice_x(s[0], s[0], NULL, 1, 0), EINVAL,
+	    "a socket can't be spliced to itself");
+	T_EXPECT_POSIX_FAILURE(splice_x(fd, t[0], NULL, 1, 0), ENOTSUP,
+	    "the source must be a socket or a pipe");
+	T_EXPECT_POSIX_FAILURE(splice_x(fds[1], t[0], NULL, 1, 0), EBADF,
+	    "the source must be readable");
+	T_EXPECT_POSIX_FAILURE(splice_x(s[0], fds[0], NULL, 1, 0), EBADF,
+	    "a pipe destination must be writable");
+	T_EXPECT_POSIX_FAILURE(splice_x(s[0], fds[1], &offset, 1, 0), ESPIPE,
+	    "there are no offsets in a pipe");
+	T_EXPECT_POSIX_FAILURE(splice_x(s[0], fd, NULL, 1, 0), EBADF,
+	    "the destination must be writable");
+	T_EXPECT_POSIX_FAILURE(splice_x(s[0], t[0], &offset, 1, 0), ESPIPE,
+	    "there are no offsets in a socket");
+	T_EXPECT_POSIX_FAILURE(splice_x(s[0], t[0], NULL, 1, MSG_PEEK), EINVAL,
+	    "unsupported flags are rejected");
+	T_EXPECT_POSIX_FAILURE(splice_x(s[0], t[0], NULL, 1, MSG_DONTWAIT), EAGAIN,
+	    "MSG_DONTWAIT doesn't wait for data");
+	T_EXPECT_POSIX_FAILURE(splice_x(fds[0], t[0], NULL, 1, MSG_DONTWAIT), EAGAIN,
+	    "MSG_DONTWAIT doesn't wait for data in a pipe");
+
+	T_QUIET; T_ASSERT_EQ(write(s[1], &c, 1), 1L, "write");
+	T_EXPECT_EQ(splice_x(s[0], t[0], NULL, 10, 0), 1L, "moves the data available");
+	T_QUIET; T_ASSERT_EQ(read(t[1], &c, 1), 1L, "read");
+	T_EXPECT_EQ(c, 'x', "the data made it through");
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(shutdown(s[1], SHUT_WR), "shutdown");
+	T_EXPECT_EQ(splice_x(s[0], t[0], NULL, 10, 0), 0L, "returns 0 at end of stream");
+
+	close(fd);
+	close(fds[0]);
+	close(fds[1]);
+	for (int i = 0; i < 2; i++) {
+		close(s[i]);
+		close(t[i]);
+	}
+}
+
+T_DECL(splice_short_write,
+    "data a file doesn't take is left on the source socket, not lost")
+{
+	struct rlimit rl = { .rlim_cur = 4096, .rlim_max = RLIM_INFINITY };
+	char path[PATH_MAX];
+	uint8_t *buf;
+	ssize_t n;
+	int fd, in[2];
+
+	make_data();
+	buf = malloc(DATA_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+
+	snprintf(path, sizeof(path), "%s/splice_short_write", dt_tmpdir());
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(unlink(path), "unlink %s", path);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(socketpair(AF_UNIX, SOCK_STREAM, 0, in), "socketpair");
+	T_QUIET; T_ASSERT_EQ(write(in[0], g_data, 16384), 16384L, "write");
+
+	/* the file can't grow past 4k, so the write stops short */
+	signal(SIGXFSZ, SIG_IGN);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setrlimit(RLIMIT_FSIZE, &rl), "setrlimit");
+	n = splice_x(in[1], fd, NULL, 16384, MSG_DONTWAIT);
+	T_EXPECT_EQ(n, 4096L, "splice_x reports what was written");
+	T_EXPECT_POSIX_FAILURE(splice_x(in[1], fd, NULL, 16384, MSG_DONTWAIT), EFBIG,
+	    "the next call runs into the error");
+	rl.rlim_cur = RLIM_INFINITY;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setrlimit(RLIMIT_FSIZE, &rl), "setrlimit");
+
+	T_QUIET; T_ASSERT_EQ(pread(fd, buf, 4096, 0), 4096L, "pread");
+	T_EXPECT_EQ(memcmp(buf, g_data, 4096), 0, "the file has the data written");
+	T_EXPECT_EQ(recv(in[1], buf, 16384, MSG_DONTWAIT | MSG_WAITALL), 12288L,
+	    "the rest is still on the socket");
+	T_EXPECT_EQ(memcmp(buf, g_data + 4096, 12288), 0, "in order");
+
+	close(in[0]);
+	close(in[1]);
+	close(fd);
+	free(buf);
+	free(g_data);
+}
+
+struct relay_args {
+	int     from;
+	int     to;
+	bool    splice;
+};
+
+static void *
+drain(void *arg)
+{
+	int fd = *(int *)arg;
+	char *buf = malloc(RELAY_SIZE);
+
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	while (read(fd, buf, RELAY_SIZE) > 0) {
+		;
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * A loopback TCP proxy: client -> [in] proxy [out] -> server.
+ * Returns the proxied throughput in GB/s.
+ */
+static double
+proxy_throughput(bool splice)
+{
+	struct peer_args wa = { .size = BENCH_SIZE };
+	mach_timebase_info_data_t tb;
+	pthread_t wthread, rthread;
+	uint64_t start, end;
+	size_t total = 0;
+	int in[2], out[2];
+
+	make_tcp_pair(in);
+	make_tcp_pair(out);
+	wa.fd = in[0];
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&rthread, NULL, drain, &out[1]),
+	    "pthread_create");
+
+	start = mach_absolute_time();
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&wthread, NULL, writer, &wa),
+	    "pthread_create");
+	if (splice) {
+		total = splice_relay(in[1], out[0], 0);
+	} else {
+		char *buf = malloc(RELAY_SIZE);
+		ssize_t n;
+
+		T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+		while ((n = read(in[1], buf, RELAY_SIZE)) > 0) {
+			T_QUIET; T_ASSERT_EQ(write(out[0], buf, (size_t)n), n, "write");
+			total += (size_t)n;
+		}
+		free(buf);
+	}
+	shutdown(out[0], SHUT_WR);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(wthread, NULL), "pthread_join");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(rthread, NULL), "pthread_join");
+	end = mach_absolute_time();
+
+	T_QUIET; T_ASSERT_EQ(total, (size_t)BENCH_SIZE, "proxied all the data");
+	for (int i = 0; i < 2; i++) {
+		close(in[i]);
+		close(out[i]);
+	}
+
+	mach_timebase_info(&tb);
+	return (double)BENCH_SIZE / (double)((end - start) * tb.numer / tb.denom);
+}
+
+T_DECL(splice_proxy_perf,
+    "loopback TCP proxy throughput, relaying in user space or with splice_x()",
+    T_META_TAG_PERF)
+{
+	double copy, splice;
+
+	make_data();
+
+	copy = proxy_throughput(false);
+	splice = proxy_throughput(true);
+
+	T_PERF("proxy_read_write", copy, "GB/s", "proxied with read() and write()");
+	T_PERF("proxy_splice", splice, "GB/s", "proxied with splice_x()");
+	T_LOG("loopback TCP proxy: %.2f GB/s with read/write, %.2f GB/s with splice_x",
+	    copy, splice);
+
+	free(g_data);
+}
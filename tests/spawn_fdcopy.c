@@ -0,0 +1,201 @@
+#include <darwintest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mach-o/dyld.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/syslimits.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.spawn"),
+    T_META_CHECK_LEAKS(false));
+
+#define MANY_FDS        100000
+#define SPAWNS          20
+
+/*
+ * Exits with the number of descriptors that are not as expected:
+ * "N" must be open, "!N" must be closed.
+ */
+T_HELPER_DECL(check_fds, "check which descriptors were inherited")
+{
+	int bad = 0;
+
+	for (int i = 0; i < argc; i++) {
+		const char *arg = argv[i];
+		bool want_open = (arg[0] != '!');
+		int fd = atoi(want_open ? arg : arg + 1);
+
+		if ((fcntl(fd, F_GETFD) != -1) != want_open) {
+			bad++;
+		}
+	}
+	exit(bad);
+}
+
+static void
+spawn_check(const char *what, posix_spawn_file_actions_t *fa, short flags,
+    char **expect)
+{
+	char path[PATH_MAX];
+	uint32_t path_size = sizeof(path);
+	char *argv[16] = { path, "-n", "check_fds", "--" };
+	posix_spawnattr_t attr;
+	int argc = 4, status;
+	pid_t pid;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(_NSGetExecutablePath(path, &path_size),
+	    "_NSGetExecutablePath");
+	while (*expect) {
+		argv[argc++] = *expect++;
+	}
+	argv[argc] = NULL;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawnattr_init(&attr), "posix_spawnattr_init");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawnattr_setflags(&attr, flags),
+	    "posix_spawnattr_setflags");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn(&pid, path, fa, &attr, argv, NULL),
+	    "posix_spawn");
+	posix_spawnattr_destroy(&attr);
+
+	T_QUIET; T_ASSERT_EQ(waitpid(pid, &status, 0), pid, "waitpid");
+	T_EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	    "%s (%d descriptors not as expected)", what, WEXITSTATUS(status));
+}
+
+static int
+open_fd_at(int fd, bool cloexec)
+{
+	int tmp = open("/dev/null", O_RDONLY);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(tmp, "open /dev/null");
+	T_QUIET; T_ASSERT_EQ(dup2(tmp, fd), fd, "dup2 to %d", fd);
+	close(tmp);
+	if (cloexec) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fcntl(fd, F_SETFD, FD_CLOEXEC), "FD_CLOEXEC");
+	}
+	return fd;
+}
+
+T_DECL(spawn_fdcopy_inherit,
+    "posix_spawn() children inherit the same descriptors however many the parent has")
+{
+	posix_spawn_file_actions_t fa;
+
+	open_fd_at(20, false);
+	open_fd_at(21, true);
+	open_fd_at(300, true);
+	open_fd_at(301, false);
+
+	spawn_check("no file actions", NULL, 0,
+	    (char *[]){ "20", "!21", "!300", "301", NULL });
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_init(&fa), "init");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_addinherit_np(&fa, 21),
+	    "addinherit_np");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_adddup2(&fa, 300, 30),
+	    "adddup2");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_addclose(&fa, 20),
+	    "addclose");
+	spawn_check("file actions on close-on-exec descriptors", &fa, 0,
+	    (char *[]){ "!20", "21", "30", "!300", "301", NULL });
+	posix_spawn_file_actions_destroy(&fa);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_init(&fa), "init");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_addinherit_np(&fa, 20),
+	    "addinherit_np");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_adddup2(&fa, 300, 22),
+	    "adddup2");
+	spawn_check("POSIX_SPAWN_CLOEXEC_DEFAULT", &fa, POSIX_SPAWN_CLOEXEC_DEFAULT,
+	    (char *[]){ "20", "!21", "22", "!300", "!301", NULL });
+	posix_spawn_file_actions_destroy(&fa);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_init(&fa), "init");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn_file_actions_addclose(&fa, 300),
+	    "addclose");
+	spawn_check("closing a close-on-exec descriptor", &fa, POSIX_SPAWN_CLOEXEC_DEFAULT,
+	    (char *[]){ "!20", "!300", "!301", NULL });
+	posix_spawn_file_actions_destroy(&fa);
+
+	close(20);
+	close(21);
+	close(300);
+	close(301);
+}
+
+static double
+spawn_us(short flags)
+{
+	char *argv[] = { "/usr/bin/true", NULL };
+	mach_timebase_info_data_t tb;
+	posix_spawnattr_t attr;
+	uint64_t start, end;
+	int status;
+	pid_t pid;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawnattr_init(&attr), "posix_spawnattr_init");
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawnattr_setflags(&attr, flags),
+	    "posix_spawnattr_setflags");
+
+	start = mach_absolute_time();
+	for (int i = 0; i < SPAWNS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn(&pid, argv[0], NULL, &attr, argv, NULL),
+		    "posix_spawn");
+		T_QUIET; T_ASSERT_EQ(waitpid(pid, &status, 0), pid, "waitpid");
+	}
+	end = mach_absolute_time();
+
+	posix_spawnattr_destroy(&attr);
+
+	mach_timebase_info(&tb);
+	return (double)((end - start) * tb.numer / tb.denom) / SPAWNS / 1000;
+}
+
+T_DECL(spawn_fdcopy_perf,
+    "posix_spawn() latency from a parent with many close-on-exec descriptors",
+    T_META_TAG_PERF)
+{
+	int maxfiles = 0, n, first;
+	size_t size = sizeof(maxfiles);
+	double none_us, cloexec_us, default_us;
+	struct rlimit rl;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.maxfilesperproc",
+	    &maxfiles, &size, NULL, 0), "kern.maxfilesperproc");
+	n = MIN(MANY_FDS, maxfiles - 64);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getrlimit(RLIMIT_NOFILE, &rl), "getrlimit");
+	rl.rlim_cur = (rlim_t)n + 64;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setrlimit(RLIMIT_NOFILE, &rl), "setrlimit");
+
+	none_us = spawn_us(0);
+
+	first = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(first, "open /dev/null");
+	for (int i = 1; i < n; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fcntl(first, F_DUPFD_CLOEXEC, 0), "dup");
+	}
+
+	cloexec_us = spawn_us(0);
+	default_us = spawn_us(POSIX_SPAWN_CLOEXEC_DEFAULT);
+
+	for (int fd = first; fd < first + n; fd++) {
+		close(fd);
+	}
+
+	T_PERF("spawn_no_fds", none_us, "us", "posix_spawn() and wait");
+	T_PERF("spawn_cloexec_fds", cloexec_us, "us",
+	    "posix_spawn() and wait, many close-on-exec descriptors");
+	T_PERF("spawn_cloexec_default", default_us, "us",
+	    "posix_spawn() and wait with POSIX_SPAWN_CLOEXEC_DEFAULT, many descriptors");
+	T_LOG("posix_spawn(): %.0f us, %.0f us with %d close-on-exec descriptors, "
+	    "%.0f us with POSIX_SPAWN_CLOEXEC_DEFAULT", none_us, cloexec_us, n, default_us);
+}
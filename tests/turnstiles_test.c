@@ -474,6 +474,57 @@ test5(void)
 	return;
 }
 
+#define TURNSTILE_MAX_HOP_DEFAULT 10
+
+struct turnstile_chain_stats {
+	uint64_t tcs_count;
+	uint64_t tcs_time_total_ns;
+	uint64_t tcs_time_max_ns;
+};
+
+static uint64_t
+get_chain_stats(const char *name, struct turnstile_chain_stats *stats)
+{
+	size_t size = sizeof(stats[0]) * TURNSTILE_MAX_HOP_DEFAULT;
+	uint64_t total = 0;
+	int ret;
+
+	ret = sysctlbyname(name, stats, &size, NULL, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ret, "sysctlbyname(%s)", name);
+	T_QUIET; T_ASSERT_EQ(size, sizeof(stats[0]) * TURNSTILE_MAX_HOP_DEFAULT, "size of %s", name);
+
+	for (int i = 0; i < TURNSTILE_MAX_HOP_DEFAULT; i++) {
+		total += stats[i].tcs_count;
+	}
+	return total;
+}
+
+T_DECL(turnstile_chain_stats, "Turnstile propagation chain length histogram",
+    T_META_ASROOT(YES), T_META_REQUIRES_SYSCTL_EQ("kern.development", 1))
+{
+	struct turnstile_chain_stats before[TURNSTILE_MAX_HOP_DEFAULT];
+	struct turnstile_chain_stats after[TURNSTILE_MAX_HOP_DEFAULT];
+	uint64_t nbefore, nafter;
+
+	nbefore = get_chain_stats("kern.turnstile_boost_chain_stats", before);
+	test1(SYSCTL_TURNSTILE_TEST_USER_DEFAULT);
+	nafter = get_chain_stats("kern.turnstile_boost_chain_stats", after);
+
+	T_ASSERT_GT(nafter, nbefore, "boosting a lock owner is accounted in the histogram");
+
+	for (int i = 0; i < TURNSTILE_MAX_HOP_DEFAULT; i++) {
+		uint64_t count = after[i].tcs_count - before[i].tcs_count;
+		if (count == 0) {
+			continue;
+		}
+		T_LOG("%2d hop(s): %llu walks, %llu ns avg, %llu ns max (since boot)",
+		    i + 1, count, (after[i].tcs_time_total_ns - before[i].tcs_time_total_ns) / count,
+		    after[i].tcs_time_max_ns);
+		T_QUIET; T_ASSERT_LE(after[i].tcs_time_max_ns, after[i].tcs_time_total_ns,
+		    "max walk time is bounded by the total");
+	}
+}
+
 T_DECL(turnstile_test, "Turnstile test", T_META_ASROOT(YES))
 {
 	test1(SYSCTL_TURNSTILE_TEST_USER_DEFAULT);
@@ -0,0 +1,290 @@
+#include <darwintest.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/sysctl.h>
+#include <sys/ulock.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.ulock"),
+    T_META_CHECK_LEAKS(false));
+
+#define MAX_WAITERS     32
+#define ROUNDS          2000
+
+/*
+ * A minimal mutex and condition variable on top of UL_COMPARE_AND_WAIT,
+ * in the style of futex based implementations: the mutex is 0 (unlocked),
+ * 1 (locked) or 2 (locked, maybe contended); the condition variable is a
+ * sequence number waiters block on.
+ */
+struct cw_mutex {
+	_Atomic uint32_t state;
+};
+
+struct cw_cond {
+	_Atomic uint32_t seq;
+};
+
+static void
+cw_mutex_lock_contended(struct cw_mutex *m)
+{
+	/* we may have been requeued behind other waiters: always lock as 2 */
+	while (atomic_exchange(&m->state, 2) != 0) {
+		__ulock_wait(UL_COMPARE_AND_WAIT | ULF_NO_ERRNO, &m->state, 2, 0);
+	}
+}
+
+static void
+cw_mutex_lock(struct cw_mutex *m)
+{
+	uint32_t unlocked = 0;
+
+	if (!atomic_compare_exchange_strong(&m->state, &unlocked, 1)) {
+		cw_mutex_lock_contended(m);
+	}
+}
+
+static void
+cw_mutex_unlock(struct cw_mutex *m)
+{
+	if (atomic_exchange(&m->state, 0) == 2) {
+		__ulock_wake(UL_COMPARE_AND_WAIT | ULF_NO_ERRNO, &m->state, 0);
+	}
+}
+
+static void
+cw_cond_wait(struct cw_cond *c, struct cw_mutex *m)
+{
+	uint32_t seq = atomic_load(&c->seq);
+
+	cw_mutex_unlock(m);
+	__ulock_wait(UL_COMPARE_AND_WAIT | ULF_NO_ERRNO, &c->seq, seq, 0);
+	cw_mutex_lock_contended(m);
+}
+
+/* must be called with the mutex held */
+static int
+cw_cond_broadcast(struct cw_cond *c, struct cw_mutex *m, bool requeue)
+{
+	atomic_fetch_add(&c->seq, 1);
+
+	if (!requeue) {
+		return __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_ALL | ULF_NO_ERRNO,
+		           &c->seq, 0);
+	}
+
+	/* make sure our unlock wakes up the waiters moved to the mutex */
+	atomic_store(&m->state, 2);
+	return __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_REQUEUE | ULF_NO_ERRNO,
+	           &c->seq, (uint64_t)(uintptr_t)&m->state);
+}
+
+static struct cw_mutex g_mutex;
+static struct cw_cond g_cond;
+static uint32_t g_generation;
+static uint32_t g_waiting;
+static bool g_done;
+
+static void *
+broadcast_waiter(void *arg __unused)
+{
+	cw_mutex_lock(&g_mutex);
+	while (!g_done) {
+		uint32_t gen = g_generation;
+
+		g_waiting++;
+		while (g_generation == gen && !g_done) {
+			cw_cond_wait(&g_cond, &g_mutex);
+		}
+	}
+	cw_mutex_unlock(&g_mutex);
+
+	return NULL;
+}
+
+static uint32_t
+waiters_waiting(void)
+{
+	uint32_t waiting;
+
+	cw_mutex_lock(&g_mutex);
+	waiting = g_waiting;
+	cw_mutex_unlock(&g_mutex);
+	return waiting;
+}
+
+static double
+run_broadcast(bool requeue, int nwaiters)
+{
+	pthread_t threads[MAX_WAITERS];
+	mach_timebase_info_data_t tb;
+	uint64_t start, end;
+
+	g_generation = 0;
+	g_waiting = 0;
+	g_done = false;
+
+	for (int i = 0; i < nwaiters; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    broadcast_waiter, NULL), "pthread_create");
+	}
+
+	start = mach_absolute_time();
+	for (uint32_t round = 1; round <= ROUNDS; round++) {
+		while (waiters_waiting() != round * (uint32_t)nwaiters) {
+			pthread_yield_np();
+		}
+
+		cw_mutex_lock(&g_mutex);
+		g_generation++;
+		if (round == ROUNDS) {
+			g_done = true;
+		}
+		cw_cond_broadcast(&g_cond, &g_mutex, requeue);
+		cw_mutex_unlock(&g_mutex);
+	}
+	end = mach_absolute_time();
+
+	for (int i = 0; i < nwaiters; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+
+	mach_timebase_info(&tb);
+	return (double)((end - start) * tb.numer / tb.denom) / ROUNDS;
+}
+
+T_DECL(ulock_requeue_moves_waiters,
+    "ULF_WAKE_REQUEUE wakes one waiter and moves the others",
+    T_META_REQUIRES_SYSCTL_EQ("kern.development", 1))
+{
+	pthread_t threads[4];
+	int rc;
+
+	g_generation = 0;
+	g_waiting = 0;
+	g_done = false;
+
+	for (int i = 0; i < 4; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    broadcast_waiter, NULL), "pthread_create");
+	}
+
+	/* wait for the 4 waiters and the condition variable to be in the kernel */
+	while (waiters_waiting() != 4 ||
+	    __ulock_wake(UL_DEBUG_HASH_DUMP_PID, NULL, 0) != 1) {
+		usleep(100);
+	}
+	/* give the last waiter time to block */
+	usleep(100000);
+
+	cw_mutex_lock(&g_mutex);
+	g_done = true;
+	rc = cw_cond_broadcast(&g_cond, &g_mutex, true);
+	T_EXPECT_EQ(rc, 3, "three waiters were moved to the mutex");
+	cw_mutex_unlock(&g_mutex);
+
+	for (int i = 0; i < 4; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+	T_PASS("all waiters were eventually woken up by the mutex");
+
+	rc = __ulock_wake(UL_UNFAIR_LOCK | ULF_WAKE_REQUEUE | ULF_NO_ERRNO,
+	    &g_cond.seq, (uint64_t)(uintptr_t)&g_mutex.state);
+	T_EXPECT_EQ(rc, -EINVAL, "requeue is only supported for compare and wait");
+	rc = __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_REQUEUE | ULF_NO_ERRNO,
+	    &g_cond.seq, (uint64_t)(uintptr_t)&g_cond.seq);
+	T_EXPECT_EQ(rc, -EINVAL, "requeue to the same address is rejected");
+}
+
+static _Atomic uint32_t g_unfair_lock;
+static _Atomic uint32_t g_seq;
+
+static void *
+seq_waiter(void *arg)
+{
+	/* the owner of the unfair lock, if arg, blocks on the sequence */
+	if (arg) {
+		atomic_store(&g_unfair_lock, pthread_mach_thread_np(pthread_self()));
+	}
+	__ulock_wait(UL_COMPARE_AND_WAIT | ULF_NO_ERRNO, &g_seq, 0, 0);
+	return NULL;
+}
+
+static void *
+unfair_waiter(void *arg __unused)
+{
+	uint32_t owner = atomic_load(&g_unfair_lock);
+
+	__ulock_wait(UL_UNFAIR_LOCK | ULF_NO_ERRNO, &g_unfair_lock, owner, 0);
+	return NULL;
+}
+
+T_DECL(ulock_requeue_deadlock,
+    "ULF_WAKE_REQUEUE refuses to move waiters onto the lock of a waiter",
+    T_META_REQUIRES_SYSCTL_EQ("kern.development", 1))
+{
+	pthread_t owner, waiter, unfair;
+	int rc;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&owner, NULL,
+	    seq_waiter, (void *)1), "pthread_create");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&waiter, NULL,
+	    seq_waiter, NULL), "pthread_create");
+	while (atomic_load(&g_unfair_lock) == 0) {
+		usleep(100);
+	}
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&unfair, NULL,
+	    unfair_waiter, NULL), "pthread_create");
+
+	/* wait for the sequence and the unfair lock to be in the kernel */
+	while (__ulock_wake(UL_DEBUG_HASH_DUMP_PID, NULL, 0) != 2) {
+		usleep(100);
+	}
+	/* give the last waiters time to block */
+	usleep(100000);
+
+	rc = __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_REQUEUE | ULF_NO_ERRNO,
+	    &g_seq, (uint64_t)(uintptr_t)&g_unfair_lock);
+	T_EXPECT_EQ(rc, -EDEADLK, "waiters aren't moved behind the owner of the target");
+
+	atomic_store(&g_seq, 1);
+	__ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_ALL | ULF_NO_ERRNO, &g_seq, 0);
+	atomic_store(&g_unfair_lock, 0);
+	__ulock_wake(UL_UNFAIR_LOCK | ULF_WAKE_ALL | ULF_WAKE_ALLOW_NON_OWNER | ULF_NO_ERRNO,
+	    &g_unfair_lock, 0);
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(owner, NULL), "pthread_join");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(waiter, NULL), "pthread_join");
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(unfair, NULL), "pthread_join");
+}
+
+T_DECL(ulock_requeue_broadcast,
+    "condition variable broadcast: wake all vs. requeue to the mutex",
+    T_META_TAG_PERF)
+{
+	int ncpu = 0;
+	size_t size = sizeof(ncpu);
+	double wake_all_ns, requeue_ns;
+	int nwaiters;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0),
+	    "hw.ncpu");
+	nwaiters = ncpu * 2;
+	if (nwaiters > MAX_WAITERS) {
+		nwaiters = MAX_WAITERS;
+	}
+
+	wake_all_ns = run_broadcast(false, nwaiters);
+	requeue_ns = run_broadcast(true, nwaiters);
+
+	T_PERF("wake_all", wake_all_ns, "ns", "broadcast round, waking all waiters");
+	T_PERF("requeue", requeue_ns, "ns", "broadcast round, requeueing to the mutex");
+	T_LOG("%d waiters: wake all %.0f ns/round, requeue %.0f ns/round",
+	    nwaiters, wake_all_ns, requeue_ns);
+}
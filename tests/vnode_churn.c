@@ -0,0 +1,84 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+#define MAXVNODES       4096
+#define MAXVNODES_STR   "4096"
+#define NFILES          (4 * MAXVNODES)
+#define ROUNDS          4
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+T_DECL(vnode_churn_open_latency,
+    "open() latency when touching more files than there are vnodes",
+    T_META_TAG_PERF, T_META_ASROOT(true),
+    /* shrink the vnode table so that a few thousand files overflow it */
+    T_META_SYSCTL_INT("kern.maxvnodes=" MAXVNODES_STR))
+{
+	int maxvnodes = MAXVNODES;
+	int reclaimed = 0, reclaimed_end = 0;
+	size_t size = sizeof(reclaimed);
+	mach_timebase_info_data_t tb;
+	char path[PATH_MAX];
+	uint64_t *lat;
+	size_t n = 0;
+	int fd;
+
+	for (int i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", dt_tmpdir(), i);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create %s", path);
+		close(fd);
+	}
+
+	(void)sysctlbyname("debug.vnode_reclaimer_reclaimed", &reclaimed, &size, NULL, 0);
+
+	lat = calloc(NFILES * ROUNDS, sizeof(lat[0]));
+	T_QUIET; T_ASSERT_NOTNULL(lat, "calloc");
+
+	for (int round = 0; round < ROUNDS; round++) {
+		for (int i = 0; i < NFILES; i++) {
+			uint64_t start;
+
+			snprintf(path, sizeof(path), "%s/f%d", dt_tmpdir(), i);
+			start = mach_absolute_time();
+			fd = open(path, O_RDONLY);
+			lat[n++] = mach_absolute_time() - start;
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "open %s", path);
+			close(fd);
+		}
+	}
+
+	size = sizeof(reclaimed_end);
+	(void)sysctlbyname("debug.vnode_reclaimer_reclaimed", &reclaimed_end, &size, NULL, 0);
+
+	mach_timebase_info(&tb);
+	qsort(lat, n, sizeof(lat[0]), compare_u64);
+#define LAT_NS(q) ((double)lat[(size_t)((n - 1) * (q))] * tb.numer / tb.denom)
+	T_PERF("open_churn_p50", LAT_NS(0.50), "ns", "median open() latency under vnode churn");
+	T_PERF("open_churn_p99", LAT_NS(0.99), "ns", "99th percentile open() latency under vnode churn");
+	T_LOG("%zu opens of %d files with %d vnodes: p50 %.0f ns, p99 %.0f ns, max %.0f ns, "
+	    "%d vnodes reclaimed ahead of time",
+	    n, NFILES, maxvnodes, LAT_NS(0.50), LAT_NS(0.99), LAT_NS(1.0),
+	    reclaimed_end - reclaimed);
+#undef LAT_NS
+
+	free(lat);
+}
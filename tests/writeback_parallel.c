@@ -0,0 +1,133 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.vfs"),
+    T_META_CHECK_LEAKS(false));
+
+#define MAX_THREADS     16
+#define FILE_SIZE       (128 << 20)
+#define WRITE_SIZE      (256 << 10)
+
+static _Atomic uint32_t g_ready;
+static _Atomic bool g_go;
+
+static int
+nwriters(void)
+{
+	int ncpu = 0;
+	size_t size = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpu, &size, NULL, 0),
+	    "hw.ncpu");
+	return ncpu > MAX_THREADS ? MAX_THREADS : ncpu;
+}
+
+static uint64_t
+wb_pushes(void)
+{
+	uint64_t pushes = 0;
+	size_t size = sizeof(pushes);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("debug.cluster_wb_pushes",
+	    &pushes, &size, NULL, 0), "debug.cluster_wb_pushes");
+	return pushes;
+}
+
+/* writes a file sequentially, then fsyncs it so that the time includes the I/O */
+static void *
+writer(void *arg)
+{
+	uintptr_t id = (uintptr_t)arg;
+	char path[PATH_MAX];
+	char *buf;
+	int fd;
+
+	buf = malloc(WRITE_SIZE);
+	T_QUIET; T_ASSERT_NOTNULL(buf, "malloc");
+	memset(buf, 'a' + (int)(id % 26), WRITE_SIZE);
+
+	snprintf(path, sizeof(path), "%s/writeback_%lu", dt_tmpdir(), (unsigned long)id);
+	unlink(path);
+	fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "create %s", path);
+
+	atomic_fetch_add(&g_ready, 1);
+	while (!atomic_load(&g_go)) {
+		;
+	}
+
+	for (off_t off = 0; off < FILE_SIZE; off += WRITE_SIZE) {
+		T_QUIET; T_ASSERT_EQ(write(fd, buf, WRITE_SIZE), (ssize_t)WRITE_SIZE, "write");
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fsync(fd), "fsync");
+
+	/* what was pushed in the background must have made it to the file */
+	T_QUIET; T_ASSERT_EQ(pread(fd, buf, WRITE_SIZE, FILE_SIZE / 2), (ssize_t)WRITE_SIZE, "pread");
+	T_QUIET; T_ASSERT_EQ(buf[WRITE_SIZE - 1], (char)('a' + (int)(id % 26)), "file contents");
+
+	close(fd);
+	unlink(path);
+	free(buf);
+	return NULL;
+}
+
+static double
+run_writers(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	mach_timebase_info_data_t tb;
+	uint64_t start, ns;
+
+	atomic_store(&g_ready, 0);
+	atomic_store(&g_go, false);
+
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    writer, (void *)(uintptr_t)i), "pthread_create");
+	}
+	while (atomic_load(&g_ready) != (uint32_t)nthreads) {
+		pthread_yield_np();
+	}
+
+	start = mach_absolute_time();
+	atomic_store(&g_go, true);
+	for (int i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), "pthread_join");
+	}
+
+	mach_timebase_info(&tb);
+	ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+	return (double)nthreads * FILE_SIZE / (1 << 20) / ((double)ns / 1e9);
+}
+
+T_DECL(writeback_parallel,
+    "aggregate throughput of many threads each writing a large file",
+    T_META_TAG_PERF)
+{
+	int nmax = nwriters();
+	uint64_t before = wb_pushes();
+
+	for (int n = 1; n <= nmax; n *= 2) {
+		char name[32];
+		double mbs;
+
+		mbs = run_writers(n);
+		snprintf(name, sizeof(name), "write_%d_files", n);
+		T_PERF(name, mbs, "MB/s", "aggregate sequential write and fsync throughput");
+		T_LOG("%2d concurrent writers: %.0f MB/s", n, mbs);
+	}
+	T_EXPECT_GT(wb_pushes(), before, "clusters were pushed in the background");
+}
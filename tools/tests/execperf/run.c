@@ -6,10 +6,15 @@
 #include <err.h>
 #include <pthread.h>
 #include <spawn.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 extern char **environ;
 
 char * const *newargv;
+int usefork;
 
 void usage(void);
 
@@ -18,18 +23,60 @@ void *work(void *);
 int
 main(int argc, char *argv[])
 {
-	int i, count, threadcount;
+	int i, ch, count, threadcount;
 	int ret;
 	pthread_t *threads;
+	size_t rss = 0;
+	int nfds = 0;
+
+	while ((ch = getopt(argc, argv, "fm:d:")) != -1) {
+		switch (ch) {
+		case 'f':
+			usefork = 1;
+			break;
+		case 'm':
+			rss = (size_t)strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'd':
+			nfds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc < 4) {
+	if (argc < 3) {
 		usage();
 	}
 
-	threadcount = atoi(argv[1]);
-	count = atoi(argv[2]);
+	threadcount = atoi(argv[0]);
+	count = atoi(argv[1]);
 
-	newargv = &argv[3];
+	newargv = &argv[2];
+
+	/* make the parent expensive to fork: resident memory, descriptors */
+	if (rss != 0) {
+		char *p = mmap(NULL, rss, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (p == MAP_FAILED) {
+			err(1, "mmap(%zu)", rss);
+		}
+		memset(p, 0x5a, rss);
+	}
+	if (nfds != 0) {
+		struct rlimit rl = { .rlim_cur = nfds + 64, .rlim_max = RLIM_INFINITY };
+
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+			err(1, "setrlimit(%d)", nfds + 64);
+		}
+		for (i = 0; i < nfds; i++) {
+			if (open("/dev/null", O_RDONLY | O_CLOEXEC) == -1) {
+				err(1, "open");
+			}
+		}
+	}
 
 	threads = (pthread_t *)calloc(threadcount, sizeof(pthread_t));
 	for (i = 0; i < threadcount; i++) {
@@ -52,7 +99,10 @@ main(int argc, char *argv[])
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s <threadcount> <count> <program> [<arg1> [<arg2> ...]]\n",
+	fprintf(stderr, "Usage: %s [-f] [-m <MB>] [-d <fds>] <threadcount> <count> <program> [<arg1> [<arg2> ...]]\n"
+	    "\t-f\tfork() and execve() instead of posix_spawn()\n"
+	    "\t-m\tdirty <MB> of anonymous memory in the parent first\n"
+	    "\t-d\topen <fds> close-on-exec descriptors in the parent first\n",
 	    getprogname());
 	exit(1);
 }
@@ -66,9 +116,20 @@ work(void *arg)
 	pid_t pid;
 
 	for (i = 0; i < count; i++) {
-		ret = posix_spawn(&pid, newargv[0], NULL, NULL, newargv, environ);
-		if (ret != 0) {
-			errc(1, ret, "posix_spawn(%s)", newargv[0]);
+		if (usefork) {
+			pid = fork();
+			if (pid == -1) {
+				err(1, "fork");
+			}
+			if (pid == 0) {
+				execve(newargv[0], newargv, environ);
+				_exit(127);
+			}
+		} else {
+			ret = posix_spawn(&pid, newargv[0], NULL, NULL, newargv, environ);
+			if (ret != 0) {
+				errc(1, ret, "posix_spawn(%s)", newargv[0]);
+			}
 		}
 
 		while (-1 == waitpid(pid, &ret, 0)) {
@@ -55,3 +55,22 @@ for i in ${EXECUTABLES}; do
 	fi
     done
 done
+
+# fork() + execve() against posix_spawn(), from a parent with 1GB resident
+# and 10000 descriptors: what fork has to duplicate before the exec
+for MODE in spawn fork; do
+    FLAGS="-m 1024 -d 10000"
+    if [ "$MODE" == "fork" ]; then
+	FLAGS="-f ${FLAGS}"
+    fi
+    echo "Running exit.pie from a large parent with ${MODE}"
+    METRIC_NAME="exit.pie_large_parent_${MODE}"
+    TIMEOUT=` /usr/bin/time ./${RUN} ${FLAGS} 1 $((${COUNT}/10)) ./exit.pie 2>&1`
+    if [ $? -ne 0 ]; then
+	echo "Failed ${METRIC_NAME}, exit status $?"
+	exit 1
+    fi
+    echo ${TIMEOUT}
+    REALTIME=`echo ${TIMEOUT} | awk '{ print $1 }'`
+    record_perf_data "${METRIC_NAME}_real" "s" $REALTIME "Real time in seconds. Lower is better. This may have variance based on load on system" > ${PERFDATA_DIR}/${METRIC_NAME}_real.perfdata
+done
@@ -0,0 +1,112 @@
+#include "perf_index.h"
+#include "fail.h"
+#include "test_file_helper.h"
+#include "ramdisk.h"
+#include <sys/param.h>
+#include <aio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define AIO_DEPTH       4
+#define AIO_READ_SIZE   4096
+
+const char ramdisk_name[] = "StressRAMDisk";
+char ramdisk_path[MAXPATHLEN];
+
+DECL_SETUP {
+	int retval;
+
+	retval = setup_ram_volume(ramdisk_name, ramdisk_path);
+	VERIFY(retval == PERFINDEX_SUCCESS, "setup_ram_volume failed");
+
+	printf("ramdisk: %s\n", ramdisk_path);
+
+	return test_file_read_setup(ramdisk_path, num_threads, length, 0L);
+}
+
+/*
+ * Every thread keeps AIO_DEPTH aio_read() requests in flight against the
+ * shared file until it has read `length' bytes.
+ */
+DECL_TEST {
+	static char readbuffs[AIO_DEPTH][AIO_READ_SIZE];
+	struct aiocb cbs[AIO_DEPTH];
+	const struct aiocb *list[AIO_DEPTH];
+	char filepath[MAXPATHLEN];
+	long long filesize, submitted = 0, completed = 0;
+	off_t offset = 0;
+	int inflight = 0;
+	int fd;
+
+	filesize = MIN(length, MAXFILESIZE / num_threads);
+	filesize -= filesize % AIO_READ_SIZE;
+	VERIFY(filesize > 0, "file too small");
+
+	snprintf(filepath, sizeof(filepath), "%s/file_read", ramdisk_path);
+	fd = open(filepath, O_RDONLY);
+	VERIFY(fd >= 0, "open failed");
+
+	bzero(cbs, sizeof(cbs));
+	for (int i = 0; i < AIO_DEPTH; i++) {
+		list[i] = NULL;
+	}
+
+	while (completed < length) {
+		/* fill the queue */
+		for (int i = 0; i < AIO_DEPTH && submitted < length; i++) {
+			if (list[i] != NULL) {
+				continue;
+			}
+			cbs[i].aio_fildes = fd;
+			cbs[i].aio_buf = readbuffs[i];
+			cbs[i].aio_nbytes = AIO_READ_SIZE;
+			cbs[i].aio_offset = offset;
+			cbs[i].aio_sigevent.sigev_notify = SIGEV_NONE;
+			if (aio_read(&cbs[i]) != 0) {
+				/* the per process limit is shared by all threads */
+				VERIFY(errno == EAGAIN, "aio_read failed");
+				break;
+			}
+			list[i] = &cbs[i];
+			inflight++;
+			submitted += AIO_READ_SIZE;
+			offset = (offset + AIO_READ_SIZE) % filesize;
+		}
+
+		if (inflight == 0) {
+			usleep(10);
+			continue;
+		}
+
+		VERIFY(aio_suspend(list, AIO_DEPTH, NULL) == 0 || errno == EINTR,
+		    "aio_suspend failed");
+
+		for (int i = 0; i < AIO_DEPTH; i++) {
+			if (list[i] == NULL || aio_error(&cbs[i]) == EINPROGRESS) {
+				continue;
+			}
+			VERIFY(aio_return(&cbs[i]) == AIO_READ_SIZE, "aio read failed");
+			list[i] = NULL;
+			inflight--;
+			completed += AIO_READ_SIZE;
+		}
+	}
+
+	close(fd);
+	return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+	int retval;
+
+	retval = test_file_read_cleanup(ramdisk_path, num_threads, length);
+	VERIFY(retval == PERFINDEX_SUCCESS, "test_file_read_cleanup failed");
+
+	retval = cleanup_ram_volume(ramdisk_path);
+	VERIFY(retval == 0, "cleanup_ram_volume failed");
+
+	return PERFINDEX_SUCCESS;
+}